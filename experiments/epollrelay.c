@@ -0,0 +1,765 @@
+/* -------------------------------------------------------------------------
+ * File: epollrelay.c
+ * Description: Event-driven variant of relay.c for measuring how a relay
+ * behaves with many concurrent flows.  Every accepted client connection
+ * gets its own connection to the server and its own bounded buffer; the
+ * relay forwards client -> server only, like relay.c.  Each worker thread
+ * runs its own epoll loop and its own SO_REUSEPORT listener, so the kernel
+ * spreads new flows across threads and no state is shared between them.
+ *
+ * With -c N2,N3 each flow also gets an N23-sized send window: it may only
+ * read (N2 + N3) cells ahead of what it has written to the server, and
+ * reading resumes in steps of N2 cells as those writes complete.  The
+ * credit comes back from this relay's own sends, not from anything
+ * downstream, so it bounds the relay's buffer the way N23 does but is not
+ * N23 backpressure: a slow server holds it back only by filling the
+ * kernel's socket buffer.
+ *
+ * Occupancy is printed once per second as a percentage of the buffer, in
+ * the format of results/router/bufferSnapshots*.txt: to stdout for all
+ * flows together, and with -s <prefix> to <prefix>-<thread>-<flow>.txt
+ * per flow.
+ *
+ * -r <bytes/sec> caps how fast each worker sends to the server, to make
+ * this hop the bottleneck.  -l <file> appends one line of key=value
+ * statistics per flow when it closes: bytes relayed, peak and
+ * time-weighted mean occupancy, and percentiles of the time data spent
+ * queued in the relay.
+ * -------------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define MIN_PORT 1
+#define MAX_PORT 65535
+#define MAX_PENDING 1024
+#define MAX_EVENTS 256
+#define MAX_THREADS 64
+#define DEFAULT_FLOW_BUFFER 262144
+#define CELL_SIZE 512
+#define LATENCY_MARKS 256
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (48 * LATENCY_SUB_BUCKETS)
+#define MIN_THROTTLE_USEC 1000
+#define TRUE 1
+#define FALSE 0
+
+#define min(a,b) ((a < b) ? a : b)
+
+typedef struct Flow Flow;
+
+/* Log-linear histogram of queueing delays in microseconds: exact below
+   16us, then 16 buckets per power of two (about 6% resolution). */
+typedef struct LatencyHist {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long total;
+    unsigned long long max;
+} LatencyHist;
+
+/* Byte position up to which data had arrived at a given time. */
+typedef struct LatencyMark {
+    unsigned long pos;
+    unsigned long long usec;
+} LatencyMark;
+
+/* What an epoll event refers to. */
+typedef struct Endpoint {
+    Flow *flow;
+    int isServer;
+} Endpoint;
+
+struct Flow {
+    int id;
+    int clientFd;
+    int serverFd;
+    Endpoint clientEnd;
+    Endpoint serverEnd;
+    unsigned clientEvents;  /* epoll interest currently registered */
+    unsigned serverEvents;
+    int connected;
+    int clientEof;
+    int closed;
+
+    char *buf;
+    unsigned long head;     /* total bytes read from the client */
+    unsigned long tail;     /* total bytes sent to the server */
+
+    long credit;            /* bytes we may still read; -1 without credit */
+    unsigned long fwdSinceCredit;
+
+    /* statistics for -l */
+    LatencyMark marks[LATENCY_MARKS];
+    unsigned markHead;
+    unsigned markTail;
+    LatencyHist latency;
+    unsigned long peakOccupancy;
+    double occupancyArea;   /* bytes x usec */
+    unsigned long long startUsec;
+    unsigned long long lastChangeUsec;
+
+    FILE *snapshots;
+    Flow *prev;
+    Flow *next;
+};
+
+typedef struct Worker {
+    int index;
+    int epfd;
+    int listenFd;
+    int timerFd;
+    int throttleFd;
+    int throttled;
+    double tokens;
+    unsigned long long lastRefillUsec;
+    FILE *stats;
+    int nextFlowId;
+    Flow *flows;
+    Flow *closedFlows;      /* freed once the current epoll batch is done */
+    pthread_t thread;
+} Worker;
+
+static struct sockaddr_in serverAddr;
+static int inPort;
+static int numThreads = 1;
+static unsigned long flowBufferSize = DEFAULT_FLOW_BUFFER;
+static int useCredit = FALSE;
+static long creditN2 = 10;
+static long creditN3 = 500;
+static const char *snapshotPrefix = NULL;
+static const char *statsPath = NULL;
+static double rateLimit = 0;
+
+static Worker workers[MAX_THREADS];
+
+/* Helper to print a provided error message and the cause as determined by
+   errno to stderr before exiting with a failure indicator of 1. */
+static void printErrorAndExit(const char *errMsg)
+{
+    perror(errMsg);
+    exit(1);
+}
+
+static void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        printErrorAndExit("epollrelay: fcntl");
+}
+
+static unsigned long long nowUsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int latencyBucket(unsigned long long usec)
+{
+    int msb, idx;
+    if (usec < LATENCY_SUB_BUCKETS)
+        return (int) usec;
+    msb = 63 - __builtin_clzll(usec);
+    idx = (msb - 3) * LATENCY_SUB_BUCKETS +
+          (int)((usec >> (msb - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return min(idx, LATENCY_BUCKETS - 1);
+}
+
+/* Smallest value that falls in bucket idx. */
+static unsigned long long latencyBucketValue(int idx)
+{
+    int octave = idx / LATENCY_SUB_BUCKETS + 3;
+    if (idx < LATENCY_SUB_BUCKETS)
+        return idx;
+    return (unsigned long long)(LATENCY_SUB_BUCKETS +
+                                idx % LATENCY_SUB_BUCKETS) << (octave - 4);
+}
+
+static void latencyRecord(LatencyHist *hist, unsigned long long usec)
+{
+    hist->counts[latencyBucket(usec)]++;
+    hist->total++;
+    if (usec > hist->max)
+        hist->max = usec;
+}
+
+static unsigned long long latencyPercentile(const LatencyHist *hist,
+                                            double pct)
+{
+    unsigned long seen = 0, want;
+    int i;
+    if (!hist->total)
+        return 0;
+    want = (unsigned long)(hist->total * pct / 100.0);
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= want)
+            return latencyBucketValue(i);
+    }
+    return hist->max;
+}
+
+/* Account for the time the current occupancy was held, before it changes. */
+static void noteOccupancy(Flow *flow, unsigned long long now)
+{
+    flow->occupancyArea += (double)(flow->head - flow->tail) *
+                           (now - flow->lastChangeUsec);
+    flow->lastChangeUsec = now;
+}
+
+static double flowOccupancy(const Flow *flow)
+{
+    return (flow->head - flow->tail) / (double) flowBufferSize;
+}
+
+/* Number of bytes this flow may read from its client right now. */
+static unsigned long flowReadAllowance(const Flow *flow)
+{
+    unsigned long space = flowBufferSize - (flow->head - flow->tail);
+    if (flow->credit >= 0)
+        return min(space, (unsigned long) flow->credit);
+    return space;
+}
+
+/* Bring the registered epoll interest of both sockets in line with what
+   the flow can currently do. */
+static void updateInterest(Worker *worker, Flow *flow)
+{
+    struct epoll_event ev;
+    unsigned want;
+
+    want = (!flow->clientEof && flowReadAllowance(flow) > 0) ? EPOLLIN : 0;
+    if (want != flow->clientEvents) {
+        ev.events = want;
+        ev.data.ptr = &flow->clientEnd;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_MOD, flow->clientFd, &ev) < 0)
+            printErrorAndExit("epollrelay: epoll_ctl");
+        flow->clientEvents = want;
+    }
+
+    want = (!flow->connected ||
+            (flow->head != flow->tail && !worker->throttled)) ? EPOLLOUT : 0;
+    if (want != flow->serverEvents) {
+        ev.events = want;
+        ev.data.ptr = &flow->serverEnd;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_MOD, flow->serverFd, &ev) < 0)
+            printErrorAndExit("epollrelay: epoll_ctl");
+        flow->serverEvents = want;
+    }
+}
+
+/* Append this flow's summary to the -l statistics file. */
+static void writeFlowStats(Worker *worker, Flow *flow)
+{
+    unsigned long long now = nowUsec();
+    double elapsed;
+
+    noteOccupancy(flow, now);
+    elapsed = now > flow->startUsec ? (double)(now - flow->startUsec) : 1;
+    fprintf(worker->stats,
+            "flow=%d-%d bytes=%lu duration_us=%llu peak_occ=%.2f "
+            "mean_occ=%.2f lat_samples=%lu lat_p50_us=%llu lat_p90_us=%llu "
+            "lat_p99_us=%llu lat_max_us=%llu\n",
+            worker->index, flow->id, flow->tail, now - flow->startUsec,
+            flow->peakOccupancy / (double) flowBufferSize * 100,
+            flow->occupancyArea / elapsed / flowBufferSize * 100,
+            flow->latency.total,
+            latencyPercentile(&flow->latency, 50),
+            latencyPercentile(&flow->latency, 90),
+            latencyPercentile(&flow->latency, 99),
+            flow->latency.max);
+    fflush(worker->stats);
+}
+
+static void closeFlow(Worker *worker, Flow *flow)
+{
+    if (worker->stats)
+        writeFlowStats(worker, flow);
+    if (flow->snapshots) {
+        fprintf(flow->snapshots, "%.2f\n", flowOccupancy(flow) * 100);
+        fclose(flow->snapshots);
+    }
+    close(flow->clientFd);
+    close(flow->serverFd);
+
+    if (flow->prev)
+        flow->prev->next = flow->next;
+    else
+        worker->flows = flow->next;
+    if (flow->next)
+        flow->next->prev = flow->prev;
+
+    /* Later events in this epoll batch may still point at the flow. */
+    flow->closed = TRUE;
+    flow->next = worker->closedFlows;
+    worker->closedFlows = flow;
+}
+
+static void freeClosedFlows(Worker *worker)
+{
+    while (worker->closedFlows) {
+        Flow *flow = worker->closedFlows;
+        worker->closedFlows = flow->next;
+        free(flow->buf);
+        free(flow);
+    }
+}
+
+static void openFlow(Worker *worker, int clientFd)
+{
+    struct epoll_event ev;
+    Flow *flow;
+    int one = 1;
+
+    flow = (Flow *) calloc(1, sizeof(Flow));
+    if (!flow || !(flow->buf = (char *) malloc(flowBufferSize)))
+        printErrorAndExit("epollrelay: malloc");
+
+    flow->id = worker->nextFlowId++;
+    flow->clientFd = clientFd;
+    flow->clientEnd.flow = flow;
+    flow->clientEnd.isServer = FALSE;
+    flow->serverEnd.flow = flow;
+    flow->serverEnd.isServer = TRUE;
+    flow->credit = useCredit ? (creditN2 + creditN3) * CELL_SIZE : -1;
+    flow->startUsec = flow->lastChangeUsec = nowUsec();
+
+    setNonBlocking(clientFd);
+    if ((flow->serverFd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        printErrorAndExit("epollrelay: socket");
+    setNonBlocking(flow->serverFd);
+    setsockopt(flow->serverFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(flow->serverFd, (struct sockaddr *)&serverAddr,
+                sizeof(serverAddr)) < 0 && errno != EINPROGRESS)
+        printErrorAndExit("epollrelay: connect");
+
+    if (snapshotPrefix) {
+        char name[512];
+        snprintf(name, sizeof(name), "%s-%d-%d.txt", snapshotPrefix,
+                 worker->index, flow->id);
+        if (!(flow->snapshots = fopen(name, "w")))
+            printErrorAndExit("epollrelay: fopen");
+    }
+
+    /* Don't read from the client until the server side is up. */
+    ev.events = 0;
+    ev.data.ptr = &flow->clientEnd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, clientFd, &ev) < 0)
+        printErrorAndExit("epollrelay: epoll_ctl");
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &flow->serverEnd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, flow->serverFd, &ev) < 0)
+        printErrorAndExit("epollrelay: epoll_ctl");
+    flow->serverEvents = EPOLLOUT;
+
+    flow->next = worker->flows;
+    if (worker->flows)
+        worker->flows->prev = flow;
+    worker->flows = flow;
+}
+
+/* Read as much as the buffer and credit allow from the client. Returns -1
+   if the flow failed. */
+static int readFromClient(Flow *flow)
+{
+    unsigned long allowance;
+
+    while ((allowance = flowReadAllowance(flow)) > 0) {
+        unsigned long off = flow->head % flowBufferSize;
+        unsigned long len = min(allowance, flowBufferSize - off);
+        ssize_t n = recv(flow->clientFd, flow->buf + off, len, 0);
+        if (n > 0) {
+            unsigned long long now = nowUsec();
+            noteOccupancy(flow, now);
+            flow->head += n;
+            if (flow->credit >= 0)
+                flow->credit -= n;
+            if (flow->head - flow->tail > flow->peakOccupancy)
+                flow->peakOccupancy = flow->head - flow->tail;
+            /* when the mark ring is full, later data is timed against an
+               older mark until it drains; good enough for percentiles */
+            if (flow->markHead - flow->markTail < LATENCY_MARKS) {
+                LatencyMark *mark =
+                    &flow->marks[flow->markHead++ % LATENCY_MARKS];
+                mark->pos = flow->head;
+                mark->usec = now;
+            } else {
+                flow->marks[(flow->markHead - 1) % LATENCY_MARKS].pos =
+                    flow->head;
+            }
+        } else if (n == 0) {
+            flow->clientEof = TRUE;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Refill the worker's -r token bucket; the bucket holds 20ms of data. */
+static void refillTokens(Worker *worker, unsigned long long now)
+{
+    double burst = rateLimit / 50 > CELL_SIZE ? rateLimit / 50 : CELL_SIZE;
+    worker->tokens += rateLimit * (now - worker->lastRefillUsec) / 1e6;
+    if (worker->tokens > burst)
+        worker->tokens = burst;
+    worker->lastRefillUsec = now;
+}
+
+/* Out of tokens: stop writing until enough have accumulated for a cell. */
+static void throttle(Worker *worker)
+{
+    struct itimerspec when;
+    unsigned long long usec =
+        (unsigned long long)((CELL_SIZE - worker->tokens) / rateLimit * 1e6);
+
+    if (usec < MIN_THROTTLE_USEC)
+        usec = MIN_THROTTLE_USEC;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = usec / 1000000;
+    when.it_value.tv_nsec = (usec % 1000000) * 1000;
+    if (timerfd_settime(worker->throttleFd, 0, &when, NULL) < 0)
+        printErrorAndExit("epollrelay: timerfd_settime");
+    worker->throttled = TRUE;
+}
+
+/* Tokens are available again: resume writing for every flow. */
+static void unthrottle(Worker *worker)
+{
+    Flow *flow;
+    worker->throttled = FALSE;
+    for (flow = worker->flows; flow; flow = flow->next)
+        updateInterest(worker, flow);
+}
+
+/* Send buffered data to the server, returning credit to the client side
+   in steps of N2 cells. Returns -1 if the flow failed. */
+static int writeToServer(Worker *worker, Flow *flow)
+{
+    while (flow->head != flow->tail && !worker->throttled) {
+        unsigned long long now = nowUsec();
+        unsigned long off = flow->tail % flowBufferSize;
+        unsigned long len = min(flow->head - flow->tail, flowBufferSize - off);
+        ssize_t n;
+
+        if (rateLimit > 0) {
+            refillTokens(worker, now);
+            if (worker->tokens < 1) {
+                throttle(worker);
+                break;
+            }
+            len = min(len, (unsigned long) worker->tokens);
+        }
+
+        n = send(flow->serverFd, flow->buf + off, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            noteOccupancy(flow, now);
+            flow->tail += n;
+            if (rateLimit > 0)
+                worker->tokens -= n;
+            while (flow->markTail != flow->markHead &&
+                   flow->marks[flow->markTail % LATENCY_MARKS].pos <=
+                   flow->tail) {
+                latencyRecord(&flow->latency,
+                    now - flow->marks[flow->markTail % LATENCY_MARKS].usec);
+                flow->markTail++;
+            }
+            if (flow->credit >= 0) {
+                flow->fwdSinceCredit += n;
+                while (flow->fwdSinceCredit >=
+                       (unsigned long)(creditN2 * CELL_SIZE)) {
+                    flow->fwdSinceCredit -= creditN2 * CELL_SIZE;
+                    flow->credit += creditN2 * CELL_SIZE;
+                }
+            }
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void handleFlowEvent(Worker *worker, Endpoint *end, unsigned events)
+{
+    Flow *flow = end->flow;
+
+    if (flow->closed)
+        return;
+
+    if (end->isServer) {
+        if (!flow->connected) {
+            int err = 0;
+            socklen_t errLen = sizeof(err);
+            getsockopt(flow->serverFd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+            if (err) {
+                errno = err;
+                perror("epollrelay: connect");
+                closeFlow(worker, flow);
+                return;
+            }
+            flow->connected = TRUE;
+        }
+        if (((events & EPOLLERR) && !(events & EPOLLOUT)) ||
+            writeToServer(worker, flow) < 0) {
+            closeFlow(worker, flow);
+            return;
+        }
+    } else {
+        /* epoll reports these even when we aren't asking to read, e.g.
+           when the flow is out of credit; without closing, we would spin. */
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            closeFlow(worker, flow);
+            return;
+        }
+        if (readFromClient(flow) < 0) {
+            closeFlow(worker, flow);
+            return;
+        }
+        /* Push freshly read data out without waiting for another round. */
+        if (flow->connected && writeToServer(worker, flow) < 0) {
+            closeFlow(worker, flow);
+            return;
+        }
+    }
+
+    if (flow->clientEof && flow->connected && flow->head == flow->tail) {
+        shutdown(flow->serverFd, SHUT_WR);
+        closeFlow(worker, flow);
+        return;
+    }
+    updateInterest(worker, flow);
+}
+
+/* Once a second: per-flow snapshots, and the aggregate occupancy of all
+   of this worker's flows on stdout. */
+static void takeSnapshots(Worker *worker)
+{
+    unsigned long used = 0, capacity = 0;
+    Flow *flow;
+
+    for (flow = worker->flows; flow; flow = flow->next) {
+        if (flow->snapshots)
+            fprintf(flow->snapshots, "%.2f\n", flowOccupancy(flow) * 100);
+        used += flow->head - flow->tail;
+        capacity += flowBufferSize;
+    }
+    if (capacity) {
+        if (numThreads > 1)
+            printf("%d ", worker->index);
+        printf("%.2f\n", used / (double) capacity * 100);
+        fflush(stdout);
+    }
+}
+
+static void acceptFlows(Worker *worker)
+{
+    for (;;) {
+        int clientFd = accept(worker->listenFd, NULL, NULL);
+        if (clientFd >= 0) {
+            openFlow(worker, clientFd);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            printErrorAndExit("epollrelay: accept");
+        }
+    }
+}
+
+static void *runWorker(void *data)
+{
+    Worker *worker = (Worker *) data;
+    struct epoll_event events[MAX_EVENTS];
+    int n, i;
+
+    for (;;) {
+        if ((n = epoll_wait(worker->epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            printErrorAndExit("epollrelay: epoll_wait");
+        }
+        for (i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &worker->listenFd) {
+                acceptFlows(worker);
+            } else if (ptr == &worker->throttleFd) {
+                unsigned long long expirations;
+                if (read(worker->throttleFd, &expirations,
+                         sizeof(expirations)) > 0)
+                    unthrottle(worker);
+            } else if (ptr == &worker->timerFd) {
+                unsigned long long expirations;
+                if (read(worker->timerFd, &expirations, sizeof(expirations)) > 0)
+                    takeSnapshots(worker);
+            } else {
+                handleFlowEvent(worker, (Endpoint *) ptr, events[i].events);
+            }
+        }
+        freeClosedFlows(worker);
+    }
+    return NULL;
+}
+
+static void setupWorker(Worker *worker, int index)
+{
+    struct sockaddr_in relayAddr;
+    struct epoll_event ev;
+    struct itimerspec interval;
+    int one = 1;
+
+    memset(worker, 0, sizeof(*worker));
+    worker->index = index;
+
+    if ((worker->epfd = epoll_create1(0)) < 0)
+        printErrorAndExit("epollrelay: epoll_create1");
+
+    /* every worker has its own listener; the kernel balances accepts */
+    memset((char *)&relayAddr, 0, sizeof(relayAddr));
+    relayAddr.sin_family = AF_INET;
+    relayAddr.sin_addr.s_addr = INADDR_ANY;
+    relayAddr.sin_port = htons(inPort);
+    if ((worker->listenFd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        printErrorAndExit("epollrelay: socket");
+    setsockopt(worker->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(worker->listenFd, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) < 0)
+        printErrorAndExit("epollrelay: SO_REUSEPORT");
+    if (bind(worker->listenFd, (struct sockaddr *)&relayAddr,
+             sizeof(relayAddr)) < 0)
+        printErrorAndExit("epollrelay: bind");
+    if (listen(worker->listenFd, MAX_PENDING) < 0)
+        printErrorAndExit("epollrelay: listen");
+    setNonBlocking(worker->listenFd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker->listenFd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->listenFd, &ev) < 0)
+        printErrorAndExit("epollrelay: epoll_ctl");
+
+    if ((worker->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+        printErrorAndExit("epollrelay: timerfd_create");
+    memset(&interval, 0, sizeof(interval));
+    interval.it_interval.tv_sec = 1;
+    interval.it_value.tv_sec = 1;
+    if (timerfd_settime(worker->timerFd, 0, &interval, NULL) < 0)
+        printErrorAndExit("epollrelay: timerfd_settime");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker->timerFd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->timerFd, &ev) < 0)
+        printErrorAndExit("epollrelay: epoll_ctl");
+
+    if ((worker->throttleFd = timerfd_create(CLOCK_MONOTONIC,
+                                             TFD_NONBLOCK)) < 0)
+        printErrorAndExit("epollrelay: timerfd_create");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker->throttleFd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->throttleFd, &ev) < 0)
+        printErrorAndExit("epollrelay: epoll_ctl");
+    worker->lastRefillUsec = nowUsec();
+
+    if (statsPath && !(worker->stats = fopen(statsPath, "a")))
+        printErrorAndExit("epollrelay: fopen");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: epollrelay [-t threads] [-b flow_buffer_bytes] "
+            "[-c n2,n3] [-s snapshot_prefix]\n"
+            "                  [-r bytes_per_sec] [-l stats_file]\n"
+            "                  <incoming_port> <server_ip_addr> <server_port>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, outPort, i;
+
+    while ((opt = getopt(argc, argv, "t:b:c:s:r:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            numThreads = atoi(optarg);
+            if (numThreads < 1 || numThreads > MAX_THREADS)
+                usage();
+            break;
+        case 'b':
+            flowBufferSize = strtoul(optarg, NULL, 10);
+            if (flowBufferSize < CELL_SIZE)
+                usage();
+            break;
+        case 'c':
+            if (sscanf(optarg, "%ld,%ld", &creditN2, &creditN3) != 2 ||
+                creditN2 < 1 || creditN3 < 0)
+                usage();
+            useCredit = TRUE;
+            break;
+        case 's':
+            snapshotPrefix = optarg;
+            break;
+        case 'r':
+            rateLimit = strtod(optarg, NULL);
+            if (rateLimit <= 0)
+                usage();
+            break;
+        case 'l':
+            statsPath = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 3)
+        usage();
+
+    /* parse port numbers */
+    inPort = atoi(argv[optind]);
+    if (inPort < MIN_PORT || inPort > MAX_PORT)
+    {
+        fprintf(stderr, "epollrelay: Invalid Incoming Port Number\n");
+        exit(1);
+    }
+
+    outPort = atoi(argv[optind + 2]);
+    if (outPort < MIN_PORT || outPort > MAX_PORT)
+    {
+        fprintf(stderr, "epollrelay: Invalid Outgoing Port Number\n");
+        exit(1);
+    }
+
+    /* build server address data structure */
+    memset((char *)&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, argv[optind + 1], &serverAddr.sin_addr) == 0)
+    {
+        fprintf(stderr, "epollrelay: Malformed Server IP Address\n");
+        exit(1);
+    }
+    serverAddr.sin_port = htons(outPort);
+
+    for (i = 0; i < numThreads; i++)
+        setupWorker(&workers[i], i);
+    for (i = 1; i < numThreads; i++)
+        pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+    runWorker(&workers[0]);
+
+    return 0;
+}
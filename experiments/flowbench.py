@@ -0,0 +1,315 @@
+#!/usr/bin/env python3
+# -------------------------------------------------------------------------
+# File: flowbench.py
+# Description: Reproducible local flow-control benchmark.  Builds a chain
+# of epollrelay hops over loopback in front of a concurrent server, pushes
+# one or more client flows through it, and sweeps N3 and the per-flow
+# buffer size.  The result is a JSON report with throughput,
+# time-to-last-byte, peak and mean buffer occupancy, and queueing latency
+# percentiles for every hop of every run.
+#
+# Run "make" first; the harness uses ./server, ./client and ./epollrelay.
+#
+# Example: three hops, the middle one limited to 2 MB/s, four flows of
+# 8 MB each, N3 swept over 50/100/500 cells and with credit disabled:
+#
+#   ./flowbench.py --hops 3 --bottleneck-hop 1 --rate 2000000 \
+#       --flows 4 --size 8000000 --n3 50,100,500,off --out report.json
+# -------------------------------------------------------------------------
+
+import argparse
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+LINE_LEN = 1024  # client.c reads lines with fgets into a 4 KiB buffer
+
+
+def parse_list(text, conv):
+    return [conv(item) for item in text.split(",") if item]
+
+
+def parse_n3(item):
+    return None if item == "off" else int(item)
+
+
+def make_payload(path, size):
+    line = ("x" * (LINE_LEN - 1) + "\n").encode()
+    with open(path, "wb") as f:
+        written = 0
+        while written + LINE_LEN <= size:
+            f.write(line)
+            written += LINE_LEN
+        if size > written:
+            f.write(b"x" * (size - written - 1) + b"\n")
+
+
+def wait_for_port(port, timeout):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.2).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("nothing listening on port %d" % port)
+
+
+def count_server_flows(path):
+    """Finished flows that carried data; port probes show up as 0 bytes."""
+    try:
+        with open(path) as f:
+            return sum(1 for line in f
+                       if len(line.split()) == 3 and int(line.split()[2]) > 0)
+    except IOError:
+        return 0
+
+
+def count_hop_flows(path):
+    try:
+        with open(path) as f:
+            return sum(1 for line in f if " bytes=0 " not in line)
+    except IOError:
+        return 0
+
+
+def wait_until(pred, timeout):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if pred():
+            return True
+        time.sleep(0.02)
+    return pred()
+
+
+def parse_stats(path):
+    flows = []
+    with open(path) as f:
+        for line in f:
+            entry = {}
+            for field in line.split():
+                key, _, value = field.partition("=")
+                try:
+                    entry[key] = float(value) if "." in value else int(value)
+                except ValueError:
+                    entry[key] = value
+            if entry:
+                flows.append(entry)
+    return flows
+
+
+def median(values):
+    values = sorted(values)
+    if not values:
+        return 0
+    mid = len(values) // 2
+    if len(values) % 2:
+        return values[mid]
+    return (values[mid - 1] + values[mid]) / 2.0
+
+
+def summarize_hop(index, flows, rate_limited):
+    """Percentiles are per flow; the hop reports the median flow for p50
+    and p90 and the worst flow for p99 and max."""
+    return {
+        "hop": index,
+        "rate_limited": rate_limited,
+        "flows_closed": len(flows),
+        "bytes": sum(f.get("bytes", 0) for f in flows),
+        "peak_occ_pct": max([f.get("peak_occ", 0) for f in flows] or [0]),
+        "mean_occ_pct": (sum(f.get("mean_occ", 0) for f in flows) /
+                         len(flows)) if flows else 0,
+        "lat_p50_us": median([f.get("lat_p50_us", 0) for f in flows]),
+        "lat_p90_us": median([f.get("lat_p90_us", 0) for f in flows]),
+        "lat_p99_us": max([f.get("lat_p99_us", 0) for f in flows] or [0]),
+        "lat_max_us": max([f.get("lat_max_us", 0) for f in flows] or [0]),
+        "per_flow": flows,
+    }
+
+
+def run_once(args, payload, workdir, n3, buf):
+    base = args.base_port
+    procs = []
+    server_out = os.path.join(workdir, "server.out")
+
+    def spawn(cmd, out_path, stdin=None):
+        out = open(out_path, "w")
+        proc = subprocess.Popen(cmd, cwd=HERE, stdout=out, stdin=stdin,
+                                stderr=subprocess.STDOUT)
+        out.close()
+        procs.append(proc)
+        return proc
+
+    try:
+        spawn(["./server", str(base), "concurrent"], server_out)
+        wait_for_port(base, 5)
+
+        # hop k listens on base+hops-k and forwards to base+hops-k-1, so the
+        # client talks to hop 0 and the last hop talks to the server
+        hop_stats = []
+        for k in reversed(range(args.hops)):
+            stats = os.path.join(workdir, "hop%d.stats" % k)
+            cmd = ["./epollrelay", "-b", str(buf), "-l", stats]
+            if n3 is not None:
+                cmd += ["-c", "%d,%d" % (args.n2, n3)]
+            if args.rate and k == args.bottleneck_hop:
+                cmd += ["-r", str(args.rate)]
+            listen = base + args.hops - k
+            cmd += [str(listen), "127.0.0.1", str(listen - 1)]
+            spawn(cmd, os.path.join(workdir, "hop%d.snapshots" % k))
+            wait_for_port(listen, 5)
+            hop_stats.insert(0, stats)
+        clients = []
+        for i in range(args.flows):
+            payload_in = open(payload)
+            clients.append(spawn(["./client", "127.0.0.1",
+                                  str(base + args.hops)],
+                                 os.path.join(workdir, "client%d.out" % i),
+                                 stdin=payload_in))
+            payload_in.close()
+
+        deadline = time.time() + args.timeout
+        for proc in clients:
+            proc.wait(max(0.1, deadline - time.time()))
+        complete = wait_until(
+            lambda: count_server_flows(server_out) >= args.flows,
+            max(0.1, deadline - time.time()))
+        wait_until(lambda: all(count_hop_flows(s) >= args.flows
+                               for s in hop_stats), 2)
+    finally:
+        for proc in procs:
+            if proc.poll() is None:
+                proc.terminate()
+        for proc in procs:
+            try:
+                proc.wait(2)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+
+    flows = []
+    with open(server_out) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 3:
+                continue
+            ttlb = int(fields[0]) + int(fields[1]) / 1e6
+            total = int(fields[2])
+            if total == 0:
+                continue
+            flows.append({"bytes": total, "ttlb_s": ttlb,
+                          "throughput_bytes_per_sec":
+                              total / ttlb if ttlb else 0})
+
+    hops = []
+    for k, stats in enumerate(hop_stats):
+        per_flow = [f for f in parse_stats(stats) if f.get("bytes", 0) > 0]
+        hops.append(summarize_hop(k, per_flow,
+                                  bool(args.rate) and
+                                  k == args.bottleneck_hop))
+
+    ttlbs = [f["ttlb_s"] for f in flows]
+    total = sum(f["bytes"] for f in flows)
+    return {
+        "n3": n3,
+        "credit": n3 is not None,
+        "buffer_bytes": buf,
+        "complete": complete and len(flows) == args.flows and
+                    all(f["bytes"] == args.size for f in flows),
+        "bytes": total,
+        "throughput_bytes_per_sec": total / max(ttlbs) if ttlbs else 0,
+        "ttlb_s": {"mean": sum(ttlbs) / len(ttlbs) if ttlbs else 0,
+                   "max": max(ttlbs) if ttlbs else 0},
+        "flows": flows,
+        "hops": hops,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Local multi-hop flow-control benchmark")
+    parser.add_argument("--hops", type=int, default=3,
+                        help="number of relays in the chain")
+    parser.add_argument("--flows", type=int, default=1,
+                        help="concurrent client flows")
+    parser.add_argument("--size", type=int, default=16000000,
+                        help="bytes sent by each client")
+    parser.add_argument("--rate", type=float, default=0,
+                        help="bottleneck rate in bytes/sec (0: none)")
+    parser.add_argument("--bottleneck-hop", type=int, default=None,
+                        help="hop index that gets --rate (default: last)")
+    parser.add_argument("--n2", type=int, default=10,
+                        help="N2 in cells when credit is on")
+    parser.add_argument("--n3", default="100,500",
+                        help="comma-separated N3 values in cells; 'off' "
+                             "runs without credit")
+    parser.add_argument("--buffer", default="262144",
+                        help="comma-separated per-flow buffer sizes")
+    parser.add_argument("--base-port", type=int, default=20000)
+    parser.add_argument("--timeout", type=float, default=300,
+                        help="seconds allowed per run")
+    parser.add_argument("--out", help="write the JSON report here")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the raw per-run output directories")
+    args = parser.parse_args()
+
+    if args.bottleneck_hop is None:
+        args.bottleneck_hop = args.hops - 1
+    if args.hops < 1 or not 0 <= args.bottleneck_hop < args.hops:
+        parser.error("invalid --hops/--bottleneck-hop")
+    for prog in ("server", "client", "epollrelay"):
+        if not os.access(os.path.join(HERE, prog), os.X_OK):
+            parser.error("%s is not built; run make in %s" % (prog, HERE))
+
+    n3s = parse_list(args.n3, parse_n3)
+    buffers = parse_list(args.buffer, int)
+    top = tempfile.mkdtemp(prefix="flowbench.")
+    payload = os.path.join(top, "payload.txt")
+    make_payload(payload, args.size)
+
+    runs = []
+    for buf in buffers:
+        for n3 in n3s:
+            workdir = os.path.join(top, "n3-%s-buf-%d" %
+                                   ("off" if n3 is None else n3, buf))
+            os.mkdir(workdir)
+            result = run_once(args, payload, workdir, n3, buf)
+            if args.keep:
+                result["output_dir"] = workdir
+            runs.append(result)
+            sys.stderr.write(
+                "n3=%-4s buf=%-8d %s %8.2f MB/s ttlb max %.3fs  %s\n" % (
+                    "off" if n3 is None else n3, buf,
+                    "ok  " if result["complete"] else "FAIL",
+                    result["throughput_bytes_per_sec"] / 1e6,
+                    result["ttlb_s"]["max"],
+                    " ".join("hop%d peak %.1f%% p99 %dus" %
+                             (h["hop"], h["peak_occ_pct"], h["lat_p99_us"])
+                             for h in result["hops"])))
+
+    report = {
+        "config": {
+            "hops": args.hops, "flows": args.flows, "size": args.size,
+            "rate": args.rate, "bottleneck_hop": args.bottleneck_hop,
+            "n2": args.n2,
+        },
+        "runs": runs,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+    if not args.keep:
+        shutil.rmtree(top)
+    return 0 if all(r["complete"] for r in runs) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -37,6 +37,9 @@ int Monitor_RemoveBuffer(Monitor *mon, char *buf, int want)
 
 void Monitor_CloseBuffer(Monitor *mon)
 {
+    pthread_mutex_lock(&mon->mutex);
 	CircBuffer_Close(&mon->cb);
+    pthread_cond_broadcast(&mon->empty);
+    pthread_mutex_unlock(&mon->mutex);
 }
 
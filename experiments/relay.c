@@ -1,4 +1,8 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* splice, F_SETPIPE_SZ */
+#endif
 #include <pthread.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,19 +12,30 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include "monitor.h"
+#include <stdint.h>
+#include "spscring.h"
 
 #define MIN_PORT 1
 #define MAX_PORT 65535
 #define COPY_BUFFER_SIZE 512
+#define SPLICE_CHUNK_SIZE 65536
 #define MAX_PENDING 15
 #define TRUE 1
 #define FALSE 0
 
-static Monitor monitor;
+static SPSCRing ring;
 
 static int flag = FALSE;
 
+/* splice mode: bytes move client -> pipe -> server entirely in the kernel.
+   The counters let the overseer report pipe occupancy in the same format
+   as the ring occupancy. */
+static int useSplice = FALSE;
+static int splicePipe[2];
+static int pipeCapacity;
+static unsigned long splicedIn;
+static unsigned long splicedOut;
+
 /* Helper to print a provided error message and the cause as determined by
    errno to stderr before exiting with a failure indicator of 1. */
 static void printErrorAndExit(const char *errMsg)
@@ -29,29 +44,55 @@ static void printErrorAndExit(const char *errMsg)
     exit(1);
 }
 
+/* Fraction of the relay buffer (ring or kernel pipe) currently in use. */
+static double bufferOccupancy(void)
+{
+	if (useSplice)
+	{
+		unsigned long out = __atomic_load_n(&splicedOut, __ATOMIC_RELAXED);
+		unsigned long in = __atomic_load_n(&splicedIn, __ATOMIC_RELAXED);
+		return (in - out) / (double) pipeCapacity;
+	}
+	return SPSCRing_Size(&ring) / (double) SPSC_RING_SIZE;
+}
+
 static void *monitorBufferSize(void *data)
 {
 	(void) data;
 	while (!flag)
 	{
-		double frac = CircBuffer_Size(&monitor.cb) / (double) BUFFER_SIZE;
-		printf("%.2f\n", frac * 100);
+		printf("%.2f\n", bufferOccupancy() * 100);
 		sleep(1);
 	}
-	double frac = CircBuffer_Size(&monitor.cb) / (double) BUFFER_SIZE;
-	printf("%.2f\n", frac * 100);
+	printf("%.2f\n", bufferOccupancy() * 100);
 	return NULL;
 }
 
+/* Helper to open a connection to the server or exit. */
+static int connectToServer(struct sockaddr_in *server_addr)
+{
+	int sockfd;
+
+	/* active open to server */
+    if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        printErrorAndExit("relay: socket");
+    
+    /* connect */
+    if (connect(sockfd, (struct sockaddr *)server_addr, sizeof(struct sockaddr_in)) < 0)
+        printErrorAndExit("relay: connect");
+
+    return sockfd;
+}
+
 static void *handleClientConnection(void *data)
 {
 	char buffer[COPY_BUFFER_SIZE];
-	int client_socket = (int) data;
+	int client_socket = (int)(intptr_t) data;
 	int read;
 	
 	while ((read = recv(client_socket, buffer, COPY_BUFFER_SIZE, 0 /*no flags*/)) > 0)
     {
-        Monitor_AddBuffer(&monitor, buffer, read);
+        SPSCRing_Write(&ring, buffer, read);
     }
     
     if (read < 0)
@@ -59,7 +100,7 @@ static void *handleClientConnection(void *data)
         printErrorAndExit("relay: recv");
     }
     
-    Monitor_CloseBuffer(&monitor);
+    SPSCRing_Close(&ring);
     
     close(client_socket);
     return NULL;
@@ -69,17 +110,10 @@ static void *handleServerConnection(void *data)
 {
 	struct sockaddr_in * server_addr = (struct sockaddr_in *)data;
 	char buffer[COPY_BUFFER_SIZE];
-	int read, sent, sockfd;
-		
-	/* active open to server */
-    if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) < 0)
-        printErrorAndExit("relay: socket");
+	int read, sent;
+	int sockfd = connectToServer(server_addr);
     
-    /* connect */
-    if (connect(sockfd, (struct sockaddr *)server_addr, sizeof(struct sockaddr_in)) < 0)
-        printErrorAndExit("relay: connect");
-    
-    while ((read = Monitor_RemoveBuffer(&monitor, buffer, COPY_BUFFER_SIZE)) > 0)
+    while ((read = SPSCRing_Read(&ring, buffer, COPY_BUFFER_SIZE)) > 0)
     {		
 		sent = 0;
 		do
@@ -95,15 +129,79 @@ static void *handleServerConnection(void *data)
     return NULL;
 }
 
+/* splice mode reader: move bytes from the client socket into the pipe. */
+static void *spliceClientConnection(void *data)
+{
+	int client_socket = (int)(intptr_t) data;
+	ssize_t moved;
+
+	while ((moved = splice(client_socket, NULL, splicePipe[1], NULL,
+	                       SPLICE_CHUNK_SIZE, SPLICE_F_MOVE)) > 0)
+	{
+		__atomic_add_fetch(&splicedIn, (unsigned long) moved, __ATOMIC_RELAXED);
+	}
+
+	if (moved < 0)
+		printErrorAndExit("relay: splice from client");
+
+	/* the writer sees EOF on the pipe once it is drained */
+	close(splicePipe[1]);
+	close(client_socket);
+	return NULL;
+}
+
+/* splice mode writer: move bytes from the pipe to the server socket. */
+static void *spliceServerConnection(void *data)
+{
+	struct sockaddr_in * server_addr = (struct sockaddr_in *)data;
+	int sockfd = connectToServer(server_addr);
+	ssize_t moved;
+
+	while ((moved = splice(splicePipe[0], NULL, sockfd, NULL,
+	                       SPLICE_CHUNK_SIZE, SPLICE_F_MOVE)) > 0)
+	{
+		__atomic_add_fetch(&splicedOut, (unsigned long) moved, __ATOMIC_RELAXED);
+	}
+
+	if (moved < 0)
+		printErrorAndExit("relay: splice to server");
+
+	close(splicePipe[0]);
+	close(sockfd);
+	return NULL;
+}
+
+/* Create the kernel pipe used in splice mode, sized to match the ring when
+   the system allows it. */
+static void openSplicePipe(void)
+{
+	if (pipe(splicePipe) < 0)
+		printErrorAndExit("relay: pipe");
+	fcntl(splicePipe[1], F_SETPIPE_SZ, SPSC_RING_SIZE);
+	if ((pipeCapacity = fcntl(splicePipe[1], F_GETPIPE_SZ)) <= 0)
+		printErrorAndExit("relay: fcntl");
+	splicedIn = 0;
+	splicedOut = 0;
+}
+
 /* Helper to read data from the client socket connection and echo all the data
    to stdout. Note: this helper could be used in multithreadedness. */
 static void handleConnection(int client_socket, struct sockaddr_in *server_addr)
 {
-	Monitor_Init(&monitor);
 	pthread_t reader, writer, overseer;
-	
-    pthread_create(&reader, NULL, handleClientConnection, (void*) client_socket);
-    pthread_create(&writer, NULL, handleServerConnection, (void*) server_addr);
+
+	if (useSplice)
+	{
+		openSplicePipe();
+		pthread_create(&reader, NULL, spliceClientConnection, (void*)(intptr_t) client_socket);
+		pthread_create(&writer, NULL, spliceServerConnection, (void*) server_addr);
+	}
+	else
+	{
+		SPSCRing_Init(&ring);
+		pthread_create(&reader, NULL, handleClientConnection, (void*)(intptr_t) client_socket);
+		pthread_create(&writer, NULL, handleServerConnection, (void*) server_addr);
+	}
     pthread_create(&overseer, NULL, monitorBufferSize, NULL);
     
     pthread_join(reader, NULL);
@@ -119,9 +217,11 @@ int main(int argc, char *argv[])
     int in_port, out_port, sockfd, client_socket;
     socklen_t addr_len;
     
-    if (argc != 4)
+    if (argc == 5 && strcmp(argv[4], "splice") == 0)
+        useSplice = TRUE;
+    else if (argc != 4)
     {
-        fprintf(stderr, "usage: relay <incoming_port> <server_ip_addr> <server_port>\n");
+        fprintf(stderr, "usage: relay <incoming_port> <server_ip_addr> <server_port> [splice]\n");
         exit(1);
     }
     
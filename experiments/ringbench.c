@@ -0,0 +1,135 @@
+/* -------------------------------------------------------------------------
+ * File: ringbench.c
+ * Description: Measures raw reader-to-writer thread throughput of the
+ * relay's hand-off buffer, without any sockets, so we can tell whether the
+ * baseline relay itself is a bottleneck when comparing it against Tor.
+ * Runs the old mutex/condvar Monitor and the lock-free SPSCRing with the
+ * same chunk sizes.
+ * -------------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "monitor.h"
+#include "spscring.h"
+
+#define DEFAULT_TOTAL_MB 1024
+#define DEFAULT_CHUNK 512
+#define MAX_CHUNK 65536
+
+static Monitor monitor;
+static SPSCRing ring;
+
+static int useRing;
+static int chunkSize = DEFAULT_CHUNK;
+static unsigned long totalBytes;
+static unsigned long consumed;
+static unsigned long checksum;
+
+static void *producer(void *data)
+{
+    char buffer[MAX_CHUNK];
+    unsigned long sent = 0;
+    int i;
+    (void) data;
+
+    for (i = 0; i < chunkSize; i++)
+        buffer[i] = (char) i;
+
+    while (sent < totalBytes) {
+        int n = chunkSize;
+        if (totalBytes - sent < (unsigned long) n)
+            n = (int)(totalBytes - sent);
+        if (useRing)
+            SPSCRing_Write(&ring, buffer, n);
+        else
+            Monitor_AddBuffer(&monitor, buffer, n);
+        sent += n;
+    }
+
+    if (useRing)
+        SPSCRing_Close(&ring);
+    else
+        Monitor_CloseBuffer(&monitor);
+    return NULL;
+}
+
+static void *consumer(void *data)
+{
+    char buffer[MAX_CHUNK];
+    int n;
+    (void) data;
+
+    for (;;) {
+        if (useRing)
+            n = SPSCRing_Read(&ring, buffer, chunkSize);
+        else
+            n = Monitor_RemoveBuffer(&monitor, buffer, chunkSize);
+        if (n <= 0)
+            break;
+        consumed += n;
+        /* touch the data so the copy cannot be optimized away */
+        checksum += (unsigned char) buffer[n - 1];
+    }
+    return NULL;
+}
+
+static double runOnce(int ringMode)
+{
+    pthread_t prod, cons;
+    struct timeval start, end;
+
+    useRing = ringMode;
+    consumed = 0;
+    if (useRing)
+        SPSCRing_Init(&ring);
+    else
+        Monitor_Init(&monitor);
+
+    gettimeofday(&start, NULL);
+    pthread_create(&cons, NULL, consumer, NULL);
+    pthread_create(&prod, NULL, producer, NULL);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    gettimeofday(&end, NULL);
+
+    if (consumed != totalBytes) {
+        fprintf(stderr, "ringbench: lost data (%lu of %lu bytes)\n",
+                consumed, totalBytes);
+        exit(1);
+    }
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long totalMb = DEFAULT_TOTAL_MB;
+    int mode;
+
+    if (argc > 3) {
+        fprintf(stderr, "usage: ringbench [total_mb] [chunk_bytes]\n");
+        exit(1);
+    }
+    if (argc > 1)
+        totalMb = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        chunkSize = atoi(argv[2]);
+    if (totalMb == 0 || chunkSize <= 0 || chunkSize > MAX_CHUNK) {
+        fprintf(stderr, "ringbench: invalid arguments\n");
+        exit(1);
+    }
+    totalBytes = totalMb << 20;
+
+    /* format: <impl> <chunk_bytes> <total_mb> <seconds> <MB/s> */
+    for (mode = 0; mode <= 1; mode++) {
+        double secs = runOnce(mode);
+        printf("%s %d %lu %.3f %.1f\n", mode ? "spsc" : "monitor",
+               chunkSize, totalMb, secs, totalMb / secs);
+    }
+    fflush(stdout);
+    return 0;
+}
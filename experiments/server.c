@@ -3,7 +3,9 @@
  * Author: Bryan Richter (bwrichte)
  * Description: Implements a server program which accepts sequential
  * connections from different client programs and receives data from them,
- * echoing all data received to stdout.
+ * echoing all data received to stdout.  With the optional "concurrent"
+ * argument each connection is handled in its own child process, so many
+ * flows can be measured at once; their output lines interleave.
  * -------------------------------------------------------------------------
  */
 
@@ -15,6 +17,7 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <signal.h>
 
 #define MIN_PORT 1
 #define MAX_PORT 65535
@@ -74,7 +77,7 @@ static void handleConnection(int client_socket)
 {
     char buffer[BUFFER_SIZE+1];
     int read;
-    unsigned long int readTotal, readTotalTotal = 0;
+    unsigned long int readTotal = 0, readTotalTotal = 0;
     struct timeval startTime, originalStartTime, curTime, diff;
     
     gettimeofday(&startTime, NULL);
@@ -119,9 +122,13 @@ int main(int argc, char *argv[])
     int port, sockfd, client_socket;
     socklen_t addr_len;
     
-    if (argc != 2)
+    int concurrent = 0;
+
+    if (argc == 3 && strcmp(argv[2], "concurrent") == 0)
+        concurrent = 1;
+    else if (argc != 2)
     {
-        fprintf(stderr, "usage: server <port>\n");
+        fprintf(stderr, "usage: server <port> [concurrent]\n");
         exit(1);
     }
     
@@ -150,6 +157,10 @@ int main(int argc, char *argv[])
     
     LOG("Listening for connections on port %d\n", port);
     listen(sockfd, MAX_PENDING);
+
+    /* let finished children be reaped automatically */
+    if (concurrent)
+        signal(SIGCHLD, SIG_IGN);
     
     /* wait for connection, then receive and handle */
     while (TRUE)
@@ -159,6 +170,22 @@ int main(int argc, char *argv[])
             printErrorAndExit("server: accept");
         
         LOG("Accepted a new connection from client addr %s\n", inet_ntoa(client_addr.sin_addr));
+        if (concurrent)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+                printErrorAndExit("server: fork");
+            if (pid == 0)
+            {
+                close(sockfd);
+                /* keep each line in one write so children don't split them */
+                setvbuf(stdout, NULL, _IOLBF, 0);
+                handleConnection(client_socket);
+                exit(0);
+            }
+            close(client_socket);
+            continue;
+        }
         handleConnection(client_socket);
     }
     
@@ -0,0 +1,182 @@
+/* -------------------------------------------------------------------------
+ * File: spscring.c
+ * Description: Lock-free single-producer/single-consumer byte ring.  Data
+ * moves with at most two memcpy calls per operation (one per side of the
+ * wrap point).  Threads only block when the ring is empty (consumer) or
+ * full (producer), and the other side only makes a wake syscall when it
+ * sees that a thread is actually parked.
+ * -------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "spscring.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
+
+#define min(a,b) ((a < b) ? a : b)
+
+#define MASK (SPSC_RING_SIZE - 1)
+
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define FULL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Sleep until *addr no longer holds val (or a spurious wakeup). */
+static void futexWait(int *addr, int val)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    if (LOAD_ACQUIRE(addr) == val)
+        sched_yield();
+#endif
+}
+
+/* Bump the sequence word at addr and wake the thread sleeping on it. */
+static void futexWake(int *addr)
+{
+    __atomic_add_fetch(addr, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+void SPSCRing_Init(SPSCRing *ring)
+{
+    ring->head = 0;
+    ring->cachedTail = 0;
+    ring->tail = 0;
+    ring->cachedHead = 0;
+    ring->dataSeq = 0;
+    ring->consumerWaiting = 0;
+    ring->spaceSeq = 0;
+    ring->producerWaiting = 0;
+    ring->eof = 0;
+}
+
+/* Producer: park until the consumer frees some space.  The waiting flag is
+   published before tail is re-read, and the consumer publishes tail before
+   reading the flag, so with a full fence on each side at least one of them
+   sees the other and no wakeup is lost. */
+static void waitForSpace(SPSCRing *ring, unsigned long head)
+{
+    int seq = LOAD_ACQUIRE(&ring->spaceSeq);
+    STORE_RELAXED(&ring->producerWaiting, 1);
+    FULL_FENCE();
+    ring->cachedTail = LOAD_ACQUIRE(&ring->tail);
+    if (head - ring->cachedTail == SPSC_RING_SIZE)
+        futexWait(&ring->spaceSeq, seq);
+    STORE_RELAXED(&ring->producerWaiting, 0);
+}
+
+/* Consumer: park until the producer publishes data or closes the ring. */
+static void waitForData(SPSCRing *ring, unsigned long tail)
+{
+    int seq = LOAD_ACQUIRE(&ring->dataSeq);
+    STORE_RELAXED(&ring->consumerWaiting, 1);
+    FULL_FENCE();
+    ring->cachedHead = LOAD_ACQUIRE(&ring->head);
+    if (ring->cachedHead == tail && !LOAD_ACQUIRE(&ring->eof))
+        futexWait(&ring->dataSeq, seq);
+    STORE_RELAXED(&ring->consumerWaiting, 0);
+}
+
+int SPSCRing_Write(SPSCRing *ring, const char *buf, int count)
+{
+    unsigned long head = ring->head;
+    int done = 0;
+
+    while (done < count) {
+        unsigned long space = SPSC_RING_SIZE - (head - ring->cachedTail);
+        if (space == 0) {
+            ring->cachedTail = LOAD_ACQUIRE(&ring->tail);
+            space = SPSC_RING_SIZE - (head - ring->cachedTail);
+            if (space == 0) {
+                waitForSpace(ring, head);
+                continue;
+            }
+        }
+
+        unsigned long n = min(space, (unsigned long)(count - done));
+        unsigned long off = head & MASK;
+        unsigned long first = min(n, SPSC_RING_SIZE - off);
+        memcpy(ring->buf + off, buf + done, first);
+        memcpy(ring->buf, buf + done + first, n - first);
+
+        head += n;
+        done += n;
+        STORE_RELEASE(&ring->head, head);
+
+        FULL_FENCE();
+        if (LOAD_RELAXED(&ring->consumerWaiting))
+            futexWake(&ring->dataSeq);
+    }
+    return 0;
+}
+
+int SPSCRing_Read(SPSCRing *ring, char *buf, int want)
+{
+    unsigned long tail = ring->tail;
+    unsigned long avail;
+
+    if (want <= 0)
+        return 0;
+
+    for (;;) {
+        avail = ring->cachedHead - tail;
+        if (avail == 0) {
+            ring->cachedHead = LOAD_ACQUIRE(&ring->head);
+            avail = ring->cachedHead - tail;
+        }
+        if (avail > 0)
+            break;
+        if (LOAD_ACQUIRE(&ring->eof)) {
+            /* eof is set after the last write, so one more look at head
+               is enough to know the ring is drained. */
+            ring->cachedHead = LOAD_ACQUIRE(&ring->head);
+            if (ring->cachedHead == tail)
+                return 0;
+            continue;
+        }
+        waitForData(ring, tail);
+    }
+
+    unsigned long n = min(avail, (unsigned long) want);
+    unsigned long off = tail & MASK;
+    unsigned long first = min(n, SPSC_RING_SIZE - off);
+    memcpy(buf, ring->buf + off, first);
+    memcpy(buf + first, ring->buf, n - first);
+
+    STORE_RELEASE(&ring->tail, tail + n);
+
+    FULL_FENCE();
+    if (LOAD_RELAXED(&ring->producerWaiting))
+        futexWake(&ring->spaceSeq);
+
+    return (int) n;
+}
+
+void SPSCRing_Close(SPSCRing *ring)
+{
+    STORE_RELEASE(&ring->eof, 1);
+    FULL_FENCE();
+    if (LOAD_RELAXED(&ring->consumerWaiting))
+        futexWake(&ring->dataSeq);
+}
+
+int SPSCRing_Size(SPSCRing *ring)
+{
+    unsigned long tail = LOAD_RELAXED(&ring->tail);
+    unsigned long head = LOAD_RELAXED(&ring->head);
+    if (head - tail > SPSC_RING_SIZE)
+        return 0;
+    return (int)(head - tail);
+}
@@ -0,0 +1,59 @@
+/* -------------------------------------------------------------------------
+ * File: spscring.h
+ * Description: Single-producer/single-consumer byte ring used by the relay
+ * to hand data from its reader thread to its writer thread without taking
+ * a lock on the fast path.
+ * -------------------------------------------------------------------------
+ */
+
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+/* Must be a power of two; matches the capacity of the old CircBuffer so
+   occupancy snapshots stay comparable. */
+#define SPSC_RING_SIZE 4194304
+#define SPSC_CACHE_LINE 64
+
+/* Start a group of fields on its own cache line.  Aligning a member also
+   aligns the whole struct, so this holds for static rings too. */
+#define SPSC_CACHE_ALIGNED __attribute__((aligned(SPSC_CACHE_LINE)))
+
+/* Positions are free-running byte counters; the slot for position p is
+   p & (SPSC_RING_SIZE - 1).  Each group of fields written by one side sits
+   on its own cache line so the producer and consumer never false-share. */
+typedef struct SPSCRing {
+    /* written by the producer only */
+    unsigned long head SPSC_CACHE_ALIGNED;
+    unsigned long cachedTail;
+
+    /* written by the consumer only */
+    unsigned long tail SPSC_CACHE_ALIGNED;
+    unsigned long cachedHead;
+
+    /* futex words: a side only sleeps (and the other side only issues a
+       wake syscall) when the ring is empty or full. */
+    int dataSeq SPSC_CACHE_ALIGNED;
+    int consumerWaiting;
+    int spaceSeq SPSC_CACHE_ALIGNED;
+    int producerWaiting;
+    int eof;
+
+    char buf[SPSC_RING_SIZE] SPSC_CACHE_ALIGNED;
+} SPSCRing;
+
+void SPSCRing_Init(SPSCRing *ring);
+
+/* Copy all count bytes into the ring, blocking while it is full. */
+int SPSCRing_Write(SPSCRing *ring, const char *buf, int count);
+
+/* Copy up to want bytes out of the ring, blocking while it is empty.
+   Returns 0 once the ring is empty and has been closed. */
+int SPSCRing_Read(SPSCRing *ring, char *buf, int want);
+
+/* Producer side: no more data will be written. */
+void SPSCRing_Close(SPSCRing *ring);
+
+/* Approximate number of bytes queued; safe to call from any thread. */
+int SPSCRing_Size(SPSCRing *ring);
+
+#endif
@@ -130,6 +130,18 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
   EVP_EncryptUpdate(&cipher->evp, (unsigned char*)data,
                     &outl, (unsigned char*)data, (int)len);
 }
+/** Write the next <b>len</b> bytes of <b>cipher</b>'s keystream to
+ * <b>out</b>, advancing the counter by <b>len</b> bytes. */
+static void
+aes_fill_keystream(aes_cnt_cipher_t *cipher, uint8_t *out, size_t len)
+{
+  int outl;
+
+  tor_assert(len < INT_MAX);
+
+  memset(out, 0, len);
+  EVP_EncryptUpdate(&cipher->evp, out, &outl, out, (int)len);
+}
 int
 evaluate_evp_for_aes(int force_val)
 {
@@ -385,6 +397,57 @@ aes_cipher_free(aes_cnt_cipher_t *cipher)
 #define UPDATE_CTR_BUF(c, n)
 #endif
 
+/** Advance the 128-bit counter of <b>cipher</b> by one block. Does not
+ * refill cipher->buf. */
+static INLINE void
+aes_increment_counter(aes_cnt_cipher_t *cipher)
+{
+  if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
+    if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
+      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
+        ++COUNTER(cipher, 3);
+        UPDATE_CTR_BUF(cipher, 3);
+      }
+      UPDATE_CTR_BUF(cipher, 2);
+    }
+    UPDATE_CTR_BUF(cipher, 1);
+  }
+  UPDATE_CTR_BUF(cipher, 0);
+}
+
+/** How many counter blocks aes_fill_blocks() hands to the block cipher in
+ * one call. */
+#define AES_CTR_BLOCKS_PER_CALL 64
+
+/** Encrypt the next <b>n_blocks</b> counter values of <b>cipher</b> into
+ * <b>out</b>, starting with the current counter and leaving the counter
+ * <b>n_blocks</b> further along.  Through EVP, the counter blocks go to the
+ * ECB implementation many at a time, so that pipelined implementations
+ * (such as AES-NI) can work on several blocks at once.  Does not touch
+ * cipher->buf or cipher->pos. */
+static void
+aes_fill_blocks(aes_cnt_cipher_t *cipher, uint8_t *out, size_t n_blocks)
+{
+  uint8_t ctrs[AES_CTR_BLOCKS_PER_CALL*16];
+
+  while (n_blocks) {
+    size_t i, n = MIN(n_blocks, AES_CTR_BLOCKS_PER_CALL);
+    for (i = 0; i < n; ++i) {
+      memcpy(ctrs + 16*i, cipher->ctr_buf.buf, 16);
+      aes_increment_counter(cipher);
+    }
+    if (cipher->using_evp) {
+      int outl = (int)(n*16);
+      EVP_EncryptUpdate(&cipher->key.evp, out, &outl, ctrs, (int)(n*16));
+    } else {
+      for (i = 0; i < n; ++i)
+        AES_encrypt(ctrs + 16*i, out + 16*i, &cipher->key.aes);
+    }
+    out += n*16;
+    n_blocks -= n;
+  }
+}
+
 #ifdef CAN_USE_OPENSSL_CTR
 /* Helper function to use EVP with openssl's counter-mode wrapper. */
 static void evp_block128_fn(const uint8_t in[16],
@@ -442,17 +505,7 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
         *(output++) = *(input++) ^ cipher->buf[c];
       } while (++c != 16);
       cipher->pos = c = 0;
-      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
-        if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
-          if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
-            ++COUNTER(cipher, 3);
-            UPDATE_CTR_BUF(cipher, 3);
-          }
-          UPDATE_CTR_BUF(cipher, 2);
-        }
-        UPDATE_CTR_BUF(cipher, 1);
-      }
-      UPDATE_CTR_BUF(cipher, 0);
+      aes_increment_counter(cipher);
       _aes_fill_buf(cipher);
     }
   }
@@ -482,22 +535,48 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
         *(data++) ^= cipher->buf[c];
       } while (++c != 16);
       cipher->pos = c = 0;
-      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 0))) {
-        if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
-          if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
-            ++COUNTER(cipher, 3);
-            UPDATE_CTR_BUF(cipher, 3);
-          }
-          UPDATE_CTR_BUF(cipher, 2);
-        }
-        UPDATE_CTR_BUF(cipher, 1);
-      }
-      UPDATE_CTR_BUF(cipher, 0);
+      aes_increment_counter(cipher);
       _aes_fill_buf(cipher);
     }
   }
 }
 
+/** Write the next <b>len</b> bytes of <b>cipher</b>'s keystream to
+ * <b>out</b>, advancing the counter by <b>len</b> bytes. */
+static void
+aes_fill_keystream(aes_cnt_cipher_t *cipher, uint8_t *out, size_t len)
+{
+  size_t n;
+#ifdef CAN_USE_OPENSSL_CTR
+  if (should_use_openssl_CTR) {
+    memset(out, 0, len);
+    aes_crypt(cipher, (const char*)out, len, (char*)out);
+    return;
+  }
+#endif
+
+  /* Whatever is left of the current block comes first... */
+  n = MIN(len, 16 - cipher->pos);
+  memcpy(out, cipher->buf + cipher->pos, n);
+  out += n;
+  len -= n;
+  cipher->pos += (unsigned int)n;
+  if (cipher->pos < 16)
+    return;
+  aes_increment_counter(cipher);
+
+  /* ...then all the whole blocks at once... */
+  n = len / 16;
+  aes_fill_blocks(cipher, out, n);
+  out += n*16;
+  len -= n*16;
+
+  /* ...then the start of the next block, which stays buffered. */
+  _aes_fill_buf(cipher);
+  memcpy(out, cipher->buf, len);
+  cipher->pos = (unsigned int)len;
+}
+
 /** Reset the 128-bit counter of <b>cipher</b> to the 16-bit big-endian value
  * in <b>iv</b>. */
 static void
@@ -519,3 +598,43 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv)
 }
 
 #endif
+
+/** Largest amount of keystream that aes_crypt_inplace_batch() generates in
+ * one go. */
+#define AES_BATCH_KEYSTREAM_LEN 4096
+
+/** Encrypt <b>n</b> buffers of <b>len</b> bytes each in place, in order,
+ * exactly as if aes_crypt_inplace() were called on each of them in turn.
+ * The keystream for the whole batch is generated a few kilobytes at a time
+ * rather than once per buffer, which keeps the block cipher busy on long
+ * runs of counter blocks instead of restarting at every buffer boundary.
+ */
+void
+aes_crypt_inplace_batch(aes_cnt_cipher_t *cipher, char **data, size_t n,
+                        size_t len)
+{
+  uint8_t keystream[AES_BATCH_KEYSTREAM_LEN];
+  size_t idx = 0, off = 0;
+
+  if (PREDICT_UNLIKELY(!len))
+    return;
+
+  while (idx < n) {
+    size_t want = MIN(sizeof(keystream), (n - idx) * len - off);
+    size_t used = 0;
+    aes_fill_keystream(cipher, keystream, want);
+    while (used < want) {
+      size_t i, take = MIN(len - off, want - used);
+      char *d = data[idx] + off;
+      for (i = 0; i < take; ++i)
+        d[i] ^= keystream[used + i];
+      used += take;
+      off += take;
+      if (off == len) {
+        off = 0;
+        ++idx;
+      }
+    }
+  }
+  memset(keystream, 0, sizeof(keystream));
+}
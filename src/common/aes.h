@@ -21,6 +21,8 @@ void aes_cipher_free(aes_cnt_cipher_t *cipher);
 void aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
                char *output);
 void aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len);
+void aes_crypt_inplace_batch(aes_cnt_cipher_t *cipher, char **data, size_t n,
+                             size_t len);
 
 int evaluate_evp_for_aes(int force_value);
 int evaluate_ctr_for_aes(void);
@@ -2375,6 +2375,24 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Return a timestamp in microseconds from a clock that never jumps
+ * backwards, if the platform has one, or from the wall clock otherwise.
+ * Only differences between two return values are meaningful. */
+uint64_t
+tor_gettime_usec_monotonic(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+  {
+    struct timeval tv;
+    tor_gettimeofday(&tv);
+    return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+  }
+}
+
 #if defined(TOR_IS_MULTITHREADED) && !defined(_WIN32)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
@@ -2659,7 +2677,6 @@ tor_mutex_free(tor_mutex_t *m)
 
 /* Conditions. */
 #ifdef USE_PTHREADS
-#if 0
 /** Cross-platform condition implementation. */
 struct tor_cond_t {
   pthread_cond_t cond;
@@ -2707,7 +2724,6 @@ tor_cond_signal_all(tor_cond_t *cond)
 {
   pthread_cond_broadcast(&cond->cond);
 }
-#endif
 /** Set up common structures for use by threading. */
 void
 tor_threads_init(void)
@@ -2720,7 +2736,6 @@ tor_threads_init(void)
   }
 }
 #elif defined(USE_WIN32_THREADS)
-#if 0
 static DWORD cond_event_tls_index;
 struct tor_cond_t {
   CRITICAL_SECTION mutex;
@@ -2803,13 +2818,10 @@ tor_cond_signal_all(tor_cond_t *cond)
   smartlist_clear(cond->events);
   LeaveCriticalSection(&cond->mutex);
 }
-#endif
 void
 tor_threads_init(void)
 {
-#if 0
   cond_event_tls_index = TlsAlloc();
-#endif
   set_main_thread();
 }
 #endif
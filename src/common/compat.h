@@ -325,6 +325,7 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+uint64_t tor_gettime_usec_monotonic(void);
 
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
@@ -647,7 +648,6 @@ void set_main_thread(void);
 int in_main_thread(void);
 
 #ifdef TOR_IS_MULTITHREADED
-#if 0
 typedef struct tor_cond_t tor_cond_t;
 tor_cond_t *tor_cond_new(void);
 void tor_cond_free(tor_cond_t *cond);
@@ -655,7 +655,6 @@ int tor_cond_wait(tor_cond_t *cond, tor_mutex_t *mutex);
 void tor_cond_signal_one(tor_cond_t *cond);
 void tor_cond_signal_all(tor_cond_t *cond);
 #endif
-#endif
 
 /** Macros for MIN/MAX.  Never use these when the arguments could have
  * side-effects.
@@ -1365,6 +1365,20 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   return 0;
 }
 
+/** Encrypt or decrypt <b>n</b> buffers of <b>len</b> bytes each in place,
+ * in order, as if by calling crypto_cipher_crypt_inplace() on each one, but
+ * generating the keystream for all of them together.  On success, return
+ * 0.  On failure, return -1.
+ */
+int
+crypto_cipher_crypt_inplace_batch(crypto_cipher_t *env, char **bufs,
+                                  size_t n, size_t len)
+{
+  tor_assert(n < SIZE_T_CEILING / (len ? len : 1));
+  aes_crypt_inplace_batch(env->cipher, bufs, n, len);
+  return 0;
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
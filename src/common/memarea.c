@@ -102,32 +102,52 @@ static int freelist_len=0;
  * spinning in malloc/free loops. */
 static memarea_chunk_t *freelist = NULL;
 
+#ifdef TOR_IS_MULTITHREADED
+/** Protects freelist and freelist_len, since worker threads can use memareas
+ * of their own.  We make it the first time we touch the freelist, which is
+ * always on the main thread, before any worker has started. */
+static tor_mutex_t *freelist_mutex = NULL;
+#define LOCK_FREELIST() STMT_BEGIN                              \
+    if (PREDICT_UNLIKELY(!freelist_mutex))                      \
+      freelist_mutex = tor_mutex_new();                         \
+    tor_mutex_acquire(freelist_mutex);                          \
+  STMT_END
+#define UNLOCK_FREELIST() tor_mutex_release(freelist_mutex)
+#else
+#define LOCK_FREELIST() STMT_NIL
+#define UNLOCK_FREELIST() STMT_NIL
+#endif
+
 /** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
 static memarea_chunk_t *
 alloc_chunk(size_t sz, int freelist_ok)
 {
+  memarea_chunk_t *res = NULL;
+  size_t chunk_size;
   tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
-    memarea_chunk_t *res = freelist;
-    freelist = res->next_chunk;
+  if (freelist_ok) {
+    LOCK_FREELIST();
+    if ((res = freelist)) {
+      freelist = res->next_chunk;
+      --freelist_len;
+    }
+    UNLOCK_FREELIST();
+  }
+  if (res) {
     res->next_chunk = NULL;
-    --freelist_len;
     CHECK_SENTINEL(res);
     return res;
-  } else {
-    size_t chunk_size = freelist_ok ? CHUNK_SIZE : sz;
-    memarea_chunk_t *res;
-    chunk_size += SENTINEL_LEN;
-    res = tor_malloc(chunk_size);
-    res->next_chunk = NULL;
-    res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
-    res->next_mem = res->u.mem;
-    tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
-               ((char*)res)+chunk_size);
-    tor_assert(realign_pointer(res->next_mem) == res->next_mem);
-    SET_SENTINEL(res);
-    return res;
   }
+  chunk_size = (freelist_ok ? CHUNK_SIZE : sz) + SENTINEL_LEN;
+  res = tor_malloc(chunk_size);
+  res->next_chunk = NULL;
+  res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
+  res->next_mem = res->u.mem;
+  tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
+             ((char*)res)+chunk_size);
+  tor_assert(realign_pointer(res->next_mem) == res->next_mem);
+  SET_SENTINEL(res);
+  return res;
 }
 
 /** Release <b>chunk</b> from a memarea, either by adding it to the freelist
@@ -136,14 +156,16 @@ static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
   CHECK_SENTINEL(chunk);
+  chunk->next_mem = chunk->u.mem;
+  LOCK_FREELIST();
   if (freelist_len < MAX_FREELIST_LEN) {
     ++freelist_len;
     chunk->next_chunk = freelist;
     freelist = chunk;
-    chunk->next_mem = chunk->u.mem;
-  } else {
-    tor_free(chunk);
+    chunk = NULL;
   }
+  UNLOCK_FREELIST();
+  tor_free(chunk);
 }
 
 /** Allocate and return new memarea. */
@@ -191,12 +213,15 @@ void
 memarea_clear_freelist(void)
 {
   memarea_chunk_t *chunk, *next;
+  LOCK_FREELIST();
+  chunk = freelist;
   freelist_len = 0;
-  for (chunk = freelist; chunk; chunk = next) {
+  freelist = NULL;
+  UNLOCK_FREELIST();
+  for ( ; chunk; chunk = next) {
     next = chunk->next_chunk;
     tor_free(chunk);
   }
-  freelist = NULL;
 }
 
 /** Return true iff <b>p</b> is in a range that has been returned by an
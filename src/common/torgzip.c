@@ -385,6 +385,109 @@ detect_compression_method(const char *in, size_t in_len)
   }
 }
 
+/** Compress the <b>in_len</b> bytes at <b>in</b> into a newly allocated
+ * "segment": a run of raw deflate blocks that refers to nothing outside
+ * itself and ends on a byte boundary with a full flush.  Store the segment in
+ * *<b>out</b>, its length in *<b>out_len</b>, and the Adler-32 checksum of
+ * <b>in</b> in *<b>adler_out</b>.  Return 0 on success, -1 on failure.
+ *
+ * Any sequence of segments, preceded by tor_zlib_segment_header() and
+ * followed by tor_zlib_segment_trailer(), is a valid ZLIB_METHOD stream for
+ * the concatenation of their inputs.  This lets us compress each directory
+ * object once and serve any subset of them without compressing again.
+ */
+int
+tor_zlib_compress_segment(char **out, size_t *out_len, uint32_t *adler_out,
+                          const char *in, size_t in_len)
+{
+  struct z_stream_s stream;
+  size_t out_size;
+  int r;
+
+  tor_assert(out);
+  tor_assert(out_len);
+  tor_assert(adler_out);
+  tor_assert(in || !in_len);
+  tor_assert(in_len < UINT_MAX);
+
+  *out = NULL;
+  memset(&stream, 0, sizeof(stream));
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = NULL;
+  /* Negative window bits mean "raw deflate": no zlib header or trailer. */
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    log_warn(LD_GENERAL, "Error from deflateInit2: %s",
+             stream.msg?stream.msg:"<no message>");
+    return -1;
+  }
+
+  /* deflateBound() covers a finished stream; the flush marker that ends a
+   * segment is no longer than what Z_FINISH would have written. */
+  out_size = deflateBound(&stream, (uLong)in_len) + 16;
+  *out = tor_malloc(out_size);
+  stream.next_in = (unsigned char*) in;
+  stream.avail_in = (unsigned int)in_len;
+  stream.next_out = (unsigned char*) *out;
+  stream.avail_out = (unsigned int)out_size;
+
+  r = deflate(&stream, Z_FULL_FLUSH);
+  if (r != Z_OK || stream.avail_in != 0 || stream.avail_out == 0) {
+    /* With avail_out left over, zlib has written the whole flush. */
+    log_warn(LD_GENERAL, "Couldn't compress segment: %s",
+             stream.msg ? stream.msg : "<no message>");
+    deflateEnd(&stream);
+    tor_free(*out);
+    return -1;
+  }
+
+  *out_len = out_size - stream.avail_out;
+  *adler_out = (uint32_t) adler32(adler32(0L, Z_NULL, 0),
+                                  (const unsigned char*)in,
+                                  (unsigned int)in_len);
+  deflateEnd(&stream);
+  if (*out_len < out_size / 2)
+    *out = tor_realloc(*out, *out_len ? *out_len : 1);
+  return 0;
+}
+
+/** Write the TOR_ZLIB_SEGMENT_HEADER_LEN bytes that begin a ZLIB_METHOD
+ * stream of segments into <b>out</b>, and return the Adler-32 checksum of
+ * an empty input, to pass to tor_zlib_segment_adler_combine(). */
+uint32_t
+tor_zlib_segment_header(char *out)
+{
+  /* CMF: deflate with a 32K window; FLG: maximum compression, no preset
+   * dictionary, and a check value that makes the pair a multiple of 31. */
+  out[0] = (char)0x78;
+  out[1] = (char)0xda;
+  return (uint32_t) adler32(0L, Z_NULL, 0);
+}
+
+/** Return the Adler-32 checksum of some input A followed by some input B,
+ * given the checksum <b>adler_a</b> of A, the checksum <b>adler_b</b> of B,
+ * and <b>len_b</b>, the length of B. */
+uint32_t
+tor_zlib_segment_adler_combine(uint32_t adler_a, uint32_t adler_b,
+                               size_t len_b)
+{
+  return (uint32_t) adler32_combine(adler_a, adler_b, (z_off_t)len_b);
+}
+
+/** Write the TOR_ZLIB_SEGMENT_TRAILER_LEN bytes that end a ZLIB_METHOD
+ * stream of segments into <b>out</b>, given the Adler-32 checksum
+ * <b>adler</b> of everything the stream's segments hold. */
+void
+tor_zlib_segment_trailer(char *out, uint32_t adler)
+{
+  /* An empty, final, fixed-Huffman block... */
+  out[0] = (char)0x03;
+  out[1] = (char)0x00;
+  /* ...and the checksum, in network order. */
+  set_uint32(out+2, htonl(adler));
+}
+
 /** Internal state for an incremental zlib compression/decompression.  The
  * body of this struct is not exposed. */
 struct tor_zlib_state_t {
@@ -34,6 +34,19 @@ int is_gzip_supported(void);
 
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
+/** Length of the header written by tor_zlib_segment_header(). */
+#define TOR_ZLIB_SEGMENT_HEADER_LEN 2
+/** Length of the trailer written by tor_zlib_segment_trailer(). */
+#define TOR_ZLIB_SEGMENT_TRAILER_LEN 6
+
+int tor_zlib_compress_segment(char **out, size_t *out_len,
+                              uint32_t *adler_out,
+                              const char *in, size_t in_len);
+uint32_t tor_zlib_segment_header(char *out);
+uint32_t tor_zlib_segment_adler_combine(uint32_t adler_a, uint32_t adler_b,
+                                        size_t len_b);
+void tor_zlib_segment_trailer(char *out, uint32_t adler);
+
 /** Return values from tor_zlib_process; see that function's documentation for
  * details. */
 typedef enum {
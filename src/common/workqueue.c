@@ -0,0 +1,609 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file workqueue.c
+ * \brief Thread pool for offloading CPU-heavy work from the main thread.
+ *
+ * The main thread hands out jobs through a bounded ring that worker threads
+ * drain with a compare-and-swap on the ring's tail, so queueing a job never
+ * takes a lock unless some worker is asleep.  Finished jobs are pushed onto a
+ * lock-free reply stack; the worker that makes the stack non-empty writes a
+ * single notification to an eventfd (or a socketpair, where eventfd is
+ * missing), and the main thread then runs every pending reply callback from
+ * its event loop.
+ *
+ * On builds without thread support, jobs run inline when they are added, and
+ * their replies are still delivered from the event loop.
+ **/
+
+#include "orconfig.h"
+#include "compat.h"
+#include "compat_libevent.h"
+#include "util.h"
+#include "torlog.h"
+#include "workqueue.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+/* Atomic primitives.  Everything the queue needs is a full barrier and a
+ * compare-and-swap on an unsigned int and on a pointer. */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define WQ_BARRIER() MemoryBarrier()
+#define WQ_CAS_UINT(p, old, new)                                        \
+  (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(new),        \
+                              (LONG)(old)) == (LONG)(old))
+#define WQ_CAS_PTR(p, old, new)                                         \
+  (InterlockedCompareExchangePointer((PVOID volatile *)(p), (new),      \
+                                     (old)) == (PVOID)(old))
+#else
+#define WQ_BARRIER() __sync_synchronize()
+#define WQ_CAS_UINT(p, old, new) __sync_bool_compare_and_swap((p),(old),(new))
+#define WQ_CAS_PTR(p, old, new) __sync_bool_compare_and_swap((p),(old),(new))
+#endif
+
+/** The largest number of worker threads we will run in one queue. */
+#define MAX_WORKQUEUE_THREADS 64
+
+/** A pool of worker threads with a job ring and a reply stack. */
+struct workqueue_t {
+  /** Ring of jobs waiting for a worker.  Only the main thread writes slots
+   * and advances <b>ring_head</b>; workers claim the slot at
+   * <b>ring_tail</b> by advancing it with a compare-and-swap. */
+  workqueue_job_t **ring;
+  /** Number of slots in <b>ring</b>, minus one.  The size is a power of
+   * two no smaller than <b>max_pending</b>. */
+  unsigned int ring_mask;
+  /** Free-running position of the next slot the main thread fills. */
+  volatile unsigned int ring_head;
+  /** Free-running position of the next slot a worker will take. */
+  volatile unsigned int ring_tail;
+
+  /** Jobs added but not yet replied to.  Main thread only.  Keeping this
+   * at or below the ring size is what lets the main thread refill a slot
+   * without checking whether a worker is still reading it. */
+  int n_pending;
+  /** Upper bound on <b>n_pending</b>. */
+  int max_pending;
+
+  /** Stack of finished jobs, newest first. */
+  workqueue_job_t * volatile replies;
+  /** Read and write ends of the reply notification channel.  With eventfd
+   * these are the same descriptor. */
+  tor_socket_t alert_fds[2];
+  /** True iff <b>alert_fds</b> is an eventfd rather than a socketpair. */
+  int alert_is_eventfd;
+  /** Event that runs workqueue_process_replies() when the channel is
+   * readable, or NULL if the caller polls for replies itself. */
+  struct event *reply_event;
+
+  /** Constructor, destructor, and argument for each thread's private
+   * state. */
+  void *(*state_new_fn)(void *);
+  void (*state_free_fn)(void *);
+  void *state_arg;
+  /** Bumped by workqueue_reset_thread_state(); a worker that sees a new
+   * value rebuilds its state before running its next job. */
+  volatile int state_generation;
+
+#ifdef TOR_IS_MULTITHREADED
+  /** Protects the sleep/wakeup handshake and thread shutdown. */
+  tor_mutex_t *lock;
+  /** Signalled when a job is added while some worker is asleep. */
+  tor_cond_t *wakeup;
+  /** Signalled by each worker as it exits. */
+  tor_cond_t *exited;
+  /** Signalled when a reply is pushed while the main thread is blocked in
+   * workqueue_wait_for_replies(). */
+  tor_cond_t *replied;
+  /** True iff the main thread is blocked on <b>replied</b>.  Written under
+   * <b>lock</b>; read without it by workers after a barrier. */
+  volatile int n_reply_waiters;
+  /** Number of workers blocked on <b>wakeup</b>.  Written under
+   * <b>lock</b>; read without it by the main thread after a barrier. */
+  volatile int n_sleeping;
+  /** Number of worker threads still running.  Protected by <b>lock</b>. */
+  int n_live;
+  /** True once workqueue_free() has asked the workers to exit. */
+  volatile int shutting_down;
+#else
+  /** Without threads, the main thread's copy of the per-thread state. */
+  void *inline_state;
+  /** The value of <b>state_generation</b> that built
+   * <b>inline_state</b>. */
+  int inline_generation;
+#endif
+};
+
+/** Tell the main thread that the reply stack has become non-empty. */
+static void
+workqueue_alert(workqueue_t *wq)
+{
+  int r;
+#ifdef HAVE_SYS_EVENTFD_H
+  if (wq->alert_is_eventfd) {
+    uint64_t one = 1;
+    r = (int)write(wq->alert_fds[1], &one, sizeof(one));
+  } else
+#endif
+  {
+    char b = 0;
+    r = (int)send(wq->alert_fds[1], &b, 1, 0);
+  }
+  /* A full channel already has a notification pending, which is all we
+   * wanted. */
+  (void)r;
+}
+
+/** Consume every pending notification on <b>wq</b>'s alert channel. */
+static void
+workqueue_drain_alerts(workqueue_t *wq)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  if (wq->alert_is_eventfd) {
+    uint64_t count;
+    if (read(wq->alert_fds[0], &count, sizeof(count)) < 0 &&
+        !ERRNO_IS_EAGAIN(errno))
+      log_warn(LD_GENERAL, "Error draining workqueue eventfd: %s",
+               strerror(errno));
+    return;
+  }
+#endif
+  {
+    char buf[64];
+    int r;
+    do {
+      r = (int)recv(wq->alert_fds[0], buf, sizeof(buf), 0);
+    } while (r > 0);
+    if (r < 0 && !ERRNO_IS_EAGAIN(tor_socket_errno(wq->alert_fds[0])))
+      log_warn(LD_GENERAL, "Error draining workqueue socket: %s",
+               tor_socket_strerror(tor_socket_errno(wq->alert_fds[0])));
+  }
+}
+
+/** Push the finished <b>job</b> onto <b>wq</b>'s reply stack, and wake the
+ * main thread if the stack was empty.  Safe to call from any thread. */
+static void
+workqueue_push_reply(workqueue_t *wq, workqueue_job_t *job)
+{
+  workqueue_job_t *head;
+  /* Only the main thread ever removes entries, and it always takes the
+   * whole stack at once, so a plain CAS push is ABA-safe. */
+  do {
+    head = wq->replies;
+    job->next_reply = head;
+  } while (!WQ_CAS_PTR(&wq->replies, head, job));
+  if (!head)
+    workqueue_alert(wq);
+#ifdef TOR_IS_MULTITHREADED
+  /* Publish the reply before looking at n_reply_waiters; see
+   * workqueue_wait_for_replies(). */
+  WQ_BARRIER();
+  if (wq->n_reply_waiters) {
+    tor_mutex_acquire(wq->lock);
+    tor_cond_signal_all(wq->replied);
+    tor_mutex_release(wq->lock);
+  }
+#endif
+}
+
+/** Run <b>job</b> with <b>state</b> unless it has been cancelled, and
+ * queue its reply. */
+static void
+workqueue_run_job(workqueue_t *wq, workqueue_job_t *job, void *state)
+{
+  if (!job->cancelled) {
+    job->work_fn(job, state);
+    job->completed = 1;
+  }
+  workqueue_push_reply(wq, job);
+}
+
+/** Try to claim the oldest job in <b>wq</b>'s ring.  Return it, or NULL if
+ * the ring is empty.  Safe to call from several threads at once. */
+static workqueue_job_t *
+workqueue_take_job(workqueue_t *wq)
+{
+  for (;;) {
+    unsigned int tail = wq->ring_tail;
+    workqueue_job_t *job;
+    WQ_BARRIER();
+    if (tail == wq->ring_head)
+      return NULL;
+    /* Pairs with the barrier between filling a slot and publishing
+     * ring_head in workqueue_add(). */
+    WQ_BARRIER();
+    job = wq->ring[tail & wq->ring_mask];
+    if (WQ_CAS_UINT(&wq->ring_tail, tail, tail + 1))
+      return job;
+  }
+}
+
+#ifdef TOR_IS_MULTITHREADED
+/** Main function for a worker thread: run jobs until the queue shuts
+ * down. */
+static void
+workqueue_thread_main(void *arg)
+{
+  workqueue_t *wq = arg;
+  void *state = NULL;
+  int generation = wq->state_generation - 1;
+
+  for (;;) {
+    workqueue_job_t *job = workqueue_take_job(wq);
+    if (!job) {
+      int done;
+      tor_mutex_acquire(wq->lock);
+      ++wq->n_sleeping;
+      /* Publish n_sleeping before looking at the ring again; the main
+       * thread publishes ring_head before looking at n_sleeping, so one of
+       * us always sees the other. */
+      WQ_BARRIER();
+      while (!wq->shutting_down && wq->ring_tail == wq->ring_head)
+        tor_cond_wait(wq->wakeup, wq->lock);
+      --wq->n_sleeping;
+      done = wq->shutting_down;
+      tor_mutex_release(wq->lock);
+      if (done)
+        break;
+      continue;
+    }
+
+    if (generation != wq->state_generation) {
+      generation = wq->state_generation;
+      if (state && wq->state_free_fn)
+        wq->state_free_fn(state);
+      state = wq->state_new_fn ? wq->state_new_fn(wq->state_arg) : NULL;
+    }
+    workqueue_run_job(wq, job, state);
+  }
+
+  if (state && wq->state_free_fn)
+    wq->state_free_fn(state);
+  tor_mutex_acquire(wq->lock);
+  --wq->n_live;
+  tor_cond_signal_all(wq->exited);
+  tor_mutex_release(wq->lock);
+  spawn_exit();
+}
+#endif
+
+/** Called by libevent when <b>wq</b>'s alert channel is readable. */
+static void
+workqueue_reply_cb(evutil_socket_t sock, short events, void *arg)
+{
+  (void)sock;
+  (void)events;
+  workqueue_process_replies(arg);
+}
+
+/** Open <b>wq</b>'s reply notification channel.  Return 0 on success, -1
+ * on failure. */
+static int
+workqueue_open_alert_channel(workqueue_t *wq)
+{
+  int err;
+#ifdef HAVE_SYS_EVENTFD_H
+  {
+    int fd = eventfd(0, 0);
+    if (fd >= 0) {
+      set_socket_nonblocking(fd);
+      wq->alert_fds[0] = wq->alert_fds[1] = fd;
+      wq->alert_is_eventfd = 1;
+      return 0;
+    }
+  }
+#endif
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, wq->alert_fds)) < 0) {
+    log_warn(LD_GENERAL, "Couldn't construct socketpair for workqueue: %s",
+             tor_socket_strerror(-err));
+    return -1;
+  }
+  set_socket_nonblocking(wq->alert_fds[0]);
+  set_socket_nonblocking(wq->alert_fds[1]);
+  return 0;
+}
+
+/** Create a new workqueue with <b>n_threads</b> worker threads that will
+ * hold at most <b>max_pending</b> unanswered jobs at once.
+ *
+ * Each thread builds a private state by calling
+ * <b>state_new_fn</b>(<b>state_arg</b>) before its first job, and frees it
+ * with <b>state_free_fn</b> when it exits or the state is reset.  Either
+ * function may be NULL.
+ *
+ * If <b>base</b> is given, replies are delivered from that event loop;
+ * otherwise the caller must watch workqueue_get_alert_socket() and call
+ * workqueue_process_replies() itself.  Return NULL on failure. */
+workqueue_t *
+workqueue_new(struct event_base *base, int n_threads, int max_pending,
+              void *(*state_new_fn)(void *),
+              void (*state_free_fn)(void *),
+              void *state_arg)
+{
+  workqueue_t *wq;
+  unsigned int ring_size = 1;
+
+  tor_assert(max_pending > 0);
+  if (n_threads < 1)
+    n_threads = 1;
+  if (n_threads > MAX_WORKQUEUE_THREADS)
+    n_threads = MAX_WORKQUEUE_THREADS;
+
+  wq = tor_malloc_zero(sizeof(workqueue_t));
+  while (ring_size < (unsigned int)max_pending)
+    ring_size <<= 1;
+  wq->ring = tor_malloc_zero(sizeof(workqueue_job_t *) * ring_size);
+  wq->ring_mask = ring_size - 1;
+  wq->max_pending = max_pending;
+  wq->state_new_fn = state_new_fn;
+  wq->state_free_fn = state_free_fn;
+  wq->state_arg = state_arg;
+  wq->alert_fds[0] = wq->alert_fds[1] = TOR_INVALID_SOCKET;
+
+  if (workqueue_open_alert_channel(wq) < 0)
+    goto err;
+
+  if (base) {
+    wq->reply_event = tor_event_new(base, wq->alert_fds[0],
+                                    EV_READ|EV_PERSIST,
+                                    workqueue_reply_cb, wq);
+    event_add(wq->reply_event, NULL);
+  }
+
+#ifdef TOR_IS_MULTITHREADED
+  wq->lock = tor_mutex_new();
+  wq->wakeup = tor_cond_new();
+  wq->exited = tor_cond_new();
+  wq->replied = tor_cond_new();
+  if (!wq->wakeup || !wq->exited || !wq->replied) {
+    log_warn(LD_GENERAL, "Couldn't create condition for workqueue.");
+    goto err;
+  }
+  {
+    int i;
+    for (i = 0; i < n_threads; ++i) {
+      tor_mutex_acquire(wq->lock);
+      ++wq->n_live;
+      tor_mutex_release(wq->lock);
+      if (spawn_func(workqueue_thread_main, wq) < 0) {
+        tor_mutex_acquire(wq->lock);
+        --wq->n_live;
+        tor_mutex_release(wq->lock);
+        log_warn(LD_GENERAL, "Couldn't spawn workqueue thread.");
+        break;
+      }
+    }
+    if (!i)
+      goto err;
+    log_info(LD_GENERAL, "Started a workqueue with %d threads.", i);
+  }
+#else
+  (void)n_threads;
+  wq->inline_generation = wq->state_generation - 1;
+#endif
+
+  return wq;
+ err:
+  workqueue_free(wq);
+  return NULL;
+}
+
+/** Stop all of <b>wq</b>'s threads, deliver replies for every job that
+ * was still queued (with <b>completed</b> false if it never ran), and
+ * release the queue.  Main thread only. */
+void
+workqueue_free(workqueue_t *wq)
+{
+  if (!wq)
+    return;
+
+#ifdef TOR_IS_MULTITHREADED
+  if (wq->lock) {
+    tor_mutex_acquire(wq->lock);
+    wq->shutting_down = 1;
+    if (wq->wakeup)
+      tor_cond_signal_all(wq->wakeup);
+    while (wq->n_live)
+      tor_cond_wait(wq->exited, wq->lock);
+    tor_mutex_release(wq->lock);
+  }
+#endif
+
+  /* No worker is left, so whatever is still in the ring never ran. */
+  while (wq->ring_tail != wq->ring_head) {
+    workqueue_job_t *job = wq->ring[wq->ring_tail & wq->ring_mask];
+    ++wq->ring_tail;
+    workqueue_push_reply(wq, job);
+  }
+  if (SOCKET_OK(wq->alert_fds[0]))
+    workqueue_process_replies(wq);
+
+  if (wq->reply_event)
+    tor_event_free(wq->reply_event);
+#ifdef HAVE_SYS_EVENTFD_H
+  if (wq->alert_is_eventfd) {
+    close(wq->alert_fds[0]);
+  } else
+#endif
+  {
+    if (SOCKET_OK(wq->alert_fds[0]))
+      tor_close_socket(wq->alert_fds[0]);
+    if (SOCKET_OK(wq->alert_fds[1]))
+      tor_close_socket(wq->alert_fds[1]);
+  }
+#ifdef TOR_IS_MULTITHREADED
+  tor_cond_free(wq->wakeup);
+  tor_cond_free(wq->exited);
+  tor_cond_free(wq->replied);
+  tor_mutex_free(wq->lock);
+#else
+  if (wq->inline_state && wq->state_free_fn)
+    wq->state_free_fn(wq->inline_state);
+#endif
+  tor_free(wq->ring);
+  tor_free(wq);
+}
+
+/** Queue <b>job</b> to be run by one of <b>wq</b>'s workers.  Return 0 on
+ * success, or -1 if <b>wq</b> already has its maximum number of pending
+ * jobs, in which case the caller still owns <b>job</b>.  Main thread
+ * only. */
+int
+workqueue_add(workqueue_t *wq, workqueue_job_t *job)
+{
+  tor_assert(job->work_fn);
+  tor_assert(job->reply_fn);
+
+  if (wq->n_pending >= wq->max_pending)
+    return -1;
+  ++wq->n_pending;
+  job->cancelled = 0;
+  job->completed = 0;
+  job->next_reply = NULL;
+
+#ifdef TOR_IS_MULTITHREADED
+  wq->ring[wq->ring_head & wq->ring_mask] = job;
+  WQ_BARRIER();
+  ++wq->ring_head;
+  /* Publish ring_head before looking at n_sleeping; see
+   * workqueue_thread_main(). */
+  WQ_BARRIER();
+  if (wq->n_sleeping) {
+    tor_mutex_acquire(wq->lock);
+    tor_cond_signal_one(wq->wakeup);
+    tor_mutex_release(wq->lock);
+  }
+#else
+  if (wq->inline_generation != wq->state_generation) {
+    wq->inline_generation = wq->state_generation;
+    if (wq->inline_state && wq->state_free_fn)
+      wq->state_free_fn(wq->inline_state);
+    wq->inline_state =
+      wq->state_new_fn ? wq->state_new_fn(wq->state_arg) : NULL;
+  }
+  workqueue_run_job(wq, job, wq->inline_state);
+#endif
+  return 0;
+}
+
+/** Ask that <b>job</b> not be run if no worker has started on it yet.  Its
+ * reply function is still called, with <b>completed</b> false if the
+ * cancellation took effect.  Main thread only. */
+void
+workqueue_job_cancel(workqueue_job_t *job)
+{
+  job->cancelled = 1;
+}
+
+/** Make every worker in <b>wq</b> rebuild its private state before running
+ * its next job.  Main thread only. */
+void
+workqueue_reset_thread_state(workqueue_t *wq)
+{
+  ++wq->state_generation;
+}
+
+/** Run the reply function of every job that <b>wq</b> has finished, oldest
+ * first.  Return the number of replies processed.  Main thread only. */
+int
+workqueue_process_replies(workqueue_t *wq)
+{
+  workqueue_job_t *list, *rev = NULL;
+  int n = 0;
+
+  /* Drain before taking the stack: a worker that pushes after this point
+   * either sees a non-empty stack (and its job is taken below) or raises a
+   * fresh notification that we will see on the next pass. */
+  workqueue_drain_alerts(wq);
+
+  do {
+    list = wq->replies;
+  } while (list && !WQ_CAS_PTR(&wq->replies, list, NULL));
+
+  while (list) {
+    workqueue_job_t *next = list->next_reply;
+    list->next_reply = rev;
+    rev = list;
+    list = next;
+  }
+
+  while (rev) {
+    workqueue_job_t *next = rev->next_reply;
+    rev->next_reply = NULL;
+    --wq->n_pending;
+    ++n;
+    rev->reply_fn(rev, rev->completed);
+    rev = next;
+  }
+  return n;
+}
+
+/** Block until <b>wq</b> has finished at least one job, then run the reply
+ * function of every finished job, as workqueue_process_replies() does.
+ * Return the number of replies processed, or 0 at once if no jobs are
+ * pending.  This is for callers that can't go on without their jobs'
+ * results; everybody else should let the event loop deliver replies.  Main
+ * thread only. */
+int
+workqueue_wait_for_replies(workqueue_t *wq)
+{
+  int n;
+  while (!(n = workqueue_process_replies(wq)) && wq->n_pending) {
+#ifdef TOR_IS_MULTITHREADED
+    tor_mutex_acquire(wq->lock);
+    ++wq->n_reply_waiters;
+    /* Publish n_reply_waiters before looking at the reply stack; a worker
+     * publishes its reply before looking at n_reply_waiters, so one of us
+     * always sees the other. */
+    WQ_BARRIER();
+    while (!wq->replies)
+      tor_cond_wait(wq->replied, wq->lock);
+    --wq->n_reply_waiters;
+    tor_mutex_release(wq->lock);
+#endif
+  }
+  return n;
+}
+
+/** Return the number of jobs added to <b>wq</b> whose replies have not yet
+ * been processed. */
+int
+workqueue_get_n_pending(const workqueue_t *wq)
+{
+  return wq->n_pending;
+}
+
+/** Return the most jobs <b>wq</b> will hold at once. */
+int
+workqueue_get_max_pending(const workqueue_t *wq)
+{
+  return wq->max_pending;
+}
+
+/** Return the socket that becomes readable when <b>wq</b> has replies
+ * waiting. */
+tor_socket_t
+workqueue_get_alert_socket(const workqueue_t *wq)
+{
+  return wq->alert_fds[0];
+}
+
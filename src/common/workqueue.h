@@ -0,0 +1,62 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file workqueue.h
+ * \brief Headers for workqueue.c
+ **/
+
+#ifndef TOR_WORKQUEUE_H
+#define TOR_WORKQUEUE_H
+
+#include "compat.h"
+
+struct event_base;
+
+typedef struct workqueue_t workqueue_t;
+typedef struct workqueue_job_t workqueue_job_t;
+
+/** Function run on a worker thread to perform <b>job</b>.
+ * <b>thread_state</b> is the calling thread's private state, as built by the
+ * queue's state constructor. */
+typedef void (*workqueue_work_fn)(workqueue_job_t *job, void *thread_state);
+/** Function run on the main thread once <b>job</b> is finished.
+ * <b>completed</b> is false if the work function never ran, because the job
+ * was cancelled or the queue was shut down first.  The reply function owns
+ * the job from then on. */
+typedef void (*workqueue_reply_fn)(workqueue_job_t *job, int completed);
+
+/** A unit of work.  Callers embed this as the first member of their own job
+ * structure, fill in the two callbacks, and hand it to workqueue_add().
+ * Results are written into the caller's structure in place; nothing is
+ * copied on the way to or from the worker. */
+struct workqueue_job_t {
+  /** Runs on a worker thread. */
+  workqueue_work_fn work_fn;
+  /** Runs on the main thread after work_fn returns. */
+  workqueue_reply_fn reply_fn;
+  /** Set by workqueue_job_cancel(); a worker that sees it skips work_fn. */
+  volatile int cancelled;
+  /** Set by the worker once work_fn has run.  Private to workqueue.c. */
+  int completed;
+  /** Next finished job on the reply stack.  Private to workqueue.c. */
+  struct workqueue_job_t *next_reply;
+};
+
+workqueue_t *workqueue_new(struct event_base *base, int n_threads,
+                           int max_pending,
+                           void *(*state_new_fn)(void *),
+                           void (*state_free_fn)(void *),
+                           void *state_arg);
+void workqueue_free(workqueue_t *wq);
+int workqueue_add(workqueue_t *wq, workqueue_job_t *job);
+void workqueue_job_cancel(workqueue_job_t *job);
+void workqueue_reset_thread_state(workqueue_t *wq);
+int workqueue_process_replies(workqueue_t *wq);
+int workqueue_wait_for_replies(workqueue_t *wq);
+int workqueue_get_n_pending(const workqueue_t *wq);
+int workqueue_get_max_pending(const workqueue_t *wq);
+tor_socket_t workqueue_get_alert_socket(const workqueue_t *wq);
+
+#endif
+
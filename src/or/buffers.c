@@ -23,6 +23,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 //#define PARANOIA
 
@@ -59,6 +62,8 @@ static int parse_socks(const char *data, size_t datalen, socks_request_t *req,
 static int parse_socks_client(const uint8_t *data, size_t datalen,
                               int state, char **reason,
                               ssize_t *drain_out);
+static INLINE void peek_from_buf(char *string, size_t string_len,
+                                 const buf_t *buf);
 
 /* Chunk manipulation functions */
 
@@ -807,26 +812,133 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
-/** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
- * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
- * more if there is a forced pending write size.)  On success, deduct the
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+#define USE_WRITEV
+
+/** Largest number of chunks we hand to a single writev() call.  Going much
+ * past this rarely helps: the kernel won't take more than a socket buffer's
+ * worth at a time anyway. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define FLUSH_MAX_IOV IOV_MAX
+#else
+#define FLUSH_MAX_IOV 64
+#endif
+
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from the front of
+ * <b>buf</b> onto socket <b>s</b> with a single writev() call spanning as
+ * many chunks as needed, up to FLUSH_MAX_IOV of them.  Set *<b>tried</b> to
+ * the number of bytes we asked the kernel to take.  On success, deduct the
+ * bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
+ * written on success, 0 on blocking, -1 on failure.
+ */
+static INLINE int
+flush_chunks_writev(tor_socket_t s, buf_t *buf, size_t sz,
+                    size_t *buf_flushlen, size_t *tried)
+{
+  struct iovec iov[FLUSH_MAX_IOV];
+  chunk_t *chunk;
+  int n_iov = 0;
+  ssize_t write_result;
+
+  *tried = 0;
+  for (chunk = buf->head; chunk && *tried < sz && n_iov < FLUSH_MAX_IOV;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len > sz - *tried)
+      len = sz - *tried;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    *tried += len;
+  }
+  write_result = writev(s, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) /* it's a real error */
+      return -1;
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    /* This advances through the chunk list past a partial write, too. */
+    *buf_flushlen -= write_result;
+    buf_remove_from_front(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif
+
+/** The largest amount of plaintext that fits in one TLS record. */
+#define TLS_RECORD_MAX_PLAINTEXT 16384
+/** Chunks holding fewer bytes than this at the front of a buffer are
+ * gathered into one TLS record, rather than each paying for its own record
+ * header and MAC.  Larger chunks, such as the cell slabs that
+ * connection_or hands us whole, are written in place: copying them would
+ * cost more than the overhead it saves. */
+#define TLS_COALESCE_MAX_CHUNK 2048
+
+/** Return the number of bytes from the front of <b>buf</b> that
+ * flush_buf_tls() should hand to the next SSL_write(), given that it may
+ * write up to <b>sz</b> bytes and that the TLS connection requires the
+ * next write to be <b>forced</b> bytes long (0 for no requirement).
+ *
+ * Usually this is what the head chunk holds.  But if the head chunk is
+ * small, we extend the write over the small chunks that follow it, up to a
+ * full TLS record.  If the result is more than the head chunk holds, the
+ * caller has to copy it out of the buffer. */
+size_t
+buf_get_tls_write_len(const buf_t *buf, size_t sz, size_t forced)
+{
+  const chunk_t *chunk = buf->head;
+  size_t len;
+
+  /* A write that blocked earlier must be retried with the same bytes, even
+   * if that is more than <b>sz</b>. */
+  if (forced)
+    return forced;
+  if (!chunk)
+    return 0;
+  if (chunk->datalen >= sz)
+    return sz;
+  len = chunk->datalen;
+  if (len >= TLS_COALESCE_MAX_CHUNK)
+    return len;
+
+  sz = MIN(sz, TLS_RECORD_MAX_PLAINTEXT);
+  for (chunk = chunk->next; chunk && len < sz; chunk = chunk->next) {
+    if (chunk->datalen >= TLS_COALESCE_MAX_CHUNK)
+      break;
+    len += MIN(chunk->datalen, sz - len);
+  }
+  return len;
+}
+
+/** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from the front
+ * of <b>buf</b> onto the TLS connection <b>tls</b>.  If <b>sz</b> is more
+ * than the head chunk holds, copy the bytes into a staging buffer first;
+ * <b>sz</b> must then be at most a TLS record.  On success, deduct the
  * bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
  * written on success, and a TOR_TLS error code on failure or blocking.
  */
 static INLINE int
-flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
-                size_t sz, size_t *buf_flushlen)
+flush_chunk_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen)
 {
+  char staging[TLS_RECORD_MAX_PLAINTEXT];
+  chunk_t *chunk = buf->head;
   int r;
-  size_t forced;
   char *data;
 
-  forced = tor_tls_get_forced_write_size(tls);
-  if (forced > sz)
-    sz = forced;
-  if (chunk) {
+  if (chunk && sz > chunk->datalen) {
+    /* We're allowed to hand SSL_write() a different pointer when we retry a
+     * blocked write, so long as the bytes are the same; they are, since we
+     * only take them off the buffer once they're written. */
+    tor_assert(sz <= sizeof(staging));
+    tor_assert(sz <= buf->datalen);
+    peek_from_buf(staging, sz, buf);
+    data = staging;
+  } else if (chunk) {
     data = chunk->data;
-    tor_assert(sz <= chunk->datalen);
   } else {
     data = NULL;
     tor_assert(sz == 0);
@@ -867,12 +979,16 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_WRITEV
+    r = flush_chunks_writev(s, buf, sz, buf_flushlen, &flushlen0);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -906,17 +1022,10 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
 
   check();
   do {
-    size_t flushlen0;
-    if (buf->head) {
-      if ((ssize_t)buf->head->datalen >= sz)
-        flushlen0 = sz;
-      else
-        flushlen0 = buf->head->datalen;
-    } else {
-      flushlen0 = 0;
-    }
+    size_t flushlen0 = buf_get_tls_write_len(buf, sz,
+                                        tor_tls_get_forced_write_size(tls));
 
-    r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
+    r = flush_chunk_tls(tls, buf, flushlen0, buf_flushlen);
     check();
     if (r < 0)
       return r;
@@ -961,6 +1070,58 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Return a new empty buffer chunk that can hold at least
+ * <b>capacity</b> bytes, to be filled in place by the caller through
+ * buf_chunk_mem() and then handed to write_chunk_to_buf(). */
+chunk_t *
+buf_chunk_new(size_t capacity)
+{
+  tor_assert(CHUNK_ALLOC_SIZE(capacity) <= MAX_CHUNK_ALLOC);
+  return chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+}
+
+/** Return a pointer to the storage of <b>chunk</b>. */
+char *
+buf_chunk_mem(chunk_t *chunk)
+{
+  return chunk->mem;
+}
+
+/** Release <b>chunk</b>, which must not be on any buffer. */
+void
+buf_chunk_free(chunk_t *chunk)
+{
+  chunk_free_unchecked(chunk);
+}
+
+/** Append the <b>len</b> bytes starting at offset <b>off</b> in the
+ * storage of <b>chunk</b> to the end of <b>buf</b>, without copying them:
+ * <b>buf</b> takes ownership of <b>chunk</b>.
+ *
+ * Return the new length of the buffer.
+ */
+int
+write_chunk_to_buf(chunk_t *chunk, size_t off, size_t len, buf_t *buf)
+{
+  tor_assert(off + len <= chunk->memlen);
+  check();
+  chunk->next = NULL;
+  chunk->data = chunk->mem + off;
+  chunk->datalen = len;
+  if (buf->tail) {
+    tor_assert(buf->head);
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    tor_assert(!buf->head);
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += len;
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -1074,6 +1235,61 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** Unpack up to <b>max</b> fixed-length cells from the front of <b>buf</b>
+ * into <b>cells_out</b>, in order.  Stop early at the first cell that is
+ * incomplete or variable-length under link protocol <b>linkproto</b>.
+ *
+ * Cells are unpacked straight out of the buffer's chunks; only a cell that
+ * straddles two chunks is gathered into a temporary copy first.  The bytes
+ * of all the cells are then removed from <b>buf</b> in one step.  Return
+ * the number of cells unpacked.
+ */
+int
+fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max, int linkproto)
+{
+  chunk_t *chunk = buf->head;
+  size_t off = 0; /* Offset of the next cell in chunk->data. */
+  size_t left = buf->datalen;
+  char tmp[CELL_NETWORK_SIZE];
+  int n = 0;
+  check();
+
+  while (n < max && left >= CELL_NETWORK_SIZE) {
+    const char *cp;
+    while (off >= chunk->datalen) {
+      off -= chunk->datalen;
+      chunk = chunk->next;
+    }
+    if (chunk->datalen - off >= CELL_NETWORK_SIZE) {
+      cp = chunk->data + off;
+    } else {
+      /* This cell straddles a chunk boundary. */
+      chunk_t *ch = chunk;
+      size_t ch_off = off, got = 0;
+      while (got < CELL_NETWORK_SIZE) {
+        size_t n_copy = ch->datalen - ch_off;
+        if (n_copy > CELL_NETWORK_SIZE - got)
+          n_copy = CELL_NETWORK_SIZE - got;
+        memcpy(tmp + got, ch->data + ch_off, n_copy);
+        got += n_copy;
+        ch = ch->next;
+        ch_off = 0;
+      }
+      cp = tmp;
+    }
+    if (cell_command_is_var_length(get_uint8(cp+2), linkproto))
+      break;
+    cell_unpack(&cells_out[n++], cp);
+    off += CELL_NETWORK_SIZE;
+    left -= CELL_NETWORK_SIZE;
+  }
+
+  if (n)
+    buf_remove_from_front(buf, n * CELL_NETWORK_SIZE);
+  check();
+  return n;
+}
+
 #ifdef USE_BUFFEREVENTS
 /** Try to read <b>n</b> bytes from <b>buf</b> at <b>pos</b> (which may be
  * NULL for the start of the buffer), copying the data only if necessary.  Set
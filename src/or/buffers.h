@@ -33,11 +33,18 @@ int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+struct chunk_t *buf_chunk_new(size_t capacity);
+char *buf_chunk_mem(struct chunk_t *chunk);
+void buf_chunk_free(struct chunk_t *chunk);
+int write_chunk_to_buf(struct chunk_t *chunk, size_t off, size_t len,
+                       buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max,
+                         int linkproto);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
@@ -90,6 +97,7 @@ void assert_buf_ok(buf_t *buf);
 
 #ifdef BUFFERS_PRIVATE
 int buf_find_string_offset(const buf_t *buf, const char *s, size_t n);
+size_t buf_get_tls_write_len(const buf_t *buf, size_t sz, size_t forced);
 #endif
 
 #endif
@@ -18,6 +18,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -27,7 +28,6 @@
 #include "rephist.h"
 #include "routerlist.h"
 #include "routerset.h"
-#include "ht.h"
 
 /********* START VARIABLES **********/
 
@@ -37,54 +37,132 @@ circuit_t *global_circuitlist=NULL;
 /** A list of all the circuits in CIRCUIT_STATE_OR_WAIT. */
 static smartlist_t *circuits_pending_or_conns=NULL;
 
+/** A heap of all the circuits with cells queued, the one whose oldest
+ * queued cell has waited longest on top.  See circuits_handle_oom(). */
+static smartlist_t *circuits_by_queue_age=NULL;
+
 static void circuit_free(circuit_t *circ);
 static void circuit_free_cpath(crypt_path_t *cpath);
 static void circuit_free_cpath_node(crypt_path_t *victim);
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
+static int compare_circs_by_queue_age(const void *a, const void *b);
 
 /********* END VARIABLES ************/
 
-/** A map from OR connection and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct orconn_circid_circuit_map_t {
-  HT_ENTRY(orconn_circid_circuit_map_t) node;
-  or_connection_t *or_conn;
-  circid_t circ_id;
-  circuit_t *circuit;
-} orconn_circid_circuit_map_t;
-
-/** Helper for hash tables: compare the OR connection and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
+/* Each OR connection keeps its own map from circuit ID to circuit, in
+ * or_connection_t.circid_map.  (Lookup performance is very important here,
+ * since we need to do it every time a cell arrives.)  It's an
+ * open-addressing hash table with linear probing, kept at most half full,
+ * so a lookup almost always touches a single cache line of a table that
+ * belongs to the connection the cell came in on. */
+
+/** Smallest non-empty size of a circid_map. */
+#define CIRCID_MAP_MIN_SIZE 8
+
+/** Return the slot of a circid_map with <b>size</b> slots where we start
+ * looking for <b>circ_id</b>.  Circuit IDs are often handed out
+ * sequentially, so spread them with a multiplicative hash. */
 static INLINE int
-_orconn_circid_entries_eq(orconn_circid_circuit_map_t *a,
-                          orconn_circid_circuit_map_t *b)
+circid_map_slot(circid_t circ_id, int size)
 {
-  return a->or_conn == b->or_conn && a->circ_id == b->circ_id;
+  return (int)((((uint32_t)circ_id) * 2654435761u) >> 16) & (size - 1);
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * or_conn in <b>a</b>. */
-static INLINE unsigned int
-_orconn_circid_entry_hash(orconn_circid_circuit_map_t *a)
+/** Return the entry for <b>circ_id</b> in the circid_map of <b>conn</b>,
+ * or NULL if there isn't one. */
+static INLINE circid_map_entry_t *
+circid_map_find(or_connection_t *conn, circid_t circ_id)
 {
-  return (((unsigned)a->circ_id)<<8) ^ (unsigned)(uintptr_t)(a->or_conn);
+  circid_map_entry_t *map = conn->circid_map;
+  int mask = conn->circid_map_size - 1;
+  int i;
+  if (!map)
+    return NULL;
+  for (i = circid_map_slot(circ_id, conn->circid_map_size);
+       map[i].circuit; i = (i + 1) & mask) {
+    if (map[i].circ_id == circ_id)
+      return &map[i];
+  }
+  return NULL;
 }
 
-/** Map from [orconn,circid] to circuit. */
-static HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
-     orconn_circid_circuit_map = HT_INITIALIZER();
-HT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-             _orconn_circid_entry_hash, _orconn_circid_entries_eq)
-HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-            _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.6,
-            malloc, realloc, free)
-
-/** The most recently returned entry from circuit_get_by_circid_orconn;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
+/** Helper: add <b>circ</b> under <b>circ_id</b> to the circid_map of
+ * <b>conn</b>, which must have a free slot and no entry for circ_id. */
+static void
+circid_map_insert(or_connection_t *conn, circid_t circ_id, circuit_t *circ)
+{
+  circid_map_entry_t *map = conn->circid_map;
+  int mask = conn->circid_map_size - 1;
+  int i = circid_map_slot(circ_id, conn->circid_map_size);
+  while (map[i].circuit)
+    i = (i + 1) & mask;
+  map[i].circ_id = circ_id;
+  map[i].circuit = circ;
+  ++conn->circid_map_n_used;
+}
+
+/** Map <b>circ_id</b> to <b>circ</b> on <b>conn</b>, replacing whatever
+ * circuit it mapped to before. */
+static void
+circid_map_set(or_connection_t *conn, circid_t circ_id, circuit_t *circ)
+{
+  circid_map_entry_t *ent = circid_map_find(conn, circ_id);
+  if (ent) {
+    ent->circuit = circ;
+    return;
+  }
+  if ((conn->circid_map_n_used + 1) * 2 > conn->circid_map_size) {
+    /* Grow the table, and rehash everything into it. */
+    circid_map_entry_t *old_map = conn->circid_map;
+    int old_size = conn->circid_map_size, i;
+    conn->circid_map_size = old_size ? old_size * 2 : CIRCID_MAP_MIN_SIZE;
+    conn->circid_map = tor_malloc_zero(sizeof(circid_map_entry_t) *
+                                       conn->circid_map_size);
+    conn->circid_map_n_used = 0;
+    for (i = 0; i < old_size; ++i) {
+      if (old_map[i].circuit)
+        circid_map_insert(conn, old_map[i].circ_id, old_map[i].circuit);
+    }
+    tor_free(old_map);
+  }
+  circid_map_insert(conn, circ_id, circ);
+}
+
+/** Remove the entry for <b>circ_id</b> from the circid_map of <b>conn</b>.
+ * Return true iff there was one. */
+static int
+circid_map_remove(or_connection_t *conn, circid_t circ_id)
+{
+  circid_map_entry_t *map = conn->circid_map;
+  circid_map_entry_t *ent = circid_map_find(conn, circ_id);
+  int mask = conn->circid_map_size - 1;
+  int hole, i;
+  if (!ent)
+    return 0;
+  /* Shift later members of the probe run back into the hole, so that
+   * lookups never need to skip over deleted slots. */
+  hole = (int)(ent - map);
+  for (i = (hole + 1) & mask; map[i].circuit; i = (i + 1) & mask) {
+    int home = circid_map_slot(map[i].circ_id, conn->circid_map_size);
+    /* Can the entry at i move to the hole without passing its home? */
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      map[hole] = map[i];
+      hole = i;
+    }
+  }
+  map[hole].circuit = NULL;
+  --conn->circid_map_n_used;
+  return 1;
+}
+
+/** Release the circuit ID map of <b>conn</b>, which is about to be
+ * freed. */
+void
+circuit_free_circid_map(or_connection_t *conn)
+{
+  tor_free(conn->circid_map);
+  conn->circid_map_size = conn->circid_map_n_used = 0;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
@@ -95,8 +173,6 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
                                  circid_t id,
                                  or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
   or_connection_t *old_conn, **conn_ptr;
   circid_t old_id, *circid_ptr;
   int was_active, make_active;
@@ -119,23 +195,10 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   if (id == old_id && conn == old_conn)
     return;
 
-  if (_last_circid_orconn_ent &&
-      ((old_id == _last_circid_orconn_ent->circ_id &&
-        old_conn == _last_circid_orconn_ent->or_conn) ||
-       (id == _last_circid_orconn_ent->circ_id &&
-        conn == _last_circid_orconn_ent->or_conn))) {
-    _last_circid_orconn_ent = NULL;
-  }
-
   if (old_conn) { /* we may need to remove it from the conn-circid map */
     tor_assert(old_conn->_base.magic == OR_CONNECTION_MAGIC);
-    search.circ_id = old_id;
-    search.or_conn = old_conn;
-    found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    if (found) {
-      tor_free(found);
+    if (circid_map_remove(old_conn, old_id))
       --old_conn->n_circuits;
-    }
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
   }
@@ -149,18 +212,7 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.or_conn = conn;
-  found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-  if (found) {
-    found->circuit = circ;
-  } else {
-    found = tor_malloc_zero(sizeof(orconn_circid_circuit_map_t));
-    found->circ_id = id;
-    found->or_conn = conn;
-    found->circuit = circ;
-    HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
-  }
+  circid_map_set(conn, id, circ);
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
 
@@ -517,6 +569,8 @@ init_circuit_base(circuit_t *circ)
 
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
+  circ->write_bucket = (int)get_options()->PerCircuitBWBurst;
+  circ->oom_heap_idx = -1;
 
   /* Initialize the cell_ewma_t structure */
   circ->n_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
@@ -565,6 +619,9 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
 
   /* Initialize the N23 parameters */
 
+  circ->n3_n = N3;
+  circ->n3_p = N3;
+
   circ->_base.credit_balance_n = N2+N3;
   circ->_base.cells_fwded_n = 0;
 
@@ -601,6 +658,10 @@ circuit_free(circuit_t *circ)
   if (!circ)
     return;
 
+  if (circ->oom_heap_idx >= 0)
+    smartlist_pqueue_remove(circuits_by_queue_age, compare_circs_by_queue_age,
+                            STRUCT_OFFSET(circuit_t, oom_heap_idx), circ);
+
   if (CIRCUIT_IS_ORIGIN(circ)) {
     origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
     mem = ocirc;
@@ -636,6 +697,9 @@ circuit_free(circuit_t *circ)
     memlen = sizeof(or_circuit_t);
     tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
 
+    /* Make sure a handshake still in a worker thread can't find us. */
+    cpuworker_cancel_circ_handshake(ocirc);
+
     crypto_cipher_free(ocirc->p_crypto);
     crypto_digest_free(ocirc->p_digest);
     crypto_cipher_free(ocirc->n_crypto);
@@ -711,8 +775,8 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_or_conns);
   circuits_pending_or_conns = NULL;
-
-  HT_CLEAR(orconn_circid_map, &orconn_circid_circuit_map);
+  smartlist_free(circuits_by_queue_age);
+  circuits_by_queue_age = NULL;
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -845,20 +909,8 @@ circuit_get_by_global_id(uint32_t id)
 static INLINE circuit_t *
 circuit_get_by_circid_orconn_impl(circid_t circ_id, or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
-
-  if (_last_circid_orconn_ent &&
-      circ_id == _last_circid_orconn_ent->circ_id &&
-      conn == _last_circid_orconn_ent->or_conn) {
-    found = _last_circid_orconn_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.or_conn = conn;
-    found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    _last_circid_orconn_ent = found;
-  }
-  if (found && found->circuit)
+  circid_map_entry_t *found = circid_map_find(conn, circ_id);
+  if (found)
     return found->circuit;
 
   return NULL;
@@ -909,6 +961,141 @@ circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn)
   return circuit_get_by_circid_orconn_impl(circ_id, conn) != NULL;
 }
 
+/** Helper for circuits_by_queue_age: order circuits so that the one whose
+ * oldest queued cell was queued first comes first. */
+static int
+compare_circs_by_queue_age(const void *a, const void *b)
+{
+  const circuit_t *c1 = a, *c2 = b;
+  int32_t diff = (int32_t)(c1->oom_queued_msec - c2->oom_queued_msec);
+  if (diff < 0)
+    return -1;
+  else if (diff > 0)
+    return 1;
+  else
+    return 0;
+}
+
+/** Set *<b>msec_out</b> to when the oldest cell now queued on <b>circ</b>
+ * was queued, or at least when the slab holding it was started, and return
+ * 1.  Return 0 if <b>circ</b> has no cells queued. */
+static int
+circuit_get_oldest_queued_msec(circuit_t *circ, uint32_t *msec_out)
+{
+  const cell_queue_t *queues[2];
+  int i, found = 0;
+  queues[0] = &circ->n_conn_cells;
+  queues[1] = CIRCUIT_IS_ORIGIN(circ) ?
+    NULL : &TO_OR_CIRCUIT(circ)->p_conn_cells;
+  for (i = 0; i < 2; ++i) {
+    if (!queues[i] || !queues[i]->n)
+      continue;
+    if (!found ||
+        (int32_t)(queues[i]->head->queued_msec - *msec_out) < 0)
+      *msec_out = queues[i]->head->queued_msec;
+    found = 1;
+  }
+  return found;
+}
+
+/** Note that <b>circ</b> may just have had its first cell queued, and add
+ * it to circuits_by_queue_age if it isn't there already. */
+void
+circuit_note_cells_queued(circuit_t *circ)
+{
+  if (circ->oom_heap_idx >= 0 ||
+      !circuit_get_oldest_queued_msec(circ, &circ->oom_queued_msec))
+    return;
+  if (!circuits_by_queue_age)
+    circuits_by_queue_age = smartlist_new();
+  smartlist_pqueue_add(circuits_by_queue_age, compare_circs_by_queue_age,
+                       STRUCT_OFFSET(circuit_t, oom_heap_idx), circ);
+}
+
+/** Note that one of the cell queues of <b>circ</b> has just been emptied,
+ * and take it out of circuits_by_queue_age if neither has cells left.  We
+ * don't update the circuit's place when its queues just get shorter: its key
+ * stays a lower bound, which circuits_handle_oom() corrects lazily. */
+void
+circuit_note_queue_drained(circuit_t *circ)
+{
+  uint32_t msec;
+  if (circ->oom_heap_idx < 0 || circuit_get_oldest_queued_msec(circ, &msec))
+    return;
+  smartlist_pqueue_remove(circuits_by_queue_age, compare_circs_by_queue_age,
+                          STRUCT_OFFSET(circuit_t, oom_heap_idx), circ);
+}
+
+/** We're over MaxMemInCellQueues, with <b>current_allocation</b> bytes in
+ * cell queues: close the circuits whose oldest queued cell has waited the
+ * longest, and free their queues, until we're back under 90% of the limit.
+ * Each circuit costs O(log n) to find, plus one more O(log n) step for
+ * every circuit whose key was out of date.  Return the number of circuits
+ * we closed. */
+int
+circuits_handle_oom(size_t current_allocation)
+{
+  const int idx_offset = STRUCT_OFFSET(circuit_t, oom_heap_idx);
+  size_t mem_target, mem_recovered = 0;
+  int n_circuits_killed = 0;
+
+  log_notice(LD_GENERAL, "We're low on memory.  Killing circuits with "
+             "over-long queues. (This behavior is controlled by "
+             "MaxMemInCellQueues.)");
+
+  mem_target = (size_t)(get_options()->MaxMemInCellQueues / 10 * 9);
+  while (current_allocation - mem_recovered > mem_target &&
+         circuits_by_queue_age && smartlist_len(circuits_by_queue_age)) {
+    circuit_t *circ = smartlist_get(circuits_by_queue_age, 0);
+    size_t before;
+    uint32_t msec;
+
+    if (!circuit_get_oldest_queued_msec(circ, &msec)) {
+      /* Its queues were emptied behind our back; it's not using memory. */
+      smartlist_pqueue_remove(circuits_by_queue_age,
+                              compare_circs_by_queue_age, idx_offset, circ);
+      continue;
+    }
+    if (msec != circ->oom_queued_msec) {
+      /* Its oldest cells have been sent since we last looked.  Every key is
+       * a lower bound, so this one may not be the oldest after all. */
+      smartlist_pqueue_remove(circuits_by_queue_age,
+                              compare_circs_by_queue_age, idx_offset, circ);
+      circ->oom_queued_msec = msec;
+      smartlist_pqueue_add(circuits_by_queue_age,
+                           compare_circs_by_queue_age, idx_offset, circ);
+      continue;
+    }
+
+    /* Free its queues now, rather than when it gets closed, so that we don't
+     * come back here for every cell we queue until then. */
+    before = cell_queues_get_total_allocation();
+    if (circ->n_conn)
+      circuit_clear_cell_queue(circ, circ->n_conn);
+    else
+      cell_queue_clear(&circ->n_conn_cells);
+    if (! CIRCUIT_IS_ORIGIN(circ)) {
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      if (or_circ->p_conn)
+        circuit_clear_cell_queue(circ, or_circ->p_conn);
+      else
+        cell_queue_clear(&or_circ->p_conn_cells);
+    }
+    if (circ->oom_heap_idx >= 0)
+      smartlist_pqueue_remove(circuits_by_queue_age,
+                              compare_circs_by_queue_age, idx_offset, circ);
+    mem_recovered += before - cell_queues_get_total_allocation();
+    if (!circ->marked_for_close)
+      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+    ++n_circuits_killed;
+  }
+
+  clean_cell_pool();
+  log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits.",
+             U64_PRINTF_ARG(mem_recovered), n_circuits_killed);
+  return n_circuits_killed;
+}
+
 /** Return the circuit that a given edge connection is using. */
 circuit_t *
 circuit_get_by_edge_conn(edge_connection_t *conn)
@@ -1262,6 +1449,7 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
 
   if (circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING) {
     onion_pending_remove(TO_OR_CIRCUIT(circ));
+    cpuworker_cancel_circ_handshake(TO_OR_CIRCUIT(circ));
   }
   /* If the circuit ever became OPEN, we sent it to the reputation history
    * module then.  If it isn't OPEN, we send it there now to remember which
@@ -32,6 +32,10 @@ circuit_t *circuit_get_by_circid_orconn(circid_t circ_id,
 int circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn);
 circuit_t *circuit_get_by_edge_conn(edge_connection_t *conn);
 void circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason);
+void circuit_free_circid_map(or_connection_t *conn);
+void circuit_note_cells_queued(circuit_t *circ);
+void circuit_note_queue_drained(circuit_t *circ);
+int circuits_handle_oom(size_t current_allocation);
 origin_circuit_t *circuit_get_by_global_id(uint32_t id);
 origin_circuit_t *circuit_get_ready_rend_circ_by_rend_data(
   const rend_data_t *rend_data);
@@ -15,6 +15,7 @@
  *   connection_or_process_cells_from_inbuf() in connection_or.c
  */
 
+#define COMMAND_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
@@ -28,6 +29,7 @@
 #include "nodelist.h"
 #include "onion.h"
 #include "relay.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 
@@ -58,7 +60,6 @@ uint64_t stats_n_authenticate_cells_processed = 0;
 uint64_t stats_n_authorize_cells_processed = 0;
 
 /* These are the main functions for processing cells */
-static void command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_create_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_created_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_relay_cell(cell_t *cell, or_connection_t *conn);
@@ -229,14 +230,22 @@ command_allowed_before_handshake(uint8_t command)
   }
 }
 
+/** Apply N23 credit from our neighbor on <b>conn</b>, which reports that it
+ * has forwarded <b>cells_fwded_neighbor</b> cells of the circuit it shares
+ * with us as <b>circ_id</b>, and still has <b>queue_len</b> of our cells
+ * queued.  The queue length is what our N3 for that neighbor governs, so we
+ * adapt N3 to it before computing the new balance.  If <b>queue_len</b> is
+ * negative, the neighbor didn't tell us, and we leave N3 alone. */
 static void
-command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn)
+command_apply_flowcontrol_credit(circid_t circ_id,
+                                 uint32_t cells_fwded_neighbor,
+                                 int queue_len,
+                                 or_connection_t *conn)
 {
-    circuit_t *circ = circuit_get_by_circid_orconn(cell->circ_id, conn);
-    uint32_t cells_fwded_neighbor;
+    circuit_t *circ = circuit_get_by_circid_orconn(circ_id, conn);
+    int old_balance, old_n3;
     if (circ == NULL) return;
     //printf("Received Credit Chip\n");
-    cells_fwded_neighbor = ntohl(get_uint32(cell->payload));
 
     /* IG: This is where we should do:
 	circ->cells_fwded_n -= cells_fwded_neighbor;
@@ -247,22 +256,44 @@ command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn)
        malicious downstream router.
 
        (and symmetrically for the _p stanza) */
+    rep_hist_note_n23_credit_received();
     if (circ->n_conn == conn) {
-       circ->credit_balance_n = N2+N3-(circ->cells_fwded_n-cells_fwded_neighbor);
+       old_balance = circ->credit_balance_n;
+       old_n3 = circuit_get_n3(circ, CELL_DIRECTION_OUT);
+       if (!CIRCUIT_IS_ORIGIN(circ) && queue_len >= 0)
+         circuit_adapt_n3(&TO_OR_CIRCUIT(circ)->n3_n, queue_len);
+       circ->credit_balance_n = N2+circuit_get_n3(circ, CELL_DIRECTION_OUT)-
+                                (circ->cells_fwded_n-cells_fwded_neighbor);
+       ++circ->n_flowctl_stats.n_credit_received;
+       if (circ->credit_balance_n != old_balance ||
+           circuit_get_n3(circ, CELL_DIRECTION_OUT) != old_n3)
+         circ->flowctl_changed = 1;
        
     	//printf("Updating next hop credit balance to %d\n", circ->credit_balance_n);
    	//circ->cells_fwded_n -= cells_fwded_neighbor;
 	//circ->credit_balance_n = N2 + N3 - circ->cells_fwded_n;
 	if (circ->credit_balance_n > 0) {
+		circuit_n23_stall_end(circ, CELL_DIRECTION_OUT);
 		make_circuit_active_on_conn(circ,conn);
 		circuit_resume_edge_reading(circ,NULL);
 	}	
     } else {
-        TO_OR_CIRCUIT(circ)->credit_balance_p = N2 + N3 - (TO_OR_CIRCUIT(circ)->cells_fwded_p - cells_fwded_neighbor);
+        old_balance = TO_OR_CIRCUIT(circ)->credit_balance_p;
+        old_n3 = TO_OR_CIRCUIT(circ)->n3_p;
+        if (queue_len >= 0)
+          circuit_adapt_n3(&TO_OR_CIRCUIT(circ)->n3_p, queue_len);
+        TO_OR_CIRCUIT(circ)->credit_balance_p =
+          N2 + circuit_get_n3(circ, CELL_DIRECTION_IN) -
+          (TO_OR_CIRCUIT(circ)->cells_fwded_p - cells_fwded_neighbor);
+        ++TO_OR_CIRCUIT(circ)->p_flowctl_stats.n_credit_received;
+        if (TO_OR_CIRCUIT(circ)->credit_balance_p != old_balance ||
+            TO_OR_CIRCUIT(circ)->n3_p != old_n3)
+          circ->flowctl_changed = 1;
         
 	//TO_OR_CIRCUIT(circ)->cells_fwded_p -= cells_fwded_neighbor;
     //TO_OR_CIRCUIT(circ)->credit_balance_p = N2 + N3 - circ->cells_fwded_n;
 	if ( TO_OR_CIRCUIT(circ)->credit_balance_p > 0) {
+		circuit_n23_stall_end(circ, CELL_DIRECTION_IN);
 		make_circuit_active_on_conn(circ,conn);
 		circuit_resume_edge_reading(circ,NULL);
 	}
@@ -282,6 +313,51 @@ command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn)
 
 }
 
+/** Process a 'flowcontrol' <b>cell</b> that just arrived from <b>conn</b>:
+ * it carries the number of cells our neighbor has forwarded on one circuit,
+ * and, if the neighbor listed N23_QUEUE_LEN_VERSION, the number it still has
+ * queued. */
+void
+command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn)
+{
+  int queue_len = -1;
+  if (conn->credit_has_queue_len)
+    queue_len = ntohs(get_uint16(cell->payload+4));
+  command_apply_flowcontrol_credit(cell->circ_id,
+                                   ntohl(get_uint32(cell->payload)),
+                                   queue_len, conn);
+}
+
+/** Process a 'flowcontrol_batch' <b>cell</b> that just arrived from
+ * <b>conn</b>.  Its payload is a sequence of entries, each holding a circuit
+ * ID followed by what a 'flowcontrol' cell for that circuit would carry;
+ * apply them all in one pass.  See
+ * connection_or_flowcontrol_batch_entry_len(). */
+void
+command_process_flowcontrol_batch_cell(var_cell_t *cell, or_connection_t *conn)
+{
+  const uint8_t *cp = cell->payload;
+  const uint8_t *end = cell->payload + cell->payload_len;
+  const int entry_len = connection_or_flowcontrol_batch_entry_len(conn);
+  int extra = cell->payload_len % entry_len;
+
+  if (extra) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a flowcontrol_batch cell with bad length %d; "
+           "ignoring the trailing %d bytes.",
+           (int)cell->payload_len, extra);
+    end -= extra;
+  }
+
+  for ( ; cp < end; cp += entry_len) {
+    command_apply_flowcontrol_credit(ntohs(get_uint16(cp)),
+                                     ntohl(get_uint32(cp+2)),
+                                     conn->credit_has_queue_len ?
+                                       ntohs(get_uint16(cp+6)) : -1,
+                                     conn);
+  }
+}
+
 
 
 /** Process a <b>cell</b> that was just received on <b>conn</b>. Keep internal
@@ -401,6 +477,9 @@ command_process_var_cell(var_cell_t *cell, or_connection_t *conn)
       ++stats_n_authorize_cells_processed;
       /* Ignored so far. */
       break;
+    case CELL_FLOWCONTROL_BATCH:
+      command_process_flowcontrol_batch_cell(cell, conn);
+      break;
     default:
       log_fn(LOG_INFO, LD_PROTOCOL,
                "Variable-length cell of unknown type (%d) received.",
@@ -479,7 +558,7 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
     memcpy(onionskin, cell->payload, ONIONSKIN_CHALLENGE_LEN);
 
     /* hand it off to the cpuworkers, and then return. */
-    if (assign_onionskin_to_cpuworker(NULL, circ, onionskin) < 0) {
+    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0) {
 #define WARN_HANDOFF_FAILURE_INTERVAL (6*60*60)
       static ratelim_t handoff_warning =
         RATELIM_INIT(WARN_HANDOFF_FAILURE_INTERVAL);
@@ -641,6 +720,84 @@ command_process_relay_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/** Process a run of <b>n</b> RELAY cells in <b>cells</b> that arrived in
+ * order on the open connection <b>conn</b>, all with the same circuit ID.
+ * On a relayed circuit, apply our layer of crypto to the whole run at once
+ * with relay_crypt_batch(), then handle the cells one by one as
+ * command_process_relay_cell() would.  Anything else goes through the
+ * ordinary one-cell path. */
+static void
+command_process_relay_cell_run(cell_t *cells, int n, or_connection_t *conn)
+{
+  cell_t *run[RELAY_CRYPT_BATCH_MAX];
+  circuit_t *circ;
+  int i, reason, direction;
+
+  circ = circuit_get_by_circid_orconn(cells[0].circ_id, conn);
+
+  if (!circ || CIRCUIT_IS_ORIGIN(circ) ||
+      circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING ||
+      n > RELAY_CRYPT_BATCH_MAX) {
+    for (i = 0; i < n; ++i)
+      command_process_cell(&cells[i], conn);
+    return;
+  }
+
+  if (cells[0].circ_id == TO_OR_CIRCUIT(circ)->p_circ_id)
+    direction = CELL_DIRECTION_OUT;
+  else
+    direction = CELL_DIRECTION_IN;
+
+  for (i = 0; i < n; ++i)
+    run[i] = &cells[i];
+  if (relay_crypt_batch(circ, run, n, direction) < 0) {
+    log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    return;
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (conn->_base.marked_for_close)
+      return;
+    ++stats_n_relay_cells_processed;
+    if ((reason = circuit_receive_relay_cell_crypted(run[i], circ,
+                                                     direction)) < 0) {
+      log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
+             "(%s) failed. Closing.",
+             direction==CELL_DIRECTION_OUT?"forward":"backward");
+      circuit_mark_for_close(circ, -reason);
+    }
+  }
+}
+
+/** Process the <b>n_cells</b> fixed-length cells in <b>cells</b>, which
+ * arrived in that order on <b>conn</b>.  Consecutive RELAY cells for the
+ * same circuit on an open connection are handled as one run, so that
+ * their relay crypto can be batched; every other cell goes to
+ * command_process_cell(). */
+void
+command_process_cells(cell_t *cells, int n_cells, or_connection_t *conn)
+{
+  int i = 0;
+
+  while (i < n_cells) {
+    int run = 1;
+    if (cells[i].command == CELL_RELAY &&
+        conn->_base.state == OR_CONN_STATE_OPEN &&
+        !conn->_base.marked_for_close) {
+      while (i + run < n_cells && run < RELAY_CRYPT_BATCH_MAX &&
+             cells[i+run].command == CELL_RELAY &&
+             cells[i+run].circ_id == cells[i].circ_id)
+        ++run;
+    }
+    if (run > 1)
+      command_process_relay_cell_run(cells + i, run, conn);
+    else
+      command_process_cell(&cells[i], conn);
+    i += run;
+  }
+}
+
 /** Process a 'destroy' <b>cell</b> that just arrived from
  * <b>conn</b>. Find the circ that it refers to (if any).
  *
@@ -648,7 +805,7 @@ command_process_relay_cell(cell_t *cell, or_connection_t *conn)
  * onionskin_pending, then call onion_pending_remove() to remove it
  * from the pending onion list (note that if it's already being
  * processed by the cpuworker, it won't be in the list anymore; but
- * when the cpuworker returns it, the circuit will be gone, and the
+ * circuit_mark_for_close() detaches it from its cpuworker job, and the
  * cpuworker response will be dropped).
  *
  * Then mark the circuit for close (which marks all edges for close,
@@ -756,6 +913,8 @@ command_process_versions_cell(var_cell_t *cell, or_connection_t *conn)
     uint16_t v = ntohs(get_uint16(cp));
     if (is_or_protocol_version_known(v) && v > highest_supported_version)
       highest_supported_version = v;
+    if (v == N23_QUEUE_LEN_VERSION)
+      conn->credit_has_queue_len = 1;
   }
   if (!highest_supported_version) {
     log_fn(LOG_PROTOCOL_WARN, LD_OR,
@@ -13,6 +13,7 @@
 #define _TOR_COMMAND_H
 
 void command_process_cell(cell_t *cell, or_connection_t *conn);
+void command_process_cells(cell_t *cells, int n_cells, or_connection_t *conn);
 void command_process_var_cell(var_cell_t *cell, or_connection_t *conn);
 
 extern uint64_t stats_n_padding_cells_processed;
@@ -21,5 +22,12 @@ extern uint64_t stats_n_created_cells_processed;
 extern uint64_t stats_n_relay_cells_processed;
 extern uint64_t stats_n_destroy_cells_processed;
 
+#ifdef COMMAND_PRIVATE
+/* Used only by command.c and test.c */
+void command_process_flowcontrol_cell(cell_t *cell, or_connection_t *conn);
+void command_process_flowcontrol_batch_cell(var_cell_t *cell,
+                                            or_connection_t *conn);
+#endif
+
 #endif
 
@@ -157,6 +157,8 @@ static config_var_t _option_vars[] = {
   V(BridgePassword,              STRING,   NULL),
   V(BridgeRecordUsageByCountry,  BOOL,     "1"),
   V(BridgeRelay,                 BOOL,     "0"),
+  V(CachedConsensusDiffs,        UINT,     "3"),
+  V(CellLatencyTracing,          BOOL,     "0"),
   V(CellStatistics,              BOOL,     "0"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
@@ -232,6 +234,7 @@ static config_var_t _option_vars[] = {
   V(FascistFirewall,             BOOL,     "0"),
   V(FirewallPorts,               CSV,      ""),
   V(FastFirstHopPK,              BOOL,     "1"),
+  V(FetchConsensusDiffs,         BOOL,     "0"),
   V(FetchDirInfoEarly,           BOOL,     "0"),
   V(FetchDirInfoExtraEarly,      BOOL,     "0"),
   V(FetchServerDescriptors,      BOOL,     "1"),
@@ -275,6 +278,7 @@ static config_var_t _option_vars[] = {
   V(Socks5ProxyPassword,         STRING,   NULL),
   OBSOLETE("IgnoreVersion"),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(KernelAwareScheduling,       BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   OBSOLETE("LinkPadding"),
@@ -287,6 +291,7 @@ static config_var_t _option_vars[] = {
   V(MaxAdvertisedBandwidth,      MEMUNIT,  "1 GB"),
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
+  V(MaxMemInCellQueues,          MEMUNIT,  "8 GB"),
   V(MaxOnionsPending,            UINT,     "100"),
   OBSOLETE("MonthlyAccountingStart"),
   V(MyFamily,                    STRING,   NULL),
@@ -313,6 +318,10 @@ static config_var_t _option_vars[] = {
   OBSOLETE("PathlenCoinWeight"),
   V(PerConnBWBurst,              MEMUNIT,  "0"),
   V(PerConnBWRate,               MEMUNIT,  "0"),
+  V(PerCircuitBWBurst,           MEMUNIT,  "0"),
+  V(PerCircuitBWRate,            MEMUNIT,  "0"),
+  V(PerStreamBWBurst,            MEMUNIT,  "0"),
+  V(PerStreamBWRate,             MEMUNIT,  "0"),
   V(PidFile,                     STRING,   NULL),
   V(TestingTorNetwork,           BOOL,     "0"),
   V(OptimisticData,              AUTOBOOL, "auto"),
@@ -402,6 +411,7 @@ static config_var_t _option_vars[] = {
   V(VoteOnHidServDirectoriesV2,  BOOL,     "1"),
   VAR("___UsingTestNetworkDefaults", BOOL, _UsingTestNetworkDefaults, "0"),
   V(UseN23, BOOL, "1"),
+  V(UseN23BatchedCredit, BOOL, "1"),
   V(CircuitWindowSize, UINT, "1000"),
   V(StreamWindowSize, UINT, "500"),
   V(N3Initial, UINT, "500"),
@@ -1589,6 +1599,11 @@ options_act(const or_options_t *old_options)
                  "data directory in 24 hours from now.");
   }
 
+  /* Start each tracing session with empty latency histograms. */
+  if ((!old_options || !old_options->CellLatencyTracing) &&
+      options->CellLatencyTracing)
+    rep_hist_reset_cell_latency();
+
   if (old_options && old_options->CellStatistics &&
       !options->CellStatistics)
     rep_hist_buffer_stats_term();
@@ -2343,6 +2358,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->MaxMemInCellQueues < (U64_LITERAL(256) << 20)) {
+    log_warn(LD_CONFIG, "MaxMemInCellQueues must be at least 256 MB for now. "
+             "Ideally, have it as large as you can afford.");
+    options->MaxMemInCellQueues = (U64_LITERAL(256) << 20);
+  }
+
   if (validate_ports_csv(options->FirewallPorts, "FirewallPorts", msg) < 0)
     return -1;
 
@@ -2601,6 +2622,14 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+  if (options->N3Min < 1)
+    REJECT("N3Min option must be positive.");
+  if (options->N3Max < options->N3Min)
+    REJECT("N3Max must be at least equal to N3Min.");
+  if (options->N3Initial < options->N3Min ||
+      options->N3Initial > options->N3Max)
+    REJECT("N3Initial must be between N3Min and N3Max inclusive.");
+
   if (ensure_bandwidth_cap(&options->BandwidthRate,
                            "BandwidthRate", msg) < 0)
     return -1;
@@ -2622,6 +2651,18 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (ensure_bandwidth_cap(&options->PerConnBWBurst,
                            "PerConnBWBurst", msg) < 0)
     return -1;
+  if (ensure_bandwidth_cap(&options->PerCircuitBWRate,
+                           "PerCircuitBWRate", msg) < 0)
+    return -1;
+  if (ensure_bandwidth_cap(&options->PerCircuitBWBurst,
+                           "PerCircuitBWBurst", msg) < 0)
+    return -1;
+  if (ensure_bandwidth_cap(&options->PerStreamBWRate,
+                           "PerStreamBWRate", msg) < 0)
+    return -1;
+  if (ensure_bandwidth_cap(&options->PerStreamBWBurst,
+                           "PerStreamBWBurst", msg) < 0)
+    return -1;
   if (ensure_bandwidth_cap(&options->AuthDirFastGuarantee,
                            "AuthDirFastGuarantee", msg) < 0)
     return -1;
@@ -2669,6 +2710,18 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->BandwidthRate > options->BandwidthBurst)
     REJECT("BandwidthBurst must be at least equal to BandwidthRate.");
 
+  if (options->PerCircuitBWRate > options->PerCircuitBWBurst)
+    REJECT("PerCircuitBWBurst must be at least equal to PerCircuitBWRate.");
+
+  if (options->PerStreamBWRate > options->PerStreamBWBurst)
+    REJECT("PerStreamBWBurst must be at least equal to PerStreamBWRate.");
+
+#ifdef USE_BUFFEREVENTS
+  if (options->PerCircuitBWRate || options->PerStreamBWRate)
+    REJECT("PerCircuitBWRate and PerStreamBWRate are not supported when "
+           "Tor is built with bufferevents.");
+#endif
+
   /* if they set relaybandwidth* really high but left bandwidth*
    * at the default, raise the defaults. */
   if (options->RelayBandwidthRate > options->BandwidthRate)
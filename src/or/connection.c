@@ -36,6 +36,7 @@
 #include "router.h"
 #include "transports.h"
 #include "routerparse.h"
+#include "scheduler.h"
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/event.h>
@@ -288,6 +289,7 @@ edge_connection_new(int type, int socket_family)
   edge_connection_t *edge_conn = tor_malloc_zero(sizeof(edge_connection_t));
   tor_assert(type == CONN_TYPE_EXIT);
   connection_init(time(NULL), TO_CONN(edge_conn), type, socket_family);
+  edge_conn->read_bucket = (int)get_options()->PerStreamBWBurst;
   return edge_conn;
 }
 
@@ -503,7 +505,11 @@ _connection_free(connection_t *conn)
     or_handshake_state_free(or_conn->handshake_state);
     or_conn->handshake_state = NULL;
     smartlist_free(or_conn->active_circuit_pqueue);
+    circuit_free_circid_map(or_conn);
+    connection_or_clear_pending_flowcontrol(or_conn);
+    scheduler_conn_freed(or_conn);
     tor_free(or_conn->nickname);
+    tor_free(or_conn->trace_marks);
   }
   if (conn->type == CONN_TYPE_AP) {
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
@@ -2146,6 +2152,9 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
     or_connection_t *or_conn = TO_OR_CONN(conn);
     if (conn->state == OR_CONN_STATE_OPEN)
       conn_bucket = or_conn->read_bucket;
+  } else if (conn->type == CONN_TYPE_EXIT && get_options()->PerStreamBWRate) {
+    /* use the per-stream limit, but if it's less than zero just use zero */
+    conn_bucket = MAX(TO_EDGE_CONN(conn)->read_bucket, 0);
   }
 
   if (!connection_is_rate_limited(conn)) {
@@ -2352,6 +2361,13 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
     TO_OR_CONN(conn)->read_bucket -= (int)num_read;
     TO_OR_CONN(conn)->write_bucket -= (int)num_written;
+  } else if (conn->type == CONN_TYPE_EXIT && num_read &&
+             get_options()->PerStreamBWRate) {
+    edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+    int was_positive = edge_conn->read_bucket > 0;
+    edge_conn->read_bucket -= (int)num_read;
+    if (was_positive && edge_conn->read_bucket <= 0)
+      rep_hist_note_stream_bucket_depleted();
   }
 }
 
@@ -2371,6 +2387,10 @@ connection_consider_empty_read_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
     reason = "connection read bucket exhausted. Pausing.";
+  } else if (conn->type == CONN_TYPE_EXIT &&
+             get_options()->PerStreamBWRate &&
+             TO_EDGE_CONN(conn)->read_bucket <= 0) {
+    reason = "stream read bucket exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
@@ -2456,6 +2476,10 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
   const or_options_t *options = get_options();
   smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  int circrate, circburst, streamrate, streamburst;
+  /** Was PerCircuitBWRate set last time we were called?  If so, sweep the
+   * circuits once more so that none stays blocked after it's turned off. */
+  static int circ_buckets_were_used = 0;
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
@@ -2468,6 +2492,11 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
     relayburst = bandwidthburst;
   }
 
+  circrate = (int)options->PerCircuitBWRate;
+  circburst = (int)options->PerCircuitBWBurst;
+  streamrate = (int)options->PerStreamBWRate;
+  streamburst = (int)options->PerStreamBWBurst;
+
   tor_assert(milliseconds_elapsed >= 0);
 
   write_buckets_empty_last_second =
@@ -2491,6 +2520,25 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
+  /* refill the per-circuit buckets, and let circuits that were waiting on
+   * theirs back onto their connections */
+  if (circrate || circ_buckets_were_used) {
+    circuit_t *circ;
+    for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+      if (CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+        continue;
+      if (circrate)
+        connection_bucket_refill_helper(&circ->write_bucket,
+                                        circrate, circburst,
+                                        milliseconds_elapsed,
+                                        "circ->write_bucket");
+      if (circ->write_blocked_on_bucket &&
+          (!circrate || circ->write_bucket > 0))
+        circuit_bucket_unblock(circ);
+    }
+  }
+  circ_buckets_were_used = circrate != 0;
+
   /* refill the per-connection buckets */
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (connection_speaks_cells(conn)) {
@@ -2511,6 +2559,11 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                         milliseconds_elapsed,
                                         "or_conn->write_bucket");
       }
+    } else if (conn->type == CONN_TYPE_EXIT && streamrate) {
+      connection_bucket_refill_helper(&TO_EDGE_CONN(conn)->read_bucket,
+                                      streamrate, streamburst,
+                                      milliseconds_elapsed,
+                                      "edge_conn->read_bucket");
     }
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
@@ -2519,8 +2572,11 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
             global_relayed_read_bucket > 0) /* even if we're relayed traffic */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->read_bucket > 0)) {
-        /* and either a non-cell conn or a cell conn with non-empty bucket */
+            TO_OR_CONN(conn)->read_bucket > 0)
+        && (conn->type != CONN_TYPE_EXIT || !streamrate ||
+            TO_EDGE_CONN(conn)->read_bucket > 0)) {
+        /* and either a non-cell conn or a cell conn with non-empty bucket,
+         * and, for an exit stream, a non-empty stream bucket */
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for read", (int)conn->s));
       conn->read_blocked_on_bw = 0;
@@ -2860,6 +2916,8 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
       }
     }
     result = (int)(buf_datalen(conn->inbuf)-initial_size);
+    if (result > 0 && get_options()->CellLatencyTracing)
+      or_conn->trace_read_usec = cell_trace_now();
     tor_tls_get_n_raw_bytes(or_conn->tls, &n_read, &n_written);
     log_debug(LD_GENERAL, "After TLS read of %d: %ld read, %ld written",
               result, (long)n_read, (long)n_written);
@@ -3292,6 +3350,9 @@ connection_handle_write_impl(connection_t *conn, int force)
        */
     }
 
+    if (result > 0)
+      cell_trace_note_flushed(or_conn, result);
+
     tor_tls_get_n_raw_bytes(or_conn->tls, &n_read, &n_written);
     log_debug(LD_GENERAL, "After TLS write of %d: %ld read, %ld written",
               result, (long)n_read, (long)n_written);
@@ -3308,6 +3369,21 @@ connection_handle_write_impl(connection_t *conn, int force)
       return -1;
     }
     n_written = (size_t) result;
+
+    if (conn->type == CONN_TYPE_DIR && TO_DIR_CONN(conn)->spool_sendfile &&
+        !conn->outbuf_flushlen && (ssize_t)n_written < max_to_write) {
+      /* The outbuf is empty; send the rest of the spooled object straight
+       * from its file. */
+      ssize_t r = connection_dirserv_sendfile(TO_DIR_CONN(conn),
+                                        (size_t)(max_to_write - n_written));
+      if (r < 0) {
+        connection_close_immediate(conn);
+        connection_mark_for_close(conn);
+        return -1;
+      }
+      n_written += (size_t) r;
+      result += (int) r;
+    }
   }
 
   if (n_written && conn->type == CONN_TYPE_AP) {
@@ -3329,7 +3405,9 @@ connection_handle_write_impl(connection_t *conn, int force)
       connection_mark_for_close(conn);
   }
 
-  if (!connection_wants_to_flush(conn)) { /* it's done flushing */
+  if (!connection_wants_to_flush(conn) &&
+      !(conn->type == CONN_TYPE_DIR &&
+        TO_DIR_CONN(conn)->spool_sendfile)) { /* it's done flushing */
     if (connection_finished_flushing(conn) < 0) {
       /* already marked */
       return -1;
@@ -3486,6 +3564,33 @@ _connection_write_to_buf_impl(const char *string, size_t len,
   }
 }
 
+/** Append the <b>len</b> bytes at offset <b>off</b> in the buffer chunk
+ * <b>chunk</b> to <b>conn</b>'s outbuf, handing the chunk over instead of
+ * copying it.  We take ownership of <b>chunk</b> in any case. */
+void
+connection_write_chunk_to_buf(struct chunk_t *chunk, size_t off, size_t len,
+                              connection_t *conn)
+{
+  /* if it's marked for close, only allow write if we mean to flush it */
+  if (!len || (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    buf_chunk_free(chunk);
+    return;
+  }
+
+  IF_HAS_BUFFEREVENT(conn, {
+    if (bufferevent_write(conn->bufev, buf_chunk_mem(chunk) + off, len) < 0)
+      log_warn(LD_NET, "bufferevent_write failed! That shouldn't happen.");
+    buf_chunk_free(chunk);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, write_chunk_to_buf(chunk, off, len, conn->outbuf));
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += len;
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
@@ -3827,8 +3932,6 @@ connection_process_inbuf(connection_t *conn, int package_partial)
                                            package_partial);
     case CONN_TYPE_DIR:
       return connection_dir_process_inbuf(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_process_inbuf(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_process_inbuf(TO_CONTROL_CONN(conn));
     default:
@@ -3885,8 +3988,6 @@ connection_finished_flushing(connection_t *conn)
       return connection_edge_finished_flushing(TO_EDGE_CONN(conn));
     case CONN_TYPE_DIR:
       return connection_dir_finished_flushing(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_finished_flushing(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_finished_flushing(TO_CONTROL_CONN(conn));
     default:
@@ -3941,8 +4042,6 @@ connection_reached_eof(connection_t *conn)
       return connection_edge_reached_eof(TO_EDGE_CONN(conn));
     case CONN_TYPE_DIR:
       return connection_dir_reached_eof(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_reached_eof(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_reached_eof(TO_CONTROL_CONN(conn));
     default:
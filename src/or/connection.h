@@ -92,6 +92,8 @@ int connection_flush(connection_t *conn);
 
 void _connection_write_to_buf_impl(const char *string, size_t len,
                                    connection_t *conn, int zlib);
+void connection_write_chunk_to_buf(struct chunk_t *chunk, size_t off,
+                                   size_t len, connection_t *conn);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
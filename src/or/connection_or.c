@@ -10,6 +10,7 @@
  * cells on the network.
  **/
 
+#define CONNECTION_OR_PRIVATE
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
@@ -29,6 +30,13 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "scheduler.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
@@ -303,7 +311,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src)
 /** Unpack the network-order buffer <b>src</b> into a host-order
  * cell_t structure <b>dest</b>.
  */
-static void
+void
 cell_unpack(cell_t *dest, const char *src)
 {
   dest->circ_id = ntohs(get_uint16(src));
@@ -417,20 +425,18 @@ connection_or_process_inbuf(or_connection_t *conn)
   return ret;
 }
 
-/** When adding cells to an OR connection's outbuf, keep adding until the
- * outbuf is at least this long, or we run out of cells. */
-#define OR_CONN_HIGHWATER (32*1024)
-
-/** Add cells to an OR connection's outbuf whenever the outbuf's data length
- * drops below this size. */
-#define OR_CONN_LOWWATER (16*1024)
-
 /** Called whenever we have flushed some data on an or_conn: add more data
  * from active circuits. */
 int
 connection_or_flushed_some(or_connection_t *conn)
 {
   size_t datalen = connection_get_outbuf_len(TO_CONN(conn));
+  if (get_options()->KernelAwareScheduling) {
+    /* The scheduler decides how much to write, once the kernel has room. */
+    if (conn->active_circuits)
+      scheduler_conn_has_cells(conn);
+    return 0;
+  }
   /* If we're under the low water mark, add cells until we're just over the
    * high water mark. */
   if (datalen < OR_CONN_LOWWATER) {
@@ -1770,6 +1776,9 @@ connection_or_set_state_open(or_connection_t *conn)
   }
 
   circuit_n_conn_done(conn, 1); /* send the pending creates, if any. */
+  /* The scheduler skipped any cells queued before we were open. */
+  if (get_options()->KernelAwareScheduling && conn->active_circuits)
+    scheduler_conn_has_cells(conn);
 
   return 0;
 }
@@ -1833,10 +1842,54 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** Unpack up to <b>max</b> fixed-length cells from <b>or_conn</b>'s inbuf
+ * into <b>cells</b>, stopping before any variable-length cell.  Return the
+ * number of cells unpacked; 0 means there is no complete fixed-length cell
+ * at the front of the inbuf. */
+static int
+connection_fetch_cells_from_buf(or_connection_t *or_conn, cell_t *cells,
+                                int max)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  IF_HAS_BUFFEREVENT(conn, {
+    char buf[CELL_NETWORK_SIZE];
+    if (connection_get_inbuf_len(conn) < CELL_NETWORK_SIZE)
+      return 0;
+    connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, conn);
+    cell_unpack(cells, buf);
+    return 1;
+  }) ELSE_IF_NO_BUFFEREVENT {
+    return fetch_cells_from_buf(conn->inbuf, cells, max, or_conn->link_proto);
+  }
+}
+
+/** Hand the <b>n_cells</b> fixed-length cells in <b>cells</b>, which were
+ * just read from <b>conn</b>, to command_process_cells(), tracing their
+ * latency if CellLatencyTracing is set. */
+static void
+connection_or_process_cell_batch(or_connection_t *conn, cell_t *cells,
+                                 int n_cells)
+{
+  int tracing = n_cells && get_options()->CellLatencyTracing;
+  if (tracing)
+    cell_trace_batch_begin(conn, n_cells);
+  command_process_cells(cells, n_cells, conn);
+  if (tracing)
+    cell_trace_batch_end();
+}
+
+/** Largest number of fixed-length cells that
+ * connection_or_process_cells_from_inbuf() collects before handing them on.
+ * The batch lives on the stack of a libevent callback, so we keep it to a
+ * few KB; runs of this many cells already share most of their crypto work.
+ */
+#define OR_INBUF_CELL_BATCH 16
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
- * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * Loop: while inbuf contains a cell, pull it off the inbuf (every complete
+ * fixed-length cell up to the next var cell at once), unpack it, and hand
+ * it to command_process_cells() or command_process_var_cell().
  *
  * Always return 0.
  */
@@ -1844,6 +1897,10 @@ static int
 connection_or_process_cells_from_inbuf(or_connection_t *conn)
 {
   var_cell_t *var_cell;
+  /* Fixed-length cells are collected here and processed together, so that
+   * runs of relay cells for one circuit can share their crypto work. */
+  cell_t cells[OR_INBUF_CELL_BATCH];
+  int n_cells = 0;
 
   while (1) {
     log_debug(LD_OR,
@@ -1852,27 +1909,34 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
-        return 0; /* not yet. */
+        break; /* not yet. */
+      /* Everything that arrived before this cell gets handled first. */
+      connection_or_process_cell_batch(conn, cells, n_cells);
+      n_cells = 0;
       circuit_build_times_network_is_live(&circ_times);
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
-      cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < CELL_NETWORK_SIZE) /* whole response available? */
-        return 0; /* not yet */
+      /* Unpack every complete cell up to the next var cell, straight out
+       * of the inbuf (create the host-order structs from the network-order
+       * strings). */
+      int n = connection_fetch_cells_from_buf(conn, cells + n_cells,
+                                              OR_INBUF_CELL_BATCH - n_cells);
+      if (!n)
+        break; /* not yet */
 
       circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
+      n_cells += n;
 
-      command_process_cell(&cell, conn);
+      if (n_cells == OR_INBUF_CELL_BATCH) {
+        connection_or_process_cell_batch(conn, cells, n_cells);
+        n_cells = 0;
+      }
     }
   }
+
+  connection_or_process_cell_batch(conn, cells, n_cells);
+  return 0;
 }
 
 /** Write a destroy cell with circ ID <b>circ_id</b> and reason <b>reason</b>
@@ -1899,8 +1963,12 @@ connection_or_send_destroy(circid_t circ_id, or_connection_t *conn, int reason)
   return 0;
 }
 
+/** Send a CELL_FLOWCONTROL on <b>conn</b> granting credit for circuit
+ * <b>circ_id</b>: we have forwarded <b>cells_fwded</b> more cells of it, and
+ * have <b>queue_len</b> cells still waiting, if the peer wants to know. */
 void
-connection_or_send_flowcontrol(circid_t circ_id, or_connection_t *conn, uint32_t cells_fwded)
+connection_or_send_flowcontrol(circid_t circ_id, or_connection_t *conn,
+                               uint32_t cells_fwded, uint16_t queue_len)
 {
   cell_t cell;
 
@@ -1913,9 +1981,268 @@ connection_or_send_flowcontrol(circid_t circ_id, or_connection_t *conn, uint32_t
   cell.circ_id = circ_id;
   cell.command = CELL_FLOWCONTROL;
   set_uint32(cell.payload, htonl(cells_fwded));
+  if (conn->credit_has_queue_len)
+    set_uint16(cell.payload+4, htons(queue_len));
   connection_or_write_cell_to_buf(&cell, conn);
 }
 
+/** Return the length of each entry in a CELL_FLOWCONTROL_BATCH on
+ * <b>conn</b>, in either direction. */
+int
+connection_or_flowcontrol_batch_entry_len(const or_connection_t *conn)
+{
+  return conn->credit_has_queue_len ? FLOWCONTROL_BATCH_ENTRY_LEN :
+    FLOWCONTROL_BATCH_ENTRY_LEN_NO_QUEUE_LEN;
+}
+
+/** Largest number of entries we put into a single CELL_FLOWCONTROL_BATCH.
+ * Anything beyond this goes into another cell in the same flush. */
+#define FLOWCONTROL_BATCH_MAX_ENTRIES 1024
+
+/** List of all or_connection_t that have N23 credit waiting to be sent. */
+static smartlist_t *conns_with_pending_credit = NULL;
+/** Event that we activate when the first credit is queued during a pass
+ * through the event loop, so that all queued credit goes out at the end of
+ * that pass. */
+static struct event *pending_credit_event = NULL;
+
+/** Libevent callback: send all N23 credit queued during this pass through
+ * the event loop. */
+static void
+pending_credit_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  connection_or_flush_all_pending_flowcontrol();
+}
+
+/** A credit that we owe the peer on an OR connection, waiting to go out
+ * in the next CELL_FLOWCONTROL_BATCH on that connection. */
+typedef struct pending_credit_t {
+  /** The circuit's ID on the connection. */
+  circid_t circ_id;
+  /** CELL_DIRECTION_OUT if the peer is the circuit's n_conn, else
+   * CELL_DIRECTION_IN. */
+  cell_direction_t direction;
+  /** Number of cells we report having forwarded. */
+  uint32_t cells_fwded;
+  /** Number of cells we report having queued. */
+  uint16_t queue_len;
+} pending_credit_t;
+
+/** Return the number of cells <b>circ</b> has queued to forward on from
+ * the neighbor we owe credit to in <b>direction</b>, capped to fit in a
+ * credit.  This is the queue whose size that neighbor's N3 governs, so it
+ * adapts its N3 to what we report. */
+static uint16_t
+circuit_get_flowcontrol_queue_len(circuit_t *circ,
+                                  cell_direction_t direction)
+{
+  int n;
+  if (direction == CELL_DIRECTION_IN)
+    n = circ->n_conn_cells.n;
+  else if (!CIRCUIT_IS_ORIGIN(circ))
+    n = TO_OR_CIRCUIT(circ)->p_conn_cells.n;
+  else
+    n = 0;
+  return (uint16_t) MIN(n, UINT16_MAX);
+}
+
+/** Tell the peer on the far side of <b>circ</b> in <b>direction</b> that we
+ * have forwarded another <b>cells_fwded</b> cells on <b>circ</b>: if
+ * <b>direction</b> is CELL_DIRECTION_OUT, the credit goes to
+ * circ-&gt;n_conn, otherwise to the p_conn of the or_circuit_t.  The credit
+ * also tells the peer how many of the cells it sent us are still queued.
+ *
+ * If batching is enabled and the link protocol supports variable-length
+ * cells, the credit is queued on the connection and sent along with the
+ * credit for every other circuit on it in one CELL_FLOWCONTROL_BATCH at the
+ * end of the current event loop pass.  Otherwise we send a CELL_FLOWCONTROL
+ * immediately.
+ *
+ * Every credit gets its own entry in the batch, even if the same circuit
+ * earns several during one pass, so that the receiver applies exactly what
+ * it would have applied for separate CELL_FLOWCONTROL cells.  (It sets its
+ * balance from each credit outright, so adding two credits up into one
+ * entry would grant it N2 cells too many.) */
+void
+connection_or_queue_flowcontrol(circuit_t *circ, cell_direction_t direction,
+                                uint32_t cells_fwded)
+{
+  or_connection_t *conn;
+  circid_t circ_id;
+  uint16_t queue_len;
+  pending_credit_t *credit;
+
+  if (direction == CELL_DIRECTION_OUT) {
+    conn = circ->n_conn;
+    circ_id = circ->n_circ_id;
+  } else {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    conn = or_circ->p_conn;
+    circ_id = or_circ->p_circ_id;
+  }
+  if (!conn)
+    return;
+
+  ++circuit_get_n23_stats(circ, direction)->n_credit_sent;
+  circ->flowctl_changed = 1;
+  rep_hist_note_n23_credit_sent();
+  queue_len = circuit_get_flowcontrol_queue_len(circ, direction);
+
+  if (!get_options()->UseN23BatchedCredit || conn->link_proto < 3) {
+    connection_or_send_flowcontrol(circ_id, conn, cells_fwded, queue_len);
+    return;
+  }
+
+  if (!conn->pending_credit)
+    conn->pending_credit = smartlist_new();
+  if (smartlist_len(conn->pending_credit) == 0) {
+    if (!conns_with_pending_credit)
+      conns_with_pending_credit = smartlist_new();
+    if (!smartlist_len(conns_with_pending_credit)) {
+      if (!pending_credit_event)
+        pending_credit_event = tor_event_new(tor_libevent_get_base(), -1,
+                                             0, pending_credit_event_cb,
+                                             NULL);
+      event_active(pending_credit_event, EV_READ, 1);
+    }
+    smartlist_add(conns_with_pending_credit, conn);
+  }
+  credit = tor_malloc(sizeof(pending_credit_t));
+  credit->circ_id = circ_id;
+  credit->direction = direction;
+  credit->cells_fwded = cells_fwded;
+  credit->queue_len = queue_len;
+  smartlist_add(conn->pending_credit, credit);
+}
+
+/** Pack all N23 credit queued on <b>conn</b> into as few
+ * CELL_FLOWCONTROL_BATCH cells as possible, and add them to
+ * <b>cells_out</b>.  Clears the queue. */
+void
+connection_or_pack_pending_flowcontrol(or_connection_t *conn,
+                                       smartlist_t *cells_out)
+{
+  smartlist_t *credits = conn->pending_credit;
+  var_cell_t *cell = NULL;
+  int n_entries = 0;
+  const int entry_len = connection_or_flowcontrol_batch_entry_len(conn);
+
+  if (!credits)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(credits, pending_credit_t *, credit) {
+    circuit_t *circ = circuit_get_by_circid_orconn(credit->circ_id, conn);
+    uint8_t *entry;
+    /* Skip circuits that closed since we queued the credit, and anything
+     * that has taken over their ID since then. */
+    if (!circ)
+      continue;
+    if (credit->direction == CELL_DIRECTION_OUT) {
+      if (circ->n_conn != conn || circ->n_circ_id != credit->circ_id)
+        continue;
+    } else {
+      if (CIRCUIT_IS_ORIGIN(circ) ||
+          TO_OR_CIRCUIT(circ)->p_conn != conn ||
+          TO_OR_CIRCUIT(circ)->p_circ_id != credit->circ_id)
+        continue;
+    }
+
+    if (!cell) {
+      cell = var_cell_new(entry_len *
+                          MIN(smartlist_len(credits) - credit_sl_idx,
+                              FLOWCONTROL_BATCH_MAX_ENTRIES));
+      cell->command = CELL_FLOWCONTROL_BATCH;
+      cell->circ_id = 0;
+    }
+    entry = cell->payload + n_entries * entry_len;
+    set_uint16(entry, htons(credit->circ_id));
+    set_uint32(entry+2, htonl(credit->cells_fwded));
+    if (conn->credit_has_queue_len)
+      set_uint16(entry+6, htons(credit->queue_len));
+    if (++n_entries == FLOWCONTROL_BATCH_MAX_ENTRIES) {
+      cell->payload_len = n_entries * entry_len;
+      smartlist_add(cells_out, cell);
+      cell = NULL;
+      n_entries = 0;
+    }
+  } SMARTLIST_FOREACH_END(credit);
+
+  if (cell) {
+    cell->payload_len = n_entries * entry_len;
+    smartlist_add(cells_out, cell);
+  }
+  SMARTLIST_FOREACH(credits, pending_credit_t *, c, tor_free(c));
+  smartlist_clear(credits);
+}
+
+/** Send all N23 credit queued on <b>conn</b>. */
+static void
+connection_or_flush_pending_flowcontrol(or_connection_t *conn)
+{
+  smartlist_t *cells;
+
+  if (!conn->pending_credit || !smartlist_len(conn->pending_credit))
+    return;
+  if (conn->_base.marked_for_close) {
+    SMARTLIST_FOREACH(conn->pending_credit, pending_credit_t *, c,
+                      tor_free(c));
+    smartlist_clear(conn->pending_credit);
+    return;
+  }
+
+  cells = smartlist_new();
+  connection_or_pack_pending_flowcontrol(conn, cells);
+  SMARTLIST_FOREACH_BEGIN(cells, var_cell_t *, cell) {
+    log_debug(LD_OR, "Sending batched credit for %d circuits.",
+              (int)(cell->payload_len /
+                    connection_or_flowcontrol_batch_entry_len(conn)));
+    connection_or_write_var_cell_to_buf(cell, conn);
+    var_cell_free(cell);
+  } SMARTLIST_FOREACH_END(cell);
+  smartlist_free(cells);
+}
+
+/** Send all N23 credit that has been queued on any OR connection. */
+void
+connection_or_flush_all_pending_flowcontrol(void)
+{
+  if (!conns_with_pending_credit)
+    return;
+  SMARTLIST_FOREACH(conns_with_pending_credit, or_connection_t *, conn,
+                    connection_or_flush_pending_flowcontrol(conn));
+  smartlist_clear(conns_with_pending_credit);
+}
+
+/** Forget all N23 credit queued on <b>conn</b>, which is about to be
+ * freed. */
+void
+connection_or_clear_pending_flowcontrol(or_connection_t *conn)
+{
+  if (conns_with_pending_credit)
+    smartlist_remove(conns_with_pending_credit, conn);
+  if (conn->pending_credit) {
+    SMARTLIST_FOREACH(conn->pending_credit, pending_credit_t *, c,
+                      tor_free(c));
+    smartlist_free(conn->pending_credit);
+    conn->pending_credit = NULL;
+  }
+}
+
+/** Release all storage held for queueing N23 credit. */
+void
+connection_or_free_all_pending_flowcontrol(void)
+{
+  smartlist_free(conns_with_pending_credit);
+  conns_with_pending_credit = NULL;
+  if (pending_credit_event) {
+    tor_event_free(pending_credit_event);
+    pending_credit_event = NULL;
+  }
+}
+
 /** Array of recognized link protocol versions. */
 static const uint16_t or_protocol_versions[] = { 1, 2, 3 };
 /** Number of versions in <b>or_protocol_versions</b>. */
@@ -1953,7 +2280,7 @@ connection_or_send_versions(or_connection_t *conn, int v3_plus)
   const int max_version = v3_plus ? UINT16_MAX : 2;
   tor_assert(conn->handshake_state &&
              !conn->handshake_state->sent_versions_at);
-  cell = var_cell_new(n_or_protocol_versions * 2);
+  cell = var_cell_new((n_or_protocol_versions + 1) * 2);
   cell->command = CELL_VERSIONS;
   for (i = 0; i < n_or_protocol_versions; ++i) {
     uint16_t v = or_protocol_versions[i];
@@ -1962,6 +2289,11 @@ connection_or_send_versions(or_connection_t *conn, int v3_plus)
     set_uint16(cell->payload+(2*n_versions), htons(v));
     ++n_versions;
   }
+  /* Not a link protocol: see N23_QUEUE_LEN_VERSION. */
+  if (v3_plus) {
+    set_uint16(cell->payload+(2*n_versions), htons(N23_QUEUE_LEN_VERSION));
+    ++n_versions;
+  }
   cell->payload_len = n_versions * 2;
 
   connection_or_write_var_cell_to_buf(cell, conn);
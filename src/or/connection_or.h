@@ -12,6 +12,14 @@
 #ifndef _TOR_CONNECTION_OR_H
 #define _TOR_CONNECTION_OR_H
 
+/** When adding cells to an OR connection's outbuf, keep adding until the
+ * outbuf is at least this long, or we run out of cells. */
+#define OR_CONN_HIGHWATER (32*1024)
+
+/** Add cells to an OR connection's outbuf whenever the outbuf's data length
+ * drops below this size. */
+#define OR_CONN_LOWWATER (16*1024)
+
 void connection_or_remove_from_identity_map(or_connection_t *conn);
 void connection_or_clear_identity_map(void);
 void clear_broken_connection_map(int disable);
@@ -69,7 +77,15 @@ int connection_or_send_destroy(circid_t circ_id, or_connection_t *conn,
                                int reason);
 void connection_or_send_flowcontrol(circid_t circ_id,
                                     or_connection_t *conn,
-                                    uint32_t cells_fwded);
+                                    uint32_t cells_fwded,
+                                    uint16_t queue_len);
+int connection_or_flowcontrol_batch_entry_len(const or_connection_t *conn);
+void connection_or_queue_flowcontrol(circuit_t *circ,
+                                     cell_direction_t direction,
+                                     uint32_t cells_fwded);
+void connection_or_flush_all_pending_flowcontrol(void);
+void connection_or_clear_pending_flowcontrol(or_connection_t *conn);
+void connection_or_free_all_pending_flowcontrol(void);
 
 int connection_or_send_versions(or_connection_t *conn, int v3_plus);
 int connection_or_send_netinfo(or_connection_t *conn);
@@ -84,9 +100,16 @@ int connection_or_send_authenticate_cell(or_connection_t *conn, int type);
 int is_or_protocol_version_known(uint16_t version);
 
 void cell_pack(packed_cell_t *dest, const cell_t *src);
+void cell_unpack(cell_t *dest, const char *src);
 void var_cell_pack_header(const var_cell_t *cell, char *hdr_out);
 var_cell_t *var_cell_new(uint16_t payload_len);
 void var_cell_free(var_cell_t *cell);
 
+#ifdef CONNECTION_OR_PRIVATE
+/* Used only by connection_or.c and test.c */
+void connection_or_pack_pending_flowcontrol(or_connection_t *conn,
+                                            smartlist_t *cells_out);
+#endif
+
 #endif
 
@@ -0,0 +1,590 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply line-based diffs between consensus documents,
+ * so that a client that has one consensus can fetch the next one without
+ * downloading all of it again.
+ *
+ * A diff looks like this:
+ *
+ *   network-status-diff-version 1
+ *   hash BASE-SHA256 TARGET-SHA256
+ *   ...commands...
+ *
+ * where the hashes are the hex-encoded SHA256 digests of the complete base
+ * and target documents.  The commands are the subset of ed(1) that diff -e
+ * produces: "Nd", "N,Md", "Na", "Nc" and "N,Mc".  The last three are
+ * followed by the new lines and then by a line holding just ".".  Commands
+ * come in order of decreasing line number, so each of them can use the
+ * base document's line numbers.
+ *
+ * Finding the longest common subsequence of two whole consensuses would
+ * take far too long, but we don't need to: router entries are sorted by
+ * identity, so we line up the entries that appear in both documents and
+ * only look for common lines within each pair.
+ **/
+
+#define CONSDIFF_PRIVATE
+#include "or.h"
+#include "consdiff.h"
+
+/** First line of every diff. */
+#define CONSDIFF_VERSION_LINE "network-status-diff-version 1"
+
+/** Don't search for common lines by brute force in any stretch of two
+ * documents whose lengths multiply to more than this: call the whole
+ * stretch changed instead.  The diff gets bigger, but stays correct. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<24)
+
+/** A parsed diff command, with line numbers counted from 1. */
+typedef struct consdiff_cmd_t {
+  /** Which command is this: 'a', 'c' or 'd'? */
+  char op;
+  /** For 'c' and 'd', the first and last base lines to replace.  For 'a',
+   * <b>last</b> is the line to append after, and <b>first</b> is one more
+   * than that. */
+  int first, last;
+  /** Index into the diff's lines of the first line to insert. */
+  int insert_idx;
+  /** How many lines to insert? */
+  int n_insert;
+} consdiff_cmd_t;
+
+/** A run of changed lines: lines [a_start, a_end) of the base document are
+ * replaced with lines [b_start, b_end) of the target document. */
+typedef struct consdiff_hunk_t {
+  int a_start, a_end, b_start, b_end;
+} consdiff_hunk_t;
+
+/** Split the NUL-terminated string <b>s</b> into lines, store a newly
+ * allocated array of them in *<b>lines_out</b>, and return how many there
+ * are.  Return -1 if <b>s</b> is not empty and does not end with a
+ * newline. */
+int
+consdiff_split_lines(const char *s, consdiff_line_t **lines_out)
+{
+  int n = 0, cap = 64;
+  consdiff_line_t *lines = tor_malloc(sizeof(consdiff_line_t)*cap);
+
+  while (*s) {
+    const char *eol = strchr(s, '\n');
+    if (!eol) {
+      tor_free(lines);
+      *lines_out = NULL;
+      return -1;
+    }
+    if (n == cap) {
+      cap *= 2;
+      lines = tor_realloc(lines, sizeof(consdiff_line_t)*cap);
+    }
+    lines[n].s = s;
+    lines[n].len = eol - s;
+    ++n;
+    s = eol + 1;
+  }
+  *lines_out = lines;
+  return n;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> hold the same text. */
+static INLINE int
+lines_eq(const consdiff_line_t *a, const consdiff_line_t *b)
+{
+  return a->len == b->len && fast_memeq(a->s, b->s, a->len);
+}
+
+/** Set <b>lens</b>[j], for every j from 0 through <b>n_b</b>, to the length
+ * of the longest common subsequence of the first <b>n_a</b> lines of
+ * <b>a</b> and the first j lines of <b>b</b>.  If <b>reverse</b>, use the
+ * last j lines of <b>b</b> instead, and read both documents backwards.
+ * <b>tmp</b> must have room for n_b+1 ints. */
+static void
+lcs_lengths(const consdiff_line_t *a, int n_a,
+            const consdiff_line_t *b, int n_b, int reverse,
+            int *lens, int *tmp)
+{
+  int i, j;
+  memset(lens, 0, sizeof(int)*(n_b+1));
+  for (i = 0; i < n_a; ++i) {
+    const consdiff_line_t *line_a = reverse ? &a[n_a-1-i] : &a[i];
+    memcpy(tmp, lens, sizeof(int)*(n_b+1));
+    for (j = 1; j <= n_b; ++j) {
+      const consdiff_line_t *line_b = reverse ? &b[n_b-j] : &b[j-1];
+      if (lines_eq(line_a, line_b))
+        lens[j] = tmp[j-1] + 1;
+      else
+        lens[j] = MAX(tmp[j], lens[j-1]);
+    }
+  }
+}
+
+/** Set keep_a[i] and keep_b[j] for every pair of lines a[i] and b[j] in a
+ * longest common subsequence of <b>a</b> and <b>b</b>.  Uses Hirschberg's
+ * algorithm, so that we only need space linear in the length of <b>b</b>.
+ */
+static void
+lcs_mark(const consdiff_line_t *a, int n_a,
+         const consdiff_line_t *b, int n_b,
+         uint8_t *keep_a, uint8_t *keep_b)
+{
+  int *fwd, *bwd, *tmp;
+  int mid, j, best = -1, best_j = 0;
+
+  /* Most of a consensus is the same from one hour to the next, so strip
+   * off the common prefix and suffix first. */
+  while (n_a && n_b && lines_eq(a, b)) {
+    *keep_a++ = 1;
+    *keep_b++ = 1;
+    ++a; ++b;
+    --n_a; --n_b;
+  }
+  while (n_a && n_b && lines_eq(&a[n_a-1], &b[n_b-1])) {
+    keep_a[n_a-1] = 1;
+    keep_b[n_b-1] = 1;
+    --n_a; --n_b;
+  }
+  if (!n_a || !n_b)
+    return;
+
+  if (n_a == 1) {
+    for (j = 0; j < n_b; ++j) {
+      if (lines_eq(&a[0], &b[j])) {
+        keep_a[0] = keep_b[j] = 1;
+        break;
+      }
+    }
+    return;
+  }
+  if ((uint64_t)n_a * (uint64_t)n_b > CONSDIFF_MAX_LCS_CELLS)
+    return;
+
+  mid = n_a / 2;
+  fwd = tor_malloc(sizeof(int)*(n_b+1));
+  bwd = tor_malloc(sizeof(int)*(n_b+1));
+  tmp = tor_malloc(sizeof(int)*(n_b+1));
+  lcs_lengths(a, mid, b, n_b, 0, fwd, tmp);
+  lcs_lengths(a+mid, n_a-mid, b, n_b, 1, bwd, tmp);
+  for (j = 0; j <= n_b; ++j) {
+    if (fwd[j] + bwd[n_b-j] > best) {
+      best = fwd[j] + bwd[n_b-j];
+      best_j = j;
+    }
+  }
+  tor_free(fwd);
+  tor_free(bwd);
+  tor_free(tmp);
+
+  lcs_mark(a, mid, b, best_j, keep_a, keep_b);
+  lcs_mark(a+mid, n_a-mid, b+best_j, n_b-best_j, keep_a+mid, keep_b+best_j);
+}
+
+/** If <b>line</b> begins a router entry, store the router's identity digest
+ * in <b>digest_out</b> and return 0.  Otherwise return -1. */
+static int
+line_get_router_id(const consdiff_line_t *line, char *digest_out)
+{
+  char b64[BASE64_DIGEST_LEN+1];
+  const char *end = line->s + line->len;
+  const char *cp;
+
+  if (line->len < 2 || fast_memneq(line->s, "r ", 2))
+    return -1;
+  /* Skip the nickname. */
+  cp = memchr(line->s+2, ' ', line->len-2);
+  if (!cp)
+    return -1;
+  ++cp;
+  if (end - cp < BASE64_DIGEST_LEN ||
+      (end - cp > BASE64_DIGEST_LEN && cp[BASE64_DIGEST_LEN] != ' '))
+    return -1;
+  memcpy(b64, cp, BASE64_DIGEST_LEN);
+  b64[BASE64_DIGEST_LEN] = '\0';
+  return digest_from_base64(digest_out, b64);
+}
+
+/** Return true iff <b>line</b> starts the part of a consensus that comes
+ * after the router entries. */
+static int
+line_is_footer(const consdiff_line_t *line)
+{
+  return !fast_memcmpstart(line->s, line->len, "directory-footer") ||
+    !fast_memcmpstart(line->s, line->len, "directory-signature ");
+}
+
+/** Find the router entries in <b>lines</b>.  Set *<b>starts_out</b> to a
+ * newly allocated array holding the index of each entry's first line,
+ * followed by the index of the first line after the last entry.  Set
+ * *<b>ids_out</b> to a newly allocated array of their identity digests.
+ * Return the number of entries, or 0 if there are none or they are not in
+ * the order a consensus would list them. */
+static int
+find_router_entries(const consdiff_line_t *lines, int n_lines,
+                    int **starts_out, char **ids_out)
+{
+  int *starts = NULL;
+  char *ids = NULL;
+  int i, n = 0, cap = 0, end = n_lines;
+
+  for (i = 0; i < n_lines; ++i) {
+    const consdiff_line_t *line = &lines[i];
+    if (line->len >= 2 && fast_memeq(line->s, "r ", 2)) {
+      if (n + 1 >= cap) {
+        cap = cap ? cap * 2 : 256;
+        starts = tor_realloc(starts, sizeof(int)*cap);
+        ids = tor_realloc(ids, DIGEST_LEN*cap);
+      }
+      if (line_get_router_id(line, ids + DIGEST_LEN*n) < 0)
+        goto unusable;
+      if (n && fast_memcmp(ids + DIGEST_LEN*(n-1), ids + DIGEST_LEN*n,
+                           DIGEST_LEN) >= 0)
+        goto unusable;
+      starts[n++] = i;
+    } else if (n && line_is_footer(line)) {
+      end = i;
+      break;
+    }
+  }
+  if (!n)
+    goto unusable;
+  starts[n] = end;
+  *starts_out = starts;
+  *ids_out = ids;
+  return n;
+
+ unusable:
+  tor_free(starts);
+  tor_free(ids);
+  *starts_out = NULL;
+  *ids_out = NULL;
+  return 0;
+}
+
+/** Mark which lines of <b>a</b> and <b>b</b> are left alone by the diff
+ * from <b>a</b> to <b>b</b>: set keep_a[i] and keep_b[j] to 1 for each pair
+ * of lines that we match up, and to 0 for every other line.  The matched
+ * lines are always a common subsequence of both documents, though not
+ * necessarily a longest one. */
+void
+consdiff_find_common_lines(const consdiff_line_t *a, int n_a,
+                           const consdiff_line_t *b, int n_b,
+                           uint8_t *keep_a, uint8_t *keep_b)
+{
+  int *starts_a = NULL, *starts_b = NULL;
+  char *ids_a = NULL, *ids_b = NULL;
+  int r_a, r_b, i = 0, j = 0;
+
+  memset(keep_a, 0, n_a);
+  memset(keep_b, 0, n_b);
+  r_a = find_router_entries(a, n_a, &starts_a, &ids_a);
+  r_b = find_router_entries(b, n_b, &starts_b, &ids_b);
+  if (!r_a || !r_b) {
+    lcs_mark(a, n_a, b, n_b, keep_a, keep_b);
+    goto done;
+  }
+
+  /* The header... */
+  lcs_mark(a, starts_a[0], b, starts_b[0], keep_a, keep_b);
+  /* ...each router that is in both documents... */
+  while (i < r_a && j < r_b) {
+    int c = fast_memcmp(ids_a + DIGEST_LEN*i, ids_b + DIGEST_LEN*j,
+                        DIGEST_LEN);
+    if (c == 0) {
+      lcs_mark(a + starts_a[i], starts_a[i+1] - starts_a[i],
+               b + starts_b[j], starts_b[j+1] - starts_b[j],
+               keep_a + starts_a[i], keep_b + starts_b[j]);
+      ++i;
+      ++j;
+    } else if (c < 0) {
+      ++i; /* Only in a: delete the whole entry. */
+    } else {
+      ++j; /* Only in b: add the whole entry. */
+    }
+  }
+  /* ...and the footer. */
+  lcs_mark(a + starts_a[r_a], n_a - starts_a[r_a],
+           b + starts_b[r_b], n_b - starts_b[r_b],
+           keep_a + starts_a[r_a], keep_b + starts_b[r_b]);
+
+ done:
+  tor_free(starts_a);
+  tor_free(starts_b);
+  tor_free(ids_a);
+  tor_free(ids_b);
+}
+
+/** Return a newly allocated diff that turns the document <b>base</b> into
+ * the document <b>target</b>, or NULL if we can't express one.  Both
+ * documents must end with a newline. */
+char *
+consdiff_generate(const char *base, const char *target)
+{
+  consdiff_line_t *a = NULL, *b = NULL;
+  uint8_t *keep_a = NULL, *keep_b = NULL;
+  smartlist_t *hunks = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  char digest[DIGEST256_LEN];
+  char hex_a[HEX_DIGEST256_LEN+1], hex_b[HEX_DIGEST256_LEN+1];
+  char *result = NULL;
+  int n_a, n_b, i, j;
+
+  n_a = consdiff_split_lines(base, &a);
+  n_b = consdiff_split_lines(target, &b);
+  if (n_a < 0 || n_b < 0) {
+    log_info(LD_DIR, "Can't make a diff with a document that doesn't end "
+             "with a newline.");
+    goto done;
+  }
+  for (j = 0; j < n_b; ++j) {
+    if (b[j].len == 1 && b[j].s[0] == '.') {
+      log_info(LD_DIR, "Can't make a diff that adds a line holding just "
+               "\".\".");
+      goto done;
+    }
+  }
+
+  keep_a = tor_malloc(n_a+1);
+  keep_b = tor_malloc(n_b+1);
+  consdiff_find_common_lines(a, n_a, b, n_b, keep_a, keep_b);
+
+  /* Collect the runs of changed lines between the kept ones. */
+  i = j = 0;
+  while (1) {
+    int a_start = i, b_start = j;
+    while (i < n_a && !keep_a[i])
+      ++i;
+    while (j < n_b && !keep_b[j])
+      ++j;
+    if (i > a_start || j > b_start) {
+      consdiff_hunk_t *h = tor_malloc(sizeof(consdiff_hunk_t));
+      h->a_start = a_start;
+      h->a_end = i;
+      h->b_start = b_start;
+      h->b_end = j;
+      smartlist_add(hunks, h);
+    }
+    if (i == n_a || j == n_b)
+      break;
+    ++i;
+    ++j;
+  }
+  if (i != n_a || j != n_b) {
+    log_warn(LD_BUG, "Mismatched common lines while generating a diff.");
+    goto done;
+  }
+
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  base16_encode(hex_a, sizeof(hex_a), digest, DIGEST256_LEN);
+  crypto_digest256(digest, target, strlen(target), DIGEST_SHA256);
+  base16_encode(hex_b, sizeof(hex_b), digest, DIGEST256_LEN);
+  smartlist_add_asprintf(out, "%s\n", CONSDIFF_VERSION_LINE);
+  smartlist_add_asprintf(out, "hash %s %s\n", hex_a, hex_b);
+
+  /* Emit the commands last hunk first, so that each command's line numbers
+   * are still those of the base document. */
+  for (i = smartlist_len(hunks) - 1; i >= 0; --i) {
+    const consdiff_hunk_t *h = smartlist_get(hunks, i);
+    if (h->a_end == h->a_start) {
+      smartlist_add_asprintf(out, "%da\n", h->a_start);
+    } else {
+      char op = h->b_end > h->b_start ? 'c' : 'd';
+      if (h->a_end - h->a_start == 1)
+        smartlist_add_asprintf(out, "%d%c\n", h->a_start + 1, op);
+      else
+        smartlist_add_asprintf(out, "%d,%d%c\n", h->a_start + 1, h->a_end,
+                               op);
+    }
+    if (h->b_end > h->b_start) {
+      for (j = h->b_start; j < h->b_end; ++j)
+        smartlist_add(out, tor_strndup(b[j].s, b[j].len + 1));
+      smartlist_add(out, tor_strdup(".\n"));
+    }
+  }
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+
+ done:
+  SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, h, tor_free(h));
+  smartlist_free(hunks);
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  tor_free(a);
+  tor_free(b);
+  tor_free(keep_a);
+  tor_free(keep_b);
+  return result;
+}
+
+/** Parse the header of <b>diff</b>, and store the SHA256 digests of the
+ * documents it goes from and to in <b>base_digest_out</b> and
+ * <b>target_digest_out</b>.  Return 0 on success, -1 if the header is
+ * malformed. */
+int
+consdiff_get_digests(const char *diff, char *base_digest_out,
+                     char *target_digest_out)
+{
+  const char *cp;
+  if (strcmpstart(diff, CONSDIFF_VERSION_LINE "\nhash "))
+    return -1;
+  cp = diff + strlen(CONSDIFF_VERSION_LINE "\nhash ");
+  if (strlen(cp) < HEX_DIGEST256_LEN*2 + 2 ||
+      cp[HEX_DIGEST256_LEN] != ' ' || cp[HEX_DIGEST256_LEN*2+1] != '\n')
+    return -1;
+  if (base16_decode(base_digest_out, DIGEST256_LEN,
+                    cp, HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(target_digest_out, DIGEST256_LEN,
+                    cp + HEX_DIGEST256_LEN + 1, HEX_DIGEST256_LEN) < 0)
+    return -1;
+  return 0;
+}
+
+/** Parse the command on <b>line</b> into <b>cmd</b>.  Return 0 on success,
+ * -1 if it isn't a well-formed command. */
+static int
+parse_diff_command(const consdiff_line_t *line, consdiff_cmd_t *cmd)
+{
+  char buf[64];
+  char *cp, *end;
+  unsigned long first, last;
+
+  if (line->len < 2 || line->len >= sizeof(buf))
+    return -1;
+  memcpy(buf, line->s, line->len);
+  buf[line->len] = '\0';
+  cmd->op = buf[line->len-1];
+  if (cmd->op != 'a' && cmd->op != 'c' && cmd->op != 'd')
+    return -1;
+  buf[line->len-1] = '\0';
+
+  if (!TOR_ISDIGIT(buf[0]))
+    return -1;
+  first = strtoul(buf, &end, 10);
+  cp = end;
+  if (*cp == ',') {
+    ++cp;
+    if (!TOR_ISDIGIT(*cp) || cmd->op == 'a')
+      return -1;
+    last = strtoul(cp, &end, 10);
+    cp = end;
+  } else {
+    last = first;
+  }
+  if (*cp || first > INT_MAX || last > INT_MAX)
+    return -1;
+
+  if (cmd->op == 'a') {
+    cmd->first = (int)first + 1;
+    cmd->last = (int)first;
+  } else {
+    if (first < 1 || last < first)
+      return -1;
+    cmd->first = (int)first;
+    cmd->last = (int)last;
+  }
+  return 0;
+}
+
+/** Apply <b>diff</b> to <b>base</b>, and return the resulting document in a
+ * newly allocated string.  Return NULL if the diff is malformed, if it was
+ * not made from <b>base</b>, or if the result is not the document whose
+ * digest the diff names. */
+char *
+consdiff_apply(const char *base, const char *diff)
+{
+  consdiff_line_t *a = NULL, *d = NULL;
+  smartlist_t *cmds = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  char base_digest[DIGEST256_LEN], target_digest[DIGEST256_LEN];
+  char digest[DIGEST256_LEN];
+  char *result = NULL, *cp;
+  size_t result_len = 0;
+  int n_a, n_d, i, cur;
+
+  if (consdiff_get_digests(diff, base_digest, target_digest) < 0) {
+    log_info(LD_DIR, "Consensus diff has a malformed header.");
+    goto done;
+  }
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  if (tor_memneq(digest, base_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff is not from the document we have.");
+    goto done;
+  }
+  n_a = consdiff_split_lines(base, &a);
+  n_d = consdiff_split_lines(diff, &d);
+  if (n_a < 0 || n_d < 0) {
+    log_info(LD_DIR, "Consensus diff or its base doesn't end with a "
+             "newline.");
+    goto done;
+  }
+
+  for (i = 2; i < n_d; ) {
+    consdiff_cmd_t *cmd = tor_malloc_zero(sizeof(consdiff_cmd_t));
+    smartlist_add(cmds, cmd);
+    if (parse_diff_command(&d[i], cmd) < 0 || cmd->last > n_a) {
+      char *line = tor_strndup(d[i].s, d[i].len);
+      log_info(LD_DIR, "Bad command in consensus diff: %s", escaped(line));
+      tor_free(line);
+      goto done;
+    }
+    ++i;
+    if (cmd->op != 'd') {
+      cmd->insert_idx = i;
+      while (i < n_d && !(d[i].len == 1 && d[i].s[0] == '.'))
+        ++i;
+      if (i == n_d) {
+        log_info(LD_DIR, "Consensus diff ends in the middle of a command.");
+        goto done;
+      }
+      cmd->n_insert = i - cmd->insert_idx;
+      ++i;
+    }
+  }
+
+  /* Walk through the commands from the start of the document, copying the
+   * base lines between them.  Each command must start at or after the point
+   * where the one after it in the diff left off; otherwise, applying them
+   * in the diff's order would not have used the base's line numbers. */
+  cur = 0;
+  for (i = smartlist_len(cmds) - 1; i >= 0; --i) {
+    const consdiff_cmd_t *cmd = smartlist_get(cmds, i);
+    int j;
+    if (cmd->first - 1 < cur) {
+      log_info(LD_DIR, "Consensus diff commands are out of order.");
+      goto done;
+    }
+    for (j = cur; j < cmd->first - 1; ++j)
+      smartlist_add(out, &a[j]);
+    for (j = 0; j < cmd->n_insert; ++j)
+      smartlist_add(out, &d[cmd->insert_idx + j]);
+    cur = cmd->last;
+  }
+  for (i = cur; i < n_a; ++i)
+    smartlist_add(out, &a[i]);
+
+  SMARTLIST_FOREACH(out, const consdiff_line_t *, line,
+                    result_len += line->len + 1);
+  cp = result = tor_malloc(result_len + 1);
+  SMARTLIST_FOREACH_BEGIN(out, const consdiff_line_t *, line) {
+    memcpy(cp, line->s, line->len);
+    cp += line->len;
+    *cp++ = '\n';
+  } SMARTLIST_FOREACH_END(line);
+  *cp = '\0';
+
+  crypto_digest256(digest, result, result_len, DIGEST_SHA256);
+  if (tor_memneq(digest, target_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff didn't produce the document it "
+             "promised.");
+    tor_free(result);
+  }
+
+ done:
+  SMARTLIST_FOREACH(cmds, consdiff_cmd_t *, cmd, tor_free(cmd));
+  smartlist_free(cmds);
+  smartlist_free(out);
+  tor_free(a);
+  tor_free(d);
+  return result;
+}
+
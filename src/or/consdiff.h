@@ -0,0 +1,32 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef TOR_CONSDIFF_H
+#define TOR_CONSDIFF_H
+
+char *consdiff_generate(const char *base, const char *target);
+char *consdiff_apply(const char *base, const char *diff);
+int consdiff_get_digests(const char *diff, char *base_digest_out,
+                         char *target_digest_out);
+
+#ifdef CONSDIFF_PRIVATE
+/** One line of a document being diffed: a pointer into the document and a
+ * length, not counting the newline. */
+typedef struct consdiff_line_t {
+  const char *s;
+  size_t len;
+} consdiff_line_t;
+
+int consdiff_split_lines(const char *s, consdiff_line_t **lines_out);
+void consdiff_find_common_lines(const consdiff_line_t *a, int n_a,
+                                const consdiff_line_t *b, int n_b,
+                                uint8_t *keep_a, uint8_t *keep_b);
+#endif
+
+#endif
+
@@ -77,7 +77,8 @@
 #define EVENT_BUILDTIMEOUT_SET     0x0017
 #define EVENT_SIGNAL           0x0018
 #define EVENT_CONF_CHANGED     0x0019
-#define _EVENT_MAX             0x0019
+#define EVENT_CIRC_FLOWCTL     0x001A
+#define _EVENT_MAX             0x001A
 /* If _EVENT_MAX ever hits 0x0020, we need to make the mask wider. */
 
 /** Bitfield: The bit 1&lt;&lt;e is set if <b>any</b> open control
@@ -954,6 +955,7 @@ static const struct control_event_t control_event_table[] = {
   { EVENT_BUILDTIMEOUT_SET, "BUILDTIMEOUT_SET" },
   { EVENT_SIGNAL, "SIGNAL" },
   { EVENT_CONF_CHANGED, "CONF_CHANGED"},
+  { EVENT_CIRC_FLOWCTL, "CIRC_FLOWCTL"},
   { 0, NULL },
 };
 
@@ -2111,6 +2113,134 @@ getinfo_helper_events(control_connection_t *control_conn,
   return 0;
 }
 
+/** Return a newly allocated string describing the N23 flow control state
+ * of the relayed circuit <b>circ</b>, as used by GETINFO flowctl/circuits
+ * and the CIRC_FLOWCTL event.  Stall times include any stall that is still
+ * in progress. */
+char *
+circuit_describe_flowctl_for_controller(or_circuit_t *circ)
+{
+  circuit_t *base = TO_CIRCUIT(circ);
+  const n23_stats_t *n_stats = &base->n_flowctl_stats;
+  const n23_stats_t *p_stats = &circ->p_flowctl_stats;
+  uint64_t n_stalled = n_stats->stalled_msec, p_stalled = p_stats->stalled_msec;
+  struct timeval now;
+  char *result;
+
+  tor_gettimeofday_cached(&now);
+  if (n_stats->stalled_since.tv_sec)
+    n_stalled += MAX(0, tv_mdiff(&n_stats->stalled_since, &now));
+  if (p_stats->stalled_since.tv_sec)
+    p_stalled += MAX(0, tv_mdiff(&p_stats->stalled_since, &now));
+
+  tor_asprintf(&result,
+               "PConn="U64_FORMAT" PCircID=%d NConn="U64_FORMAT" NCircID=%d "
+               "N3N=%d N3P=%d CreditN=%d CreditP=%d "
+               "FwdN=%lu FwdP=%lu StallsN=%lu StallsP=%lu "
+               "StalledMsecN="U64_FORMAT" StalledMsecP="U64_FORMAT" "
+               "CreditSentN=%lu CreditSentP=%lu "
+               "CreditRecvN=%lu CreditRecvP=%lu",
+               U64_PRINTF_ARG(circ->p_conn ?
+                              circ->p_conn->_base.global_identifier : 0),
+               (int)circ->p_circ_id,
+               U64_PRINTF_ARG(base->n_conn ?
+                              base->n_conn->_base.global_identifier : 0),
+               (int)base->n_circ_id,
+               circ->n3_n, circ->n3_p,
+               base->credit_balance_n, circ->credit_balance_p,
+               (unsigned long)base->cells_fwded_n,
+               (unsigned long)circ->cells_fwded_p,
+               (unsigned long)n_stats->n_stalls,
+               (unsigned long)p_stats->n_stalls,
+               U64_PRINTF_ARG(n_stalled), U64_PRINTF_ARG(p_stalled),
+               (unsigned long)n_stats->n_credit_sent,
+               (unsigned long)p_stats->n_credit_sent,
+               (unsigned long)n_stats->n_credit_received,
+               (unsigned long)p_stats->n_credit_received);
+  return result;
+}
+
+/** Implementation helper for GETINFO: answers questions about N23 flow
+ * control. */
+static int
+getinfo_helper_flowctl(control_connection_t *control_conn,
+                       const char *question, char **answer,
+                       const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+  if (!strcmp(question, "flowctl/circuits")) {
+    circuit_t *circ;
+    smartlist_t *lines = smartlist_new();
+    for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+      if (CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+        continue;
+      smartlist_add(lines,
+                    circuit_describe_flowctl_for_controller(
+                                                    TO_OR_CIRCUIT(circ)));
+    }
+    *answer = smartlist_join_strings(lines, "\r\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  } else if (!strcmp(question, "flowctl/histograms")) {
+    *answer = rep_hist_format_n23_stats();
+  }
+  return 0;
+}
+
+/** Implementation helper for GETINFO: answers questions about the
+ * PerCircuitBWRate and PerStreamBWRate token buckets. */
+static int
+getinfo_helper_bwshaping(control_connection_t *control_conn,
+                         const char *question, char **answer,
+                         const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+  if (!strcmp(question, "bw-shaping/circuits")) {
+    circuit_t *circ;
+    smartlist_t *lines = smartlist_new();
+    for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+      or_circuit_t *or_circ;
+      if (CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+        continue;
+      or_circ = TO_OR_CIRCUIT(circ);
+      smartlist_add_asprintf(lines,
+                 "PConn="U64_FORMAT" PCircID=%d NConn="U64_FORMAT" "
+                 "NCircID=%d Bucket=%d Depletions=%lu Blocked=%d",
+                 U64_PRINTF_ARG(or_circ->p_conn ?
+                                or_circ->p_conn->_base.global_identifier : 0),
+                 (int)or_circ->p_circ_id,
+                 U64_PRINTF_ARG(circ->n_conn ?
+                                circ->n_conn->_base.global_identifier : 0),
+                 (int)circ->n_circ_id,
+                 circ->write_bucket,
+                 (unsigned long)circ->n_bucket_depletions,
+                 (int)circ->write_blocked_on_bucket);
+    }
+    *answer = smartlist_join_strings(lines, "\r\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  } else if (!strcmp(question, "bw-shaping/counters")) {
+    *answer = rep_hist_format_bucket_stats();
+  }
+  return 0;
+}
+
+/** Implementation helper for GETINFO: answers questions about the
+ * latency of cells relayed here, as traced with CellLatencyTracing. */
+static int
+getinfo_helper_celllatency(control_connection_t *control_conn,
+                           const char *question, char **answer,
+                           const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+  if (!strcmp(question, "cell-latency/histograms"))
+    *answer = rep_hist_format_cell_latency();
+  return 0;
+}
+
 /** Callback function for GETINFO: on a given control connection, try to
  * answer the question <b>q</b> and store the newly-allocated answer in
  * *<b>a</b>. If an internal error occurs, return -1 and optionally set
@@ -2236,6 +2366,16 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   PREFIX("ip-to-country/", geoip, "Perform a GEOIP lookup"),
+  ITEM("flowctl/circuits", flowctl,
+       "N23 flow control state of each circuit relayed here."),
+  ITEM("flowctl/histograms", flowctl,
+       "N23 credit counters and stall/queue-length histograms."),
+  ITEM("bw-shaping/circuits", bwshaping,
+       "PerCircuitBWRate token bucket of each circuit relayed here."),
+  ITEM("bw-shaping/counters", bwshaping,
+       "How often circuits and exit streams have used up their buckets."),
+  ITEM("cell-latency/histograms", celllatency,
+       "Per-stage latency histograms, in usec, of cells relayed here."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -3897,6 +4037,30 @@ control_event_stream_bandwidth_used(void)
   return 0;
 }
 
+/** A second or more has elapsed: tell any interested control
+ * connections about the N23 flow control state of every relayed circuit
+ * whose state has changed since the last CIRC_FLOWCTL event. */
+int
+control_event_circ_flowctl(void)
+{
+  circuit_t *circ;
+  if (!EVENT_IS_INTERESTING(EVENT_CIRC_FLOWCTL))
+    return 0;
+
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    char *desc;
+    if (CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close ||
+        !circ->flowctl_changed)
+      continue;
+    circ->flowctl_changed = 0;
+    desc = circuit_describe_flowctl_for_controller(TO_OR_CIRCUIT(circ));
+    send_control_event(EVENT_CIRC_FLOWCTL, ALL_FORMATS,
+                       "650 CIRC_FLOWCTL %s\r\n", desc);
+    tor_free(desc);
+  }
+  return 0;
+}
+
 /** A second or more has elapsed: tell any interested control
  * connections how much bandwidth we used. */
 int
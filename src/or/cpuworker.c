@@ -5,48 +5,104 @@
 
 /**
  * \file cpuworker.c
- * \brief Implements a farm of 'CPU worker' processes to perform
- * CPU-intensive tasks in another thread or process, to not
- * interrupt the main thread.
+ * \brief Implements a farm of 'CPU worker' threads to perform
+ * CPU-intensive tasks without interrupting the main thread.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins.  Each handshake is a
+ * cpuworker_job_t that goes to a workqueue_t thread pool; the worker writes
+ * its answer into the job, and the main thread picks it up from the pool's
+ * reply callback.
+ *
+ * A second pool does directory work: parsing big networkstatus documents,
+ * and checking batches of signatures (see sig_check_batch_t).  The main
+ * thread waits for those jobs, doing a share of the work itself, so they
+ * finish in a fraction of the time rather than later.
+ *
+ * A third pool checks the signatures on the router descriptors and
+ * consensuses that we download.  Nobody waits for it: the main loop goes on
+ * relaying cells, and the caller's callback gets the verdicts later (see
+ * sig_check_batch_run_async()).
  **/
 
+#define CPUWORKER_PRIVATE
 #include "or.h"
-#include "buffers.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "config.h"
-#include "connection.h"
 #include "cpuworker.h"
 #include "main.h"
 #include "onion.h"
 #include "router.h"
+#include "workqueue.h"
 
-/** The maximum number of cpuworker processes we will keep around. */
+/** The maximum number of cpuworker threads we will keep around. */
 #define MAX_CPUWORKERS 16
-/** The minimum number of cpuworker processes we will keep around. */
+/** The minimum number of cpuworker threads we will keep around. */
 #define MIN_CPUWORKERS 1
-
-/** The tag specifies which circuit this onionskin was from. */
-#define TAG_LEN 10
-/** How many bytes are sent from the cpuworker back to tor? */
-#define LEN_ONION_RESPONSE \
-  (1+TAG_LEN+ONIONSKIN_REPLY_LEN+CPATH_KEY_MATERIAL_LEN)
-
-/** How many cpuworkers we have running right now. */
-static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
-static int num_cpuworkers_busy=0;
-/** We need to spawn new cpuworkers whenever we rotate the onion keys
- * on platforms where execution contexts==processes.  This variable stores
- * the last time we got a key rotation event. */
-static time_t last_rotation_time=0;
-
-static void cpuworker_main(void *data) ATTR_NORETURN;
-static int spawn_cpuworker(void);
-static void spawn_enough_cpuworkers(void);
-static void process_pending_task(connection_t *cpuworker);
+/** How many handshakes may be handed to the pool per worker thread before
+ * further CREATE cells wait on the onion queue?  A little slack keeps every
+ * thread busy while the main thread is elsewhere; more than that would only
+ * move work out of the onion queue, where old requests get dropped. */
+#define CPUWORKER_JOBS_PER_THREAD 4
+
+/** One onionskin handshake, as handed to a worker thread. */
+typedef struct cpuworker_job_t {
+  /** Workqueue bookkeeping; must come first. */
+  workqueue_job_t base;
+  /** The circuit that is waiting for this handshake, or NULL if it has
+   * gone away.  Only the main thread looks at this. */
+  or_circuit_t *circ;
+  /** The onionskin from the CREATE cell. */
+  char onionskin[ONIONSKIN_CHALLENGE_LEN];
+  /** Set by the worker: true iff the handshake succeeded. */
+  int success;
+  /** Set by the worker: the payload of our CREATED cell. */
+  char reply[ONIONSKIN_REPLY_LEN];
+  /** Set by the worker: the negotiated key material. */
+  char keys[CPATH_KEY_MATERIAL_LEN];
+} cpuworker_job_t;
+
+/** Private state for each worker thread. */
+typedef struct cpuworker_thread_state_t {
+  /** The worker's own copies of our current and previous onion keys. */
+  crypto_pk_t *onion_key;
+  crypto_pk_t *last_onion_key;
+} cpuworker_thread_state_t;
+
+/** The pool that runs our handshakes, or NULL if we haven't started it. */
+static workqueue_t *cpuworker_queue = NULL;
+
+/** Never run more than this many directory worker threads. */
+#define MAX_DIR_WORKERS 8
+/** Don't give a thread fewer signatures than this to check at once: below
+ * about this many, handing them off costs more than checking them here. */
+#define MIN_SIG_CHECKS_PER_JOB 4
+
+/** Private state for each directory worker thread, and for the main thread
+ * when it does its share of a batch. */
+typedef struct dir_worker_state_t {
+  /** Scratch space for the digests we recover from signatures. */
+  char *buf;
+  /** Allocated length of <b>buf</b>. */
+  size_t buf_len;
+} dir_worker_state_t;
+
+/** The pool that does directory work, or NULL if we haven't started it. */
+static workqueue_t *dir_worker_queue = NULL;
+/** How many threads dir_worker_queue has. */
+static int dir_worker_n_threads = 0;
+/** How many jobs may wait on sig_check_queue for each of its threads before
+ * we check further signatures on the main thread instead? */
+#define SIG_CHECK_JOBS_PER_THREAD 16
+/** The pool that checks signatures for sig_check_batch_run_async(), or NULL
+ * if we haven't started it. */
+static workqueue_t *sig_check_queue = NULL;
+/** How many threads sig_check_queue has. */
+static int sig_check_n_threads = 0;
+/** True while cpuworkers_free_all() shuts down sig_check_queue. */
+static int sig_check_shutting_down = 0;
+
+static void queue_pending_tasks(void);
 
 /** Initialize the cpuworker subsystem.
  */
@@ -56,446 +112,617 @@ cpu_init(void)
   cpuworkers_rotate();
 }
 
-/** Called when we're done sending a request to a cpuworker. */
-int
-connection_cpu_finished_flushing(connection_t *conn)
+/** Workqueue state constructor: give a worker thread its own copies of the
+ * onion keys. */
+static void *
+worker_state_new(void *arg)
 {
-  tor_assert(conn);
-  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
-  return 0;
+  cpuworker_thread_state_t *ws;
+  (void)arg;
+  ws = tor_malloc_zero(sizeof(cpuworker_thread_state_t));
+  dup_onion_keys(&ws->onion_key, &ws->last_onion_key);
+  return ws;
 }
 
-/** Pack global_id and circ_id; set *tag to the result. (See note on
- * cpuworker_main for wire format.) */
+/** Workqueue state destructor: release a worker thread's onion keys. */
 static void
-tag_pack(char *tag, uint64_t conn_id, circid_t circ_id)
+worker_state_free(void *arg)
 {
-  /*XXXX RETHINK THIS WHOLE MESS !!!! !NM NM NM NM*/
-  set_uint64(tag, conn_id);
-  set_uint16(tag+8, circ_id);
+  cpuworker_thread_state_t *ws = arg;
+  if (ws->onion_key)
+    crypto_pk_free(ws->onion_key);
+  if (ws->last_onion_key)
+    crypto_pk_free(ws->last_onion_key);
+  tor_free(ws);
+  crypto_thread_cleanup();
 }
 
-/** Unpack <b>tag</b> into addr, port, and circ_id.
- */
-static void
-tag_unpack(const char *tag, uint64_t *conn_id, circid_t *circ_id)
+/** Start the worker pool if we haven't already.  Return 0 on success, -1
+ * on failure. */
+static int
+cpuworker_queue_init(void)
 {
-  *conn_id = get_uint64(tag);
-  *circ_id = get_uint16(tag+8);
+  int n_threads;
+
+  if (cpuworker_queue)
+    return 0;
+
+  n_threads = get_num_cpus(get_options());
+  if (n_threads < MIN_CPUWORKERS)
+    n_threads = MIN_CPUWORKERS;
+  if (n_threads > MAX_CPUWORKERS)
+    n_threads = MAX_CPUWORKERS;
+
+  cpuworker_queue = workqueue_new(tor_libevent_get_base(), n_threads,
+                                  n_threads * CPUWORKER_JOBS_PER_THREAD,
+                                  worker_state_new, worker_state_free,
+                                  NULL);
+  if (!cpuworker_queue) {
+    log_warn(LD_GENERAL, "Couldn't start cpuworker threads.");
+    return -1;
+  }
+  log_info(LD_OR, "Started %d cpuworker threads.", n_threads);
+  return 0;
 }
 
-/** Called when the onion key has changed and we need to spawn new
- * cpuworkers.  Close all currently idle cpuworkers, and mark the last
- * rotation time as now.
+/** Called when the onion key has changed: make every worker pick up the new
+ * keys before its next handshake, and start the workers if we are a server
+ * and they aren't running yet.
  */
 void
 cpuworkers_rotate(void)
 {
-  connection_t *cpuworker;
-  while ((cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                                   CPUWORKER_STATE_IDLE))) {
-    connection_mark_for_close(cpuworker);
-    --num_cpuworkers;
-  }
-  last_rotation_time = time(NULL);
-  if (server_mode(get_options()))
-    spawn_enough_cpuworkers();
+  if (cpuworker_queue)
+    workqueue_reset_thread_state(cpuworker_queue);
+  else if (server_mode(get_options()))
+    cpuworker_queue_init();
 }
 
-/** If the cpuworker closes the connection,
- * mark it as closed and spawn a new one as needed. */
-int
-connection_cpu_reached_eof(connection_t *conn)
+/** Release the worker pools.  Any handshake still in flight is dropped. */
+void
+cpuworkers_free_all(void)
 {
-  log_warn(LD_GENERAL,"Read eof. CPU worker died unexpectedly.");
-  if (conn->state != CPUWORKER_STATE_IDLE) {
-    /* the circ associated with this cpuworker will have to wait until
-     * it gets culled in run_connection_housekeeping(), since we have
-     * no way to find out which circ it was. */
-    log_warn(LD_GENERAL,"...and it left a circuit queued; abandoning circ.");
-    num_cpuworkers_busy--;
-  }
-  num_cpuworkers--;
-  spawn_enough_cpuworkers(); /* try to regrow. hope we don't end up
-                                spinning. */
-  connection_mark_for_close(conn);
-  return 0;
+  workqueue_t *wq = cpuworker_queue;
+  /* Clear the pointer first so the reply callbacks that workqueue_free()
+   * runs don't try to queue more work. */
+  cpuworker_queue = NULL;
+  workqueue_free(wq);
+  workqueue_free(dir_worker_queue);
+  dir_worker_queue = NULL;
+  dir_worker_n_threads = 0;
+  /* Batches still out come back aborted, even if their signatures have
+   * all been checked: our callers may already have freed the state their
+   * callbacks would update.  See sig_check_job_async_reply(). */
+  sig_check_shutting_down = 1;
+  workqueue_free(sig_check_queue);
+  sig_check_shutting_down = 0;
+  sig_check_queue = NULL;
+  sig_check_n_threads = 0;
 }
 
-/** Called when we get data from a cpuworker.  If the answer is not complete,
- * wait for a complete answer. If the answer is complete,
- * process it as appropriate.
- */
-int
-connection_cpu_process_inbuf(connection_t *conn)
+/** Workqueue work function: run the server side of an onionskin handshake
+ * on a worker thread, and leave the answer in the job. */
+static void
+cpuworker_onion_handshake_threadfn(workqueue_job_t *work, void *state)
 {
-  char success;
-  char buf[LEN_ONION_RESPONSE];
-  uint64_t conn_id;
-  circid_t circ_id;
-  connection_t *tmp_conn;
-  or_connection_t *p_conn = NULL;
-  circuit_t *circ;
-
-  tor_assert(conn);
-  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
-
-  if (!connection_get_inbuf_len(conn))
-    return 0;
-
-  if (conn->state == CPUWORKER_STATE_BUSY_ONION) {
-    if (connection_get_inbuf_len(conn) < LEN_ONION_RESPONSE)
-      return 0; /* not yet */
-    tor_assert(connection_get_inbuf_len(conn) == LEN_ONION_RESPONSE);
-
-    connection_fetch_from_buf(&success,1,conn);
-    connection_fetch_from_buf(buf,LEN_ONION_RESPONSE-1,conn);
-
-    /* parse out the circ it was talking about */
-    tag_unpack(buf, &conn_id, &circ_id);
-    circ = NULL;
-    tmp_conn = connection_get_by_global_id(conn_id);
-    if (tmp_conn && !tmp_conn->marked_for_close &&
-        tmp_conn->type == CONN_TYPE_OR)
-      p_conn = TO_OR_CONN(tmp_conn);
-
-    if (p_conn)
-      circ = circuit_get_by_circid_orconn(circ_id, p_conn);
-
-    if (success == 0) {
-      log_debug(LD_OR,
-                "decoding onionskin failed. "
-                "(Old key or bad software.) Closing.");
-      if (circ)
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      goto done_processing;
-    }
-    if (!circ) {
-      /* This happens because somebody sends us a destroy cell and the
-       * circuit goes away, while the cpuworker is working. This is also
-       * why our tag doesn't include a pointer to the circ, because we'd
-       * never know if it's still valid.
-       */
-      log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
-      goto done_processing;
-    }
-    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-    if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,
-                         buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0) {
-      log_warn(LD_OR,"onionskin_answer failed. Closing.");
-      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-      goto done_processing;
-    }
-    log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+  cpuworker_job_t *job = (cpuworker_job_t *)work;
+  cpuworker_thread_state_t *ws = state;
+
+  if (onion_skin_server_handshake(job->onionskin, ws->onion_key,
+                                  ws->last_onion_key, job->reply, job->keys,
+                                  CPATH_KEY_MATERIAL_LEN) < 0) {
+    job->success = 0;
+    memset(job->reply, 0, sizeof(job->reply));
+    memset(job->keys, 0, sizeof(job->keys));
   } else {
-    tor_assert(0); /* don't ask me to do handshakes yet */
+    job->success = 1;
   }
-
- done_processing:
-  conn->state = CPUWORKER_STATE_IDLE;
-  num_cpuworkers_busy--;
-  if (conn->timestamp_created < last_rotation_time) {
-    connection_mark_for_close(conn);
-    num_cpuworkers--;
-    spawn_enough_cpuworkers();
-  } else {
-    process_pending_task(conn);
-  }
-  return 0;
+  memset(job->onionskin, 0, sizeof(job->onionskin));
 }
 
-/** Implement a cpuworker.  'data' is an fdarray as returned by socketpair.
- * Read and writes from fdarray[1].  Reads requests, writes answers.
- *
- *   Request format:
- *          Task type           [1 byte, always CPUWORKER_TASK_ONION]
- *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_CHALLENGE_LEN
- *   Response format:
- *          Success/failure     [1 byte, boolean.]
- *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_REPLY_LEN
- *          Negotiated keys     KEY_LEN*2+DIGEST_LEN*2
- *
- *  (Note: this _should_ be by addr/port, since we're concerned with specific
- * connections, not with routers (where we'd use identity).)
- */
+/** Workqueue reply function: on the main thread, answer the circuit that
+ * asked for <b>work</b>, if it still exists, then hand the freed slot to
+ * the next waiting onionskin. */
 static void
-cpuworker_main(void *data)
+cpuworker_onion_handshake_replyfn(workqueue_job_t *work, int completed)
 {
-  char question[ONIONSKIN_CHALLENGE_LEN];
-  uint8_t question_type;
-  tor_socket_t *fdarray = data;
-  tor_socket_t fd;
+  cpuworker_job_t *job = (cpuworker_job_t *)work;
+  or_circuit_t *circ = job->circ;
 
-  /* variables for onion processing */
-  char keys[CPATH_KEY_MATERIAL_LEN];
-  char reply_to_proxy[ONIONSKIN_REPLY_LEN];
-  char buf[LEN_ONION_RESPONSE];
-  char tag[TAG_LEN];
-  crypto_pk_t *onion_key = NULL, *last_onion_key = NULL;
-
-  fd = fdarray[1]; /* this side is ours */
-#ifndef TOR_IS_MULTITHREADED
-  tor_close_socket(fdarray[0]); /* this is the side of the socketpair the
-                                 * parent uses */
-  tor_free_all(1); /* so the child doesn't hold the parent's fd's open */
-  handle_signals(0); /* ignore interrupts from the keyboard, etc */
-#endif
-  tor_free(data);
-
-  dup_onion_keys(&onion_key, &last_onion_key);
-
-  for (;;) {
-    ssize_t r;
-
-    if ((r = recv(fd, (void *)&question_type, 1, 0)) != 1) {
-//      log_fn(LOG_ERR,"read type failed. Exiting.");
-      if (r == 0) {
-        log_info(LD_OR,
-                 "CPU worker exiting because Tor process closed connection "
-                 "(either rotated keys or died).");
-      } else {
-        log_info(LD_OR,
-                 "CPU worker exiting because of error on connection to Tor "
-                 "process.");
-        log_info(LD_OR,"(Error on %d was %s)",
-                 fd, tor_socket_strerror(tor_socket_errno(fd)));
-      }
-      goto end;
-    }
-    tor_assert(question_type == CPUWORKER_TASK_ONION);
-
-    if (read_all(fd, tag, TAG_LEN, 1) != TAG_LEN) {
-      log_err(LD_BUG,"read tag failed. Exiting.");
-      goto end;
-    }
-
-    if (read_all(fd, question, ONIONSKIN_CHALLENGE_LEN, 1) !=
-        ONIONSKIN_CHALLENGE_LEN) {
-      log_err(LD_BUG,"read question failed. Exiting.");
-      goto end;
-    }
+  if (circ) {
+    tor_assert(circ->workqueue_entry == job);
+    circ->workqueue_entry = NULL;
+  }
 
-    if (question_type == CPUWORKER_TASK_ONION) {
-      if (onion_skin_server_handshake(question, onion_key, last_onion_key,
-          reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0) {
-        /* failure */
-        log_debug(LD_OR,"onion_skin_server_handshake failed.");
-        *buf = 0; /* indicate failure in first byte */
-        memcpy(buf+1,tag,TAG_LEN);
-        /* send all zeros as answer */
-        memset(buf+1+TAG_LEN, 0, LEN_ONION_RESPONSE-(1+TAG_LEN));
-      } else {
-        /* success */
-        log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-        buf[0] = 1; /* 1 means success */
-        memcpy(buf+1,tag,TAG_LEN);
-        memcpy(buf+1+TAG_LEN,reply_to_proxy,ONIONSKIN_REPLY_LEN);
-        memcpy(buf+1+TAG_LEN+ONIONSKIN_REPLY_LEN,keys,CPATH_KEY_MATERIAL_LEN);
-      }
-      if (write_all(fd, buf, LEN_ONION_RESPONSE, 1) != LEN_ONION_RESPONSE) {
-        log_err(LD_BUG,"writing response buf failed. Exiting.");
-        goto end;
-      }
-      log_debug(LD_OR,"finished writing response.");
-    }
+  if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the
+     * circuit goes away, while the cpuworker is working. */
+    log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
+    goto done_processing;
   }
- end:
-  if (onion_key)
-    crypto_pk_free(onion_key);
-  if (last_onion_key)
-    crypto_pk_free(last_onion_key);
-  tor_close_socket(fd);
-  crypto_thread_cleanup();
-  spawn_exit();
+  if (!completed) {
+    log_info(LD_OR, "onionskin was never processed. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+    goto done_processing;
+  }
+  if (!job->success) {
+    log_debug(LD_OR,
+              "decoding onionskin failed. "
+              "(Old key or bad software.) Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_TORPROTOCOL);
+    goto done_processing;
+  }
+  if (onionskin_answer(circ, CELL_CREATED, job->reply, job->keys) < 0) {
+    log_warn(LD_OR,"onionskin_answer failed. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+    goto done_processing;
+  }
+  log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+
+ done_processing:
+  memset(job, 0, sizeof(cpuworker_job_t));
+  tor_free(job);
+  if (cpuworker_queue)
+    queue_pending_tasks();
 }
 
-/** Launch a new cpuworker. Return 0 if we're happy, -1 if we failed.
- */
+/** Hand <b>onionskin</b> for <b>circ</b> to the worker pool, which must
+ * have room for it.  Takes ownership of <b>onionskin</b>.  Return 0 on
+ * success, -1 on failure. */
 static int
-spawn_cpuworker(void)
+cpuworker_queue_handshake(or_circuit_t *circ, char *onionskin)
 {
-  tor_socket_t *fdarray;
-  tor_socket_t fd;
-  connection_t *conn;
-  int err;
-
-  fdarray = tor_malloc(sizeof(tor_socket_t)*2);
-  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fdarray)) < 0) {
-    log_warn(LD_NET, "Couldn't construct socketpair for cpuworker: %s",
-             tor_socket_strerror(-err));
-    tor_free(fdarray);
+  cpuworker_job_t *job;
+
+  if (!circ->p_conn) {
+    log_info(LD_OR,"circ->p_conn gone. Failing circ.");
+    tor_free(onionskin);
     return -1;
   }
 
-  tor_assert(SOCKET_OK(fdarray[0]));
-  tor_assert(SOCKET_OK(fdarray[1]));
-
-  fd = fdarray[0];
-  spawn_func(cpuworker_main, (void*)fdarray);
-  log_debug(LD_OR,"just spawned a cpu worker.");
-#ifndef TOR_IS_MULTITHREADED
-  tor_close_socket(fdarray[1]); /* don't need the worker's side of the pipe */
-  tor_free(fdarray);
-#endif
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->base.work_fn = cpuworker_onion_handshake_threadfn;
+  job->base.reply_fn = cpuworker_onion_handshake_replyfn;
+  job->circ = circ;
+  memcpy(job->onionskin, onionskin, ONIONSKIN_CHALLENGE_LEN);
+  tor_free(onionskin);
 
-  conn = connection_new(CONN_TYPE_CPUWORKER, AF_UNIX);
+  if (workqueue_add(cpuworker_queue, &job->base) < 0) {
+    log_warn(LD_BUG, "Workqueue refused a job it had room for.");
+    tor_free(job);
+    return -1;
+  }
+  circ->workqueue_entry = job;
+  return 0;
+}
 
-  set_socket_nonblocking(fd);
+/** Move waiting onionskins from the onion queue to the worker pool until
+ * the pool is full or the queue is empty. */
+static void
+queue_pending_tasks(void)
+{
+  or_circuit_t *circ;
+  char *onionskin = NULL;
 
-  /* set up conn so it's got all the data we need to remember */
-  conn->s = fd;
-  conn->address = tor_strdup("localhost");
-  tor_addr_make_unspec(&conn->addr);
+  while (workqueue_get_n_pending(cpuworker_queue) <
+         workqueue_get_max_pending(cpuworker_queue)) {
+    circ = onion_next_task(&onionskin);
+    if (!circ)
+      return;
+    if (cpuworker_queue_handshake(circ, onionskin) < 0)
+      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+  }
+}
 
-  if (connection_add(conn) < 0) { /* no space, forget it */
-    log_warn(LD_NET,"connection_add for cpuworker failed. Giving up.");
-    connection_free(conn); /* this closes fd */
+/** Try to tell a cpuworker to perform the public key operations necessary to
+ * respond to <b>onionskin</b> for the circuit <b>circ</b>.
+ *
+ * If the worker pool is full, queue the task onto the pending onion list
+ * and return.  Return 0 if we successfully assign or queue the task, or -1
+ * on failure.
+ */
+int
+assign_onionskin_to_cpuworker(or_circuit_t *circ, char *onionskin)
+{
+  if (!cpuworker_queue && cpuworker_queue_init() < 0) {
+    tor_free(onionskin);
     return -1;
   }
 
-  conn->state = CPUWORKER_STATE_IDLE;
-  connection_start_reading(conn);
+  if (workqueue_get_n_pending(cpuworker_queue) >=
+      workqueue_get_max_pending(cpuworker_queue)) {
+    log_debug(LD_OR,"No idle cpuworkers. Queuing.");
+    if (onion_pending_add(circ, onionskin) < 0) {
+      tor_free(onionskin);
+      return -1;
+    }
+    return 0;
+  }
 
-  return 0; /* success */
+  return cpuworker_queue_handshake(circ, onionskin);
 }
 
-/** If we have too few or too many active cpuworkers, try to spawn new ones
- * or kill idle ones.
- */
-static void
-spawn_enough_cpuworkers(void)
+/** If <b>circ</b> has a handshake in the worker pool, detach it so that
+ * the answer is thrown away, and ask the pool to skip it if no worker has
+ * started on it yet. */
+void
+cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  int num_cpuworkers_needed = get_num_cpus(get_options());
+  cpuworker_job_t *job = circ->workqueue_entry;
+  if (!job)
+    return;
+  tor_assert(job->circ == circ);
+  workqueue_job_cancel(&job->base);
+  job->circ = NULL;
+  circ->workqueue_entry = NULL;
+}
 
-  if (num_cpuworkers_needed < MIN_CPUWORKERS)
-    num_cpuworkers_needed = MIN_CPUWORKERS;
-  if (num_cpuworkers_needed > MAX_CPUWORKERS)
-    num_cpuworkers_needed = MAX_CPUWORKERS;
 
-  while (num_cpuworkers < num_cpuworkers_needed) {
-    if (spawn_cpuworker() < 0) {
-      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
-      return;
-    }
-    num_cpuworkers++;
-  }
+/** Workqueue state constructor for directory workers. */
+static void *
+dir_worker_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(sizeof(dir_worker_state_t));
 }
 
-/** Take a pending task from the queue and assign it to 'cpuworker'. */
+/** Workqueue state destructor for directory workers. */
 static void
-process_pending_task(connection_t *cpuworker)
+dir_worker_state_free(void *arg)
 {
-  or_circuit_t *circ;
-  char *onionskin = NULL;
+  dir_worker_state_t *ws = arg;
+  tor_free(ws->buf);
+  tor_free(ws);
+  crypto_thread_cleanup();
+}
 
-  tor_assert(cpuworker);
+/** Return the pool that does directory work, starting it if we haven't
+ * yet, and set *<b>n_threads_out</b> to how many threads it has.  Return
+ * NULL if we shouldn't use one: the main thread is expected to do a share
+ * of every batch, so with one CPU there is nobody to share with.  Jobs on
+ * this pool are handed the worker's dir_worker_state_t; their callers
+ * should collect them with workqueue_wait_for_replies(). */
+workqueue_t *
+cpuworker_get_dir_queue(int *n_threads_out)
+{
+#ifdef TOR_IS_MULTITHREADED
+  static int failed = 0;
+  if (!dir_worker_queue && !failed) {
+    int n_threads = get_num_cpus(get_options()) - 1;
+    if (n_threads > MAX_DIR_WORKERS)
+      n_threads = MAX_DIR_WORKERS;
+    if (n_threads < 1)
+      return NULL;
+    dir_worker_queue = workqueue_new(NULL, n_threads, n_threads,
+                                     dir_worker_state_new,
+                                     dir_worker_state_free, NULL);
+    if (!dir_worker_queue) {
+      log_info(LD_GENERAL, "Couldn't start directory worker threads; "
+               "doing directory work on the main thread.");
+      failed = 1;
+      return NULL;
+    }
+    dir_worker_n_threads = n_threads;
+    log_info(LD_DIR, "Started %d directory worker threads.", n_threads);
+  }
+  *n_threads_out = dir_worker_n_threads;
+  return dir_worker_queue;
+#else
+  (void)n_threads_out;
+  return NULL;
+#endif
+}
 
-  /* for now only process onion tasks */
+/** One signature in a sig_check_batch_t. */
+typedef struct sig_check_t {
+  /** The key that is supposed to have made the signature. */
+  crypto_pk_t *key;
+  /** The signature itself. */
+  char *signature;
+  size_t signature_len;
+  /** The digest that is supposed to have been signed. */
+  char digest[DIGEST256_LEN];
+  size_t digest_len;
+  /** Set once checked: true iff the signature is good. */
+  int ok;
+} sig_check_t;
+
+typedef struct sig_check_job_t sig_check_job_t;
+
+/** A list of signatures to check all at once.  Build one with
+ * sig_check_batch_add(), check it with sig_check_batch_run() or
+ * sig_check_batch_run_async(), and read the verdicts with
+ * sig_check_batch_is_ok(). */
+struct sig_check_batch_t {
+  /** The sig_check_t for each signature, in the order they were added. */
+  smartlist_t *checks;
+  /** For sig_check_batch_run_async(): the jobs we handed out, and how many
+   * of them haven't come back yet. */
+  sig_check_job_t *jobs;
+  int n_jobs_pending;
+  /** For sig_check_batch_run_async(): true iff some job never ran, because
+   * the pool was shut down first. */
+  unsigned int aborted:1;
+  /** For sig_check_batch_run_async(): what to call once every job is back,
+   * and what to pass it. */
+  sig_check_batch_done_fn done_fn;
+  void *done_arg;
+};
+
+/** A run of signatures from a sig_check_batch_t, as handed to a directory
+ * worker. */
+struct sig_check_job_t {
+  /** Workqueue bookkeeping; must come first. */
+  workqueue_job_t base;
+  /** The batch that this run comes from. */
+  sig_check_batch_t *batch;
+  /** The first signature to check. */
+  sig_check_t **checks;
+  /** How many signatures to check. */
+  int n_checks;
+  /** True iff the signatures have been checked. */
+  unsigned int completed:1;
+};
+
+/** Return a new, empty, sig_check_batch_t. */
+sig_check_batch_t *
+sig_check_batch_new(void)
+{
+  sig_check_batch_t *batch = tor_malloc_zero(sizeof(sig_check_batch_t));
+  batch->checks = smartlist_new();
+  return batch;
+}
 
-  circ = onion_next_task(&onionskin);
-  if (!circ)
+/** Release all storage held in <b>batch</b>. */
+void
+sig_check_batch_free(sig_check_batch_t *batch)
+{
+  if (!batch)
     return;
-  if (assign_onionskin_to_cpuworker(cpuworker, circ, onionskin))
-    log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+  tor_assert(!batch->n_jobs_pending);
+  SMARTLIST_FOREACH_BEGIN(batch->checks, sig_check_t *, check) {
+    crypto_pk_free(check->key);
+    tor_free(check->signature);
+    tor_free(check);
+  } SMARTLIST_FOREACH_END(check);
+  smartlist_free(batch->checks);
+  tor_free(batch);
 }
 
-/** How long should we let a cpuworker stay busy before we give
- * up on it and decide that we have a bug or infinite loop?
- * This value is high because some servers with low memory/cpu
- * sometimes spend an hour or more swapping, and Tor starves. */
-#define CPUWORKER_BUSY_TIMEOUT (60*60*12)
+/** Add to <b>batch</b> a check that the <b>signature_len</b>-byte
+ * <b>signature</b> is a signature by <b>key</b> on the
+ * <b>digest_len</b>-byte <b>digest</b>.  We copy everything we need, so the
+ * caller may free its arguments at once.  Return the index of the check in
+ * <b>batch</b>. */
+int
+sig_check_batch_add(sig_check_batch_t *batch,
+                    const char *digest, size_t digest_len,
+                    const char *signature, size_t signature_len,
+                    crypto_pk_t *key)
+{
+  sig_check_t *check = tor_malloc_zero(sizeof(sig_check_t));
+  tor_assert(digest_len <= DIGEST256_LEN);
+  check->key = crypto_pk_dup_key(key);
+  check->signature = tor_memdup(signature, signature_len);
+  check->signature_len = signature_len;
+  memcpy(check->digest, digest, digest_len);
+  check->digest_len = digest_len;
+  smartlist_add(batch->checks, check);
+  return smartlist_len(batch->checks) - 1;
+}
 
-/** We have a bug that I can't find. Sometimes, very rarely, cpuworkers get
- * stuck in the 'busy' state, even though the cpuworker process thinks of
- * itself as idle. I don't know why. But here's a workaround to kill any
- * cpuworker that's been busy for more than CPUWORKER_BUSY_TIMEOUT.
- */
+/** Return the number of checks in <b>batch</b>. */
+int
+sig_check_batch_len(const sig_check_batch_t *batch)
+{
+  return smartlist_len(batch->checks);
+}
+
+/** Return true iff sig_check_batch_run() found that the signature at index
+ * <b>idx</b> of <b>batch</b> is good. */
+int
+sig_check_batch_is_ok(const sig_check_batch_t *batch, int idx)
+{
+  const sig_check_t *check = smartlist_get(batch->checks, idx);
+  return check->ok;
+}
+
+/** Check every signature in <b>job</b>, using the scratch space in
+ * <b>ws</b>.  Safe to call from any thread. */
 static void
-cull_wedged_cpuworkers(void)
+sig_check_job_run(sig_check_job_t *job, dir_worker_state_t *ws)
 {
-  time_t now = time(NULL);
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (!conn->marked_for_close &&
-        conn->type == CONN_TYPE_CPUWORKER &&
-        conn->state == CPUWORKER_STATE_BUSY_ONION &&
-        conn->timestamp_lastwritten + CPUWORKER_BUSY_TIMEOUT < now) {
-      log_notice(LD_BUG,
-                 "closing wedged cpuworker. Can somebody find the bug?");
-      num_cpuworkers_busy--;
-      num_cpuworkers--;
-      connection_mark_for_close(conn);
+  int i;
+  for (i = 0; i < job->n_checks; ++i) {
+    sig_check_t *check = job->checks[i];
+    size_t keysize = crypto_pk_keysize(check->key);
+    if (ws->buf_len < keysize) {
+      tor_free(ws->buf);
+      ws->buf = tor_malloc(keysize);
+      ws->buf_len = keysize;
     }
-  } SMARTLIST_FOREACH_END(conn);
+    check->ok =
+      crypto_pk_public_checksig(check->key, ws->buf, keysize,
+                                check->signature, check->signature_len)
+        >= (int)check->digest_len &&
+      tor_memeq(ws->buf, check->digest, check->digest_len);
+  }
 }
 
-/** Try to tell a cpuworker to perform the public key operations necessary to
- * respond to <b>onionskin</b> for the circuit <b>circ</b>.
- *
- * If <b>cpuworker</b> is defined, assert that he's idle, and use him. Else,
- * look for an idle cpuworker and use him. If none idle, queue task onto the
- * pending onion list and return.  Return 0 if we successfully assign the
- * task, or -1 on failure.
- */
-int
-assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                              or_circuit_t *circ, char *onionskin)
+/** Workqueue work function for signature checks.  Runs on a directory
+ * worker. */
+static void
+sig_check_job_work(workqueue_job_t *_job, void *state)
 {
-  char qbuf[1];
-  char tag[TAG_LEN];
-  time_t now = approx_time();
-  static time_t last_culled_cpuworkers = 0;
-
-  /* Checking for wedged cpuworkers requires a linear search over all
-   * connections, so let's do it only once a minute.
-   */
-#define CULL_CPUWORKERS_INTERVAL 60
-
-  if (last_culled_cpuworkers + CULL_CPUWORKERS_INTERVAL <= now) {
-    cull_wedged_cpuworkers();
-    spawn_enough_cpuworkers();
-    last_culled_cpuworkers = now;
+  sig_check_job_run((sig_check_job_t *)_job, state);
+}
+
+/** Workqueue reply function for signature checks. */
+static void
+sig_check_job_reply(workqueue_job_t *_job, int completed)
+{
+  sig_check_job_t *job = (sig_check_job_t *)_job;
+  job->completed = completed;
+}
+
+/** Check every signature in <b>batch</b>.  If there are enough to be worth
+ * it, split them between the directory workers and this thread; return
+ * once they have all been checked. */
+void
+sig_check_batch_run(sig_check_batch_t *batch)
+{
+  sig_check_job_t *jobs;
+  dir_worker_state_t ws;
+  workqueue_t *wq = NULL;
+  int n = smartlist_len(batch->checks);
+  int n_threads = 0, n_jobs, n_waiting = 0, i;
+
+  n_jobs = n / MIN_SIG_CHECKS_PER_JOB;
+  if (n_jobs >= 2)
+    wq = cpuworker_get_dir_queue(&n_threads);
+  if (!wq)
+    n_jobs = 1;
+  else if (n_jobs > n_threads + 1)
+    n_jobs = n_threads + 1;
+
+  memset(&ws, 0, sizeof(ws));
+  jobs = tor_malloc_zero(sizeof(sig_check_job_t) * n_jobs);
+  for (i = 0; i < n_jobs; ++i) {
+    int first = (int)((int64_t)n * i / n_jobs);
+    int last = (int)((int64_t)n * (i+1) / n_jobs);
+    jobs[i].checks = ((sig_check_t **)batch->checks->list) + first;
+    jobs[i].n_checks = last - first;
+    jobs[i].base.work_fn = sig_check_job_work;
+    jobs[i].base.reply_fn = sig_check_job_reply;
   }
 
-  if (1) {
-    if (num_cpuworkers_busy == num_cpuworkers) {
-      log_debug(LD_OR,"No idle cpuworkers. Queuing.");
-      if (onion_pending_add(circ, onionskin) < 0) {
-        tor_free(onionskin);
-        return -1;
-      }
-      return 0;
+  /* Hand out every run but the first, which we check ourselves.  Any run
+   * the queue won't take, we check here too. */
+  for (i = 1; i < n_jobs; ++i) {
+    if (workqueue_add(wq, &jobs[i].base) == 0)
+      ++n_waiting;
+  }
+  sig_check_job_run(&jobs[0], &ws);
+  jobs[0].completed = 1;
+  while (n_waiting)
+    n_waiting -= workqueue_wait_for_replies(wq);
+  for (i = 1; i < n_jobs; ++i) {
+    if (!jobs[i].completed)
+      sig_check_job_run(&jobs[i], &ws);
+  }
+
+  tor_free(ws.buf);
+  tor_free(jobs);
+}
+
+/** Return the pool that checks signatures for sig_check_batch_run_async(),
+ * starting it if we haven't yet, and set *<b>n_threads_out</b> to how many
+ * threads it has.  Unlike the directory workers, it gets a thread even when
+ * we have only one CPU: the point is to keep the main loop going, not to
+ * finish sooner.  Return NULL if we couldn't start it. */
+workqueue_t *
+sig_check_get_queue(int *n_threads_out)
+{
+  static int failed = 0;
+  if (!sig_check_queue && !failed) {
+    int n_threads = get_num_cpus(get_options()) - 1;
+    if (n_threads > MAX_DIR_WORKERS)
+      n_threads = MAX_DIR_WORKERS;
+    if (n_threads < 1)
+      n_threads = 1;
+    sig_check_queue = workqueue_new(tor_libevent_get_base(), n_threads,
+                                    n_threads * SIG_CHECK_JOBS_PER_THREAD,
+                                    dir_worker_state_new,
+                                    dir_worker_state_free, NULL);
+    if (!sig_check_queue) {
+      log_info(LD_GENERAL, "Couldn't start signature checking threads; "
+               "checking signatures on the main thread.");
+      failed = 1;
+      return NULL;
     }
+    sig_check_n_threads = n_threads;
+    log_info(LD_DIR, "Started %d signature checking threads.", n_threads);
+  }
+  *n_threads_out = sig_check_n_threads;
+  return sig_check_queue;
+}
 
-    if (!cpuworker)
-      cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                               CPUWORKER_STATE_IDLE);
+/** Note that a job from the asynchronous batch <b>batch</b> is done, or
+ * never ran if <b>completed</b> is false.  If it was the last job out,
+ * tell the batch's owner. */
+static void
+sig_check_batch_job_done(sig_check_batch_t *batch, int completed)
+{
+  if (!completed)
+    batch->aborted = 1;
+  tor_assert(batch->n_jobs_pending > 0);
+  if (--batch->n_jobs_pending)
+    return;
+  tor_free(batch->jobs);
+  batch->done_fn(batch, !batch->aborted, batch->done_arg);
+}
 
-    tor_assert(cpuworker);
+/** Workqueue reply function for sig_check_batch_run_async().  A reply that
+ * comes while we shut the pool down counts as aborted, whether or not the
+ * job ran. */
+static void
+sig_check_job_async_reply(workqueue_job_t *_job, int completed)
+{
+  sig_check_batch_job_done(((sig_check_job_t *)_job)->batch,
+                           completed && !sig_check_shutting_down);
+}
 
-    if (!circ->p_conn) {
-      log_info(LD_OR,"circ->p_conn gone. Failing circ.");
-      tor_free(onionskin);
-      return -1;
+/** Check every signature in <b>batch</b> on the signature checking pool,
+ * without waiting for the verdicts.  Once they are all in, call
+ * <b>done_fn</b>(<b>batch</b>, <b>completed</b>, <b>arg</b>) from the main
+ * loop.  <b>completed</b> is false if some signatures were never checked,
+ * because we are shutting down: then the callback should drop whatever it
+ * was going to do, since most of Tor may already be gone.  The callback
+ * owns the batch and must free it.
+ *
+ * If we can't hand a run of signatures to the pool, we check it here, so
+ * <b>done_fn</b> may be called before this function returns. */
+void
+sig_check_batch_run_async(sig_check_batch_t *batch,
+                          sig_check_batch_done_fn done_fn, void *arg)
+{
+  dir_worker_state_t ws;
+  workqueue_t *wq;
+  int n = smartlist_len(batch->checks);
+  int n_threads = 0, n_jobs, i;
+
+  tor_assert(!batch->n_jobs_pending);
+  batch->done_fn = done_fn;
+  batch->done_arg = arg;
+  batch->aborted = 0;
+
+  wq = n ? sig_check_get_queue(&n_threads) : NULL;
+  n_jobs = n / MIN_SIG_CHECKS_PER_JOB;
+  if (n_jobs > n_threads)
+    n_jobs = n_threads;
+  if (n_jobs < 1)
+    n_jobs = 1;
+
+  batch->jobs = tor_malloc_zero(sizeof(sig_check_job_t) * n_jobs);
+  /* Count every job as out before handing any of them over, so that the
+   * callback can't run until we're done here. */
+  batch->n_jobs_pending = n_jobs + 1;
+  memset(&ws, 0, sizeof(ws));
+  for (i = 0; i < n_jobs; ++i) {
+    sig_check_job_t *job = &batch->jobs[i];
+    int first = (int)((int64_t)n * i / n_jobs);
+    int last = (int)((int64_t)n * (i+1) / n_jobs);
+    job->batch = batch;
+    job->checks = ((sig_check_t **)batch->checks->list) + first;
+    job->n_checks = last - first;
+    job->base.work_fn = sig_check_job_work;
+    job->base.reply_fn = sig_check_job_async_reply;
+    if (!wq || workqueue_add(wq, &job->base) < 0) {
+      sig_check_job_run(job, &ws);
+      sig_check_batch_job_done(batch, 1);
     }
-    tag_pack(tag, circ->p_conn->_base.global_identifier,
-             circ->p_circ_id);
-
-    cpuworker->state = CPUWORKER_STATE_BUSY_ONION;
-    /* touch the lastwritten timestamp, since that's how we check to
-     * see how long it's been since we asked the question, and sometimes
-     * we check before the first call to connection_handle_write(). */
-    cpuworker->timestamp_lastwritten = time(NULL);
-    num_cpuworkers_busy++;
-
-    qbuf[0] = CPUWORKER_TASK_ONION;
-    connection_write_to_buf(qbuf, 1, cpuworker);
-    connection_write_to_buf(tag, sizeof(tag), cpuworker);
-    connection_write_to_buf(onionskin, ONIONSKIN_CHALLENGE_LEN, cpuworker);
-    tor_free(onionskin);
   }
-  return 0;
+  tor_free(ws.buf);
+  /* This one is for ourselves. */
+  sig_check_batch_job_done(batch, 1);
 }
-
@@ -14,12 +14,35 @@
 
 void cpu_init(void);
 void cpuworkers_rotate(void);
-int connection_cpu_finished_flushing(connection_t *conn);
-int connection_cpu_reached_eof(connection_t *conn);
-int connection_cpu_process_inbuf(connection_t *conn);
-int assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                                  or_circuit_t *circ,
+void cpuworkers_free_all(void);
+int assign_onionskin_to_cpuworker(or_circuit_t *circ,
                                   char *onionskin);
+void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
+
+struct workqueue_t *cpuworker_get_dir_queue(int *n_threads_out);
+
+/** A batch of signatures to check at once on the directory workers. */
+typedef struct sig_check_batch_t sig_check_batch_t;
+sig_check_batch_t *sig_check_batch_new(void);
+void sig_check_batch_free(sig_check_batch_t *batch);
+int sig_check_batch_add(sig_check_batch_t *batch,
+                        const char *digest, size_t digest_len,
+                        const char *signature, size_t signature_len,
+                        crypto_pk_t *key);
+int sig_check_batch_len(const sig_check_batch_t *batch);
+int sig_check_batch_is_ok(const sig_check_batch_t *batch, int idx);
+void sig_check_batch_run(sig_check_batch_t *batch);
+/** Called by sig_check_batch_run_async() once every signature in
+ * <b>batch</b> has been checked, or once we've given up on it if
+ * <b>completed</b> is false. */
+typedef void (*sig_check_batch_done_fn)(sig_check_batch_t *batch,
+                                        int completed, void *arg);
+void sig_check_batch_run_async(sig_check_batch_t *batch,
+                               sig_check_batch_done_fn done_fn, void *arg);
+
+#ifdef CPUWORKER_PRIVATE
+struct workqueue_t *sig_check_get_queue(int *n_threads_out);
+#endif
 
 #endif
 
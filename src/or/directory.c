@@ -118,6 +118,10 @@ static void directory_initiate_command_rend(const char *address,
 #define ROBOTS_CACHE_LIFETIME (24*60*60)
 #define MICRODESC_CACHE_LIFETIME (48*60*60)
 
+/** URL prefix under which we serve diffs from recent consensuses to the
+ * current one. */
+#define CONSENSUS_DIFF_URL_PREFIX "/tor/status-vote/current/consensus-diff/"
+
 /********* END VARIABLES ************/
 
 /** Return true iff the directory purpose <b>dir_purpose</b> (and if it's
@@ -1180,7 +1184,19 @@ directory_send_command(dir_connection_t *conn,
       /* resource is optional.  If present, it's a flavor name */
       tor_assert(!payload);
       httpcommand = "GET";
-      url = directory_get_consensus_url(resource);
+      {
+        char base_digest[DIGEST256_LEN];
+        if (networkstatus_get_consensus_diff_base(resource,
+                                                  base_digest) == 0) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex), base_digest, DIGEST256_LEN);
+          tor_asprintf(&url, CONSENSUS_DIFF_URL_PREFIX "%s/%s.z",
+                       resource ? resource : "ns", hex);
+          conn->fetching_consensus_diff = 1;
+        } else {
+          url = directory_get_consensus_url(resource);
+        }
+      }
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
       break;
@@ -1515,41 +1531,150 @@ body_is_plausible(const char *body, size_t len, int purpose)
   }
 }
 
+/** What is left to do for a fetch of router descriptors once their
+ * signatures have been checked: see load_downloaded_routers(). */
+typedef struct downloaded_routers_t {
+  /** The digests that we asked for and haven't got yet, or NULL. */
+  smartlist_t *which;
+  /** How many digests we asked for. */
+  int n_asked_for;
+  /** As for load_downloaded_routers(). */
+  int descriptor_digests;
+  int router_purpose;
+  /** The HTTP status of the response. */
+  int status_code;
+  /** The directory server we got them from, for the log. */
+  char *address;
+  uint16_t port;
+} downloaded_routers_t;
+
+/** Callback for router_load_routers_from_string_async(): the router
+ * descriptors from the fetch in the downloaded_routers_t <b>arg</b> are
+ * in, and <b>n_added</b> of them were new.  Note our progress, and mark
+ * the ones that we asked for and didn't get as failed. */
+static void
+load_downloaded_routers_done(int n_added, void *arg)
+{
+  downloaded_routers_t *dl = arg;
+
+  if (n_added >= 0) {
+    control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                            count_loading_descriptors_progress());
+    if (n_added)
+      directory_info_has_arrived(time(NULL), 0);
+    if (dl->which) { /* mark remaining ones as failed */
+      log_info(LD_DIR, "Received %d/%d router descriptors requested "
+               "from %s:%d", dl->n_asked_for - smartlist_len(dl->which),
+               dl->n_asked_for, dl->address, (int)dl->port);
+      if (smartlist_len(dl->which)) {
+        dir_routerdesc_download_failed(dl->which, dl->status_code,
+                                       dl->router_purpose, 0,
+                                       dl->descriptor_digests);
+      }
+    }
+  }
+  if (dl->which) {
+    SMARTLIST_FOREACH(dl->which, char *, cp, tor_free(cp));
+    smartlist_free(dl->which);
+  }
+  tor_free(dl->address);
+  tor_free(dl);
+}
+
 /** Called when we've just fetched a bunch of router descriptors in
- * <b>body</b>.  The list <b>which</b>, if present, holds digests for
- * descriptors we requested: descriptor digests if <b>descriptor_digests</b>
- * is true, or identity digests otherwise.  Parse the descriptors, validate
- * them, and annotate them as having purpose <b>purpose</b> and as having been
- * downloaded from <b>source</b>.
- *
- * Return the number of routers actually added. */
-static int
-load_downloaded_routers(const char *body, smartlist_t *which,
-                        int descriptor_digests,
-                        int router_purpose,
-                        const char *source)
+ * <b>body</b> from <b>conn</b>.  The list <b>which</b>, if present, holds
+ * the <b>n_asked_for</b> digests for descriptors we requested: descriptor
+ * digests if <b>descriptor_digests</b> is true, or identity digests
+ * otherwise.  Parse the descriptors, and annotate them as having purpose
+ * <b>conn</b>-&gt;router_purpose and as having been downloaded from
+ * <b>conn</b>.  Then validate them and add them without holding up the main
+ * loop, and mark the ones in <b>which</b> that we didn't get as failed.  We
+ * take ownership of <b>which</b>. */
+static void
+load_downloaded_routers(const char *body, dir_connection_t *conn,
+                        smartlist_t *which, int n_asked_for,
+                        int descriptor_digests, int status_code)
 {
   char buf[256];
   char time_buf[ISO_TIME_LEN+1];
-  int added = 0;
+  int router_purpose = conn->router_purpose;
   int general = router_purpose == ROUTER_PURPOSE_GENERAL;
+  downloaded_routers_t *dl = tor_malloc_zero(sizeof(downloaded_routers_t));
   format_iso_time(time_buf, time(NULL));
-  tor_assert(source);
+
+  dl->which = which;
+  dl->n_asked_for = n_asked_for;
+  dl->descriptor_digests = descriptor_digests;
+  dl->router_purpose = router_purpose;
+  dl->status_code = status_code;
+  dl->address = tor_strdup(conn->_base.address);
+  dl->port = conn->_base.port;
 
   if (tor_snprintf(buf, sizeof(buf),
                    "@downloaded-at %s\n"
                    "@source %s\n"
-                   "%s%s%s", time_buf, escaped(source),
+                   "%s%s%s", time_buf, escaped(conn->_base.address),
                    !general ? "@purpose " : "",
                    !general ? router_purpose_to_string(router_purpose) : "",
-                   !general ? "\n" : "")<0)
-    return added;
+                   !general ? "\n" : "")<0) {
+    load_downloaded_routers_done(0, dl);
+    return;
+  }
+
+  router_load_routers_from_string_async(body, NULL, which,
+                                        descriptor_digests, buf,
+                                        load_downloaded_routers_done, dl);
+}
+
+/** A consensus that we have fetched, whose signatures are being checked:
+ * see load_downloaded_consensus_done(). */
+typedef struct downloaded_consensus_t {
+  /** The flavor we asked for. */
+  char *flavname;
+  /** The directory server we got it from. */
+  char *address;
+  uint16_t port;
+  char identity_digest[DIGEST_LEN];
+  /** True iff we built it from a consensus diff. */
+  unsigned int was_diff:1;
+} downloaded_consensus_t;
+
+/** Callback for networkstatus_set_current_consensus_async(): we're done
+ * with the consensus fetch in the downloaded_consensus_t <b>arg</b>, and
+ * trying to make it our current consensus returned <b>result</b>.  If that
+ * worked, fetch what it tells us to; if not, note the failure as
+ * connection_dir_request_failed() would have, had we known before the
+ * connection closed. */
+static void
+load_downloaded_consensus_done(int completed, int result, void *arg)
+{
+  downloaded_consensus_t *dc = arg;
+  time_t now = time(NULL);
+
+  if (!completed) {
+    /* We're shutting down. */
+  } else if (result < 0) {
+    log_fn(result<-1?LOG_WARN:LOG_INFO, LD_DIR,
+           "Unable to load %s consensus directory downloaded from "
+           "server '%s:%d'. I'll try again soon.",
+           dc->flavname, dc->address, dc->port);
+    if (dc->was_diff)
+      networkstatus_consensus_diff_failed(dc->flavname);
+    if (!entry_list_is_constrained(get_options()))
+      router_set_status(dc->identity_digest, 0); /* don't try him again */
+    networkstatus_consensus_download_failed(0, dc->flavname);
+  } else {
+    /* launches router downloads as needed */
+    routers_update_all_from_networkstatus(now, 3);
+    update_microdescs_from_networkstatus(now);
+    update_microdesc_downloads(now);
+    directory_info_has_arrived(now, 0);
+    log_info(LD_DIR, "Successfully loaded consensus.");
+  }
 
-  added = router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
-                                  descriptor_digests, buf);
-  control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
-                          count_loading_descriptors_progress());
-  return added;
+  tor_free(dc->flavname);
+  tor_free(dc->address);
+  tor_free(dc);
 }
 
 /** We are a client, and we've finished reading the server's
@@ -1802,8 +1927,17 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
   if (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
-    int r;
     const char *flavname = conn->requested_resource;
+    if (conn->fetching_consensus_diff && status_code != 200) {
+      log_info(LD_DIR, "Received http status code %d (%s) from server "
+               "'%s:%d' while fetching a consensus diff.  I'll fetch the "
+               "whole consensus instead.", status_code, escaped(reason),
+               conn->_base.address, conn->_base.port);
+      tor_free(body); tor_free(headers); tor_free(reason);
+      networkstatus_consensus_diff_failed(flavname);
+      networkstatus_consensus_download_failed(0, flavname);
+      return -1;
+    }
     if (status_code != 200) {
       int severity = (status_code == 304) ? LOG_INFO : LOG_WARN;
       log(severity, LD_DIR,
@@ -1817,21 +1951,35 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->_base.address, conn->_base.port);
-    if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
-      log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
-             "Unable to load %s consensus directory downloaded from "
-             "server '%s:%d'. I'll try again soon.",
-             flavname, conn->_base.address, conn->_base.port);
-      tor_free(body); tor_free(headers); tor_free(reason);
-      networkstatus_consensus_download_failed(0, flavname);
-      return -1;
+    if (conn->fetching_consensus_diff) {
+      char *consensus = networkstatus_apply_consensus_diff(flavname, body);
+      if (!consensus) {
+        log_info(LD_DIR, "Couldn't apply the consensus diff from server "
+                 "'%s:%d'.  I'll fetch the whole consensus instead.",
+                 conn->_base.address, conn->_base.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_diff_failed(flavname);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      tor_free(body);
+      body = consensus;
+      body_len = strlen(body);
+    }
+    {
+      downloaded_consensus_t *dc =
+        tor_malloc_zero(sizeof(downloaded_consensus_t));
+      dc->flavname = tor_strdup(flavname);
+      dc->address = tor_strdup(conn->_base.address);
+      dc->port = conn->_base.port;
+      memcpy(dc->identity_digest, conn->identity_digest, DIGEST_LEN);
+      dc->was_diff = conn->fetching_consensus_diff;
+      /* We hear back in load_downloaded_consensus_done(). */
+      networkstatus_set_current_consensus_async(body, flavname, 0,
+                                           load_downloaded_consensus_done,
+                                           dc);
+      body = NULL;
     }
-    /* launches router downloads as needed */
-    routers_update_all_from_networkstatus(now, 3);
-    update_microdescs_from_networkstatus(now);
-    update_microdesc_downloads(now);
-    directory_info_has_arrived(now, 0);
-    log_info(LD_DIR, "Successfully loaded consensus.");
   }
 
   if (conn->_base.purpose == DIR_PURPOSE_FETCH_CERTIFICATE) {
@@ -1957,10 +2105,11 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       } else {
         //router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
         //                       descriptor_digests, conn->router_purpose);
-        if (load_downloaded_routers(body, which, descriptor_digests,
-                                conn->router_purpose,
-                                conn->_base.address))
-          directory_info_has_arrived(now, 0);
+        load_downloaded_routers(body, conn, which, n_asked_for,
+                                descriptor_digests, status_code);
+        /* load_downloaded_routers() marks the ones we didn't get once
+         * it has checked the ones we did. */
+        which = NULL;
       }
     }
     if (which) { /* mark remaining ones as failed */
@@ -2741,6 +2890,40 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     goto done;
   }
 
+  if (!strcmpstart(url, CONSENSUS_DIFF_URL_PREFIX)) {
+    /* consensus diff fetch: .../consensus-diff/FLAVOR/HEXDIGEST */
+    const char *flavor = url + strlen(CONSENSUS_DIFF_URL_PREFIX);
+    const char *hex = strchr(flavor, '/');
+    char digest[DIGEST256_LEN];
+    char *flavor_name;
+    cached_dir_t *d = NULL;
+    if (hex && strlen(hex+1) == HEX_DIGEST256_LEN &&
+        base16_decode(digest, sizeof(digest), hex+1, HEX_DIGEST256_LEN)==0) {
+      flavor_name = tor_strndup(flavor, hex-flavor);
+      d = dirserv_get_consensus_diff(flavor_name, digest);
+      tor_free(flavor_name);
+    }
+    if (!d) {
+      write_http_status_line(conn, 404, "Not found");
+      goto done;
+    }
+    dlen = compressed ? d->dir_z_len : d->dir_len;
+    if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
+      log_info(LD_DIRSERV,
+               "Client asked for a consensus diff, but we've been "
+               "writing too many bytes lately. Sending 503 Dir busy.");
+      write_http_status_line(conn, 503, "Directory busy, try again later");
+      goto done;
+    }
+    note_request(compressed ? "/tor/status-vote/current/consensus-diff.z" :
+                 "/tor/status-vote/current/consensus-diff", dlen);
+    write_http_response_header(conn, dlen, compressed,
+                               NETWORKSTATUS_CACHE_LIFETIME);
+    connection_write_to_buf(compressed ? d->dir_z : d->dir, dlen,
+                            TO_CONN(conn));
+    goto done;
+  }
+
   if (!strcmpstart(url,"/tor/status/")
       || !strcmpstart(url, "/tor/status-vote/current/consensus")) {
     /* v2 or v3 network status fetch. */
@@ -3075,7 +3258,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       }
       write_http_response_header(conn, -1, compressed, cache_lifetime);
       if (compressed)
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
+        connection_dirserv_start_precompressed_spool(conn);
       /* Prime the connection with some data. */
       connection_dirserv_flushed_some(conn);
     }
@@ -10,6 +10,7 @@
 #include "confparse.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -24,6 +25,17 @@
 #include "routerlist.h"
 #include "routerparse.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) && \
+  defined(HAVE_SYS_MMAN_H) && !defined(USE_BUFFEREVENTS)
+/** Defined if we can send cached directory objects straight from their
+ * files to a socket with sendfile(). */
+#define USE_SENDFILE
+#endif
+
 /**
  * \file dirserv.c
  * \brief Directory server core implementation. Manages directory
@@ -1353,6 +1365,23 @@ static digestmap_t *cached_v2_networkstatus = NULL;
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** One consensus that we used to serve, along with a diff from it to the
+ * consensus of the same flavor that we're serving now. */
+typedef struct consensus_history_entry_t {
+  /** SHA256 digest of the whole text of the old consensus. */
+  char digest[DIGEST256_LEN];
+  /** The whole text of the old consensus. */
+  char *body;
+  /** A diff from <b>body</b> to the current consensus, or NULL if we
+   * couldn't make one. */
+  cached_dir_t *diff;
+} consensus_history_entry_t;
+
+/** Map from flavor name to a smartlist of consensus_history_entry_t for the
+ * last CachedConsensusDiffs consensuses of that flavor we served, most
+ * recent first. */
+static strmap_t *consensus_histories = NULL;
+
 /** Possibly replace the contents of <b>d</b> with the value of
  * <b>directory</b> published on <b>when</b>, unless <b>when</b> is older than
  * the last value, or too far in the future.
@@ -1402,6 +1431,7 @@ new_cached_dir(char *s, time_t published)
 {
   cached_dir_t *d = tor_malloc_zero(sizeof(cached_dir_t));
   d->refcnt = 1;
+  d->dir_z_fd = -1;
   d->dir = s;
   d->dir_len = strlen(s);
   d->published = published;
@@ -1417,10 +1447,56 @@ static void
 clear_cached_dir(cached_dir_t *d)
 {
   tor_free(d->dir);
-  tor_free(d->dir_z);
+  if (d->dir_z_map) {
+    tor_munmap_file(d->dir_z_map);
+    if (d->dir_z_fd >= 0)
+      close(d->dir_z_fd);
+    d->dir_z = NULL;
+  } else {
+    tor_free(d->dir_z);
+  }
   memset(d, 0, sizeof(cached_dir_t));
 }
 
+/** Write the compressed contents of <b>d</b> to <b>fname</b>, and serve
+ * them from a mapping of that file instead of from the heap.  If we can
+ * sendfile(), also keep the file open so that unencrypted connections can
+ * be fed straight from it.  On failure, leave <b>d</b> as it was. */
+static void
+cached_dir_move_to_disk(cached_dir_t *d, const char *fname)
+{
+#ifdef HAVE_SYS_MMAN_H
+  tor_mmap_t *map;
+  if (!d->dir_z || d->dir_z_map)
+    return;
+  /* write_bytes_to_file() replaces the old file with a rename, so anybody
+   * still spooling an older object from its mapping keeps seeing it. */
+  if (write_bytes_to_file(fname, d->dir_z, d->dir_z_len, 1) < 0) {
+    log_info(LD_DIRSERV, "Couldn't write compressed object to %s; serving "
+             "it from memory.", escaped(fname));
+    return;
+  }
+  map = tor_mmap_file(fname);
+  if (!map || map->size != d->dir_z_len ||
+      fast_memneq(map->data, d->dir_z, d->dir_z_len)) {
+    log_info(LD_DIRSERV, "Couldn't map compressed object from %s; serving "
+             "it from memory.", escaped(fname));
+    if (map)
+      tor_munmap_file(map);
+    return;
+  }
+#ifdef USE_SENDFILE
+  d->dir_z_fd = tor_open_cloexec(fname, O_RDONLY, 0);
+#endif
+  tor_free(d->dir_z);
+  d->dir_z = (char *)map->data;
+  d->dir_z_map = map;
+#else
+  (void)d;
+  (void)fname;
+#endif
+}
+
 /** Free all storage held by the cached_dir_t in <b>d</b>. */
 static void
 _free_cached_dir(void *_d)
@@ -1523,6 +1599,98 @@ dirserv_set_cached_networkstatus_v2(const char *networkstatus,
   }
 }
 
+/** Release all storage held in <b>ent</b>. */
+static void
+consensus_history_entry_free(consensus_history_entry_t *ent)
+{
+  if (!ent)
+    return;
+  tor_free(ent->body);
+  if (ent->diff)
+    cached_dir_decref(ent->diff);
+  tor_free(ent);
+}
+
+/** Helper: free a smartlist of consensus_history_entry_t. */
+static void
+_consensus_history_free(void *_hist)
+{
+  smartlist_t *hist = _hist;
+  SMARTLIST_FOREACH(hist, consensus_history_entry_t *, ent,
+                    consensus_history_entry_free(ent));
+  smartlist_free(hist);
+}
+
+/** We're about to replace the consensus of flavor <b>flavor_name</b> whose
+ * text is <b>old_body</b> (if any) with <b>new_body</b>, published at
+ * <b>published</b>.  Remember <b>old_body</b>, forget all but the
+ * CachedConsensusDiffs most recent consensuses we've served, and recompute
+ * the diff from each of those to <b>new_body</b>. */
+static void
+consensus_history_update(const char *flavor_name, const char *old_body,
+                         const char *new_body, time_t published)
+{
+  const int max_entries = get_options()->CachedConsensusDiffs;
+  char new_digest[DIGEST256_LEN];
+  smartlist_t *hist;
+  int i;
+
+  if (!consensus_histories)
+    consensus_histories = strmap_new();
+  hist = strmap_get(consensus_histories, flavor_name);
+  if (!hist) {
+    hist = smartlist_new();
+    strmap_set(consensus_histories, flavor_name, hist);
+  }
+
+  crypto_digest256(new_digest, new_body, strlen(new_body), DIGEST_SHA256);
+
+  if (old_body && max_entries > 0) {
+    consensus_history_entry_t *ent =
+      tor_malloc_zero(sizeof(consensus_history_entry_t));
+    crypto_digest256(ent->digest, old_body, strlen(old_body), DIGEST_SHA256);
+    ent->body = tor_strdup(old_body);
+    smartlist_insert(hist, 0, ent);
+  }
+
+  /* Drop anything too old, and anything that is the same document as
+   * something more recent. */
+  for (i = 0; i < smartlist_len(hist); ++i) {
+    consensus_history_entry_t *ent = smartlist_get(hist, i);
+    int j, drop = (i >= max_entries) ||
+      tor_memeq(ent->digest, new_digest, DIGEST256_LEN);
+    for (j = 0; j < i && !drop; ++j) {
+      consensus_history_entry_t *newer = smartlist_get(hist, j);
+      if (tor_memeq(newer->digest, ent->digest, DIGEST256_LEN))
+        drop = 1;
+    }
+    if (drop) {
+      consensus_history_entry_free(ent);
+      smartlist_del_keeporder(hist, i--);
+    }
+  }
+
+  SMARTLIST_FOREACH_BEGIN(hist, consensus_history_entry_t *, ent) {
+    char *diff;
+    if (ent->diff) {
+      cached_dir_decref(ent->diff);
+      ent->diff = NULL;
+    }
+    diff = consdiff_generate(ent->body, new_body);
+    if (diff) {
+      ent->diff = new_cached_dir(diff, published);
+    } else {
+      log_info(LD_DIRSERV, "Couldn't generate a %s consensus diff; clients "
+               "with that consensus will fetch the whole thing.",
+               flavor_name);
+    }
+  } SMARTLIST_FOREACH_END(ent);
+
+  if (smartlist_len(hist))
+    log_info(LD_DIRSERV, "Serving %s consensus diffs from %d older "
+             "consensuses.", flavor_name, smartlist_len(hist));
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
  * validation is performed. */
@@ -1539,8 +1707,23 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
 
   new_networkstatus = new_cached_dir(tor_strdup(networkstatus), published);
   memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
-  old_networkstatus = strmap_set(cached_consensuses, flavor_name,
-                                 new_networkstatus);
+  {
+    char *fname;
+    if (!strcmp(flavor_name, "ns")) {
+      fname = get_datadir_fname("cached-consensus.z");
+    } else {
+      char buf[128];
+      tor_snprintf(buf, sizeof(buf), "cached-%s-consensus.z", flavor_name);
+      fname = get_datadir_fname(buf);
+    }
+    cached_dir_move_to_disk(new_networkstatus, fname);
+    tor_free(fname);
+  }
+  old_networkstatus = strmap_get(cached_consensuses, flavor_name);
+  consensus_history_update(flavor_name,
+                           old_networkstatus ? old_networkstatus->dir : NULL,
+                           networkstatus, published);
+  strmap_set(cached_consensuses, flavor_name, new_networkstatus);
   if (old_networkstatus)
     cached_dir_decref(old_networkstatus);
 }
@@ -1733,6 +1916,25 @@ dirserv_get_consensus(const char *flavor_name)
   return strmap_get(cached_consensuses, flavor_name);
 }
 
+/** Return a diff, suitable for sending to clients, from the consensus of
+ * flavor <b>flavor_name</b> whose text has the SHA256 digest
+ * <b>digest256</b> to the latest consensus of that flavor.  Return NULL if
+ * we don't have one. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *digest256)
+{
+  smartlist_t *hist;
+  if (!consensus_histories)
+    return NULL;
+  hist = strmap_get(consensus_histories, flavor_name);
+  if (!hist)
+    return NULL;
+  SMARTLIST_FOREACH(hist, consensus_history_entry_t *, ent,
+    if (tor_memeq(ent->digest, digest256, DIGEST256_LEN))
+      return ent->diff);
+  return NULL;
+}
+
 /** For authoritative directories: the current (v2) network status. */
 static cached_dir_t *the_v2_networkstatus = NULL;
 
@@ -3620,6 +3822,130 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
  * below this threshold. */
 #define DIRSERV_BUFFER_MIN 16384
 
+/** How long do we keep a precompressed descriptor that nobody has asked
+ * for? */
+#define PRECOMPRESSED_DESC_MAX_IDLE (60*60)
+
+/** A server descriptor or extra-info document, compressed once with
+ * tor_zlib_compress_segment() so that we can splice it into any compressed
+ * response without compressing it again. */
+typedef struct precompressed_desc_t {
+  char *body; /**< The compressed segment. */
+  size_t body_len; /**< Length of <b>body</b>. */
+  size_t plain_len; /**< Length of the descriptor before compression. */
+  uint32_t adler; /**< Adler-32 checksum of the uncompressed descriptor. */
+  time_t last_served; /**< When did we last spool this segment? */
+} precompressed_desc_t;
+
+/** Map from descriptor digest to precompressed_desc_t, for every server
+ * descriptor and extra-info document we've recently served compressed. */
+static digestmap_t *precompressed_descs = NULL;
+/** Total length of all the segments in precompressed_descs. */
+static size_t precompressed_descs_len = 0;
+
+/** Release all storage held in <b>pd</b>. */
+static void
+precompressed_desc_free(precompressed_desc_t *pd)
+{
+  if (!pd)
+    return;
+  tor_free(pd->body);
+  tor_free(pd);
+}
+
+/** Helper: free a precompressed_desc_t stored in a map. */
+static void
+_precompressed_desc_free(void *pd)
+{
+  precompressed_desc_free(pd);
+}
+
+/** Return the precompressed segment for <b>sd</b>, compressing and caching
+ * it first if we don't have it yet.  Return NULL if we can't get at the
+ * descriptor body or can't compress it. */
+static const precompressed_desc_t *
+dirserv_get_precompressed_desc(const signed_descriptor_t *sd, time_t now)
+{
+  precompressed_desc_t *pd;
+  const char *body;
+
+  if (!precompressed_descs)
+    precompressed_descs = digestmap_new();
+
+  pd = digestmap_get(precompressed_descs, sd->signed_descriptor_digest);
+  if (pd && pd->plain_len == sd->signed_descriptor_len) {
+    pd->last_served = now;
+    return pd;
+  }
+
+  body = signed_descriptor_get_body(sd);
+  if (!body)
+    return NULL;
+  if (pd) {
+    precompressed_descs_len -= pd->body_len;
+    tor_free(pd->body);
+  } else {
+    pd = tor_malloc_zero(sizeof(precompressed_desc_t));
+    digestmap_set(precompressed_descs, sd->signed_descriptor_digest, pd);
+  }
+  if (tor_zlib_compress_segment(&pd->body, &pd->body_len, &pd->adler,
+                                body, sd->signed_descriptor_len) < 0) {
+    digestmap_remove(precompressed_descs, sd->signed_descriptor_digest);
+    precompressed_desc_free(pd);
+    return NULL;
+  }
+  pd->plain_len = sd->signed_descriptor_len;
+  pd->last_served = now;
+  precompressed_descs_len += pd->body_len;
+  return pd;
+}
+
+/** Forget every precompressed descriptor that we haven't served since
+ * PRECOMPRESSED_DESC_MAX_IDLE seconds before <b>now</b>.  Descriptors we no
+ * longer have stop being served, so this is what removes them too. */
+void
+dirserv_clean_precompressed_descs(time_t now)
+{
+  time_t cutoff = now - PRECOMPRESSED_DESC_MAX_IDLE;
+  if (!precompressed_descs)
+    return;
+  DIGESTMAP_FOREACH_MODIFY(precompressed_descs, digest,
+                           precompressed_desc_t *, pd) {
+    if (pd->last_served < cutoff) {
+      precompressed_descs_len -= pd->body_len;
+      precompressed_desc_free(pd);
+      MAP_DEL_CURRENT(digest);
+    }
+  } DIGESTMAP_FOREACH_END;
+  log_debug(LD_DIRSERV, "%d precompressed descriptors cached, using %lu "
+            "bytes.", digestmap_size(precompressed_descs),
+            (unsigned long)precompressed_descs_len);
+}
+
+/** Begin a compressed response on <b>conn</b>, which is about to spool
+ * server descriptors or extra-info documents: write the start of the zlib
+ * stream, and splice precompressed descriptors in after it from now on. */
+void
+connection_dirserv_start_precompressed_spool(dir_connection_t *conn)
+{
+  char header[TOR_ZLIB_SEGMENT_HEADER_LEN];
+  tor_assert(!conn->zlib_state);
+  conn->spool_adler = tor_zlib_segment_header(header);
+  conn->spool_precompressed = 1;
+  connection_write_to_buf(header, sizeof(header), TO_CONN(conn));
+}
+
+/** Spooling helper: write the end of the zlib stream that
+ * connection_dirserv_start_precompressed_spool() began on <b>conn</b>. */
+static void
+connection_dirserv_finish_precompressed_spool(dir_connection_t *conn)
+{
+  char trailer[TOR_ZLIB_SEGMENT_TRAILER_LEN];
+  tor_zlib_segment_trailer(trailer, conn->spool_adler);
+  connection_write_to_buf(trailer, sizeof(trailer), TO_CONN(conn));
+  conn->spool_precompressed = 0;
+}
+
 /** Spooling helper: called when we have no more data to spool to <b>conn</b>.
  * Flushes any remaining data to be (un)compressed, and changes the spool
  * source to NONE.  Returns 0 on success, negative on failure. */
@@ -3648,7 +3974,8 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
                conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_FP);
   int extra = (conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_FP ||
                conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_DIGEST);
-  time_t publish_cutoff = time(NULL)-ROUTER_MAX_AGE_TO_PUBLISH;
+  time_t now = time(NULL);
+  time_t publish_cutoff = now-ROUTER_MAX_AGE_TO_PUBLISH;
 
   const or_options_t *options = get_options();
 
@@ -3684,6 +4011,17 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
       if (router && router->purpose == ROUTER_PURPOSE_BRIDGE)
         rep_hist_note_desc_served(sd->identity_digest);
     }
+    if (conn->spool_precompressed) {
+      const precompressed_desc_t *pd =
+        dirserv_get_precompressed_desc(sd, now);
+      if (!pd)
+        continue;
+      connection_write_to_buf(pd->body, pd->body_len, TO_CONN(conn));
+      conn->spool_adler = tor_zlib_segment_adler_combine(conn->spool_adler,
+                                                         pd->adler,
+                                                         pd->plain_len);
+      continue;
+    }
     body = signed_descriptor_get_body(sd);
     if (conn->zlib_state) {
       /* XXXX024 This 'last' business should actually happen on the last
@@ -3704,6 +4042,8 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
 
   if (!smartlist_len(conn->fingerprint_stack)) {
     /* We just wrote the last one; finish up. */
+    if (conn->spool_precompressed)
+      connection_dirserv_finish_precompressed_spool(conn);
     conn->dir_spool_src = DIR_SPOOL_NONE;
     smartlist_free(conn->fingerprint_stack);
     conn->fingerprint_stack = NULL;
@@ -3788,6 +4128,70 @@ connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
   return 0;
 }
 
+/** Return true iff we should send the compressed object <b>d</b> to
+ * <b>conn</b> straight from its file, rather than through the outbuf. */
+static int
+connection_dirserv_can_sendfile(const dir_connection_t *conn,
+                                const cached_dir_t *d)
+{
+#ifdef USE_SENDFILE
+  /* Linked connections are begindir tunnels: they get their bytes from the
+   * mapping instead, since those need to go through TLS anyway. */
+  return d->dir_z_map && d->dir_z_fd >= 0 && !conn->zlib_state &&
+    !conn->_base.linked && SOCKET_OK(conn->_base.s);
+#else
+  (void)conn;
+  (void)d;
+  return 0;
+#endif
+}
+
+/** Called when <b>conn</b> has flushed its outbuf and has
+ * spool_sendfile set: send up to <b>max_bytes</b> more of
+ * <b>conn</b>-\>cached_dir straight from its file.  Once it's all sent,
+ * drop the cached_dir so that the next call to
+ * connection_dirserv_flushed_some() goes on to whatever comes next.  Return
+ * the number of bytes sent, or -1 if the connection is dead. */
+ssize_t
+connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes)
+{
+#ifdef USE_SENDFILE
+  cached_dir_t *d = conn->cached_dir;
+  off_t offset = conn->cached_dir_offset;
+  size_t remaining;
+  ssize_t r;
+
+  if (!conn->spool_sendfile || !d)
+    return 0;
+  remaining = d->dir_z_len - (size_t)offset;
+  if (max_bytes > remaining)
+    max_bytes = remaining;
+  if (max_bytes) {
+    r = sendfile(conn->_base.s, d->dir_z_fd, &offset, max_bytes);
+    if (r < 0) {
+      int e = tor_socket_errno(conn->_base.s);
+      if (ERRNO_IS_EAGAIN(e))
+        return 0;
+      log_info(LD_DIRSERV, "sendfile() failed: %s", tor_socket_strerror(e));
+      return -1;
+    }
+  } else {
+    r = 0;
+  }
+  conn->cached_dir_offset = offset;
+  if ((size_t)offset == d->dir_z_len) {
+    conn->spool_sendfile = 0;
+    cached_dir_decref(d);
+    conn->cached_dir = NULL;
+  }
+  return r;
+#else
+  (void)conn;
+  (void)max_bytes;
+  return 0;
+#endif
+}
+
 /** Spooling helper: Called when we're spooling networkstatus objects on
  * <b>conn</b>, and the outbuf has become too empty.  If the current
  * networkstatus object (in <b>conn</b>-\>cached_dir) has more data, pull data
@@ -3801,7 +4205,10 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
 {
 
   while (connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
-    if (conn->cached_dir) {
+    if (conn->spool_sendfile) {
+      /* The rest of cached_dir goes out once the outbuf is empty. */
+      return 0;
+    } else if (conn->cached_dir) {
       int uncompressing = (conn->zlib_state != NULL);
       int r = connection_dirserv_add_dir_bytes_to_outbuf(conn);
       if (conn->dir_spool_src == DIR_SPOOL_NONE) {
@@ -3828,6 +4235,8 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
         ++d->refcnt;
         conn->cached_dir = d;
         conn->cached_dir_offset = 0;
+        if (connection_dirserv_can_sendfile(conn, d))
+          conn->spool_sendfile = 1;
       }
     } else {
       connection_dirserv_finish_spooling(conn);
@@ -3883,5 +4292,11 @@ dirserv_free_all(void)
   cached_v2_networkstatus = NULL;
   strmap_free(cached_consensuses, _free_cached_dir);
   cached_consensuses = NULL;
+  strmap_free(consensus_histories, _consensus_history_free);
+  consensus_histories = NULL;
+
+  digestmap_free(precompressed_descs, _precompressed_desc_free);
+  precompressed_descs = NULL;
+  precompressed_descs_len = 0;
 }
 
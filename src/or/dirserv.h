@@ -53,6 +53,9 @@
    )
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+void connection_dirserv_start_precompressed_spool(dir_connection_t *conn);
+ssize_t connection_dirserv_sendfile(dir_connection_t *conn, size_t max_bytes);
+void dirserv_clean_precompressed_descs(time_t now);
 
 int dirserv_add_own_fingerprint(const char *nickname, crypto_pk_t *pk);
 int dirserv_load_fingerprint_file(void);
@@ -87,6 +90,8 @@ void directory_set_dirty(void);
 cached_dir_t *dirserv_get_directory(void);
 cached_dir_t *dirserv_get_runningrouters(void);
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *digest256);
 void dirserv_set_cached_directory(const char *directory, time_t when,
                                   int is_running_routers);
 void dirserv_set_cached_networkstatus_v2(const char *directory,
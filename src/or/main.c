@@ -46,6 +46,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
 #include "statefile.h"
 #include "status.h"
 #ifdef USE_DMALLOC
@@ -1190,7 +1191,7 @@ run_scheduled_events(time_t now)
   flush_pending_log_callbacks();
 
   /** 1a. Every MIN_ONION_KEY_LIFETIME seconds, rotate the onion keys,
-   *  shut down and restart all cpuworkers, and update the directory if
+   *  have the cpuworkers pick up the new keys, and update the directory if
    *  necessary.
    */
   if (is_server &&
@@ -1432,6 +1433,8 @@ run_scheduled_events(time_t now)
     networkstatus_v2_list_clean(now);
     /* Remove dead routers. */
     routerlist_remove_old_routers();
+    /* Forget precompressed descriptors nobody is asking for. */
+    dirserv_clean_precompressed_descs(now);
 
     /* Also, once per minute, check whether we want to download any
      * networkstatus documents.
@@ -1624,6 +1627,7 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
 
   control_event_bandwidth_used((uint32_t)bytes_read,(uint32_t)bytes_written);
   control_event_stream_bandwidth_used();
+  control_event_circ_flowctl();
 
   if (server_mode(options) &&
       !net_is_disabled() &&
@@ -1842,8 +1846,8 @@ do_hup(void)
    * force a retry there. */
 
   if (server_mode(options)) {
-    /* Restart cpuworker and dnsworker processes, so they get up-to-date
-     * configuration options. */
+    /* Have the cpuworkers reload their keys, and restart the dnsworker
+     * processes, so they get up-to-date configuration options. */
     cpuworkers_rotate();
     dns_reset();
   }
@@ -1879,7 +1883,7 @@ do_main_loop(void)
     }
   }
 
-  /* Set up the packed_cell_t memory pool. */
+  /* Set up the memory pool for queued cells. */
   init_cell_pool();
 
   /* Set up our buckets */
@@ -2454,9 +2458,15 @@ tor_free_all(int postfork)
   dns_free_all();
   clear_pending_onions();
   circuit_free_all();
+  if (!postfork) {
+    /* Worker threads don't survive a fork. */
+    cpuworkers_free_all();
+  }
   entry_guards_free_all();
   pt_free_all();
   connection_free_all();
+  connection_or_free_all_pending_flowcontrol();
+  scheduler_free_all();
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   nodelist_free_all();
@@ -15,7 +15,9 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -95,6 +97,20 @@ static time_t last_networkstatus_download_attempted = 0;
 static time_t time_to_download_next_consensus[N_CONSENSUS_FLAVORS];
 /** Download status for the current consensus networkstatus. */
 static download_status_t consensus_dl_status[N_CONSENSUS_FLAVORS];
+/** How many consensuses that we asked for by each flavor are we checking
+ * the signatures on?  We count the flavor we asked for rather than the one
+ * we got, so that a server that sends the wrong one can't make us fetch the
+ * right one twice at once. */
+static int n_consensuses_being_checked[N_CONSENSUS_FLAVORS];
+/** SHA256 digest of the whole text of the latest consensus of each flavor
+ * that we've accepted, valid iff have_consensus_text_digest is set.  We name
+ * it when asking a directory cache for a consensus diff. */
+static char consensus_text_digest[N_CONSENSUS_FLAVORS][DIGEST256_LEN];
+/** True iff consensus_text_digest holds a digest for each flavor. */
+static int have_consensus_text_digest[N_CONSENSUS_FLAVORS];
+/** True iff our last attempt to fetch or apply a consensus diff of each
+ * flavor failed, so we should fetch the whole consensus next time. */
+static int consensus_diff_failed[N_CONSENSUS_FLAVORS];
 
 /** True iff we have logged a warning about this OR's version being older than
  * listed by the authorities. */
@@ -105,6 +121,10 @@ static int have_warned_about_new_version = 0;
 
 static void download_status_map_update_from_v2_networkstatus(void);
 static void routerstatus_list_update_named_server_map(void);
+static int networkstatus_set_current_consensus_impl(networkstatus_t *c,
+                                                    const char *consensus,
+                                                    const char *flavor,
+                                                    unsigned flags);
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -294,7 +314,7 @@ router_reload_consensus_networkstatus(void)
 }
 
 /** Free all storage held by the vote_routerstatus object <b>rs</b>. */
-static void
+void
 vote_routerstatus_free(vote_routerstatus_t *rs)
 {
   vote_microdesc_hash_t *h, *next;
@@ -432,6 +452,20 @@ networkstatus_get_voter_by_id(networkstatus_t *vote,
   return NULL;
 }
 
+/** Return true iff <b>sig</b> says it was made with the signing key in
+ * <b>cert</b>. */
+static int
+document_signature_matches_cert(const document_signature_t *sig,
+                                const authority_cert_t *cert)
+{
+  char key_digest[DIGEST_LEN];
+  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
+    return 0;
+  return tor_memeq(sig->signing_key_digest, key_digest, DIGEST_LEN) &&
+    tor_memeq(sig->identity_digest, cert->cache_info.identity_digest,
+              DIGEST_LEN);
+}
+
 /** Check whether the signature <b>sig</b> is correctly signed with the
  * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
  * signing key; otherwise set the good_signature or bad_signature flag on
@@ -441,16 +475,11 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
                                        document_signature_t *sig,
                                        const authority_cert_t *cert)
 {
-  char key_digest[DIGEST_LEN];
   const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
   char *signed_digest;
   size_t signed_digest_len;
 
-  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
-    return -1;
-  if (tor_memneq(sig->signing_key_digest, key_digest, DIGEST_LEN) ||
-      tor_memneq(sig->identity_digest, cert->cache_info.identity_digest,
-                 DIGEST_LEN))
+  if (!document_signature_matches_cert(sig, cert))
     return -1;
 
   signed_digest_len = crypto_pk_keysize(cert->signing_key);
@@ -470,6 +499,75 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
   return 0;
 }
 
+/** Add every as-yet-unchecked signature on <b>consensus</b> from a
+ * recognized authority whose certificate we have to <b>batch</b>, and its
+ * document_signature_t to <b>sigs</b> in the same order.
+ * networkstatus_check_consensus_signature() deals with the rest. */
+static void
+networkstatus_add_signatures_to_batch(networkstatus_t *consensus,
+                                      sig_check_batch_t *batch,
+                                      smartlist_t *sigs)
+{
+  time_t now = time(NULL);
+
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now ||
+          !document_signature_matches_cert(sig, cert))
+        continue;
+      sig_check_batch_add(batch, consensus->digests.d[sig->alg],
+                          sig->alg == DIGEST_SHA1 ?
+                            DIGEST_LEN : DIGEST256_LEN,
+                          sig->signature, sig->signature_len,
+                          cert->signing_key);
+      smartlist_add(sigs, sig);
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+}
+
+/** Set the good_signature or bad_signature flag on each
+ * document_signature_t in <b>sigs</b>, from the verdicts in the checked
+ * <b>batch</b> built by networkstatus_add_signatures_to_batch(). */
+static void
+networkstatus_note_signature_verdicts(const sig_check_batch_t *batch,
+                                      smartlist_t *sigs)
+{
+  SMARTLIST_FOREACH_BEGIN(sigs, document_signature_t *, sig) {
+    if (sig_check_batch_is_ok(batch, sig_sl_idx)) {
+      sig->good_signature = 1;
+    } else {
+      log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
+      sig->bad_signature = 1;
+    }
+  } SMARTLIST_FOREACH_END(sig);
+}
+
+/** Check every as-yet-unchecked signature on <b>consensus</b> from a
+ * recognized authority whose certificate we have, all at once on our
+ * directory workers, and set its good_signature or bad_signature flag.
+ * networkstatus_check_consensus_signature() deals with the rest. */
+static void
+networkstatus_check_signatures_in_parallel(networkstatus_t *consensus)
+{
+  sig_check_batch_t *batch = sig_check_batch_new();
+  smartlist_t *sigs = smartlist_new();
+
+  networkstatus_add_signatures_to_batch(consensus, batch, sigs);
+  sig_check_batch_run(batch);
+  networkstatus_note_signature_verdicts(batch, sigs);
+
+  smartlist_free(sigs);
+  sig_check_batch_free(batch);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -499,6 +597,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  networkstatus_check_signatures_in_parallel(consensus);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1249,6 +1349,8 @@ update_consensus_networkstatus_downloads(time_t now)
     if (connection_dir_get_by_purpose_and_resource(
                                 DIR_PURPOSE_FETCH_CONSENSUS, resource))
       continue; /* There's an in-progress download.*/
+    if (n_consensuses_being_checked[i])
+      continue; /* We're checking the signatures on one we downloaded. */
 
     waiting = &consensus_waiting_for_certs[i];
     if (waiting->consensus) {
@@ -1287,6 +1389,64 @@ networkstatus_consensus_download_failed(int status_code, const char *flavname)
   }
 }
 
+/** If we should ask for a diff rather than a whole consensus of flavor
+ * <b>flavname</b>, store the SHA256 digest of the consensus that we have in
+ * <b>digest_out</b> and return 0.  Otherwise return -1. */
+int
+networkstatus_get_consensus_diff_base(const char *flavname, char *digest_out)
+{
+  int flav = networkstatus_parse_flavor_name(flavname ? flavname : "ns");
+  if (flav < 0 || !get_options()->FetchConsensusDiffs)
+    return -1;
+  if (!have_consensus_text_digest[flav] || consensus_diff_failed[flav])
+    return -1;
+  memcpy(digest_out, consensus_text_digest[flav], DIGEST256_LEN);
+  return 0;
+}
+
+/** Called when we couldn't get or couldn't use a consensus diff of flavor
+ * <b>flavname</b>: fetch the whole consensus until we next accept one. */
+void
+networkstatus_consensus_diff_failed(const char *flavname)
+{
+  int flav = networkstatus_parse_flavor_name(flavname ? flavname : "ns");
+  if (flav >= 0)
+    consensus_diff_failed[flav] = 1;
+}
+
+/** Apply the consensus diff <b>diff</b> to the consensus of flavor
+ * <b>flavname</b> in our data directory, and return the newly allocated
+ * result.  The diff names the digests of the document it applies to and
+ * of the document it produces; return NULL if either doesn't match.  The
+ * caller still needs to check the signatures on the result. */
+char *
+networkstatus_apply_consensus_diff(const char *flavname, const char *diff)
+{
+  char *fname, *base, *result;
+  if (!flavname || !strcmp(flavname, "ns")) {
+    fname = get_datadir_fname("cached-consensus");
+  } else if (!strcmp(flavname, "microdesc")) {
+    fname = get_datadir_fname("cached-microdesc-consensus");
+  } else {
+    char buf[128];
+    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavname);
+    fname = get_datadir_fname(buf);
+  }
+  base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  if (!base) {
+    log_info(LD_DIR, "Couldn't read %s to apply a consensus diff to it.",
+             escaped(fname));
+    tor_free(fname);
+    return NULL;
+  }
+  result = consdiff_apply(base, diff);
+  if (!result)
+    log_info(LD_DIR, "Consensus diff didn't apply to %s.", escaped(fname));
+  tor_free(base);
+  tor_free(fname);
+  return result;
+}
+
 /** How long do we (as a cache) wait after a consensus becomes non-fresh
  * before trying to fetch another? */
 #define CONSENSUS_MIN_SECONDS_BEFORE_CACHING 120
@@ -1619,7 +1779,121 @@ networkstatus_set_current_consensus(const char *consensus,
                                     const char *flavor,
                                     unsigned flags)
 {
-  networkstatus_t *c=NULL;
+  networkstatus_t *c;
+
+  /* Make sure it's parseable. */
+  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  if (!c) {
+    log_warn(LD_DIR, "Unable to parse networkstatus consensus");
+    return -2;
+  }
+  return networkstatus_set_current_consensus_impl(c, consensus, flavor,
+                                                  flags);
+}
+
+/** A consensus that we have downloaded and parsed, and whose signatures are
+ * being checked on the signature checking threads. */
+typedef struct consensus_being_checked_t {
+  /** The consensus, and its text. */
+  networkstatus_t *consensus;
+  char *body;
+  /** As for networkstatus_set_current_consensus(). */
+  char *flavor;
+  unsigned flags;
+  /** The flavor we asked for, as counted in n_consensuses_being_checked,
+   * or -1 if we don't know it. */
+  int requested_flavor;
+  /** The signatures being checked, in the same order as in the batch. */
+  smartlist_t *sigs;
+  /** What to call once we're done with the consensus, and what to pass
+   * it. */
+  networkstatus_set_done_fn done_fn;
+  void *done_arg;
+} consensus_being_checked_t;
+
+/** Callback for sig_check_batch_run_async(): the signatures on the
+ * consensus_being_checked_t <b>arg</b> have been checked.  Try to make it
+ * our current consensus, and tell whoever downloaded it how that went. */
+static void
+consensus_sigs_checked(sig_check_batch_t *batch, int completed, void *arg)
+{
+  consensus_being_checked_t *cbc = arg;
+  int result = -1;
+
+  if (cbc->requested_flavor >= 0)
+    --n_consensuses_being_checked[cbc->requested_flavor];
+  if (completed) {
+    networkstatus_note_signature_verdicts(batch, cbc->sigs);
+    result = networkstatus_set_current_consensus_impl(cbc->consensus,
+                                                      cbc->body,
+                                                      cbc->flavor,
+                                                      cbc->flags);
+  } else {
+    networkstatus_vote_free(cbc->consensus);
+  }
+  cbc->done_fn(completed, result, cbc->done_arg);
+
+  sig_check_batch_free(batch);
+  smartlist_free(cbc->sigs);
+  tor_free(cbc->body);
+  tor_free(cbc->flavor);
+  tor_free(cbc);
+}
+
+/** As networkstatus_set_current_consensus() for a consensus that we have
+ * just downloaded, but check its signatures without making the main loop
+ * wait: we parse it at once, and decide whether to accept it once the
+ * verdicts are in.  Then call <b>done_fn</b>(1, r, <b>arg</b>), where r is
+ * what networkstatus_set_current_consensus() would have returned, or
+ * <b>done_fn</b>(0, -1, <b>arg</b>) if we gave up because we're shutting
+ * down.  We take ownership of <b>consensus</b>.  The callback may run
+ * before this function returns. */
+void
+networkstatus_set_current_consensus_async(char *consensus,
+                                          const char *flavor,
+                                          unsigned flags,
+                                          networkstatus_set_done_fn done_fn,
+                                          void *arg)
+{
+  consensus_being_checked_t *cbc;
+  sig_check_batch_t *batch;
+  networkstatus_t *c;
+
+  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  if (!c) {
+    log_warn(LD_DIR, "Unable to parse networkstatus consensus");
+    tor_free(consensus);
+    done_fn(1, -2, arg);
+    return;
+  }
+
+  cbc = tor_malloc_zero(sizeof(consensus_being_checked_t));
+  cbc->consensus = c;
+  cbc->body = consensus;
+  cbc->flavor = tor_strdup(flavor);
+  cbc->flags = flags;
+  cbc->requested_flavor = networkstatus_parse_flavor_name(flavor);
+  cbc->sigs = smartlist_new();
+  cbc->done_fn = done_fn;
+  cbc->done_arg = arg;
+
+  batch = sig_check_batch_new();
+  networkstatus_add_signatures_to_batch(c, batch, cbc->sigs);
+  if (cbc->requested_flavor >= 0)
+    ++n_consensuses_being_checked[cbc->requested_flavor];
+  sig_check_batch_run_async(batch, consensus_sigs_checked, cbc);
+}
+
+/** Helper for networkstatus_set_current_consensus() and
+ * consensus_sigs_checked(): as networkstatus_set_current_consensus(), for
+ * the consensus <b>c</b> that we have parsed from <b>consensus</b>.  We take
+ * ownership of <b>c</b>. */
+static int
+networkstatus_set_current_consensus_impl(networkstatus_t *c,
+                                         const char *consensus,
+                                         const char *flavor,
+                                         unsigned flags)
+{
   int r, result = -1;
   time_t now = time(NULL);
   const or_options_t *options = get_options();
@@ -1638,17 +1912,10 @@ networkstatus_set_current_consensus(const char *consensus,
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
     log_warn(LD_BUG, "Unrecognized consensus flavor %s", flavor);
+    networkstatus_vote_free(c);
     return -2;
   }
 
-  /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
-  if (!c) {
-    log_warn(LD_DIR, "Unable to parse networkstatus consensus");
-    result = -2;
-    goto done;
-  }
-
   if ((int)c->flavor != flav) {
     /* This wasn't the flavor we thought we were getting. */
     if (require_flavor) {
@@ -1847,6 +2114,11 @@ networkstatus_set_current_consensus(const char *consensus,
     write_str_to_file(consensus_fname, consensus, 0);
   }
 
+  crypto_digest256(consensus_text_digest[flav], consensus, strlen(consensus),
+                   DIGEST_SHA256);
+  have_consensus_text_digest[flav] = 1;
+  consensus_diff_failed[flav] = 0;
+
 /** If a consensus appears more than this many seconds before its declared
  * valid-after time, declare that our clock is skewed. */
 #define EARLY_CONSENSUS_NOTICE_SKEW 60
@@ -21,6 +21,7 @@ void networkstatus_reset_download_failures(void);
 int router_reload_v2_networkstatus(void);
 int router_reload_consensus_networkstatus(void);
 void routerstatus_free(routerstatus_t *rs);
+void vote_routerstatus_free(vote_routerstatus_t *rs);
 void networkstatus_v2_free(networkstatus_v2_t *ns);
 void networkstatus_vote_free(networkstatus_t *ns);
 networkstatus_voter_info_t *networkstatus_get_voter_by_id(
@@ -66,6 +67,11 @@ const char *networkstatus_get_router_digest_by_nickname(const char *nickname);
 int networkstatus_nickname_is_unnamed(const char *nickname);
 void networkstatus_consensus_download_failed(int status_code,
                                              const char *flavname);
+int networkstatus_get_consensus_diff_base(const char *flavname,
+                                         char *digest_out);
+void networkstatus_consensus_diff_failed(const char *flavname);
+char *networkstatus_apply_consensus_diff(const char *flavname,
+                                         const char *diff);
 void update_consensus_networkstatus_fetch_time(time_t now);
 int should_delay_dir_fetches(const or_options_t *options);
 void update_networkstatus_downloads(time_t now);
@@ -88,6 +94,15 @@ networkstatus_t *networkstatus_get_reasonably_live_consensus(time_t now,
 int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags);
+/** Called by networkstatus_set_current_consensus_async() once it's done
+ * with a consensus. */
+typedef void (*networkstatus_set_done_fn)(int completed, int result,
+                                          void *arg);
+void networkstatus_set_current_consensus_async(char *consensus,
+                                          const char *flavor,
+                                          unsigned flags,
+                                          networkstatus_set_done_fn done_fn,
+                                          void *arg);
 void networkstatus_note_certs_arrived(void);
 void routers_update_all_from_networkstatus(time_t now, int dir_version);
 void routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
@@ -815,8 +815,16 @@ typedef enum {
 /** Amount to increment a stream window when we get a stream SENDME. */
 #define STREAMWINDOW_INCREMENT 50
 
+/** Number of cells an N23 node forwards on a circuit before it sends a
+ * credit (CELL_FLOWCONTROL) cell back to the node feeding it. */
 #define N2 10
+/** Value of N3 that new circuits start with.  Each or_circuit_t then adapts
+ * its own N3 between N3_MIN and N3_MAX; see circuit_get_n3(). */
 #define N3 (get_options()->N3Initial)
+/** Largest value that a circuit's adaptive N3 may grow to. */
+#define N3_MAX (get_options()->N3Max)
+/** Smallest value that a circuit's adaptive N3 may shrink to. */
+#define N3_MIN (get_options()->N3Min)
 
 /* Cell commands.  These values are defined in tor-spec.txt. */
 #define CELL_PADDING 0
@@ -836,6 +844,21 @@ typedef enum {
 #define CELL_AUTH_CHALLENGE 130
 #define CELL_AUTHENTICATE 131
 #define CELL_AUTHORIZE 132
+#define CELL_FLOWCONTROL_BATCH 133
+
+/** Number of bytes in each entry of a CELL_FLOWCONTROL_BATCH payload: a
+ * two-byte circuit ID followed by the same cells_fwded and queue length
+ * that a CELL_FLOWCONTROL carries at the start of its payload. */
+#define FLOWCONTROL_BATCH_ENTRY_LEN 8
+/** As FLOWCONTROL_BATCH_ENTRY_LEN, on a connection to a peer that doesn't
+ * report its queue length: just the circuit ID and cells_fwded. */
+#define FLOWCONTROL_BATCH_ENTRY_LEN_NO_QUEUE_LEN 6
+
+/** A number we list in our VERSIONS cell, well beyond any real link
+ * protocol, to say that our N23 credit carries the length of our queue.
+ * Peers that don't know it ignore it, and we only put the queue length in
+ * credit for peers that list it too. */
+#define N23_QUEUE_LEN_VERSION 0x4e23
 
 /** How long to test reachability before complaining to the user. */
 #define TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT (20*60)
@@ -906,32 +929,91 @@ typedef struct var_cell_t {
 
 /** A cell as packed for writing to the network. */
 typedef struct packed_cell_t {
-  struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
 } packed_cell_t;
 
-/** Number of cells added to a circuit queue including their insertion
- * time on 10 millisecond detail; used for buffer statistics. */
-typedef struct insertion_time_elem_t {
-  struct insertion_time_elem_t *next; /**< Next element in queue. */
-  uint32_t insertion_time; /**< When were cells inserted (in 10 ms steps
-                             * starting at 0:00 of the current day)? */
-  unsigned counter; /**< How many cells were inserted? */
-} insertion_time_elem_t;
-
-/** Queue of insertion times. */
-typedef struct insertion_time_queue_t {
-  struct insertion_time_elem_t *first; /**< First element in queue. */
-  struct insertion_time_elem_t *last; /**< Last element in queue. */
-} insertion_time_queue_t;
+/** Stages of the relay pipeline whose latency CellLatencyTracing
+ * measures.  Each stage runs from the end of the previous one. */
+typedef enum {
+  /** Read from TLS until parsed out of the inbuf. */
+  CELL_TRACE_INBUF = 0,
+  /** Parsed until relay crypto has been applied. */
+  CELL_TRACE_CRYPT,
+  /** Relay crypto done until added to the next circuit queue. */
+  CELL_TRACE_RELAY,
+  /** Waiting in the circuit queue until copied to the outbuf. */
+  CELL_TRACE_CIRCQUEUE,
+  /** Waiting in the outbuf until written to TLS. */
+  CELL_TRACE_OUTBUF,
+  /** Read from TLS until written to TLS again. */
+  CELL_TRACE_TOTAL
+} cell_trace_stage_t;
+/** Number of cell_trace_stage_t values. */
+#define CELL_TRACE_N_STAGES 6
+
+/** A traced cell that has been copied into an OR connection's outbuf but
+ * not yet written to TLS. */
+typedef struct cell_trace_mark_t {
+  /** Value of the connection's trace_bytes_flushed once the last byte of
+   * this cell has been written. */
+  uint64_t end_pos;
+  /** When the cell entered the outbuf (low 32 bits of usec). */
+  uint32_t outbuf_usec;
+  /** When the cell was read from TLS, or 0 if unknown. */
+  uint32_t read_usec;
+} cell_trace_mark_t;
+
+/** How many traced cells we remember per OR connection outbuf.  Cells
+ * past this limit are not traced through the outbuf stage. */
+#define CELL_TRACE_MAX_MARKS 64
+
+/** Number of cells stored in one cell_slab_t: as many as fit in a 4096-byte
+ * buffer chunk. */
+#define CELL_SLAB_N_CELLS 7
+
+struct chunk_t;
+
+/** A run of consecutive cells in a cell_queue_t.  The packed cells are
+ * stored one after another in a buffer chunk, so that adding a cell to a
+ * queue or flushing a run of cells from it touches contiguous memory, and
+ * so that a run that reaches the end of the slab can be handed to an
+ * outbuf without copying.  The per-cell bookkeeping lives in small arrays
+ * alongside.  Slabs are allocated from a single memory pool. */
+typedef struct cell_slab_t {
+  struct cell_slab_t *next; /**< Next slab in the queue, or NULL. */
+  /** Buffer chunk holding the cells, or NULL once it has been handed to a
+   * connection's outbuf. */
+  struct chunk_t *chunk;
+  /** The cells themselves, in the storage of <b>chunk</b>. */
+  packed_cell_t *cells;
+  uint16_t first; /**< Index of the first cell still queued in this slab. */
+  uint16_t end; /**< One past the index of the last cell in this slab. */
+  /** When the first cell in this slab was queued, as given by
+   * cell_queue_msec_now(). */
+  uint32_t queued_msec;
+  /** If CellStatistics is on: when each cell was queued, in 10 ms steps
+   * starting at 0:00 of the current day; CELL_INSERTION_TIME_UNKNOWN if
+   * the cell was queued while CellStatistics was off. */
+  uint32_t insertion_time[CELL_SLAB_N_CELLS];
+  /** If CellLatencyTracing is on: low 32 bits of the monotonic time in
+   * usec when each cell was read from TLS, or 0 if it wasn't read from the
+   * network. */
+  uint32_t trace_read_usec[CELL_SLAB_N_CELLS];
+  /** If CellLatencyTracing is on: low 32 bits of the monotonic time in
+   * usec when each cell was added to the queue, or 0 if not traced. */
+  uint32_t trace_queued_usec[CELL_SLAB_N_CELLS];
+} cell_slab_t;
+
+/** Value of cell_slab_t.insertion_time for a cell whose insertion time we
+ * didn't record. */
+#define CELL_INSERTION_TIME_UNKNOWN UINT32_MAX
 
 /** A queue of cells on a circuit, waiting to be added to the
  * or_connection_t's outbuf. */
 typedef struct cell_queue_t {
-  packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
-  packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
+  cell_slab_t *head; /**< The first slab, or NULL if the queue is empty. */
+  cell_slab_t *tail; /**< The last slab, or NULL if the queue is empty. */
   int n; /**< The number of cells in the queue. */
-  insertion_time_queue_t *insertion_times; /**< Insertion times of cells. */
 } cell_queue_t;
 
 /** Beginning of a RELAY cell payload. */
@@ -1192,6 +1274,14 @@ typedef struct or_handshake_state_t {
   /**@}*/
 } or_handshake_state_t;
 
+/** One slot of an or_connection_t's circid_map. */
+typedef struct circid_map_entry_t {
+  /** The circuit using circ_id on this connection, or NULL if this slot is
+   * empty. */
+  struct circuit_t *circuit;
+  circid_t circ_id;
+} circid_map_entry_t;
+
 /** Subtype of connection_t for an "OR connection" -- that is, one that speaks
  * cells over TLS. */
 typedef struct or_connection_t {
@@ -1264,13 +1354,21 @@ typedef struct or_connection_t {
 #endif
   int n_circuits; /**< How many circuits use this connection as p_conn or
                    * n_conn ? */
+  /** Open-addressing hash table, with linear probing, from circuit ID to
+   * the circuit that uses that ID on this connection.  We look up a cell's
+   * circuit here every time one arrives.  See circuitlist.c. */
+  circid_map_entry_t *circid_map;
+  /** Number of slots in circid_map: 0 or a power of two. */
+  int circid_map_size;
+  /** Number of slots in circid_map that hold a circuit. */
+  int circid_map_n_used;
 
   /** Double-linked ring of circuits with queued cells waiting for room to
    * free up on this connection's outbuf.  Every time we pull cells from a
    * circuit, we advance this pointer to the next circuit in the ring. */
   struct circuit_t *active_circuits;
   /** Priority queue of cell_ewma_t for circuits with queued cells waiting for
-   * room to free up on this connection's outbuf.  Kept in heap order
+   * room to free up on this connection's outbuf.  Kept in 4-ary heap order
    * according to EWMA.
    *
    * This is redundant with active_circuits; if we ever decide only to use the
@@ -1278,10 +1376,47 @@ typedef struct or_connection_t {
    */
   smartlist_t *active_circuit_pqueue;
   /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled. */
+   * their ewma values rescaled.  We let them go unscaled for a few ticks,
+   * and weight new cells more heavily instead. */
   unsigned active_circuit_pqueue_last_recalibrated;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
+
+  /** N23 credits (pending_credit_t) that we owe our peer for circuits on
+   * this connection, in the order we earned them.  Flushed as a single
+   * CELL_FLOWCONTROL_BATCH once per pass through the event loop.  NULL if
+   * nothing is pending. */
+  smartlist_t *pending_credit;
+  /** True iff our peer listed N23_QUEUE_LEN_VERSION in its VERSIONS cell,
+   * so that the N23 credit we exchange carries queue lengths. */
+  unsigned int credit_has_queue_len:1;
+
+  /** True iff this connection is waiting for the next scheduler pass, with
+   * KernelAwareScheduling. */
+  unsigned int scheduler_pending:1;
+  /** During a scheduler pass: how many more cells this connection may
+   * write. */
+  int scheduler_budget;
+  /** During a scheduler pass: the scheduler's priority for this connection;
+   * lower goes first. */
+  double scheduler_priority;
+  /** During a scheduler pass: our position in the scheduler's priority
+   * queue. */
+  int scheduler_heap_idx;
+
+  /** If CellLatencyTracing is on: when we last read bytes from TLS on this
+   * connection (low 32 bits of usec). */
+  uint32_t trace_read_usec;
+  /** Total bytes written from our outbuf to TLS; compared against
+   * <b>trace_marks</b> to tell when a traced cell has left the outbuf. */
+  uint64_t trace_bytes_flushed;
+  /** Ring buffer of CELL_TRACE_MAX_MARKS traced cells that are in our
+   * outbuf, oldest first; NULL until we trace our first cell. */
+  cell_trace_mark_t *trace_marks;
+  /** Index of the oldest entry in <b>trace_marks</b>. */
+  int trace_marks_head;
+  /** Number of entries in <b>trace_marks</b>. */
+  int trace_marks_len;
 } or_connection_t;
 
 /** Subtype of connection_t for an "edge connection" -- that is, an entry (ap)
@@ -1331,6 +1466,11 @@ typedef struct edge_connection_t {
    * cells. */
   unsigned int edge_blocked_on_circ:1;
 
+  /** Number of bytes this stream may still read from the Internet before
+   * we stop reading from it.  Only used on exit connections when
+   * PerStreamBWRate is set. */
+  int read_bucket;
+
 } edge_connection_t;
 
 /** Subtype of edge_connection_t for an "entry connection" -- that is, a SOCKS
@@ -1446,6 +1586,20 @@ typedef struct dir_connection_t {
   off_t cached_dir_offset;
   /** The zlib object doing on-the-fly compression for spooled data. */
   tor_zlib_state_t *zlib_state;
+  /** True iff we're compressing spooled descriptors by splicing together
+   * blobs from the precompressed descriptor cache, instead of running them
+   * through zlib_state. */
+  unsigned int spool_precompressed:1;
+  /** If spool_precompressed is set, the Adler-32 checksum of everything
+   * we've spooled so far. */
+  uint32_t spool_adler;
+  /** True iff we're sending the rest of cached_dir straight from its file
+   * with sendfile() whenever the outbuf is empty, instead of copying it
+   * onto the outbuf. */
+  unsigned int spool_sendfile:1;
+  /** True iff this is a consensus fetch for which we asked for a diff
+   * against the consensus we already have. */
+  unsigned int fetching_consensus_diff:1;
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
@@ -1630,6 +1784,13 @@ typedef struct cached_dir_t {
   time_t published; /**< When was this object published. */
   digests_t digests; /**< Digests of this object (networkstatus only) */
   int refcnt; /**< Reference count for this cached_dir_t. */
+  /** If <b>dir_z</b> has been written to disk, the mapping of that file
+   * that <b>dir_z</b> points into.  Otherwise NULL, and <b>dir_z</b> is on
+   * the heap. */
+  tor_mmap_t *dir_z_map;
+  /** If <b>dir_z_map</b> is set, a file descriptor open on the same file
+   * for sendfile(), or -1 if we don't have one. */
+  int dir_z_fd;
 } cached_dir_t;
 
 /** Enum used to remember where a signed_descriptor_t is stored and how to
@@ -2489,6 +2650,25 @@ typedef struct {
   int heap_index;
 } cell_ewma_t;
 
+/**
+ * The n23_stats_t structure records what N23 flow control has done on one
+ * of a relayed circuit's two links, so that controllers can see how often
+ * the circuit runs out of credit for that neighbor and for how long.
+ */
+typedef struct {
+  /** How many times has this direction run out of credit? */
+  uint32_t n_stalls;
+  /** Total milliseconds spent without credit, not counting the stall that
+   * is still in progress, if any. */
+  uint64_t stalled_msec;
+  /** When the current stall began; tv_sec is 0 if we have credit. */
+  struct timeval stalled_since;
+  /** How many credit messages have we sent to this neighbor? */
+  uint32_t n_credit_sent;
+  /** How many credit messages have we received from this neighbor? */
+  uint32_t n_credit_received;
+} n23_stats_t;
+
 #define ORIGIN_CIRCUIT_MAGIC 0x35315243u
 #define OR_CIRCUIT_MAGIC 0x98ABC04Fu
 
@@ -2536,6 +2716,10 @@ typedef struct circuit_t {
   /** True iff we are waiting for p_conn_cells to become less full before
    * allowing n_streams to add any more cells. (OR circuit only.) */
   unsigned int streams_blocked_on_p_conn : 1;
+  /** True iff this circuit has used up its PerCircuitBWRate token bucket,
+   * and is kept off its connections' lists of active circuits until the
+   * bucket is refilled. (OR circuit only.) */
+  unsigned int write_blocked_on_bucket : 1;
 
   uint8_t state; /**< Current status of this circuit. */
   uint8_t purpose; /**< Why are we creating this circuit? */
@@ -2550,6 +2734,21 @@ typedef struct circuit_t {
    * more. */
   int deliver_window;
 
+  /** Number of bytes this circuit may still write to its connections
+   * before it must yield to the other circuits on them.  Only used when
+   * PerCircuitBWRate is set. (OR circuit only.) */
+  int write_bucket;
+  /** How many times has this circuit used up its write_bucket? */
+  uint32_t n_bucket_depletions;
+
+  /** Position of this circuit in the heap of circuits with queued cells,
+   * ordered by how long their oldest cell has waited; -1 if it has no cells
+   * queued.  Used to pick victims when we exceed MaxMemInCellQueues. */
+  int oom_heap_idx;
+  /** Our key in that heap: no later than when the oldest cell now queued
+   * on this circuit was queued, as given by cell_queue_msec_now(). */
+  uint32_t oom_queued_msec;
+
   /** For storage while n_conn is pending
     * (state CIRCUIT_STATE_OR_WAIT). When defined, it is always
     * length ONIONSKIN_CHALLENGE_LEN. */
@@ -2603,6 +2802,12 @@ typedef struct circuit_t {
                            /* suggested change: in the flow control
 			    * cell, give the number of cells seen _since
 			    * the last flow control cell_. */
+  /** N23 statistics for our link to n_conn. */
+  n23_stats_t n_flowctl_stats;
+  /** True iff N3, a credit balance or a stall changed, or we sent credit,
+   * since the last CIRC_FLOWCTL event.  Forwarding a cell alone doesn't
+   * count, so that busy circuits don't get an event every second. */
+  unsigned int flowctl_changed : 1;
 } circuit_t;
 
 /** Largest number of relay_early cells that we can send on a given
@@ -2827,6 +3032,10 @@ typedef struct or_circuit_t {
   /** True iff this circuit was made with a CREATE_FAST cell. */
   unsigned int is_first_hop : 1;
 
+  /** If this circuit's handshake is in the cpuworker pool, the job that
+   * holds it.  NULL otherwise. */
+  struct cpuworker_job_t *workqueue_entry;
+
   /** Number of cells that were removed from circuit queue; reset every
    * time when writing buffer stats to disk. */
   uint32_t processed_cells;
@@ -2846,6 +3055,15 @@ typedef struct or_circuit_t {
                            /* suggested change: in the flow control
 			    * cell, give the number of cells seen _since
 			    * the last flow control cell_. */
+
+  /** Adaptive N3 for the cells we send to n_conn, which the next hop
+   * queues.  Adapted on every credit from the next hop, by the queue length
+   * it reports; always within [N3Min, N3Max]. */
+  int n3_n;
+  /** Adaptive N3 for the cells we send to p_conn. */
+  int n3_p;
+  /** N23 statistics for our link to p_conn. */
+  n23_stats_t p_flowctl_stats;
 } or_circuit_t;
 
 /** Convert a circuit subtype to a circuit_t. */
@@ -3146,6 +3364,9 @@ typedef struct {
   /** Boolean: do we publish hidden service descriptors to the HS auths? */
   int PublishHidServDescriptors;
   int FetchServerDescriptors; /**< Do we fetch server descriptors as normal? */
+  /** Do we ask directory caches for a diff against the consensus we already
+   * have, instead of for the whole new consensus? */
+  int FetchConsensusDiffs;
   int FetchHidServDescriptors; /**< and hidden service descriptors? */
   int FetchV2Networkstatus; /**< Do we fetch v2 networkstatus documents when
                              * we don't need to? */
@@ -3237,6 +3458,10 @@ typedef struct {
   int MaxOnionsPending; /**< How many circuit CREATE requests do we allow
                          * to wait simultaneously before we start dropping
                          * them? */
+  uint64_t MaxMemInCellQueues; /**< If we have more memory than this
+                                * allocated for circuit cell queues, close
+                                * the circuits whose cells have waited
+                                * longest. */
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
@@ -3253,6 +3478,14 @@ typedef struct {
                                  * use in a second for all relayed conns? */
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
+  uint64_t PerCircuitBWRate; /**< Long-term bw on a single relayed circuit,
+                              * if set. */
+  uint64_t PerCircuitBWBurst; /**< Allowed burst on a single relayed circuit,
+                               * if set. */
+  uint64_t PerStreamBWRate; /**< Long-term bw on a single exit stream, if
+                             * set. */
+  uint64_t PerStreamBWBurst; /**< Allowed burst on a single exit stream, if
+                              * set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
@@ -3424,6 +3657,9 @@ typedef struct {
                     disclaimer. This allows a server administrator to show
                     that they're running Tor and anyone visiting their server
                     will know this without any specialized knowledge. */
+  /** As a directory cache, how many past consensuses of each flavor do we
+   * keep diffs from? */
+  int CachedConsensusDiffs;
   int DisableDebuggerAttachment; /**< Currently Linux only specific attempt to
                                       disable ptrace; needs BSD testing. */
   /** Boolean: if set, we start even if our resolv.conf file is missing
@@ -3488,6 +3724,10 @@ typedef struct {
   /** If true, the user wants us to collect cell statistics. */
   int CellStatistics;
 
+  /** If true, timestamp cells as they move through the relay pipeline and
+   * keep per-stage latency histograms for the controller. */
+  int CellLatencyTracing;
+
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
@@ -3588,6 +3828,11 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, choose which circuit's cells to write next across all OR
+   * connections at once, once per pass through the event loop, and write
+   * only as many as each connection's TCP socket can send right away. */
+  int KernelAwareScheduling;
+
   /** If true, do not enable IOCP on windows with bufferevents, even if
    * we think we could. */
   int DisableIOCP;
@@ -3647,6 +3892,11 @@ typedef struct {
   /** The size of the stream window.  */
   int StreamWindowSize;
 
+  /** If 1, coalesce the N23 credit for all circuits on an OR connection
+   * into one CELL_FLOWCONTROL_BATCH per event loop pass, when the link
+   * protocol allows variable-length cells. */
+  int UseN23BatchedCredit;
+
   /** The initial value of N3. */
   int N3Initial;
 
@@ -30,9 +30,11 @@
 #include "reasons.h"
 #include "relay.h"
 #include "rendcommon.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -49,6 +51,11 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static int circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
+                                           cell_direction_t cell_direction,
+                                           int crypted);
+static int relay_cell_is_recognized_here(or_circuit_t *circ, cell_t *cell);
+static void cell_trace_note_crypted(int n);
 
 static int connection_or_consider_sending_flowcontrol_cell(int cell_direction_p, int nBuffer,
                                    circuit_t *circ, or_connection_t * orconn);
@@ -169,6 +176,29 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
 int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
+{
+  return circuit_receive_relay_cell_impl(cell, circ, cell_direction, 0);
+}
+
+/** As circuit_receive_relay_cell(), but for a <b>cell</b> on a non-origin
+ * circuit whose layer of relay crypto has already been applied by
+ * relay_crypt_batch(). */
+int
+circuit_receive_relay_cell_crypted(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction)
+{
+  tor_assert(!CIRCUIT_IS_ORIGIN(circ));
+  return circuit_receive_relay_cell_impl(cell, circ, cell_direction, 1);
+}
+
+/** Helper: implements circuit_receive_relay_cell() and
+ * circuit_receive_relay_cell_crypted().  If <b>crypted</b> is true, the
+ * cell has already been through relay_crypt_batch(), and we only need to
+ * check whether it is recognized. */
+static int
+circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
+                                cell_direction_t cell_direction,
+                                int crypted)
 {
   or_connection_t *or_conn=NULL;
   crypt_path_t *layer_hint=NULL;
@@ -182,8 +212,13 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
              cell_direction == CELL_DIRECTION_IN);
   if (circ->marked_for_close)
     return 0;
-    
-  if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
+
+  if (crypted) {
+    if (cell_direction == CELL_DIRECTION_OUT &&
+        relay_cell_is_recognized_here(TO_OR_CIRCUIT(circ), cell))
+      recognized = 1;
+  } else if (relay_crypt(circ, cell, cell_direction, &layer_hint,
+                         &recognized) < 0) {
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
   }
@@ -339,6 +374,7 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
                                   cell->payload, 1) < 0)
         return -1;
+      cell_trace_note_crypted(1);
 //      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
 //             "the client.");
     }
@@ -348,16 +384,68 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
     if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
                                 cell->payload, 0) < 0)
       return -1;
+    cell_trace_note_crypted(1);
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
-    }
+    if (relay_cell_is_recognized_here(TO_OR_CIRCUIT(circ), cell))
+      *recognized = 1;
+  }
+  return 0;
+}
+
+/** Return true iff <b>cell</b>, which has just had our layer of crypto
+ * removed on its way away from the origin along <b>circ</b>, is addressed
+ * to us. */
+static int
+relay_cell_is_recognized_here(or_circuit_t *circ, cell_t *cell)
+{
+  relay_header_t rh;
+
+  relay_header_unpack(&rh, cell->payload);
+  /* If it's possibly recognized, we have to check the digest to be sure. */
+  return rh.recognized == 0 && relay_digest_matches(circ->n_digest, cell);
+}
+
+/** Apply our one layer of relay crypto to the <b>n</b> cells in
+ * <b>cells</b>, which all arrived in that order on the non-origin circuit
+ * <b>circ</b> in direction <b>cell_direction</b>.  The keystream for all of
+ * them is generated together, instead of once per cell as relay_crypt()
+ * does.  Each cell must then be passed to
+ * circuit_receive_relay_cell_crypted(), in the same order.
+ *
+ * The running digests can't be folded into this pass: whether a cell's
+ * digest is ours to check depends on its decrypted header.
+ *
+ * Return -1 to indicate that we should mark the circuit for close,
+ * else return 0.
+ */
+int
+relay_crypt_batch(circuit_t *circ, cell_t **cells, int n,
+                  cell_direction_t cell_direction)
+{
+  char *payloads[RELAY_CRYPT_BATCH_MAX];
+  crypto_cipher_t *cipher;
+  int i;
+
+  tor_assert(circ);
+  tor_assert(!CIRCUIT_IS_ORIGIN(circ));
+  tor_assert(n >= 0 && n <= RELAY_CRYPT_BATCH_MAX);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  if (cell_direction == CELL_DIRECTION_IN)
+    cipher = TO_OR_CIRCUIT(circ)->p_crypto;
+  else
+    cipher = TO_OR_CIRCUIT(circ)->n_crypto;
+
+  for (i = 0; i < n; ++i)
+    payloads[i] = (char *) cells[i]->payload;
+
+  if (crypto_cipher_crypt_inplace_batch(cipher, payloads, n,
+                                        CELL_PAYLOAD_SIZE) < 0) {
+    log_warn(LD_BUG,"Error during relay encryption");
+    return -1;
   }
+  cell_trace_note_crypted(n);
   return 0;
 }
 
@@ -1464,7 +1552,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
         if (!CIRCUIT_IS_ORIGIN(circ)) {
             cell_queue_t *queue;
             queue = &TO_OR_CIRCUIT(circ)->p_conn_cells;
-            if ( queue->n > N2+N3 ) {  /* IG: This doesn't check the adaptive N3 value */
+            if ( queue->n > N2+circuit_get_n3(circ, CELL_DIRECTION_IN) ) {
                 connection_stop_reading(TO_CONN(conn));
                 return 0;
             }
@@ -1651,7 +1739,9 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   }
 
   if (get_options()->UseN23) {
-    max_to_package = N2+N3 - cells_on_queue;
+    cell_direction_t direction = CIRCUIT_IS_ORIGIN(circ) ?
+      CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
+    max_to_package = N2+circuit_get_n3(circ, direction) - cells_on_queue;
   }else {
     /* How many cells do we have space for?  It will be the minimum of
      * the number needed to exhaust the package window, and the minimum
@@ -1844,26 +1934,22 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 #define assert_active_circuits_ok_paranoid(conn)
 #endif
 
-/** The total number of cells we have allocated from the memory pool. */
-static int total_cells_allocated = 0;
+/** The total number of cell slabs we have allocated from the memory
+ * pool. */
+static int total_slabs_allocated = 0;
 
-/** A memory pool to allocate packed_cell_t objects. */
+/** A memory pool to allocate cell_slab_t objects. */
 static mp_pool_t *cell_pool = NULL;
 
-/** Memory pool to allocate insertion_time_elem_t objects used for cell
- * statistics. */
-static mp_pool_t *it_pool = NULL;
-
 /** Allocate structures to hold cells. */
 void
 init_cell_pool(void)
 {
   tor_assert(!cell_pool);
-  cell_pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
+  cell_pool = mp_pool_new(sizeof(cell_slab_t), 128*1024);
 }
 
-/** Free all storage used to hold cells (and insertion times if we measure
- * cell statistics). */
+/** Free all storage used to hold cells. */
 void
 free_cell_pool(void)
 {
@@ -1872,10 +1958,6 @@ free_cell_pool(void)
     mp_pool_destroy(cell_pool);
     cell_pool = NULL;
   }
-  if (it_pool) {
-    mp_pool_destroy(it_pool);
-    it_pool = NULL;
-  }
 }
 
 /** Free excess storage in cell pool. */
@@ -1886,20 +1968,62 @@ clean_cell_pool(void)
   mp_pool_clean(cell_pool, 0, 1);
 }
 
-/** Release storage held by <b>cell</b>. */
+/** Release storage held by <b>slab</b>, including its chunk if it still
+ * has one. */
 static INLINE void
-packed_cell_free_unchecked(packed_cell_t *cell)
+cell_slab_free(cell_slab_t *slab)
 {
-  --total_cells_allocated;
-  mp_pool_release(cell);
+  --total_slabs_allocated;
+  if (slab->chunk)
+    buf_chunk_free(slab->chunk);
+  mp_pool_release(slab);
 }
 
-/** Allocate and return a new packed_cell_t. */
-static INLINE packed_cell_t *
-packed_cell_new(void)
+/** Roughly how much memory each cell_slab_t costs us, counting its chunk. */
+#define CELL_SLAB_MEM_COST \
+  (sizeof(cell_slab_t) + CELL_SLAB_N_CELLS * CELL_NETWORK_SIZE)
+
+/** Return roughly how many bytes we have allocated for cells waiting in
+ * circuit queues. */
+size_t
+cell_queues_get_total_allocation(void)
 {
-  ++total_cells_allocated;
-  return mp_pool_get(cell_pool);
+  return (size_t)total_slabs_allocated * CELL_SLAB_MEM_COST;
+}
+
+/** Check whether we've got too much memory tied up in cell queues; if so,
+ * close circuits to get some back.  Return true iff we closed any. */
+static INLINE int
+cell_queues_check_size(void)
+{
+  size_t alloc = cell_queues_get_total_allocation();
+  if (alloc >= get_options()->MaxMemInCellQueues)
+    return circuits_handle_oom(alloc) > 0;
+  return 0;
+}
+
+/** Return the current time in milliseconds, truncated to 32 bits, for
+ * comparing how long cells have been queued.  Compare two such times by
+ * their signed difference. */
+uint32_t
+cell_queue_msec_now(void)
+{
+  struct timeval now;
+  tor_gettimeofday_cached(&now);
+  return (uint32_t)(((uint64_t)now.tv_sec) * 1000 + now.tv_usec / 1000);
+}
+
+/** Allocate and return a new empty cell_slab_t. */
+static INLINE cell_slab_t *
+cell_slab_new(void)
+{
+  cell_slab_t *slab = mp_pool_get(cell_pool);
+  ++total_slabs_allocated;
+  slab->next = NULL;
+  slab->chunk = buf_chunk_new(CELL_SLAB_N_CELLS * CELL_NETWORK_SIZE);
+  slab->cells = (packed_cell_t *) buf_chunk_mem(slab->chunk);
+  slab->first = slab->end = 0;
+  return slab;
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -1908,120 +2032,276 @@ void
 dump_cell_pool_usage(int severity)
 {
   circuit_t *c;
+  cell_slab_t *slab;
   int n_circs = 0;
   int n_cells = 0;
+  int n_slabs = 0;
   for (c = _circuit_get_global_list(); c; c = c->next) {
     n_cells += c->n_conn_cells.n;
-    if (!CIRCUIT_IS_ORIGIN(c))
+    for (slab = c->n_conn_cells.head; slab; slab = slab->next)
+      ++n_slabs;
+    if (!CIRCUIT_IS_ORIGIN(c)) {
       n_cells += TO_OR_CIRCUIT(c)->p_conn_cells.n;
+      for (slab = TO_OR_CIRCUIT(c)->p_conn_cells.head; slab;
+           slab = slab->next)
+        ++n_slabs;
+    }
     ++n_circs;
   }
-  log(severity, LD_MM, "%d cells allocated on %d circuits. %d cells leaked.",
-      n_cells, n_circs, total_cells_allocated - n_cells);
+  log(severity, LD_MM, "%d cells allocated in %d slabs on %d circuits. "
+      "%d slabs leaked.",
+      n_cells, n_slabs, n_circs, total_slabs_allocated - n_slabs);
   mp_pool_log_status(cell_pool, severity);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell)
+/*** Cell latency tracing ***/
+
+/** Timestamps shared by the batch of cells that
+ * connection_or_process_cells_from_inbuf() is currently handing to
+ * command_process_cells(), when CellLatencyTracing is set.  All of them are
+ * zero outside such a batch; a zero timestamp means "unknown". */
+static struct {
+  /** When the TLS read that brought in these cells returned. */
+  uint32_t read_usec;
+  /** When the cells were parsed off the inbuf. */
+  uint32_t parse_usec;
+  /** When our layer of crypto was last applied to one of these cells. */
+  uint32_t crypt_usec;
+} cell_trace_batch;
+
+/** Return the current time in microseconds for CellLatencyTracing.  The
+ * value wraps every 71 minutes, which is fine for differences between
+ * stages; it is never zero, so that zero can mean "not stamped". */
+uint32_t
+cell_trace_now(void)
 {
-  packed_cell_t *c = packed_cell_new();
-  cell_pack(c, cell);
-  c->next = NULL;
-  return c;
+  uint32_t now = (uint32_t)tor_gettime_usec_monotonic();
+  return now ? now : 1;
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
+/** Note that the <b>n_cells</b> cells just parsed from the inbuf of
+ * <b>conn</b> are about to be processed. */
 void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+cell_trace_batch_begin(or_connection_t *conn, int n_cells)
 {
-  if (queue->tail) {
-    tor_assert(!queue->tail->next);
-    queue->tail->next = cell;
-  } else {
-    queue->head = cell;
+  cell_trace_batch.read_usec = conn->trace_read_usec;
+  cell_trace_batch.parse_usec = cell_trace_now();
+  cell_trace_batch.crypt_usec = 0;
+  if (cell_trace_batch.read_usec)
+    rep_hist_note_cell_latency(CELL_TRACE_INBUF,
+                   cell_trace_batch.parse_usec - cell_trace_batch.read_usec,
+                   n_cells);
+}
+
+/** Note that the current batch of cells has been processed. */
+void
+cell_trace_batch_end(void)
+{
+  memset(&cell_trace_batch, 0, sizeof(cell_trace_batch));
+}
+
+/** Note that our layer of crypto has just been applied to <b>n</b> cells
+ * of the current batch. */
+static void
+cell_trace_note_crypted(int n)
+{
+  if (!cell_trace_batch.parse_usec)
+    return;
+  cell_trace_batch.crypt_usec = cell_trace_now();
+  rep_hist_note_cell_latency(CELL_TRACE_CRYPT,
+                   cell_trace_batch.crypt_usec - cell_trace_batch.parse_usec,
+                   n);
+}
+
+/** Stamp the <b>i</b>th cell of <b>slab</b>, which has just been added to
+ * a circuit queue. */
+static void
+cell_trace_note_queued(cell_slab_t *slab, int i)
+{
+  uint32_t now = cell_trace_now();
+  slab->trace_queued_usec[i] = now;
+  slab->trace_read_usec[i] = cell_trace_batch.read_usec;
+  if (cell_trace_batch.crypt_usec)
+    rep_hist_note_cell_latency(CELL_TRACE_RELAY,
+                               now - cell_trace_batch.crypt_usec, 1);
+}
+
+/** Note that the <b>i</b>th cell of <b>slab</b> has just been moved from
+ * its circuit queue onto the outbuf of <b>conn</b>, followed by
+ * <b>bytes_after</b> more bytes.  Remember where in the outbuf the cell
+ * ends so that cell_trace_note_flushed() can tell when it hits the
+ * network. */
+static void
+cell_trace_note_written(or_connection_t *conn, const cell_slab_t *slab,
+                        int i, size_t bytes_after)
+{
+  uint32_t now;
+  cell_trace_mark_t *mark;
+  if (!slab->trace_queued_usec[i])
+    return;
+  now = cell_trace_now();
+  rep_hist_note_cell_latency(CELL_TRACE_CIRCQUEUE,
+                             now - slab->trace_queued_usec[i], 1);
+  if (!conn->trace_marks)
+    conn->trace_marks = tor_malloc_zero(sizeof(cell_trace_mark_t) *
+                                        CELL_TRACE_MAX_MARKS);
+  if (conn->trace_marks_len == CELL_TRACE_MAX_MARKS)
+    return; /* Sample: don't follow this one to the network. */
+  mark = &conn->trace_marks[(conn->trace_marks_head + conn->trace_marks_len)
+                            % CELL_TRACE_MAX_MARKS];
+  mark->end_pos = conn->trace_bytes_flushed +
+    buf_datalen(TO_CONN(conn)->outbuf) - bytes_after;
+  mark->outbuf_usec = now;
+  mark->read_usec = slab->trace_read_usec[i];
+  ++conn->trace_marks_len;
+}
+
+/** Note that <b>n_bytes</b> have just been flushed from the outbuf of
+ * <b>conn</b> to TLS, and record the outbuf and end-to-end latency of every
+ * traced cell that has now been written completely. */
+void
+cell_trace_note_flushed(or_connection_t *conn, size_t n_bytes)
+{
+  uint32_t now;
+  conn->trace_bytes_flushed += n_bytes;
+  if (!conn->trace_marks_len)
+    return;
+  now = cell_trace_now();
+  while (conn->trace_marks_len) {
+    cell_trace_mark_t *mark = &conn->trace_marks[conn->trace_marks_head];
+    if (mark->end_pos > conn->trace_bytes_flushed)
+      break;
+    rep_hist_note_cell_latency(CELL_TRACE_OUTBUF, now - mark->outbuf_usec, 1);
+    if (mark->read_usec)
+      rep_hist_note_cell_latency(CELL_TRACE_TOTAL, now - mark->read_usec, 1);
+    conn->trace_marks_head =
+      (conn->trace_marks_head + 1) % CELL_TRACE_MAX_MARKS;
+    --conn->trace_marks_len;
   }
-  queue->tail = cell;
-  cell->next = NULL;
+}
+
+/** Add an empty slot to the end of <b>queue</b> and return the slab
+ * that holds it; the slot is the last one in use in that slab. */
+static INLINE cell_slab_t *
+cell_queue_append_slot(cell_queue_t *queue)
+{
+  cell_slab_t *slab = queue->tail;
+  if (!slab || slab->end == CELL_SLAB_N_CELLS) {
+    slab = cell_slab_new();
+    slab->queued_msec = cell_queue_msec_now();
+    if (queue->tail)
+      queue->tail->next = slab;
+    else
+      queue->head = slab;
+    queue->tail = slab;
+  }
+  ++slab->end;
   ++queue->n;
+  return slab;
+}
+
+#define SECONDS_IN_A_DAY 86400L
+
+/** Return the current time in 10 ms steps starting at 0:00 of the current
+ * day, as used for cell statistics. */
+static INLINE uint32_t
+cell_insertion_time_now(void)
+{
+  struct timeval now;
+  tor_gettimeofday_cached(&now);
+  return (uint32_t)(((now.tv_sec % SECONDS_IN_A_DAY) * 100L)
+                    + ((uint32_t)now.tv_usec / (uint32_t)10000L));
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
+/** Append a packed copy of <b>cell</b> to the end of <b>queue</b>. */
 void
 cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
 {
-  packed_cell_t *copy = packed_cell_copy(cell);
-  /* Remember the time when this cell was put in the queue. */
-  if (get_options()->CellStatistics) {
-    struct timeval now;
-    uint32_t added;
-    insertion_time_queue_t *it_queue = queue->insertion_times;
-    if (!it_pool)
-      it_pool = mp_pool_new(sizeof(insertion_time_elem_t), 1024);
-    tor_gettimeofday_cached(&now);
-#define SECONDS_IN_A_DAY 86400L
-    added = (uint32_t)(((now.tv_sec % SECONDS_IN_A_DAY) * 100L)
-            + ((uint32_t)now.tv_usec / (uint32_t)10000L));
-    if (!it_queue) {
-      it_queue = tor_malloc_zero(sizeof(insertion_time_queue_t));
-      queue->insertion_times = it_queue;
-    }
-    if (it_queue->last && it_queue->last->insertion_time == added) {
-      it_queue->last->counter++;
-    } else {
-      insertion_time_elem_t *elem = mp_pool_get(it_pool);
-      elem->next = NULL;
-      elem->insertion_time = added;
-      elem->counter = 1;
-      if (it_queue->last) {
-        it_queue->last->next = elem;
-        it_queue->last = elem;
-      } else {
-        it_queue->first = it_queue->last = elem;
-      }
-    }
+  cell_slab_t *slab = cell_queue_append_slot(queue);
+  int i = slab->end - 1;
+  const or_options_t *options = get_options();
+
+  cell_pack(&slab->cells[i], cell);
+  if (options->CellLatencyTracing) {
+    cell_trace_note_queued(slab, i);
+  } else {
+    slab->trace_read_usec[i] = slab->trace_queued_usec[i] = 0;
   }
-  cell_queue_append(queue, copy);
+  /* Remember the time when this cell was put in the queue. */
+  if (options->CellStatistics)
+    slab->insertion_time[i] = cell_insertion_time_now();
+  else
+    slab->insertion_time[i] = CELL_INSERTION_TIME_UNKNOWN;
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell, *next;
-  cell = queue->head;
-  while (cell) {
-    next = cell->next;
-    packed_cell_free_unchecked(cell);
-    cell = next;
+  cell_slab_t *slab, *next;
+  for (slab = queue->head; slab; slab = next) {
+    next = slab->next;
+    cell_slab_free(slab);
   }
   queue->head = queue->tail = NULL;
   queue->n = 0;
-  if (queue->insertion_times) {
-    while (queue->insertion_times->first) {
-      insertion_time_elem_t *elem = queue->insertion_times->first;
-      queue->insertion_times->first = elem->next;
-      mp_pool_release(elem);
-    }
-    tor_free(queue->insertion_times);
-  }
 }
 
-/** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
-static INLINE packed_cell_t *
-cell_queue_pop(cell_queue_t *queue)
+/** Remove the cell at the head of <b>queue</b>, which must not be empty,
+ * without touching its contents.  If that was the last cell in its slab,
+ * unlink the slab from <b>queue</b> and return 1; the caller must then
+ * free it.  Otherwise return 0. */
+static INLINE int
+cell_queue_take_first(cell_queue_t *queue)
 {
-  packed_cell_t *cell = queue->head;
-  if (!cell)
-    return NULL;
-  queue->head = cell->next;
-  if (cell == queue->tail) {
-    tor_assert(!queue->head);
+  cell_slab_t *slab = queue->head;
+  tor_assert(slab && slab->first < slab->end);
+  --queue->n;
+  if (++slab->first < slab->end)
+    return 0;
+  tor_assert(slab->end == CELL_SLAB_N_CELLS || slab == queue->tail);
+  queue->head = slab->next;
+  if (!queue->head)
     queue->tail = NULL;
+  return 1;
+}
+
+/** Remove and discard the cell at the head of <b>queue</b>, which must not
+ * be empty. */
+void
+cell_queue_drop_first(cell_queue_t *queue)
+{
+  cell_slab_t *slab = queue->head;
+  if (cell_queue_take_first(queue))
+    cell_slab_free(slab);
+}
+
+/** Write the cells of <b>slab</b> from index <b>start</b> up to (but not
+ * including) its first queued cell onto the outbuf of <b>conn</b>.  If
+ * <b>unlinked</b>, the slab has been emptied and removed from its queue:
+ * hand its chunk to the outbuf instead of copying the cells, and free the
+ * slab. */
+static void
+cell_slab_write_run(or_connection_t *conn, cell_slab_t *slab, int start,
+                    int unlinked)
+{
+  int end = slab->first, i;
+  size_t len = (end - start) * CELL_NETWORK_SIZE;
+
+  if (unlinked) {
+    connection_write_chunk_to_buf(slab->chunk, start * CELL_NETWORK_SIZE,
+                                  len, TO_CONN(conn));
+    slab->chunk = NULL;
+  } else {
+    connection_write_to_buf(slab->cells[start].body, len, TO_CONN(conn));
   }
-  --queue->n;
-  return cell;
+  if (get_options()->CellLatencyTracing) {
+    for (i = start; i < end; ++i)
+      cell_trace_note_written(conn, slab, i,
+                              (end - 1 - i) * CELL_NETWORK_SIZE);
+  }
+  if (unlinked)
+    cell_slab_free(slab);
 }
 
 /** Return a pointer to the "next_active_on_{n,p}_conn" pointer of <b>circ</b>,
@@ -2056,19 +2336,6 @@ prev_circ_on_conn_p(circuit_t *circ, or_connection_t *conn)
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
-{
-  const cell_ewma_t *e1=p1, *e2=p2;
-  if (e1->cell_count < e2->cell_count)
-    return -1;
-  else if (e1->cell_count > e2->cell_count)
-    return 1;
-  else
-    return 0;
-}
-
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -2112,6 +2379,13 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    worth F^N, and a cell sent N seconds after the start of the current tick is
    worth F^-N.  This way we don't overflow, and we don't need to constantly
    rescale.
+
+   We don't even rescale every time the tick changes: each connection's
+   counts stay relative to the tick on which it last rescaled them, and new
+   cells get weight F^-N for the N ticks since then.  Only once that weight
+   grows large do we rescale every active circuit on the connection.  The
+   weights for a whole number of ticks, and for each hundredth of a second
+   within a tick, come from tables that we fill in whenever F changes.
  */
 
 /** How long does a tick last (seconds)? */
@@ -2121,22 +2395,34 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
  * consensus or a configuration setting.  zero means "disabled". */
 #define EWMA_DEFAULT_HALFLIFE 0.0
 
+/** How many equal steps do we divide a tick into when looking up the weight
+ * of a cell sent partway through it? */
+#define EWMA_FRAC_STEPS 1000
+
+/** How many ticks can a connection's cell counts go without rescaling, at
+ * most? */
+#define EWMA_MAX_LAZY_TICKS 64
+
+/** What's the largest weight we'll give a new cell before rescaling a
+ * connection's cell counts? */
+#define EWMA_MAX_WEIGHT 1e15
+
 /** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
- * and the fraction of the tick that has elapsed between the start of the tick
- * and <b>now</b>.  Return the former and store the latter in
- * *<b>remainder_out</b>.
+ * and how many of the tick's EWMA_FRAC_STEPS steps have elapsed between the
+ * start of the tick and <b>now</b>.  Return the former and store the latter
+ * in *<b>step_out</b>.
  *
  * These tick values are not meant to be shared between Tor instances, or used
  * for other purposes. */
 static unsigned
-cell_ewma_tick_from_timeval(const struct timeval *now,
-                            double *remainder_out)
+cell_ewma_tick_from_timeval(const struct timeval *now, int *step_out)
 {
   unsigned res = (unsigned) (now->tv_sec / EWMA_TICK_LEN);
-  /* rem */
-  double rem = (now->tv_sec % EWMA_TICK_LEN) +
-    ((double)(now->tv_usec)) / 1.0e6;
-  *remainder_out = rem / EWMA_TICK_LEN;
+  uint64_t usec = ((uint64_t)(now->tv_sec % EWMA_TICK_LEN)) * 1000000 +
+    now->tv_usec;
+  *step_out = (int)(usec * EWMA_FRAC_STEPS / (EWMA_TICK_LEN * 1000000));
+  if (*step_out >= EWMA_FRAC_STEPS)
+    *step_out = EWMA_FRAC_STEPS - 1;
   return res;
 }
 
@@ -2155,11 +2441,43 @@ static double ewma_scale_factor = 0.1;
 /* DOCDOC ewma_enabled */
 static int ewma_enabled = 0;
 
+/** ewma_tick_weight[n] is the weight of a cell sent at the start of the
+ * n'th tick after a connection last rescaled its cell counts: that is,
+ * ewma_scale_factor ** -n. */
+static double ewma_tick_weight[EWMA_MAX_LAZY_TICKS];
+/** How many entries of ewma_tick_weight are in use?  A connection rescales
+ * its cell counts once this many ticks have passed. */
+static int ewma_n_lazy_ticks = 1;
+/** ewma_step_weight[i] is the weight of a cell sent i/EWMA_FRAC_STEPS of
+ * the way through a tick, relative to one sent at its start: that is,
+ * ewma_scale_factor ** (-i/EWMA_FRAC_STEPS). */
+static double ewma_step_weight[EWMA_FRAC_STEPS];
+
 /*DOCDOC*/
 #define EPSILON 0.00001
 /*DOCDOC*/
 #define LOG_ONEHALF -0.69314718055994529
 
+/** Recompute ewma_tick_weight and ewma_step_weight from
+ * ewma_scale_factor. */
+static void
+cell_ewma_fill_weight_tables(void)
+{
+  int i;
+  for (i = 0; i < EWMA_FRAC_STEPS; ++i)
+    ewma_step_weight[i] = pow(ewma_scale_factor,
+                              -((double)i) / EWMA_FRAC_STEPS);
+  /* A cell sent late in the last tick we allow weighs nearly as much as
+   * one sent at the start of the tick after it. */
+  ewma_tick_weight[0] = 1.0;
+  for (i = 1; i < EWMA_MAX_LAZY_TICKS; ++i) {
+    if (pow(ewma_scale_factor, -(i+1)) > EWMA_MAX_WEIGHT)
+      break;
+    ewma_tick_weight[i] = pow(ewma_scale_factor, -i);
+  }
+  ewma_n_lazy_ticks = i;
+}
+
 /** Adjust the global cell scale factor based on <b>options</b> */
 void
 cell_ewma_set_scale_factor(const or_options_t *options,
@@ -2194,6 +2512,7 @@ cell_ewma_set_scale_factor(const or_options_t *options,
     /* compute per-tick scale factor. */
     ewma_scale_factor = exp( LOG_ONEHALF / halflife );
     ewma_enabled = 1;
+    cell_ewma_fill_weight_tables();
     log_info(LD_OR,
              "Enabled cell_ewma algorithm because of value in %s; "
              "scale factor is %f per %d seconds",
@@ -2242,40 +2561,142 @@ scale_active_circuits(or_connection_t *conn, unsigned cur_tick)
   conn->active_circuit_pqueue_last_recalibrated = cur_tick;
 }
 
+/* ==== Priority queue of cell_ewma_t ====
+
+   Each connection keeps the cell_ewma_t of its active circuits in
+   active_circuit_pqueue, as a heap ordered by cell_count in which every
+   element records its own position in heap_index.  We use a 4-ary heap,
+   rather than smartlist_pqueue's binary one: it's half as deep, and the
+   children of each node sit next to each other in memory.
+ */
+
+/** How many children does each node in the heap have? */
+#define EWMA_HEAP_ARITY 4
+/** Return the index of the parent of the node at <b>i</b>. */
+#define EWMA_HEAP_PARENT(i) (((i)-1) / EWMA_HEAP_ARITY)
+/** Return the index of the first child of the node at <b>i</b>. */
+#define EWMA_HEAP_FIRST_CHILD(i) ((i)*EWMA_HEAP_ARITY + 1)
+/** Return the cell_ewma_t at index <b>i</b> of <b>heap</b>. */
+#define EWMA_HEAP_AT(heap, i) ((cell_ewma_t *)(heap)->list[(i)])
+
+/** Move the cell_ewma_t at <b>idx</b> in <b>heap</b> towards the root until
+ * its parent has no higher a count. */
+static void
+cell_ewma_heap_sift_up(smartlist_t *heap, int idx)
+{
+  cell_ewma_t *ewma = EWMA_HEAP_AT(heap, idx);
+  while (idx > 0) {
+    int parent = EWMA_HEAP_PARENT(idx);
+    cell_ewma_t *p = EWMA_HEAP_AT(heap, parent);
+    if (p->cell_count <= ewma->cell_count)
+      break;
+    heap->list[idx] = p;
+    p->heap_index = idx;
+    idx = parent;
+  }
+  heap->list[idx] = ewma;
+  ewma->heap_index = idx;
+}
+
+/** Move the cell_ewma_t at <b>idx</b> in <b>heap</b> away from the root
+ * until none of its children has a lower count. */
+static void
+cell_ewma_heap_sift_down(smartlist_t *heap, int idx)
+{
+  const int n = smartlist_len(heap);
+  cell_ewma_t *ewma = EWMA_HEAP_AT(heap, idx);
+  for (;;) {
+    int first = EWMA_HEAP_FIRST_CHILD(idx);
+    int end, best, i;
+    cell_ewma_t *c;
+    if (first >= n)
+      break;
+    end = MIN(first + EWMA_HEAP_ARITY, n);
+    best = first;
+    for (i = first + 1; i < end; ++i) {
+      if (EWMA_HEAP_AT(heap, i)->cell_count <
+          EWMA_HEAP_AT(heap, best)->cell_count)
+        best = i;
+    }
+    c = EWMA_HEAP_AT(heap, best);
+    if (ewma->cell_count <= c->cell_count)
+      break;
+    heap->list[idx] = c;
+    c->heap_index = idx;
+    idx = best;
+  }
+  heap->list[idx] = ewma;
+  ewma->heap_index = idx;
+}
+
 /** Rescale <b>ewma</b> to the same scale as <b>conn</b>, and add it to
  * <b>conn</b>'s priority queue of active circuits */
-static void
+void
 add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma)
 {
+  smartlist_t *heap = conn->active_circuit_pqueue;
   tor_assert(ewma->heap_index == -1);
   scale_single_cell_ewma(ewma,
                          conn->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(conn->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       STRUCT_OFFSET(cell_ewma_t, heap_index),
-                       ewma);
+  smartlist_add(heap, ewma);
+  cell_ewma_heap_sift_up(heap, smartlist_len(heap) - 1);
 }
 
 /** Remove <b>ewma</b> from <b>conn</b>'s priority queue of active circuits */
-static void
+void
 remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
 {
-  tor_assert(ewma->heap_index != -1);
-  smartlist_pqueue_remove(conn->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          STRUCT_OFFSET(cell_ewma_t, heap_index),
-                          ewma);
+  smartlist_t *heap = conn->active_circuit_pqueue;
+  int idx = ewma->heap_index;
+  cell_ewma_t *last;
+  tor_assert(idx != -1);
+  tor_assert(EWMA_HEAP_AT(heap, idx) == ewma);
+
+  last = smartlist_pop_last(heap);
+  if (last != ewma) {
+    heap->list[idx] = last;
+    last->heap_index = idx;
+    cell_ewma_heap_sift_up(heap, idx);
+    cell_ewma_heap_sift_down(heap, last->heap_index);
+  }
+  ewma->heap_index = -1;
 }
 
-/** Remove and return the first cell_ewma_t from conn's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma_from_conn(or_connection_t *conn)
+/** Add <b>increment</b> to the count of <b>ewma</b>, which has just had
+ * cells flushed onto <b>conn</b>, and restore heap order if it's still
+ * among <b>conn</b>'s active circuits.  We do this once per burst of
+ * cells, rather than once per cell. */
+void
+cell_ewma_note_flushed(or_connection_t *conn, cell_ewma_t *ewma,
+                       double increment)
 {
-  return smartlist_pqueue_pop(conn->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              STRUCT_OFFSET(cell_ewma_t, heap_index));
+  ewma->cell_count += increment;
+  if (ewma->heap_index != -1) {
+    tor_assert(EWMA_HEAP_AT(conn->active_circuit_pqueue,
+                            ewma->heap_index) == ewma);
+    cell_ewma_heap_sift_down(conn->active_circuit_pqueue, ewma->heap_index);
+  }
+}
+
+/** Return the EWMA cell count of the circuit that <b>conn</b> would flush
+ * from next, scaled to the current tick so that it can be compared with
+ * counts from other connections.  Return -1 if the cell_ewma algorithm is
+ * disabled, or if <b>conn</b> has no active circuits. */
+double
+cell_ewma_get_next_count(or_connection_t *conn)
+{
+  cell_ewma_t *ewma;
+  unsigned tick, elapsed;
+  if (!ewma_enabled || !smartlist_len(conn->active_circuit_pqueue))
+    return -1.0;
+  ewma = smartlist_get(conn->active_circuit_pqueue, 0);
+  tick = cell_ewma_get_tick();
+  elapsed = tick - conn->active_circuit_pqueue_last_recalibrated;
+  if (elapsed < (unsigned)ewma_n_lazy_ticks)
+    return ewma->cell_count / ewma_tick_weight[elapsed];
+  return ewma->cell_count *
+    get_scale_factor(conn->active_circuit_pqueue_last_recalibrated, tick);
 }
 
 /** Add <b>circ</b> to the list of circuits with pending cells on
@@ -2290,6 +2711,10 @@ make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn)
     /* Already active. */
     return;
   }
+  if (circ->write_blocked_on_bucket) {
+    /* circuit_bucket_unblock() will do this once the bucket is refilled. */
+    return;
+  }
 
   assert_active_circuits_ok_paranoid(conn);
 
@@ -2314,6 +2739,9 @@ make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn)
   }
 
   assert_active_circuits_ok_paranoid(conn);
+
+  if (get_options()->KernelAwareScheduling)
+    scheduler_conn_has_cells(conn);
 }
 
 /** Remove <b>circ</b> from the list of circuits with pending cells on
@@ -2357,6 +2785,54 @@ make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn)
   assert_active_circuits_ok_paranoid(conn);
 }
 
+/** Note that <b>circ</b> has used up its PerCircuitBWRate token bucket,
+ * and take it off the lists of active circuits on both of its connections
+ * so that the other circuits there get their turn. */
+static void
+circuit_bucket_block(circuit_t *circ)
+{
+  or_connection_t *p_conn = TO_OR_CIRCUIT(circ)->p_conn;
+  circ->write_blocked_on_bucket = 1;
+  ++circ->n_bucket_depletions;
+  rep_hist_note_circ_bucket_depleted();
+  if (circ->n_conn)
+    make_circuit_inactive_on_conn(circ, circ->n_conn);
+  if (p_conn)
+    make_circuit_inactive_on_conn(circ, p_conn);
+}
+
+/** Helper for circuit_bucket_unblock(): make <b>circ</b> active again on
+ * <b>conn</b>, where it has <b>queue</b> waiting in <b>direction</b>, unless
+ * it's out of N23 credit there. */
+static void
+circuit_bucket_unblock_on_conn(circuit_t *circ, or_connection_t *conn,
+                               cell_queue_t *queue,
+                               cell_direction_t direction)
+{
+  if (!conn || !queue->n || TO_CONN(conn)->marked_for_close ||
+      circuit_get_n23_stats(circ, direction)->stalled_since.tv_sec)
+    return;
+  make_circuit_active_on_conn(circ, conn);
+  /* As in append_cell_to_circuit_queue(): if nothing is waiting on the
+   * outbuf, nothing will call flushed_some to move these cells along. */
+  if (!get_options()->KernelAwareScheduling &&
+      !connection_get_outbuf_len(TO_CONN(conn)))
+    connection_or_flush_from_first_active_circuit(conn, 1, approx_time());
+}
+
+/** Called when the PerCircuitBWRate token bucket of <b>circ</b> has been
+ * refilled, or shaping turned off: let it send cells again. */
+void
+circuit_bucket_unblock(circuit_t *circ)
+{
+  or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+  circ->write_blocked_on_bucket = 0;
+  circuit_bucket_unblock_on_conn(circ, circ->n_conn, &circ->n_conn_cells,
+                                 CELL_DIRECTION_OUT);
+  circuit_bucket_unblock_on_conn(circ, or_circ->p_conn,
+                                 &or_circ->p_conn_cells, CELL_DIRECTION_IN);
+}
+
 /** Remove all circuits from the list of circuits with pending cells on
  * <b>conn</b>. */
 void
@@ -2455,6 +2931,16 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   cell_ewma_t *cell_ewma = NULL;
   double ewma_increment = -1;
 
+  /* The slab we have taken cells from but not written yet, and the index
+   * of the first such cell. */
+  cell_slab_t *run_slab = NULL;
+  int run_start = 0;
+
+  /* Are we charging this circuit's PerCircuitBWRate bucket, and has it
+   * run dry? */
+  int shape_circ;
+  int bucket_empty = 0;
+
 //find the direction of the cell (the previous queue or the next queue)
 
   int cell_direction_p=0;
@@ -2465,16 +2951,18 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 
   /* See if we're doing the ewma circuit selection algorithm. */
   if (ewma_enabled) {
-    unsigned tick;
-    double fractional_tick;
+    unsigned tick, ticks_elapsed;
+    int step;
     tor_gettimeofday_cached(&now_hires);
-    tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
+    tick = cell_ewma_tick_from_timeval(&now_hires, &step);
 
-    if (tick != conn->active_circuit_pqueue_last_recalibrated) {
+    ticks_elapsed = tick - conn->active_circuit_pqueue_last_recalibrated;
+    if (ticks_elapsed >= (unsigned)ewma_n_lazy_ticks) {
       scale_active_circuits(conn, tick);
+      ticks_elapsed = 0;
     }
 
-    ewma_increment = pow(ewma_scale_factor, -fractional_tick);
+    ewma_increment = ewma_tick_weight[ticks_elapsed] * ewma_step_weight[step];
 
     cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
     circ = cell_ewma_to_circuit(cell_ewma);
@@ -2489,40 +2977,28 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
     cell_direction_p=1; //N23
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
+  shape_circ = get_options()->PerCircuitBWRate && !CIRCUIT_IS_ORIGIN(circ);
 
-  for (n_flushed = 0; n_flushed < max && queue->head; ) {
-    packed_cell_t *cell = cell_queue_pop(queue);
-    //uint8_t command = cell->body[2];//never used?? -RD
+  for (n_flushed = 0; n_flushed < max && queue->n; ) {
+    cell_slab_t *slab = queue->head;
+    int i = slab->first;
     tor_assert(*next_circ_on_conn_p(circ,conn));
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
-      struct timeval tvnow;
       uint32_t flushed;
       uint32_t cell_waiting_time;
-      insertion_time_queue_t *it_queue = queue->insertion_times;
-      tor_gettimeofday_cached(&tvnow);
-      flushed = (uint32_t)((tvnow.tv_sec % SECONDS_IN_A_DAY) * 100L +
-                 (uint32_t)tvnow.tv_usec / (uint32_t)10000L);
-      if (!it_queue || !it_queue->first) {
+      if (slab->insertion_time[i] == CELL_INSERTION_TIME_UNKNOWN) {
         log_info(LD_GENERAL, "Cannot determine insertion time of cell. "
                              "Looks like the CellStatistics option was "
                              "recently enabled.");
       } else {
         or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
-        insertion_time_elem_t *elem = it_queue->first;
+        flushed = cell_insertion_time_now();
         cell_waiting_time =
             (uint32_t)((flushed * 10L + SECONDS_IN_A_DAY * 1000L -
-                        elem->insertion_time * 10L) %
+                        slab->insertion_time[i] * 10L) %
                        (SECONDS_IN_A_DAY * 1000L));
-#undef SECONDS_IN_A_DAY
-        elem->counter--;
-        if (elem->counter < 1) {
-          it_queue->first = elem->next;
-          if (elem == it_queue->last)
-            it_queue->last = NULL;
-          mp_pool_release(elem);
-        }
         orcirc->total_cell_waiting_time += cell_waiting_time;
         orcirc->processed_cells++;
       }
@@ -2530,24 +3006,30 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 
     /* If we just flushed our queue and this circuit is used for a
      * tunneled directory request, possibly advance its state. */
-    if (queue->n == 0 && TO_CONN(conn)->dirreq_id)
+    if (queue->n == 1 && TO_CONN(conn)->dirreq_id)
       geoip_change_dirreq_state(TO_CONN(conn)->dirreq_id,
                                 DIRREQ_TUNNELED,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
 
-    connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
-
-    packed_cell_free_unchecked(cell);
+    /* Cells are written out a slab at a time: whole slabs by handing their
+     * chunk to the outbuf, and the run taken from a partly flushed slab by
+     * copying it once we're done here. */
+    if (slab != run_slab) {
+      tor_assert(!run_slab);
+      run_slab = slab;
+      run_start = i;
+    }
+    if (cell_queue_take_first(queue)) {
+      cell_slab_write_run(conn, run_slab, run_start, 1);
+      run_slab = NULL;
+    }
     ++n_flushed;
-    if (cell_ewma) {
-      cell_ewma_t *tmp;
-      cell_ewma->cell_count += ewma_increment;
-      /* We pop and re-add the cell_ewma_t here, not above, since we need to
-       * re-add it immediately to keep the priority queue consistent with
-       * the linked-list implementation */
-      tmp = pop_first_cell_ewma_from_conn(conn);
-      tor_assert(tmp == cell_ewma);
-      add_cell_ewma_to_conn(conn, cell_ewma);
+    if (shape_circ) {
+      circ->write_bucket -= CELL_NETWORK_SIZE;
+      /* Note this before the N23 check below can bail out: a circuit that
+       * runs out of credit and bucket together still has to be blocked. */
+      if (circ->write_bucket <= 0)
+        bucket_empty = 1;
     }
 
 //mashael_N23
@@ -2569,6 +3051,10 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
       assert_active_circuits_ok_paranoid(conn);
       goto done;
     }
+    if (bucket_empty) {
+      /* This circuit has had its share for now; the others can go. */
+      break;
+    }
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
   assert_active_circuits_ok_paranoid(conn);
@@ -2583,8 +3069,17 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   if (queue->n == 0) {
     log_debug(LD_GENERAL, "Made a circuit inactive.");
     make_circuit_inactive_on_conn(circ, conn);
+    circuit_note_queue_drained(circ);
   }
  done:
+  if (bucket_empty)
+    circuit_bucket_block(circ);
+  if (run_slab)
+    cell_slab_write_run(conn, run_slab, run_start, 0);
+  /* We keep flushing from the same circuit whatever its count, so we only
+   * need to charge it for the whole burst and reheap once, here. */
+  if (cell_ewma && n_flushed)
+    cell_ewma_note_flushed(conn, cell_ewma, n_flushed * ewma_increment);
   if (n_flushed)
     conn->timestamp_last_added_nonpadding = now;
   return n_flushed;
@@ -2614,6 +3109,14 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
   }
 
   cell_queue_append_packed_copy(queue, cell);
+  if (queue->n == 1)
+    circuit_note_cells_queued(circ);
+
+  if (PREDICT_UNLIKELY(cell_queues_check_size())) {
+    /* We might have just closed this circuit to get memory back. */
+    if (circ->marked_for_close)
+      return;
+  }
 
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
@@ -2632,7 +3135,10 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     make_circuit_active_on_conn(circ, orconn);
   }
 
-  if (! connection_get_outbuf_len(TO_CONN(orconn))) {
+  if (get_options()->KernelAwareScheduling) {
+    /* Leave the cell on the queue until the scheduler picks it. */
+    scheduler_conn_has_cells(orconn);
+  } else if (! connection_get_outbuf_len(TO_CONN(orconn))) {
     /* There is no data at all waiting to be sent on the outbuf.  Add a
      * cell, so that we can notice when it gets flushed, flushed_some can
      * get called, and we can start putting more data onto the buffer then.
@@ -2694,36 +3200,123 @@ Similarly, the middle OR sends a flow control cell to the entry OR everytime it
 */
 
 
+/** Return the N3 value that governs cells <b>circ</b> queues in
+ * <b>direction</b>.  OR circuits carry their own adaptive values; origin
+ * circuits always use the configured N3Initial. */
+int
+circuit_get_n3(circuit_t *circ, cell_direction_t direction)
+{
+  or_circuit_t *or_circ;
+  if (CIRCUIT_IS_ORIGIN(circ))
+    return N3;
+  or_circ = TO_OR_CIRCUIT(circ);
+  return (direction == CELL_DIRECTION_OUT) ? or_circ->n3_n : or_circ->n3_p;
+}
+
+/** Return the N23 statistics for <b>circ</b>'s link to n_conn if
+ * <b>direction</b> is CELL_DIRECTION_OUT, or to p_conn otherwise. */
+n23_stats_t *
+circuit_get_n23_stats(circuit_t *circ, cell_direction_t direction)
+{
+  if (direction == CELL_DIRECTION_OUT)
+    return &circ->n_flowctl_stats;
+  return &TO_OR_CIRCUIT(circ)->p_flowctl_stats;
+}
+
+/** Note that <b>circ</b> has run out of N23 credit for sending cells in
+ * <b>direction</b>.  Does nothing if it was already stalled. */
+void
+circuit_n23_stall_begin(circuit_t *circ, cell_direction_t direction)
+{
+  n23_stats_t *stats = circuit_get_n23_stats(circ, direction);
+  if (stats->stalled_since.tv_sec)
+    return;
+  ++stats->n_stalls;
+  tor_gettimeofday_cached(&stats->stalled_since);
+  circ->flowctl_changed = 1;
+}
+
+/** Note that <b>circ</b> has credit again for sending cells in
+ * <b>direction</b>, and account for the time it spent stalled. */
+void
+circuit_n23_stall_end(circuit_t *circ, cell_direction_t direction)
+{
+  n23_stats_t *stats = circuit_get_n23_stats(circ, direction);
+  struct timeval now;
+  long msec;
+  if (!stats->stalled_since.tv_sec)
+    return;
+  tor_gettimeofday_cached(&now);
+  msec = tv_mdiff(&stats->stalled_since, &now);
+  if (msec < 0)
+    msec = 0;
+  stats->stalled_msec += msec;
+  stats->stalled_since.tv_sec = 0;
+  stats->stalled_since.tv_usec = 0;
+  rep_hist_note_n23_stall(msec);
+  circ->flowctl_changed = 1;
+}
+
+/** Adapt the N3 value at *<b>n3</b> to the occupancy of the queue it
+ * governs: the neighbor we send to reports, along with its credit, that it
+ * still holds <b>queue_len</b> of our cells after forwarding a batch of N2.
+ * If it drained the queue completely, it is forwarding faster than we can
+ * feed it, so allow more cells in flight.  If cells are piling up past N2
+ * there, its onward link is the bottleneck, so give back buffer space.
+ *
+ * We must not adapt on our own queue instead: it fills up precisely when
+ * the neighbor withholds credit, which would shrink N3 and so our credit
+ * further, until every slow circuit sat at N3Min.
+ *
+ * The result is always clamped to [N3Min, N3Max], so that a config change
+ * takes effect on existing circuits too. */
+void
+circuit_adapt_n3(int *n3, int queue_len)
+{
+  int val = *n3;
+  if (queue_len == 0)
+    val += N2;
+  else if (queue_len > N2)
+    val -= N2;
+
+  if (val > N3_MAX)
+    val = N3_MAX;
+  if (val < N3_MIN)
+    val = N3_MIN;
+  *n3 = val;
+}
+
 static int
 connection_or_consider_sending_flowcontrol_cell(int cell_direction_p, int nBuffer,
                                                 circuit_t *circ,
                                                 or_connection_t * orconn)
 {
     int credit_balance = 0;
-    or_connection_t *previous_or = NULL;
-    circid_t circ_id;
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
 
 	// printf("Considering sending a credit chip...\n");
     /* IG: In this function, we should reset cells_fwded_{n,p} after
-     * calling connection_or_send_flowcontrol().  (And then just check
+     * calling connection_or_queue_flowcontrol().  (And then just check
      * == N2 (and assert <= N2) instead of (% N2 == 0).) */
 
     /* IG: refactor this so that it ends up with a single call to
-     * connection_or_send_flowcontrol()  [or maybe one for each
+     * connection_or_queue_flowcontrol()  [or maybe one for each
      * direction]. */
 
     if (cell_direction_p) { //cell headed IN (from server towards OP). (going previous previous previous)
-        or_circuit_t *or_circ;
-        previous_or = circ->n_conn;
-        circ_id =circ->n_circ_id;
-        or_circ = TO_OR_CIRCUIT(circ);
         or_circ->credit_balance_p--;
         or_circ->cells_fwded_p++;
+        if (or_circ->cells_fwded_p == N2)
+            rep_hist_note_n23_queue_len(nBuffer);
         credit_balance =or_circ->credit_balance_p;
         if (or_circ->is_first_hop) { //if Entry
-            if (credit_balance == 0) or_circ->credit_balance_p = N2+N3; //if credit balance is zero, reset it coz nobody will send us credit
+            //if credit balance is zero, reset it, since nobody sends us credit
+            if (credit_balance == 0) {
+                or_circ->credit_balance_p = N2+or_circ->n3_p;
+                circ->flowctl_changed = 1;
+            }
             if ( or_circ->cells_fwded_p == N2) {
-                if (nBuffer <N2+N3) connection_or_send_flowcontrol(circ_id,previous_or,or_circ->cells_fwded_p);
+                if (nBuffer <N2+or_circ->n3_p) connection_or_queue_flowcontrol(circ,CELL_DIRECTION_OUT,or_circ->cells_fwded_p);
 		or_circ->cells_fwded_p = 0;
             }
         } else if (!circ->n_conn) { //if Exit
@@ -2732,33 +3325,47 @@ connection_or_consider_sending_flowcontrol_cell(int cell_direction_p, int nBuffe
                 for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
                     connection_stop_reading(TO_CONN(conn));
                 make_circuit_inactive_on_conn(circ,orconn);
+                circuit_n23_stall_begin(circ, CELL_DIRECTION_IN);
             }
         } else {//if Middle
-            if (credit_balance <= 0) make_circuit_inactive_on_conn(circ,orconn);
+            if (credit_balance <= 0) {
+                make_circuit_inactive_on_conn(circ,orconn);
+                circuit_n23_stall_begin(circ, CELL_DIRECTION_IN);
+            }
             if ( or_circ->cells_fwded_p == N2 ) {
-                if (nBuffer <N2+N3)  connection_or_send_flowcontrol(circ_id, previous_or,or_circ->cells_fwded_p);
+                if (nBuffer <N2+or_circ->n3_p)  connection_or_queue_flowcontrol(circ,CELL_DIRECTION_OUT,or_circ->cells_fwded_p);
 		or_circ->cells_fwded_p = 0;
             }
         }
     }
 else { //cell headed OUT (going next next next)
-        previous_or = TO_OR_CIRCUIT(circ)->p_conn;
-        circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
         circ->credit_balance_n--;
         circ->cells_fwded_n++;
+        if (circ->cells_fwded_n == N2)
+            rep_hist_note_n23_queue_len(nBuffer);
         credit_balance=circ->credit_balance_n;
-        if (TO_OR_CIRCUIT(circ)->is_first_hop) { //if Entryi
-            if (credit_balance <= 0) make_circuit_inactive_on_conn(circ,orconn); //wait for credit from Middle
+        if (or_circ->is_first_hop) { //if Entryi
+            if (credit_balance <= 0) { //wait for credit from Middle
+                make_circuit_inactive_on_conn(circ,orconn);
+                circuit_n23_stall_begin(circ, CELL_DIRECTION_OUT);
+            }
         } else if (!circ->n_conn) {//if this node is an EXIT
-            if (credit_balance == 0) circ->credit_balance_n = N2+N3; //reset the balance for myself since no one will send me a credit
+            //reset the balance for myself since no one will send me a credit
+            if (credit_balance == 0) {
+                circ->credit_balance_n = N2+or_circ->n3_n;
+                circ->flowctl_changed = 1;
+            }
             if ( circ->cells_fwded_n == N2) {
-                connection_or_send_flowcontrol(circ_id, previous_or,circ->cells_fwded_n);
+                connection_or_queue_flowcontrol(circ,CELL_DIRECTION_IN,circ->cells_fwded_n);
 		circ->cells_fwded_n = 0;
             }
         } else {//if Middle
-            if (credit_balance <= 0) make_circuit_inactive_on_conn(circ,orconn);
+            if (credit_balance <= 0) {
+                make_circuit_inactive_on_conn(circ,orconn);
+                circuit_n23_stall_begin(circ, CELL_DIRECTION_OUT);
+            }
             if ( circ->cells_fwded_n == N2 ) {
-                connection_or_send_flowcontrol(circ_id, previous_or,circ->cells_fwded_n);
+                connection_or_queue_flowcontrol(circ,CELL_DIRECTION_IN,circ->cells_fwded_n);
 		circ->cells_fwded_n = 0;
             }
         }
@@ -2844,6 +3451,7 @@ circuit_clear_cell_queue(circuit_t *circ, or_connection_t *orconn)
     make_circuit_inactive_on_conn(circ,orconn);
 
   cell_queue_clear(queue);
+  circuit_note_queue_drained(circ);
 }
 
 /** Fail with an assert if the active circuits ring on <b>orconn</b> is
@@ -15,8 +15,15 @@
 extern uint64_t stats_n_relay_cells_relayed;
 extern uint64_t stats_n_relay_cells_delivered;
 
+/** Largest number of cells relay_crypt_batch() handles in one call. */
+#define RELAY_CRYPT_BATCH_MAX 64
+
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_relay_cell_crypted(cell_t *cell, circuit_t *circ,
+                                       cell_direction_t cell_direction);
+int relay_crypt_batch(circuit_t *circ, cell_t **cells, int n,
+                      cell_direction_t cell_direction);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
 void relay_header_unpack(relay_header_t *dest, const uint8_t *src);
@@ -31,6 +38,12 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int *max_cells);
 void connection_edge_consider_sending_sendme(edge_connection_t *conn);
 void circuit_resume_edge_reading(circuit_t *circ, crypt_path_t *layer_hint);
+int circuit_get_n3(circuit_t *circ, cell_direction_t direction);
+void circuit_adapt_n3(int *n3, int queue_len);
+n23_stats_t *circuit_get_n23_stats(circuit_t *circ,
+                                   cell_direction_t direction);
+void circuit_n23_stall_begin(circuit_t *circ, cell_direction_t direction);
+void circuit_n23_stall_end(circuit_t *circ, cell_direction_t direction);
 
 extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
@@ -43,7 +56,6 @@ void clean_cell_pool(void);
 void dump_cell_pool_usage(int severity);
 
 void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
 void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
@@ -55,17 +67,31 @@ int connection_or_flush_from_first_active_circuit(or_connection_t *conn,
 void assert_active_circuits_ok(or_connection_t *orconn);
 void make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn);
 void make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn);
+void circuit_bucket_unblock(circuit_t *circ);
 
 int append_address_to_payload(uint8_t *payload_out, const tor_addr_t *addr);
 const uint8_t *decode_address_from_payload(tor_addr_t *addr_out,
                                         const uint8_t *payload,
                                         int payload_len);
 unsigned cell_ewma_get_tick(void);
+double cell_ewma_get_next_count(or_connection_t *conn);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 void circuit_clear_cell_queue(circuit_t *circ, or_connection_t *orconn);
+size_t cell_queues_get_total_allocation(void);
+uint32_t cell_queue_msec_now(void);
+
+uint32_t cell_trace_now(void);
+void cell_trace_batch_begin(or_connection_t *conn, int n_cells);
+void cell_trace_batch_end(void);
+void cell_trace_note_flushed(or_connection_t *conn, size_t n_bytes);
 
 #ifdef RELAY_PRIVATE
+void cell_queue_drop_first(cell_queue_t *queue);
+void add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma);
+void remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma);
+void cell_ewma_note_flushed(or_connection_t *conn, cell_ewma_t *ewma,
+                            double increment);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
 #endif
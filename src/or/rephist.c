@@ -2995,6 +2995,290 @@ rep_hist_conn_stats_write(time_t now)
   return start_of_conn_stats_interval + WRITE_STATS_INTERVAL;
 }
 
+/*** N23 flow control statistics ***/
+
+/** Number of buckets in each N23 histogram.  Bucket 0 counts zero values;
+ * bucket i > 0 counts values in [2^(i-1), 2^i), and the last bucket also
+ * counts everything larger. */
+#define N23_HIST_BUCKETS 16
+
+/** Histogram of how long circuits stayed without N23 credit, in msec. */
+static uint64_t n23_stall_msec_hist[N23_HIST_BUCKETS];
+/** Histogram of circuit queue lengths each time a circuit finished
+ * forwarding a batch of N2 cells -- the value that the neighbor feeding the
+ * queue adapts its N3 to. */
+static uint64_t n23_queue_len_hist[N23_HIST_BUCKETS];
+/** Total number of N23 credit messages we have sent. */
+static uint64_t n23_credit_sent = 0;
+/** Total number of N23 credit messages we have received. */
+static uint64_t n23_credit_received = 0;
+
+/** Return the N23 histogram bucket that <b>val</b> falls into. */
+static INLINE int
+n23_hist_bucket(uint64_t val)
+{
+  int b;
+  if (!val)
+    return 0;
+  b = tor_log2(val) + 1;
+  return MIN(b, N23_HIST_BUCKETS - 1);
+}
+
+/** Note that a circuit just got N23 credit again after <b>msec</b>
+ * milliseconds without any. */
+void
+rep_hist_note_n23_stall(uint64_t msec)
+{
+  ++n23_stall_msec_hist[n23_hist_bucket(msec)];
+}
+
+/** Note that a circuit forwarded N2 cells and had <b>queue_len</b> cells
+ * left in its queue afterwards. */
+void
+rep_hist_note_n23_queue_len(int queue_len)
+{
+  ++n23_queue_len_hist[n23_hist_bucket(queue_len < 0 ? 0 : queue_len)];
+}
+
+/** Note that we sent a credit message to one of our neighbors. */
+void
+rep_hist_note_n23_credit_sent(void)
+{
+  ++n23_credit_sent;
+}
+
+/** Note that we received a credit message from one of our neighbors. */
+void
+rep_hist_note_n23_credit_received(void)
+{
+  ++n23_credit_received;
+}
+
+/** Helper: append to <b>out</b> a line named <b>name</b> listing each
+ * bucket of <b>hist</b> as lowerbound=count. */
+static void
+n23_format_histogram(smartlist_t *out, const char *name,
+                     const uint64_t *hist)
+{
+  smartlist_t *elts = smartlist_new();
+  char *joined;
+  int i;
+  for (i = 0; i < N23_HIST_BUCKETS; ++i) {
+    smartlist_add_asprintf(elts, U64_FORMAT"="U64_FORMAT,
+                           U64_PRINTF_ARG(i ? (U64_LITERAL(1) << (i-1)) : 0),
+                           U64_PRINTF_ARG(hist[i]));
+  }
+  joined = smartlist_join_strings(elts, " ", 0, NULL);
+  smartlist_add_asprintf(out, "%s %s\n", name, joined);
+  tor_free(joined);
+  SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+  smartlist_free(elts);
+}
+
+/** Return a newly allocated string describing the N23 flow control
+ * histograms and counters we have collected since startup. */
+char *
+rep_hist_format_n23_stats(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  smartlist_add_asprintf(lines, "credit-sent "U64_FORMAT"\n",
+                         U64_PRINTF_ARG(n23_credit_sent));
+  smartlist_add_asprintf(lines, "credit-received "U64_FORMAT"\n",
+                         U64_PRINTF_ARG(n23_credit_received));
+  n23_format_histogram(lines, "stall-msec", n23_stall_msec_hist);
+  n23_format_histogram(lines, "queue-len", n23_queue_len_hist);
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/*** Per-circuit and per-stream token buckets ***/
+
+/** How many times has a circuit used up its PerCircuitBWRate bucket? */
+static uint64_t circ_bucket_depletions = 0;
+/** How many times has an exit stream used up its PerStreamBWRate bucket? */
+static uint64_t stream_bucket_depletions = 0;
+
+/** Note that a circuit has used up its PerCircuitBWRate token bucket. */
+void
+rep_hist_note_circ_bucket_depleted(void)
+{
+  ++circ_bucket_depletions;
+}
+
+/** Note that an exit stream has used up its PerStreamBWRate token
+ * bucket. */
+void
+rep_hist_note_stream_bucket_depleted(void)
+{
+  ++stream_bucket_depletions;
+}
+
+/** Return a newly allocated string describing how often circuits and
+ * streams have run out of their token buckets since startup, and how many
+ * circuits are waiting for theirs to be refilled right now. */
+char *
+rep_hist_format_bucket_stats(void)
+{
+  char *result;
+  circuit_t *circ;
+  int n_blocked = 0;
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    if (circ->write_blocked_on_bucket && !circ->marked_for_close)
+      ++n_blocked;
+  }
+  tor_asprintf(&result,
+               "circuit-depletions "U64_FORMAT"\n"
+               "stream-depletions "U64_FORMAT"\n"
+               "circuits-blocked %d\n",
+               U64_PRINTF_ARG(circ_bucket_depletions),
+               U64_PRINTF_ARG(stream_bucket_depletions),
+               n_blocked);
+  return result;
+}
+
+/*** Cell latency tracing ***/
+
+/** Each power of two of latency is split into 2^CELL_LAT_SUB_BITS linear
+ * sub-buckets, so a bucket's width is at most 1/8 of its lower bound.  All
+ * values below 2^CELL_LAT_SUB_BITS usec get a bucket of their own. */
+#define CELL_LAT_SUB_BITS 3
+/** Number of sub-buckets per power of two. */
+#define CELL_LAT_SUB_BUCKETS (1<<CELL_LAT_SUB_BITS)
+/** Number of buckets needed to cover every 32-bit usec value. */
+#define CELL_LAT_BUCKETS ((32 - CELL_LAT_SUB_BITS + 1) * CELL_LAT_SUB_BUCKETS)
+
+/** Latency histogram and totals for one stage of the relay pipeline. */
+typedef struct cell_latency_hist_t {
+  uint64_t buckets[CELL_LAT_BUCKETS];
+  uint64_t count;
+  uint64_t sum_usec;
+  uint32_t max_usec;
+} cell_latency_hist_t;
+
+/** One histogram per cell_trace_stage_t.  Every stage is timed on the
+ * main thread, so the histograms have a single writer and need no lock. */
+static cell_latency_hist_t cell_latency_hists[CELL_TRACE_N_STAGES];
+
+/** Names of the stages, as shown to the controller. */
+static const char *cell_trace_stage_names[CELL_TRACE_N_STAGES] = {
+  "inbuf", "crypt", "relay", "circqueue", "outbuf", "total",
+};
+
+/** Return the histogram bucket for a latency of <b>usec</b>. */
+static INLINE int
+cell_latency_bucket(uint32_t usec)
+{
+  int e;
+  if (usec < CELL_LAT_SUB_BUCKETS)
+    return (int)usec;
+  e = tor_log2(usec);
+  return (e - CELL_LAT_SUB_BITS + 1) * CELL_LAT_SUB_BUCKETS +
+    (int)((usec >> (e - CELL_LAT_SUB_BITS)) & (CELL_LAT_SUB_BUCKETS - 1));
+}
+
+/** Return the smallest latency that falls into bucket <b>b</b>. */
+static uint32_t
+cell_latency_bucket_lower_bound(int b)
+{
+  int e;
+  if (b < CELL_LAT_SUB_BUCKETS)
+    return (uint32_t)b;
+  e = b / CELL_LAT_SUB_BUCKETS + CELL_LAT_SUB_BITS - 1;
+  return (uint32_t)(CELL_LAT_SUB_BUCKETS + b % CELL_LAT_SUB_BUCKETS)
+    << (e - CELL_LAT_SUB_BITS);
+}
+
+/** Note that <b>n</b> cells each spent <b>usec</b> microseconds in pipeline
+ * stage <b>stage</b>. */
+void
+rep_hist_note_cell_latency(cell_trace_stage_t stage, uint32_t usec,
+                           unsigned n)
+{
+  cell_latency_hist_t *h;
+  tor_assert(stage >= 0 && stage < CELL_TRACE_N_STAGES);
+  h = &cell_latency_hists[stage];
+  h->buckets[cell_latency_bucket(usec)] += n;
+  h->count += n;
+  h->sum_usec += (uint64_t)usec * n;
+  if (usec > h->max_usec)
+    h->max_usec = usec;
+}
+
+/** Forget all cell latency measurements. */
+void
+rep_hist_reset_cell_latency(void)
+{
+  memset(cell_latency_hists, 0, sizeof(cell_latency_hists));
+}
+
+/** Return the lower bound of the bucket that holds the <b>pct</b>th
+ * percentile of <b>h</b>. */
+static uint32_t
+cell_latency_percentile(const cell_latency_hist_t *h, double pct)
+{
+  uint64_t want, seen = 0;
+  int b;
+  if (!h->count)
+    return 0;
+  want = (uint64_t)(h->count * pct / 100.0);
+  if (want >= h->count)
+    want = h->count - 1;
+  for (b = 0; b < CELL_LAT_BUCKETS; ++b) {
+    seen += h->buckets[b];
+    if (seen > want)
+      return cell_latency_bucket_lower_bound(b);
+  }
+  return h->max_usec;
+}
+
+/** Return a newly allocated string describing the per-stage cell latency
+ * histograms: one line per stage with its sample count, total and maximum
+ * latency, some percentiles, and every non-empty bucket as
+ * lowerbound:count.  All times are in microseconds. */
+char *
+rep_hist_format_cell_latency(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int stage, b;
+
+  for (stage = 0; stage < CELL_TRACE_N_STAGES; ++stage) {
+    const cell_latency_hist_t *h = &cell_latency_hists[stage];
+    smartlist_t *elts = smartlist_new();
+    char *joined;
+    for (b = 0; b < CELL_LAT_BUCKETS; ++b) {
+      if (!h->buckets[b])
+        continue;
+      smartlist_add_asprintf(elts, "%lu:"U64_FORMAT,
+                             (unsigned long)cell_latency_bucket_lower_bound(b),
+                             U64_PRINTF_ARG(h->buckets[b]));
+    }
+    joined = smartlist_join_strings(elts, ",", 0, NULL);
+    smartlist_add_asprintf(lines,
+                           "%s count="U64_FORMAT" sum="U64_FORMAT" max=%lu "
+                           "p50=%lu p90=%lu p99=%lu p999=%lu buckets=%s\n",
+                           cell_trace_stage_names[stage],
+                           U64_PRINTF_ARG(h->count),
+                           U64_PRINTF_ARG(h->sum_usec),
+                           (unsigned long)h->max_usec,
+                           (unsigned long)cell_latency_percentile(h, 50),
+                           (unsigned long)cell_latency_percentile(h, 90),
+                           (unsigned long)cell_latency_percentile(h, 99),
+                           (unsigned long)cell_latency_percentile(h, 99.9),
+                           joined);
+    tor_free(joined);
+    SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+    smartlist_free(elts);
+  }
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
 /** Free all storage held by the OR/link history caches, by the
  * bandwidth history arrays, by the port history, or by statistics . */
 void
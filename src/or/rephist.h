@@ -96,5 +96,20 @@ char *rep_hist_format_conn_stats(time_t now);
 time_t rep_hist_conn_stats_write(time_t now);
 void rep_hist_conn_stats_term(void);
 
+void rep_hist_note_n23_stall(uint64_t msec);
+void rep_hist_note_n23_queue_len(int queue_len);
+void rep_hist_note_n23_credit_sent(void);
+void rep_hist_note_n23_credit_received(void);
+char *rep_hist_format_n23_stats(void);
+
+void rep_hist_note_circ_bucket_depleted(void);
+void rep_hist_note_stream_bucket_depleted(void);
+char *rep_hist_format_bucket_stats(void);
+
+void rep_hist_note_cell_latency(cell_trace_stage_t stage, uint32_t usec,
+                                unsigned n);
+void rep_hist_reset_cell_latency(void);
+char *rep_hist_format_cell_latency(void);
+
 #endif
 
@@ -17,6 +17,7 @@
 #include "config.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -57,6 +58,10 @@ static void list_pending_downloads(digestmap_t *result,
                                    int purpose, const char *prefix);
 static void launch_dummy_descriptor_download_as_needed(time_t now,
                                    const or_options_t *options);
+static int router_load_checked_routers(smartlist_t *routers,
+                                       saved_location_t saved_location,
+                                       smartlist_t *requested_fingerprints,
+                                       int descriptor_digests);
 
 DECLARE_TYPED_DIGESTMAP_FNS(sdmap_, digest_sd_map_t, signed_descriptor_t)
 DECLARE_TYPED_DIGESTMAP_FNS(rimap_, digest_ri_map_t, routerinfo_t)
@@ -75,6 +80,23 @@ DECLARE_TYPED_DIGESTMAP_FNS(eimap_, digest_ei_map_t, extrainfo_t)
  * server. */
 static smartlist_t *trusted_dir_servers = NULL;
 
+/** Router descriptors that we have parsed, and whose signatures are being
+ * checked on the signature checking threads. */
+typedef struct router_load_t {
+  /** The routers, in the same order as their signatures in the batch. */
+  smartlist_t *routers;
+  /** As for router_load_routers_from_string(). */
+  smartlist_t *requested_fingerprints;
+  int descriptor_digests;
+  /** What to call once we've added the routers, and what to pass it. */
+  router_load_done_fn done_fn;
+  void *done_arg;
+} router_load_t;
+
+/** Every router_load_t whose signatures haven't been checked yet, or NULL
+ * if there has never been one. */
+static smartlist_t *pending_router_loads = NULL;
+
 /** List of for a given authority, and download status for latest certificate.
  */
 typedef struct cert_list_t {
@@ -2903,6 +2925,10 @@ routerlist_free_all(void)
 {
   routerlist_free(routerlist);
   routerlist = NULL;
+  /* The loads themselves go away when their signature checks are
+   * aborted. */
+  smartlist_free(pending_router_loads);
+  pending_router_loads = NULL;
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -3551,15 +3577,94 @@ router_load_routers_from_string(const char *s, const char *eos,
                                 int descriptor_digests,
                                 const char *prepend_annotations)
 {
-  smartlist_t *routers = smartlist_new(), *changed = smartlist_new();
-  char fp[HEX_DIGEST_LEN+1];
-  const char *msg;
-  int from_cache = (saved_location != SAVED_NOWHERE);
+  smartlist_t *routers = smartlist_new();
   int allow_annotations = (saved_location != SAVED_NOWHERE);
-  int any_changed = 0;
+  int any_changed;
 
   router_parse_list_from_string(&s, eos, routers, saved_location, 0,
                                 allow_annotations, prepend_annotations);
+  any_changed = router_load_checked_routers(routers, saved_location,
+                                            requested_fingerprints,
+                                            descriptor_digests);
+  smartlist_free(routers);
+  return any_changed;
+}
+
+/** Callback for sig_check_batch_run_async(): the signatures on the routers
+ * in the router_load_t <b>arg</b> have been checked.  Add the good ones to
+ * our directory, and tell whoever downloaded them. */
+static void
+router_load_sigs_checked(sig_check_batch_t *batch, int completed, void *arg)
+{
+  router_load_t *load = arg;
+  int n_added = -1;
+
+  if (completed) {
+    smartlist_remove(pending_router_loads, load);
+    routerinfo_list_drop_bad_signatures(load->routers, 0, batch, NULL);
+    n_added = router_load_checked_routers(load->routers, SAVED_NOWHERE,
+                                          load->requested_fingerprints,
+                                          load->descriptor_digests);
+  } else {
+    SMARTLIST_FOREACH(load->routers, routerinfo_t *, ri,
+                      routerinfo_free(ri));
+  }
+  sig_check_batch_free(batch);
+  load->done_fn(n_added, load->done_arg);
+  smartlist_free(load->routers);
+  tor_free(load);
+}
+
+/** As router_load_routers_from_string() for routers that we have just
+ * downloaded, but check their signatures without making the main loop
+ * wait.  Once the good ones are added, call <b>done_fn</b>(n, <b>arg</b>),
+ * where n is the number of routers added, or -1 if we gave up on them
+ * because we're shutting down.  <b>requested_fingerprints</b> must last
+ * until then; the callback may free it.  The callback may run before this
+ * function returns. */
+void
+router_load_routers_from_string_async(const char *s, const char *eos,
+                                      smartlist_t *requested_fingerprints,
+                                      int descriptor_digests,
+                                      const char *prepend_annotations,
+                                      router_load_done_fn done_fn,
+                                      void *arg)
+{
+  router_load_t *load = tor_malloc_zero(sizeof(router_load_t));
+  sig_check_batch_t *batch = sig_check_batch_new();
+
+  load->routers = smartlist_new();
+  load->requested_fingerprints = requested_fingerprints;
+  load->descriptor_digests = descriptor_digests;
+  load->done_fn = done_fn;
+  load->done_arg = arg;
+  router_parse_list_from_string_unchecked(&s, eos, load->routers,
+                                          prepend_annotations, batch);
+  log_info(LD_DIR, "Checking the signatures on %d router descriptors.",
+           smartlist_len(load->routers));
+
+  if (!pending_router_loads)
+    pending_router_loads = smartlist_new();
+  smartlist_add(pending_router_loads, load);
+  sig_check_batch_run_async(batch, router_load_sigs_checked, load);
+}
+
+/** Helper for router_load_routers_from_string() and
+ * router_load_routers_from_string_async(): add the routers in
+ * <b>routers</b>, whose signatures have been checked, to our directory.
+ * Each one is added or freed.  Other arguments and the return value are as
+ * for router_load_routers_from_string(). */
+static int
+router_load_checked_routers(smartlist_t *routers,
+                            saved_location_t saved_location,
+                            smartlist_t *requested_fingerprints,
+                            int descriptor_digests)
+{
+  smartlist_t *changed = smartlist_new();
+  char fp[HEX_DIGEST_LEN+1];
+  const char *msg;
+  int from_cache = (saved_location != SAVED_NOWHERE);
+  int any_changed = 0;
 
   routers_update_status_from_consensus_networkstatus(routers, !from_cache);
 
@@ -3611,7 +3716,6 @@ router_load_routers_from_string(const char *s, const char *eos,
   if (any_changed)
     router_rebuild_store(0, &routerlist->desc_store);
 
-  smartlist_free(routers);
   smartlist_free(changed);
 
   return any_changed;
@@ -3886,6 +3990,20 @@ list_pending_descriptor_downloads(digestmap_t *result, int extrainfo)
   int purpose =
     extrainfo ? DIR_PURPOSE_FETCH_EXTRAINFO : DIR_PURPOSE_FETCH_SERVERDESC;
   list_pending_downloads(result, purpose, "d/");
+
+  /* Don't fetch descriptors again while we check their signatures. */
+  if (!extrainfo && pending_router_loads) {
+    SMARTLIST_FOREACH_BEGIN(pending_router_loads, router_load_t *, load) {
+      if (!load->descriptor_digests || !load->requested_fingerprints)
+        continue;
+      SMARTLIST_FOREACH_BEGIN(load->requested_fingerprints, const char *,
+                              hex) {
+        char d[DIGEST_LEN];
+        if (!base16_decode(d, sizeof(d), hex, strlen(hex)))
+          digestmap_set(result, d, (void*)1);
+      } SMARTLIST_FOREACH_END(hex);
+    } SMARTLIST_FOREACH_END(load);
+  }
 }
 
 /** For every microdescriptor we are currently downloading by descriptor
@@ -119,6 +119,15 @@ int router_load_routers_from_string(const char *s, const char *eos,
                                      smartlist_t *requested_fingerprints,
                                      int descriptor_digests,
                                      const char *prepend_annotations);
+/** Called by router_load_routers_from_string_async() with the number of
+ * routers added, or -1 if we gave up on them. */
+typedef void (*router_load_done_fn)(int n_added, void *arg);
+void router_load_routers_from_string_async(const char *s, const char *eos,
+                                      smartlist_t *requested_fingerprints,
+                                      int descriptor_digests,
+                                      const char *prepend_annotations,
+                                      router_load_done_fn done_fn,
+                                      void *arg);
 void router_load_extrainfo_from_string(const char *s, const char *eos,
                                        saved_location_t saved_location,
                                        smartlist_t *requested_fingerprints,
@@ -9,9 +9,11 @@
  * \brief Code to parse and validate router descriptors and directories.
  **/
 
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 #include "config.h"
 #include "circuitbuild.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "policies.h"
@@ -23,6 +25,7 @@
 #include "networkstatus.h"
 #include "rephist.h"
 #include "routerparse.h"
+#include "workqueue.h"
 #undef log
 #include <math.h>
 
@@ -570,6 +573,11 @@ static directory_token_t *get_next_token(memarea_t *area,
                                          token_rule_t *table);
 #define CST_CHECK_AUTHORITY   (1<<0)
 #define CST_NO_CHECK_OBJTYPE  (1<<1)
+static routerinfo_t *router_parse_entry_from_string_impl(
+                                       const char *s, const char *end,
+                                       int cache_copy, int allow_annotations,
+                                       const char *prepend_annotations,
+                                       sig_check_batch_t *batch);
 static int check_signature_token(const char *digest,
                                  ssize_t digest_len,
                                  directory_token_t *tok,
@@ -1049,30 +1057,21 @@ dir_signing_key_is_trusted(crypto_pk_t *key)
   return 1;
 }
 
-/** Check whether the object body of the token in <b>tok</b> has a good
- * signature for <b>digest</b> using key <b>pkey</b>.  If
- * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
- * a directory authority.  If <b>CST_NO_CHECK_OBJTYPE</b> is set, do not check
- * the object type of the signature object. Use <b>doctype</b> as the type of
- * the document when generating log messages.  Return 0 on success, negative
- * on failure.
- */
+/** Helper for check_signature_token() and queue_signature_token(): return
+ * 0 if the token in <b>tok</b> is the sort of signature object that
+ * <b>flags</b> asks for, made with an acceptable key <b>pkey</b>, and
+ * negative otherwise. */
 static int
-check_signature_token(const char *digest,
-                      ssize_t digest_len,
-                      directory_token_t *tok,
-                      crypto_pk_t *pkey,
-                      int flags,
-                      const char *doctype)
+check_signature_token_is_usable(directory_token_t *tok,
+                                crypto_pk_t *pkey,
+                                int flags,
+                                const char *doctype)
 {
-  char *signed_digest;
-  size_t keysize;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
   tor_assert(pkey);
   tor_assert(tok);
-  tor_assert(digest);
   tor_assert(doctype);
 
   if (check_authority && !dir_signing_key_is_trusted(pkey)) {
@@ -1087,6 +1086,31 @@ check_signature_token(const char *digest,
       return -1;
     }
   }
+  return 0;
+}
+
+/** Check whether the object body of the token in <b>tok</b> has a good
+ * signature for <b>digest</b> using key <b>pkey</b>.  If
+ * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
+ * a directory authority.  If <b>CST_NO_CHECK_OBJTYPE</b> is set, do not check
+ * the object type of the signature object. Use <b>doctype</b> as the type of
+ * the document when generating log messages.  Return 0 on success, negative
+ * on failure.
+ */
+static int
+check_signature_token(const char *digest,
+                      ssize_t digest_len,
+                      directory_token_t *tok,
+                      crypto_pk_t *pkey,
+                      int flags,
+                      const char *doctype)
+{
+  char *signed_digest;
+  size_t keysize;
+
+  tor_assert(digest);
+  if (check_signature_token_is_usable(tok, pkey, flags, doctype) < 0)
+    return -1;
 
   keysize = crypto_pk_keysize(pkey);
   signed_digest = tor_malloc(keysize);
@@ -1108,6 +1132,26 @@ check_signature_token(const char *digest,
   return 0;
 }
 
+/** As check_signature_token(), but instead of checking the signature, add
+ * it to <b>batch</b> for sig_check_batch_run() to check later.  Return 0 if
+ * we added it, and negative if the signature is unusable. */
+static int
+queue_signature_token(sig_check_batch_t *batch,
+                      const char *digest,
+                      ssize_t digest_len,
+                      directory_token_t *tok,
+                      crypto_pk_t *pkey,
+                      int flags,
+                      const char *doctype)
+{
+  tor_assert(digest);
+  if (check_signature_token_is_usable(tok, pkey, flags, doctype) < 0)
+    return -1;
+  sig_check_batch_add(batch, digest, digest_len,
+                      tok->object_body, tok->object_size, pkey);
+  return 0;
+}
+
 /** Helper: move *<b>s_ptr</b> ahead to the next router, the next extra-info,
  * or to the first of the annotations proceeding the next router or
  * extra-info---whichever comes first.  Set <b>is_extrainfo_out</b> to true if
@@ -1146,25 +1190,20 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
-/** Given a string *<b>s</b> containing a concatenated sequence of router
- * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
- * them and stores the result in <b>dest</b>.  All routers are marked running
- * and valid.  Advances *s to a point immediately following the last router
- * entry.  Ignore any trailing router entries that are not complete.
- *
- * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
- * isn't SAVED_NOWHERE, remember the offset of each descriptor.
- *
- * Returns 0 on success and -1 on failure.
- */
-int
-router_parse_list_from_string(const char **s, const char *eos,
-                              smartlist_t *dest,
-                              saved_location_t saved_location,
-                              int want_extrainfo,
-                              int allow_annotations,
-                              const char *prepend_annotations)
+/** Helper for router_parse_list_from_string() and
+ * router_parse_list_from_string_unchecked(): parse as the former does, but
+ * if <b>batch</b> is given, add the signature of each router descriptor we
+ * parse to it, rather than checking it, and if <b>batch_starts</b> is
+ * given, add the start of each one to it. */
+static int
+router_parse_list_from_string_impl(const char **s, const char *eos,
+                                   smartlist_t *dest,
+                                   saved_location_t saved_location,
+                                   int want_extrainfo,
+                                   int allow_annotations,
+                                   const char *prepend_annotations,
+                                   sig_check_batch_t *batch,
+                                   smartlist_t *batch_starts)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
@@ -1208,16 +1247,18 @@ router_parse_list_from_string(const char **s, const char *eos,
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations);
+      router = router_parse_entry_from_string_impl(*s, end,
+                                            saved_location != SAVED_IN_CACHE,
+                                            allow_annotations,
+                                            prepend_annotations, batch);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
                   router_purpose_to_string(router->purpose));
         signed_desc = &router->cache_info;
         elt = router;
+        if (batch_starts)
+          smartlist_add(batch_starts, (char *)*s);
       }
     }
     if (!elt) {
@@ -1235,6 +1276,103 @@ router_parse_list_from_string(const char **s, const char *eos,
   return 0;
 }
 
+/** Given a string *<b>s</b> containing a concatenated sequence of router
+ * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
+ * them and stores the result in <b>dest</b>.  All routers are marked running
+ * and valid.  Advances *s to a point immediately following the last router
+ * entry.  Ignore any trailing router entries that are not complete.
+ *
+ * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
+ * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
+ * isn't SAVED_NOWHERE, remember the offset of each descriptor.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int
+router_parse_list_from_string(const char **s, const char *eos,
+                              smartlist_t *dest,
+                              saved_location_t saved_location,
+                              int want_extrainfo,
+                              int allow_annotations,
+                              const char *prepend_annotations)
+{
+  /* Router descriptor signatures we have yet to check, and the start of
+   * each descriptor, for dump_desc(). */
+  sig_check_batch_t *batch;
+  smartlist_t *batch_starts;
+  int first_router_idx = smartlist_len(dest);
+  int r;
+
+  if (want_extrainfo)
+    return router_parse_list_from_string_impl(s, eos, dest, saved_location,
+                                              1, allow_annotations,
+                                              prepend_annotations,
+                                              NULL, NULL);
+
+  batch = sig_check_batch_new();
+  batch_starts = smartlist_new();
+  r = router_parse_list_from_string_impl(s, eos, dest, saved_location, 0,
+                                         allow_annotations,
+                                         prepend_annotations,
+                                         batch, batch_starts);
+  /* Every router we added to dest has its signature in the batch, in
+   * order.  Check them all at once, and keep only the good ones. */
+  sig_check_batch_run(batch);
+  routerinfo_list_drop_bad_signatures(dest, first_router_idx, batch,
+                                      batch_starts);
+  sig_check_batch_free(batch);
+  smartlist_free(batch_starts);
+  return r;
+}
+
+/** As router_parse_list_from_string() for router descriptors, but don't
+ * check their signatures: add the signature of each router we add to
+ * <b>dest</b> to <b>batch</b>, in the same order.  The caller must check
+ * them, and then call routerinfo_list_drop_bad_signatures().  Since the
+ * routers may outlive *<b>s</b>, <b>saved_location</b> must be
+ * SAVED_NOWHERE. */
+int
+router_parse_list_from_string_unchecked(const char **s, const char *eos,
+                                        smartlist_t *dest,
+                                        const char *prepend_annotations,
+                                        sig_check_batch_t *batch)
+{
+  tor_assert(batch);
+  return router_parse_list_from_string_impl(s, eos, dest, SAVED_NOWHERE, 0,
+                                            0, prepend_annotations,
+                                            batch, NULL);
+}
+
+/** Given the routers in <b>routers</b> from index <b>first_idx</b> on,
+ * whose signatures are in the checked <b>batch</b> in the same order, free
+ * and remove every one whose signature is bad, keeping the others in order.
+ * If <b>starts</b> is given, it holds the start of the text of each router
+ * to dump; otherwise we dump its signed_descriptor_body. */
+void
+routerinfo_list_drop_bad_signatures(smartlist_t *routers, int first_idx,
+                                    const sig_check_batch_t *batch,
+                                    const smartlist_t *starts)
+{
+  int i, n_kept = first_idx;
+  tor_assert(smartlist_len(routers) - first_idx ==
+             sig_check_batch_len(batch));
+  for (i = 0; i < sig_check_batch_len(batch); ++i) {
+    routerinfo_t *router = smartlist_get(routers, first_idx + i);
+    if (sig_check_batch_is_ok(batch, i)) {
+      smartlist_set(routers, n_kept++, router);
+    } else {
+      log_warn(LD_DIR, "Error reading router descriptor: invalid "
+               "signature.");
+      dump_desc(starts ? smartlist_get(starts, i) :
+                  router->cache_info.signed_descriptor_body,
+                "router descriptor");
+      routerinfo_free(router);
+    }
+  }
+  while (smartlist_len(routers) > n_kept)
+    smartlist_del_keeporder(routers, smartlist_len(routers) - 1);
+}
+
 /* For debugging: define to count every descriptor digest we've seen so we
  * know if we need to try harder to avoid duplicate verifies. */
 #undef COUNT_DISTINCT_DIGESTS
@@ -1316,6 +1454,21 @@ routerinfo_t *
 router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations)
+{
+  return router_parse_entry_from_string_impl(s, end, cache_copy,
+                                             allow_annotations,
+                                             prepend_annotations, NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>batch</b> is set, don't
+ * check the router's signature: add it to <b>batch</b> instead, if and only
+ * if we return a router.  The caller must throw the router away if the
+ * signature turns out to be bad. */
+static routerinfo_t *
+router_parse_entry_from_string_impl(const char *s, const char *end,
+                                    int cache_copy, int allow_annotations,
+                                    const char *prepend_annotations,
+                                    sig_check_batch_t *batch)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1611,7 +1764,8 @@ router_parse_entry_from_string(const char *s, const char *end,
     verified_digests = digestmap_new();
   digestmap_set(verified_digests, signed_digest, (void*)(uintptr_t)1);
 #endif
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
+  if (!batch &&
+      check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
                             "router descriptor") < 0)
     goto err;
 
@@ -1624,6 +1778,13 @@ router_parse_entry_from_string(const char *s, const char *end,
     router->platform = tor_strdup("<unknown>");
   }
 
+  /* Last, so that we only queue the signature if we return the router. */
+  if (batch &&
+      queue_signature_token(batch, digest, DIGEST_LEN, tok,
+                            router->identity_pkey, 0,
+                            "router descriptor") < 0)
+    goto err;
+
   goto done;
 
  err:
@@ -1981,6 +2142,18 @@ find_start_of_next_routerstatus(const char *s)
     return eos;
 }
 
+/** Return an escaped copy of <b>s</b>, as escaped() would, but allocated in
+ * <b>area</b> rather than in a static buffer, so that it's safe to use off
+ * the main thread.  The copy lives until <b>area</b> is next cleared. */
+static const char *
+escaped_in_area(memarea_t *area, const char *s)
+{
+  char *esc = esc_for_log(s);
+  char *result = memarea_strdup(area, esc);
+  tor_free(esc);
+  return result;
+}
+
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
  * empty smartlist at <b>tokens</b>, parse and return the first router status
  * object in the string, and advance *<b>s</b> to just after the end of the
@@ -1994,6 +2167,13 @@ find_start_of_next_routerstatus(const char *s)
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>failed_entries</b> and <b>deferred_entries</b> are provided, we're
+ * running off the main thread.  Then don't dump an unparseable entry to
+ * disk, but add its start to <b>failed_entries</b> for our caller to dump
+ * instead; and don't parse an entry that needs code we can't safely run
+ * here, but add its start to <b>deferred_entries</b> and return NULL.
+ * Different threads must use different <b>area</b>s and <b>tokens</b>.
  **/
 static routerstatus_t *
 routerstatus_parse_entry_from_string(memarea_t *area,
@@ -2001,7 +2181,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      networkstatus_t *vote,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
-                                     consensus_flavor_t flav)
+                                     consensus_flavor_t flav,
+                                     smartlist_t *failed_entries,
+                                     smartlist_t *deferred_entries)
 {
   const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
@@ -2046,21 +2228,21 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!is_legal_nickname(tok->args[0])) {
     log_warn(LD_DIR,
              "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             escaped_in_area(area, tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
     log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+             escaped_in_area(area, tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
       log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+               escaped_in_area(area, tok->args[2]));
       goto err;
     }
   }
@@ -2076,7 +2258,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
     log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+             escaped_in_area(area, tok->args[5+offset]));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -2088,6 +2270,15 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   {
     smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
+    if (a_lines && deferred_entries) {
+      /* The address parser logs through escaped(). */
+      smartlist_free(a_lines);
+      smartlist_add(deferred_entries, (char*)s_dup);
+      if (!vote_rs)
+        routerstatus_free(rs);
+      rs = NULL;
+      goto done;
+    }
     if (a_lines) {
       find_single_ipv6_orport(a_lines, &rs->ipv6_addr, &rs->ipv6_orport);
       smartlist_free(a_lines);
@@ -2104,7 +2295,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
         vote_rs->flags |= (U64_LITERAL(1)<<p);
       } else {
         log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+                 escaped_in_area(area, tok->args[i]));
         goto err;
       }
     }
@@ -2169,7 +2360,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                                   10, 0, UINT32_MAX,
                                                   &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          log_warn(LD_DIR, "Invalid Bandwidth %s",
+                   escaped_in_area(area, tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -2180,7 +2372,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
           log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+                   escaped_in_area(area, tok->args[i]));
           goto err;
         }
         rs->has_measured_bw = 1;
@@ -2194,7 +2386,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
       log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+               escaped_in_area(area, tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -2221,14 +2413,17 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
         log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+                 escaped_in_area(area, tok->args[0]));
         goto err;
       }
     } else {
+      char id_hex[HEX_DIGEST_LEN+1], addr_buf[INET_NTOA_BUF_LEN];
+      base16_encode(id_hex, sizeof(id_hex), rs->identity_digest, DIGEST_LEN);
+      in.s_addr = htonl(rs->addr);
+      tor_inet_ntoa(&in, addr_buf, sizeof(addr_buf));
       log_info(LD_BUG, "Found an entry in networkstatus with no "
                "microdescriptor digest. (Router %s=%s at %s:%d.)",
-               rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
-               fmt_addr32(rs->addr), rs->or_port);
+               rs->nickname, id_hex, addr_buf, rs->or_port);
     }
   }
 
@@ -2237,7 +2432,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  if (failed_entries)
+    smartlist_add(failed_entries, (char*)s_dup);
+  else
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -2253,6 +2451,262 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** Parse routerstatus entries for the vote or consensus <b>ns</b> of flavor
+ * <b>flav</b>, starting at *<b>s</b> and stopping at the first thing that
+ * isn't one, or at <b>end</b> if it is given.  Add the entries we can parse
+ * to <b>out</b> in order, and advance *<b>s</b> past all of them.
+ * <b>area</b>, <b>tokens</b>, <b>failed_entries</b> and
+ * <b>deferred_entries</b> are as for routerstatus_parse_entry_from_string();
+ * add a NULL to <b>out</b> in place of each deferred entry. */
+void
+parse_routerstatus_entries(memarea_t *area, smartlist_t *tokens,
+                           const char **s, const char *end,
+                           networkstatus_t *ns, consensus_flavor_t flav,
+                           smartlist_t *out, smartlist_t *failed_entries,
+                           smartlist_t *deferred_entries)
+{
+  int n_deferred = deferred_entries ? smartlist_len(deferred_entries) : 0;
+  while ((!end || *s < end) && !strcmpstart(*s, "r ")) {
+    if (ns->type != NS_TYPE_CONSENSUS) {
+      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+      if (routerstatus_parse_entry_from_string(area, s, tokens, ns,
+                                               rs, 0, 0, failed_entries,
+                                               deferred_entries))
+        smartlist_add(out, rs);
+      else
+        vote_routerstatus_free(rs);
+    } else {
+      routerstatus_t *rs;
+      if ((rs = routerstatus_parse_entry_from_string(area, s, tokens,
+                                                     NULL, NULL,
+                                                     ns->consensus_method,
+                                                     flav, failed_entries,
+                                                     deferred_entries)))
+        smartlist_add(out, rs);
+    }
+    if (deferred_entries && smartlist_len(deferred_entries) > n_deferred) {
+      smartlist_add(out, NULL);
+      ++n_deferred;
+    }
+  }
+}
+
+/** Don't give a routerstatus parsing job fewer bytes than this: below about
+ * this size, handing the job off costs more than parsing it here. */
+#define MIN_ROUTERSTATUS_PARSE_JOB_LEN (32*1024)
+
+/** A piece of a networkstatus document whose routerstatus entries we've
+ * handed to the directory workers. */
+typedef struct routerstatus_parse_job_t {
+  /** Must be first. */
+  workqueue_job_t base;
+  /** The networkstatus we're parsing entries for.  Workers only read it. */
+  networkstatus_t *ns;
+  /** The flavor of <b>ns</b>. */
+  consensus_flavor_t flav;
+  /** Start of the first entry in this piece. */
+  const char *start;
+  /** Start of the first entry in the next piece. */
+  const char *end;
+  /** Where the worker stopped parsing: <b>end</b>, unless the document
+   * wasn't split where we thought it was. */
+  const char *stopped_at;
+  /** The entries the worker parsed, in order, with a NULL in place of each
+   * entry it left for the main thread. */
+  smartlist_t *entries;
+  /** The start of each entry the worker couldn't parse, in order. */
+  smartlist_t *failed_entries;
+  /** The start of each entry the worker left for the main thread, in
+   * order. */
+  smartlist_t *deferred_entries;
+  /** True iff the entries have been parsed. */
+  unsigned int completed:1;
+} routerstatus_parse_job_t;
+
+/** Parse all the entries in <b>job</b>'s piece of its networkstatus, using
+ * a memarea of the job's own. */
+static void
+routerstatus_parse_job_run(routerstatus_parse_job_t *job)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *s = job->start;
+  parse_routerstatus_entries(area, tokens, &s, job->end, job->ns, job->flav,
+                             job->entries, job->failed_entries,
+                             job->deferred_entries);
+  job->stopped_at = s;
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Work function for routerstatus parsing jobs.  Runs on a directory
+ * worker. */
+static void
+routerstatus_parse_job_work(workqueue_job_t *_job, void *thread_state)
+{
+  (void)thread_state;
+  routerstatus_parse_job_run((routerstatus_parse_job_t *)_job);
+}
+
+/** Reply function for routerstatus parsing jobs. */
+static void
+routerstatus_parse_job_reply(workqueue_job_t *_job, int completed)
+{
+  routerstatus_parse_job_t *job = (routerstatus_parse_job_t *)_job;
+  job->completed = completed;
+}
+
+/** Free every entry that <b>job</b> parsed for a networkstatus of type
+ * <b>type</b>, and the lists that held them. */
+static void
+routerstatus_parse_job_clear(routerstatus_parse_job_t *job,
+                             networkstatus_type_t type)
+{
+  if (type != NS_TYPE_CONSENSUS) {
+    SMARTLIST_FOREACH(job->entries, vote_routerstatus_t *, rs,
+                      vote_routerstatus_free(rs));
+  } else {
+    SMARTLIST_FOREACH(job->entries, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+  }
+  smartlist_free(job->entries);
+  smartlist_free(job->failed_entries);
+  smartlist_free(job->deferred_entries);
+}
+
+/** Return the end of the routerstatus entries in the networkstatus whose
+ * first entry starts at <b>s</b>: the start of the directory footer or the
+ * first signature, or else the end of the string.  This is where
+ * find_start_of_next_routerstatus() will stop the last entry. */
+static const char *
+find_end_of_routerstatus_entries(const char *s)
+{
+  const char *footer = strstr(s, "\ndirectory-footer");
+  const char *sig = strstr(s, "\ndirectory-signature");
+  if (footer && sig)
+    return MIN(footer, sig) + 1;
+  else if (footer)
+    return footer + 1;
+  else if (sig)
+    return sig + 1;
+  else
+    return s + strlen(s);
+}
+
+/** If there are enough routerstatus entries starting at *<b>s</b> to be
+ * worth it, split them into pieces at entry boundaries, parse the pieces on
+ * the directory workers and this thread at once, and add the results to
+ * <b>ns</b>-\>routerstatus_list, advancing *<b>s</b> past them.  The
+ * result, including which entries get dumped as unparseable, is the same as
+ * parse_routerstatus_entries() would give; call that afterwards to parse
+ * anything we didn't. */
+void
+parse_routerstatus_entries_in_parallel(const char **s, networkstatus_t *ns,
+                                       consensus_flavor_t flav)
+{
+  routerstatus_parse_job_t *jobs;
+  workqueue_t *wq;
+  const char *start = *s, *end, *cut;
+  int n_threads = 0, n_jobs, n_waiting = 0, ok = 1, i;
+
+  if (strcmpstart(start, "r "))
+    return;
+  end = find_end_of_routerstatus_entries(start);
+  n_jobs = (int)((end - start) / MIN_ROUTERSTATUS_PARSE_JOB_LEN);
+  if (n_jobs < 2 || !(wq = cpuworker_get_dir_queue(&n_threads)))
+    return;
+  if (n_jobs > n_threads + 1)
+    n_jobs = n_threads + 1;
+
+  jobs = tor_malloc_zero(sizeof(routerstatus_parse_job_t) * n_jobs);
+  cut = start;
+  for (i = 0; i < n_jobs; ++i) {
+    routerstatus_parse_job_t *job = &jobs[i];
+    job->ns = ns;
+    job->flav = flav;
+    job->start = cut;
+    if (i == n_jobs - 1) {
+      cut = end;
+    } else {
+      /* Every entry starts with "r " at the start of a line; that's where
+       * find_start_of_next_routerstatus() ends the one before it. */
+      const char *target = MAX(cut, start + (end - start) / n_jobs * (i+1));
+      const char *next = tor_memstr(target, end - target, "\nr ");
+      cut = next ? next + 1 : end;
+    }
+    job->end = job->stopped_at = cut;
+    job->entries = smartlist_new();
+    job->failed_entries = smartlist_new();
+    job->deferred_entries = smartlist_new();
+  }
+
+  /* Hand out every piece but the first, which we parse ourselves.  Any
+   * piece the queue won't take, we parse here too. */
+  for (i = 1; i < n_jobs; ++i) {
+    routerstatus_parse_job_t *job = &jobs[i];
+    job->base.work_fn = routerstatus_parse_job_work;
+    job->base.reply_fn = routerstatus_parse_job_reply;
+    if (job->start < job->end && workqueue_add(wq, &job->base) == 0)
+      ++n_waiting;
+  }
+  routerstatus_parse_job_run(&jobs[0]);
+  jobs[0].completed = 1;
+  while (n_waiting)
+    n_waiting -= workqueue_wait_for_replies(wq);
+  for (i = 0; i < n_jobs; ++i) {
+    if (!jobs[i].completed) {
+      /* The queue was full or shutting down, or the piece was empty. */
+      routerstatus_parse_job_run(&jobs[i]);
+    }
+    if (jobs[i].stopped_at != jobs[i].end)
+      ok = 0;
+  }
+
+  if (ok) {
+    memarea_t *area = memarea_new();
+    smartlist_t *tokens = smartlist_new();
+    for (i = 0; i < n_jobs; ++i) {
+      routerstatus_parse_job_t *job = &jobs[i];
+      int deferred_idx = 0, failed_idx = 0;
+      const char *failed;
+      SMARTLIST_FOREACH_BEGIN(job->entries, void *, rs) {
+        if (rs) {
+          smartlist_add(ns->routerstatus_list, rs);
+        } else {
+          const char *cp = smartlist_get(job->deferred_entries,
+                                         deferred_idx++);
+          /* Keep dumps in document order, as dump_desc() is rate-limited. */
+          while (failed_idx < smartlist_len(job->failed_entries) &&
+                 (failed = smartlist_get(job->failed_entries,
+                                         failed_idx)) < cp) {
+            dump_desc(failed, "routerstatus entry");
+            ++failed_idx;
+          }
+          parse_routerstatus_entries(area, tokens, &cp, cp+1, ns, flav,
+                                     ns->routerstatus_list, NULL, NULL);
+        }
+      } SMARTLIST_FOREACH_END(rs);
+      smartlist_clear(job->entries);
+      while (failed_idx < smartlist_len(job->failed_entries)) {
+        failed = smartlist_get(job->failed_entries, failed_idx++);
+        dump_desc(failed, "routerstatus entry");
+      }
+    }
+    smartlist_free(tokens);
+    memarea_drop_all(area);
+    *s = end;
+  } else {
+    /* We split the document somewhere that parse_routerstatus_entries()
+     * wouldn't have stopped.  That shouldn't happen, but if it does, throw
+     * the pieces away and let our caller parse it all in order. */
+    log_info(LD_BUG, "Routerstatus entries weren't where we expected; "
+             "parsing them again on the main thread.");
+  }
+  for (i = 0; i < n_jobs; ++i)
+    routerstatus_parse_job_clear(&jobs[i], ns->type);
+  tor_free(jobs);
+}
+
 /** Helper to sort a smartlist of pointers to routerstatus_t */
 int
 compare_routerstatus_entries(const void **_a, const void **_b)
@@ -2399,7 +2853,8 @@ networkstatus_v2_parse_from_string(const char *s)
   while (!strcmpstart(s, "r ")) {
     routerstatus_t *rs;
     if ((rs = routerstatus_parse_entry_from_string(area, &s, tokens,
-                                                   NULL, NULL, 0, 0)))
+                                                   NULL, NULL, 0, 0,
+                                                   NULL, NULL)))
       smartlist_add(ns->entries, rs);
   }
   smartlist_sort(ns->entries, compare_routerstatus_entries);
@@ -3158,25 +3613,9 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
-  while (!strcmpstart(s, "r ")) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
-                                               rs, 0, 0))
-        smartlist_add(ns->routerstatus_list, rs);
-      else {
-        tor_free(rs->version);
-        tor_free(rs);
-      }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav)))
-        smartlist_add(ns->routerstatus_list, rs);
-    }
-  }
+  parse_routerstatus_entries_in_parallel(&s, ns, flav);
+  parse_routerstatus_entries(rs_area, rs_tokens, &s, NULL, ns, flav,
+                             ns->routerstatus_list, NULL, NULL);
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
     routerstatus_t *rs1, *rs2;
     if (ns->type != NS_TYPE_CONSENSUS) {
@@ -31,6 +31,14 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   int is_extrainfo,
                                   int allow_annotations,
                                   const char *prepend_annotations);
+struct sig_check_batch_t;
+int router_parse_list_from_string_unchecked(const char **s, const char *eos,
+                                        smartlist_t *dest,
+                                        const char *prepend_annotations,
+                                        struct sig_check_batch_t *batch);
+void routerinfo_list_drop_bad_signatures(smartlist_t *routers, int first_idx,
+                                   const struct sig_check_batch_t *batch,
+                                   const smartlist_t *starts);
 int router_parse_runningrouters(const char *str);
 int router_parse_directory(const char *str);
 
@@ -84,5 +92,18 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
                                    size_t intro_points_encoded_size);
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
 
+#ifdef ROUTERPARSE_PRIVATE
+struct memarea_t;
+void parse_routerstatus_entries(struct memarea_t *area, smartlist_t *tokens,
+                                const char **s, const char *end,
+                                networkstatus_t *ns, consensus_flavor_t flav,
+                                smartlist_t *out,
+                                smartlist_t *failed_entries,
+                                smartlist_t *deferred_entries);
+void parse_routerstatus_entries_in_parallel(const char **s,
+                                            networkstatus_t *ns,
+                                            consensus_flavor_t flav);
+#endif
+
 #endif
 
@@ -0,0 +1,249 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.c
+ * \brief Decide which circuit's cells to write next across all OR
+ * connections at once, writing no more than each socket can send.
+ *
+ * Ordinarily, each OR connection moves cells from its circuits' queues onto
+ * its outbuf whenever the outbuf drops below OR_CONN_LOWWATER.  Those cells
+ * then wait in the outbuf and in the kernel's socket buffer, where nothing
+ * can reorder them, however quiet the circuit that queues a cell next.
+ *
+ * With KernelAwareScheduling, a connection with cells to send just asks to
+ * be scheduled.  Once per pass through the event loop, we ask the kernel
+ * how much each waiting connection's socket could put on the wire right
+ * now, and hand out cells a few at a time: always from the circuit with the
+ * lowest EWMA cell count among all the connections that still have room, or
+ * round-robin between connections when the cell_ewma algorithm is off.
+ **/
+
+#define SCHEDULER_PRIVATE
+#include "or.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "relay.h"
+#include "scheduler.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+
+#if defined(TCP_INFO) && defined(SIOCOUTQNSD)
+/** Defined if we can ask the kernel about a TCP socket's congestion window
+ * and how much unsent data it holds. */
+#define USE_TCP_INFO
+#endif
+
+/** How long do we wait before looking again at a connection whose socket
+ * had no room for any cells, and whose outbuf is empty? */
+#define SCHEDULER_RETRY_MSEC 10
+
+/** How many cells do we write from a circuit before we choose again?  A
+ * slab's worth lets a flush hand whole slabs to the outbuf without copying
+ * them, and saves a heap operation per cell, while still switching circuits
+ * often enough to keep the EWMA order. */
+#define SCHEDULER_BURST_CELLS CELL_SLAB_N_CELLS
+
+/** Connections waiting for the next scheduler pass. */
+static smartlist_t *pending_conns = NULL;
+/** Event that runs the scheduler after the current pass through the event
+ * loop, or after SCHEDULER_RETRY_MSEC. */
+static struct event *scheduler_event = NULL;
+/** True iff we have activated scheduler_event and it hasn't yet run. */
+static int scheduler_run_queued = 0;
+/** If nonnegative, the unit tests' stand-in for every connection's
+ * scheduler_get_cell_budget(). */
+static int cell_budget_for_testing = -1;
+
+/** Helper for the scheduler's priority queue: compare two connections by
+ * their scheduler_priority. */
+static int
+compare_conns_by_priority(const void *a, const void *b)
+{
+  const or_connection_t *c1 = a, *c2 = b;
+  if (c1->scheduler_priority < c2->scheduler_priority)
+    return -1;
+  else if (c1->scheduler_priority > c2->scheduler_priority)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return the number of cells we should let <b>conn</b> write this pass:
+ * enough to fill as much of its TCP congestion window as isn't already
+ * taken by data in flight, in the socket buffer, or on its outbuf.  Where we
+ * can't ask the kernel, fill the outbuf up to OR_CONN_HIGHWATER as usual. */
+int
+scheduler_get_cell_budget(or_connection_t *conn)
+{
+  connection_t *c = TO_CONN(conn);
+  ssize_t room = OR_CONN_HIGHWATER;
+#ifdef USE_TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  int notsent;
+  if (SOCKET_OK(c->s) &&
+      getsockopt(c->s, IPPROTO_TCP, TCP_INFO, (void*)&info, &len) == 0 &&
+      ioctl(c->s, SIOCOUTQNSD, &notsent) == 0) {
+    room = ((ssize_t)info.tcpi_snd_cwnd - (ssize_t)info.tcpi_unacked) *
+      (ssize_t)info.tcpi_snd_mss - notsent;
+  }
+#endif
+  room -= (ssize_t)connection_get_outbuf_len(c);
+  if (room <= 0)
+    return 0;
+  return (int)CEIL_DIV(room, CELL_NETWORK_SIZE);
+}
+
+/** Run one scheduler pass over every connection in pending_conns. */
+void
+scheduler_run(void)
+{
+  smartlist_t *to_run, *heap;
+  const int idx_offset = STRUCT_OFFSET(or_connection_t, scheduler_heap_idx);
+  time_t now = approx_time();
+  double n_written = 0;
+  int retry = 0;
+
+  if (!pending_conns || !smartlist_len(pending_conns))
+    return;
+  to_run = pending_conns;
+  pending_conns = smartlist_new();
+  heap = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(to_run, or_connection_t *, conn) {
+    conn->scheduler_pending = 0;
+    /* It's safe to drop these: a connection that is marked for close will
+     * never write again; one with no active circuits asks again from
+     * make_circuit_active_on_conn() once a circuit has a cell for it; and
+     * one that isn't open yet asks again from
+     * connection_or_set_state_open(). */
+    if (conn->_base.marked_for_close || !conn->active_circuits ||
+        conn->_base.state != OR_CONN_STATE_OPEN)
+      continue;
+    if (cell_budget_for_testing >= 0)
+      conn->scheduler_budget = cell_budget_for_testing;
+    else
+      conn->scheduler_budget = scheduler_get_cell_budget(conn);
+    if (conn->scheduler_budget <= 0) {
+      /* If there's anything on the outbuf, we'll hear from this connection
+       * again once some of it is written.  Otherwise the kernel is waiting
+       * for ACKs, so look again soon. */
+      if (!connection_get_outbuf_len(TO_CONN(conn))) {
+        conn->scheduler_pending = 1;
+        smartlist_add(pending_conns, conn);
+        retry = 1;
+      }
+      continue;
+    }
+    conn->scheduler_priority = cell_ewma_get_next_count(conn);
+    if (conn->scheduler_priority < 0)
+      conn->scheduler_priority = 0;
+    smartlist_pqueue_add(heap, compare_conns_by_priority, idx_offset, conn);
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(to_run);
+
+  while (smartlist_len(heap)) {
+    or_connection_t *conn =
+      smartlist_pqueue_pop(heap, compare_conns_by_priority, idx_offset);
+    int n = connection_or_flush_from_first_active_circuit(conn,
+                               MIN(conn->scheduler_budget,
+                                   SCHEDULER_BURST_CELLS), now);
+    conn->scheduler_budget -= n;
+    /* Once a connection runs out of room, it has cells on its outbuf, so
+     * it will ask to be scheduled again once they're written. */
+    if (n > 0 && conn->scheduler_budget > 0 && conn->active_circuits &&
+        !conn->_base.marked_for_close) {
+      conn->scheduler_priority = cell_ewma_get_next_count(conn);
+      if (conn->scheduler_priority < 0) {
+        /* No EWMA: go to the back of the line. */
+        conn->scheduler_priority = ++n_written;
+      }
+      smartlist_pqueue_add(heap, compare_conns_by_priority, idx_offset,
+                           conn);
+    }
+  }
+  smartlist_free(heap);
+
+  if (retry) {
+    struct timeval tv = { 0, SCHEDULER_RETRY_MSEC * 1000 };
+    event_add(scheduler_event, &tv);
+  }
+}
+
+/** Libevent callback: run the scheduler. */
+static void
+scheduler_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  scheduler_run_queued = 0;
+  event_del(scheduler_event);
+  scheduler_run();
+}
+
+/** Note that <b>conn</b> has circuits with cells to write, and have the
+ * scheduler decide when to write them at the end of this pass through the
+ * event loop.  Only used with KernelAwareScheduling. */
+void
+scheduler_conn_has_cells(or_connection_t *conn)
+{
+  if (conn->scheduler_pending)
+    return;
+  if (!pending_conns)
+    pending_conns = smartlist_new();
+  conn->scheduler_pending = 1;
+  smartlist_add(pending_conns, conn);
+
+  if (!scheduler_run_queued) {
+    if (!scheduler_event)
+      scheduler_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                      scheduler_event_cb, NULL);
+    event_active(scheduler_event, EV_READ, 1);
+    scheduler_run_queued = 1;
+  }
+}
+
+/** Forget about <b>conn</b>, which is about to be freed. */
+void
+scheduler_conn_freed(or_connection_t *conn)
+{
+  if (conn->scheduler_pending && pending_conns)
+    smartlist_remove(pending_conns, conn);
+  conn->scheduler_pending = 0;
+}
+
+/** Give every connection a budget of <b>budget</b> cells per scheduler
+ * pass, whatever its socket says, or go back to asking the kernel if
+ * <b>budget</b> is negative.  Private; used only by the unit tests. */
+void
+scheduler_set_cell_budget_for_testing_(int budget)
+{
+  cell_budget_for_testing = budget;
+}
+
+/** Release all storage held by the scheduler. */
+void
+scheduler_free_all(void)
+{
+  smartlist_free(pending_conns);
+  pending_conns = NULL;
+  if (scheduler_event) {
+    tor_event_free(scheduler_event);
+    scheduler_event = NULL;
+  }
+  scheduler_run_queued = 0;
+}
+
@@ -0,0 +1,23 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.h
+ * \brief Header file for scheduler.c.
+ **/
+
+#ifndef _TOR_SCHEDULER_H
+#define _TOR_SCHEDULER_H
+
+void scheduler_conn_has_cells(or_connection_t *conn);
+void scheduler_conn_freed(or_connection_t *conn);
+void scheduler_free_all(void);
+
+#ifdef SCHEDULER_PRIVATE
+int scheduler_get_cell_budget(or_connection_t *conn);
+void scheduler_run(void);
+void scheduler_set_cell_budget_for_testing_(int budget);
+#endif
+
+#endif
+
@@ -14,9 +14,14 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#include <math.h>
+
 #define RELAY_PRIVATE
 
 #include "or.h"
+#include "buffers.h"
+#include "circuitlist.h"
+#include "connection_or.h"
 #include "relay.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
@@ -103,9 +108,13 @@ bench_cell_aes(void)
   const int len = 509;
   const int iters = (1<<16);
   const int max_misalign = 15;
+  const int max_batch = 64;
   char *b = tor_malloc(len+max_misalign);
+  /* Lay the batch out like the payloads of an array of cell_t. */
+  char *cells = tor_malloc(max_batch * sizeof(cell_t));
+  char *bufs[64];
   crypto_cipher_t *c;
-  int i, misalign;
+  int i, misalign, batch;
 
   c = crypto_cipher_new(NULL);
 
@@ -120,8 +129,22 @@ bench_cell_aes(void)
            NANOCOUNT(start, end, iters*len));
   }
 
+  for (i = 0; i < max_batch; ++i)
+    bufs[i] = cells + i*sizeof(cell_t) + STRUCT_OFFSET(cell_t, payload);
+  for (batch = 1; batch <= max_batch; batch *= 2) {
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      crypto_cipher_crypt_inplace_batch(c, bufs, batch, len);
+    }
+    end = perftime();
+    printf("%2d cells per batch: %.2f nsec per cell (%.0f cells/sec)\n",
+           batch, NANOCOUNT(start, end, iters),
+           1e9 / NANOCOUNT(start, end, iters));
+  }
+
   crypto_cipher_free(c);
   tor_free(b);
+  tor_free(cells);
 }
 
 /** Run digestmap_t performance benchmarks. */
@@ -248,6 +271,203 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Run benchmarks for unpacking cells from a full inbuf. */
+static void
+bench_cell_parse(void)
+{
+  const int n_cells = 4096, iters = 32;
+  /* Fill the inbuf in TLS-record-sized pieces, as reads from TLS do. */
+  const size_t record_len = 16384;
+  const size_t len = (size_t)n_cells * CELL_NETWORK_SIZE;
+  char *packed = tor_malloc(len);
+  char tmp[CELL_NETWORK_SIZE];
+  cell_t cells[RELAY_CRYPT_BATCH_MAX];
+  buf_t *buf = buf_new();
+  var_cell_t *var_cell;
+  uint64_t start, total;
+  size_t off;
+  int i, it, batched, n_parsed;
+
+  for (i = 0; i < n_cells; ++i) {
+    char *cp = packed + i*CELL_NETWORK_SIZE;
+    crypto_rand(cp, CELL_NETWORK_SIZE);
+    set_uint16(cp, htons((i % 100) + 1));
+    set_uint8(cp+2, CELL_RELAY);
+  }
+
+  reset_perftime();
+  for (batched = 0; batched <= 1; ++batched) {
+    total = 0;
+    n_parsed = 0;
+    for (it = 0; it < iters; ++it) {
+      for (off = 0; off < len; off += record_len)
+        write_to_buf(packed + off, MIN(record_len, len - off), buf);
+      start = perftime();
+      if (batched) {
+        int n;
+        while ((n = fetch_cells_from_buf(buf, cells, RELAY_CRYPT_BATCH_MAX,
+                                         3)))
+          n_parsed += n;
+      } else {
+        /* What connection_or_process_cells_from_inbuf used to do. */
+        while (buf_datalen(buf) >= CELL_NETWORK_SIZE) {
+          fetch_var_cell_from_buf(buf, &var_cell, 3);
+          fetch_from_buf(tmp, CELL_NETWORK_SIZE, buf);
+          cell_unpack(&cells[0], tmp);
+          ++n_parsed;
+        }
+      }
+      total += perftime() - start;
+    }
+    tor_assert(n_parsed == n_cells * iters);
+    printf("%s: %.2f ns per cell (%.0f cells/sec)\n",
+           batched ? "Batched" : "One at a time",
+           NANOCOUNT(0, total, n_parsed),
+           n_parsed / (total / 1e9));
+  }
+
+  buf_free(buf);
+  tor_free(packed);
+}
+
+/** Helper: compare the counts of two cell_ewma_t, for smartlist_pqueue. */
+static int
+compare_cell_ewma_counts(const void *p1, const void *p2)
+{
+  const cell_ewma_t *e1=p1, *e2=p2;
+  if (e1->cell_count < e2->cell_count)
+    return -1;
+  else if (e1->cell_count > e2->cell_count)
+    return 1;
+  else
+    return 0;
+}
+
+/** Run benchmarks for picking the next circuit to flush among many active
+ * circuits on one connection, and charging it for the cells it sent. */
+static void
+bench_cell_ewma(void)
+{
+  const int n_circs = 10000, iters = 1<<18;
+  const int idx_offset = STRUCT_OFFSET(cell_ewma_t, heap_index);
+  or_connection_t *conn = tor_malloc_zero(sizeof(or_connection_t));
+  cell_ewma_t *ewma = tor_malloc_zero(sizeof(cell_ewma_t)*n_circs);
+  smartlist_t *heap;
+  double weight[1000];
+  uint64_t start, end;
+  int i, j, burst;
+
+  conn->active_circuit_pqueue = heap = smartlist_new();
+  for (i = 0; i < 1000; ++i)
+    weight[i] = pow(0.8, -i / 1000.0);
+
+  reset_perftime();
+  for (burst = 1; burst <= 16; burst *= 4) {
+    /* The way we used to do it: one pow() per flush, and a pop and re-add on
+     * a binary heap per cell. */
+    for (i = 0; i < n_circs; ++i) {
+      ewma[i].cell_count = crypto_rand_int(1000);
+      smartlist_pqueue_add(heap, compare_cell_ewma_counts, idx_offset,
+                           &ewma[i]);
+    }
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      double increment = pow(0.8, -(i % 1000) / 1000.0);
+      cell_ewma_t *e = smartlist_get(heap, 0);
+      for (j = 0; j < burst; ++j) {
+        e->cell_count += increment;
+        smartlist_pqueue_pop(heap, compare_cell_ewma_counts, idx_offset);
+        smartlist_pqueue_add(heap, compare_cell_ewma_counts, idx_offset, e);
+      }
+    }
+    end = perftime();
+    printf("Binary heap, bursts of %2d cells: %.2f ns per cell\n", burst,
+           NANOCOUNT(start, end, iters*burst));
+    smartlist_clear(heap);
+
+    /* The way we do it now: a table lookup per flush, and one reheap per
+     * burst on a 4-ary heap. */
+    for (i = 0; i < n_circs; ++i) {
+      ewma[i].cell_count = crypto_rand_int(1000);
+      ewma[i].heap_index = -1;
+      add_cell_ewma_to_conn(conn, &ewma[i]);
+    }
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      cell_ewma_note_flushed(conn, smartlist_get(heap, 0),
+                             burst * weight[i % 1000]);
+    }
+    end = perftime();
+    printf("4-ary heap,  bursts of %2d cells: %.2f ns per cell\n", burst,
+           NANOCOUNT(start, end, iters*burst));
+    smartlist_clear(heap);
+  }
+
+  smartlist_free(heap);
+  tor_free(ewma);
+  tor_free(conn);
+}
+
+/** Run benchmarks for looking up the circuit each incoming cell belongs to,
+ * on a relay with many busy connections. */
+static void
+bench_circid_map(void)
+{
+  const int n_conns = 2000, n_circs = 50000, iters = 1<<22;
+  or_connection_t **conns = tor_malloc(sizeof(or_connection_t*) * n_conns);
+  or_circuit_t **circs = tor_malloc(sizeof(or_circuit_t*) * n_circs);
+  int *order = tor_malloc(sizeof(int) * iters);
+  uint64_t start, end;
+  int i, j, run, n_found;
+
+  for (i = 0; i < n_conns; ++i) {
+    conns[i] = tor_malloc_zero(sizeof(or_connection_t));
+    conns[i]->_base.magic = OR_CONNECTION_MAGIC;
+  }
+  for (i = 0; i < n_circs; ++i) {
+    or_connection_t *conn = conns[crypto_rand_int(n_conns)];
+    circid_t id;
+    do {
+      id = (circid_t)(1 + crypto_rand_int(1<<15));
+    } while (circuit_id_in_use_on_orconn(id, conn));
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->_base.magic = OR_CIRCUIT_MAGIC;
+    circuit_set_p_circid_orconn(circs[i], id, conn);
+  }
+
+  reset_perftime();
+  /* Cells from one circuit often arrive a few at a time. */
+  for (run = 1; run <= 16; run *= 4) {
+    for (i = 0; i < iters / run; ++i)
+      order[i] = crypto_rand_int(n_circs);
+    n_found = 0;
+    start = perftime();
+    for (i = 0; i < iters / run; ++i) {
+      or_circuit_t *circ = circs[order[i]];
+      for (j = 0; j < run; ++j) {
+        if (circuit_get_by_circid_orconn(circ->p_circ_id, circ->p_conn))
+          ++n_found;
+      }
+    }
+    end = perftime();
+    tor_assert(n_found == (iters / run) * run);
+    printf("%d circuits on %d conns, runs of %2d cells: %.2f ns per lookup\n",
+           n_circs, n_conns, run, NANOCOUNT(start, end, n_found));
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    circuit_set_p_circid_orconn(circs[i], 0, NULL);
+    tor_free(circs[i]);
+  }
+  for (i = 0; i < n_conns; ++i) {
+    circuit_free_circid_map(conns[i]);
+    tor_free(conns[i]);
+  }
+  tor_free(order);
+  tor_free(circs);
+  tor_free(conns);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -263,6 +483,9 @@ static struct benchmark_t benchmarks[] = {
   ENT(aes),
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_parse),
+  ENT(cell_ewma),
+  ENT(circid_map),
   {NULL,NULL,0}
 };
 
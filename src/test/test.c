@@ -26,6 +26,12 @@ const char tor_git_revision[] = "";
 #include <dirent.h>
 #endif
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 /* These macros pull in declarations for some functions and structures that
  * are typically file-private. */
 #define BUFFERS_PRIVATE
@@ -33,6 +39,12 @@ const char tor_git_revision[] = "";
 #define GEOIP_PRIVATE
 #define ROUTER_PRIVATE
 #define CIRCUIT_PRIVATE
+#define COMMAND_PRIVATE
+#define CONNECTION_OR_PRIVATE
+#define CONTROL_PRIVATE
+#define CPUWORKER_PRIVATE
+#define RELAY_PRIVATE
+#define SCHEDULER_PRIVATE
 
 /*
  * Linux doesn't provide lround in math.h by default, but mac os does...
@@ -45,9 +57,16 @@ double fabs(double x);
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
+#include "circuitlist.h"
+#include "command.h"
 #include "config.h"
+#include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
+#include "control.h"
+#include "cpuworker.h"
 #include "geoip.h"
+#include "main.h"
 #include "rendcommon.h"
 #include "test.h"
 #include "torgzip.h"
@@ -55,8 +74,11 @@ double fabs(double x);
 #include "memarea.h"
 #include "onion.h"
 #include "policies.h"
+#include "relay.h"
 #include "rephist.h"
 #include "routerparse.h"
+#include "scheduler.h"
+#include "workqueue.h"
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -636,6 +658,203 @@ test_buffer_copy(void *arg)
     generic_buffer_free(buf2);
 }
 
+/** Run unit tests for handing chunks to buffers without copying. */
+static void
+test_buffer_chunk(void *arg)
+{
+  buf_t *buf = NULL;
+  struct chunk_t *chunk;
+  char *mem, b[1024];
+  int i;
+  (void)arg;
+
+  buf = buf_new();
+  write_to_buf("abc", 3, buf);
+
+  /* Fill a chunk in place, then hand part of it to the buffer. */
+  chunk = buf_chunk_new(2048);
+  mem = buf_chunk_mem(chunk);
+  for (i = 0; i < 2048; ++i)
+    mem[i] = (char)i;
+  tt_int_op(write_chunk_to_buf(chunk, 512, 1024, buf), ==, 1027);
+  tt_int_op(buf_datalen(buf), ==, 1027);
+
+  /* Data written afterwards goes after the chunk's data, and may use the
+   * rest of its space. */
+  write_to_buf("xyz", 3, buf);
+  tt_int_op(buf_datalen(buf), ==, 1030);
+
+  fetch_from_buf(b, 3, buf);
+  test_mem_op(b, ==, "abc", 3);
+  fetch_from_buf(b, 1024, buf);
+  for (i = 0; i < 1024; ++i)
+    tt_int_op((unsigned char)b[i], ==, (i+512) & 0xff);
+  fetch_from_buf(b, 3, buf);
+  test_mem_op(b, ==, "xyz", 3);
+  tt_int_op(buf_datalen(buf), ==, 0);
+
+ done:
+  if (buf)
+    buf_free(buf);
+}
+
+/** Run unit tests for unpacking runs of cells from a buffer. */
+static void
+test_buffer_fetch_cells(void *arg)
+{
+  buf_t *buf = NULL;
+  var_cell_t *var_cell = NULL;
+  cell_t cells[64];
+  char cell[CELL_NETWORK_SIZE];
+  int i;
+  (void)arg;
+
+  buf = buf_new();
+  memset(cell, 0, sizeof(cell));
+  /* Ten fixed-length cells, some of which straddle chunks... */
+  for (i = 1; i <= 10; ++i) {
+    set_uint16(cell, htons(i));
+    set_uint8(cell+2, CELL_RELAY);
+    memset(cell+3, i, CELL_PAYLOAD_SIZE);
+    write_to_buf(cell, sizeof(cell), buf);
+  }
+  /* ... then a VERSIONS cell, another fixed-length cell, and part of a
+   * third. */
+  write_to_buf("\x00\x00\x07\x00\x02\x00\x03", 7, buf);
+  set_uint16(cell, htons(11));
+  write_to_buf(cell, sizeof(cell), buf);
+  write_to_buf(cell, 100, buf);
+
+  tt_int_op(fetch_cells_from_buf(buf, cells, 4, 3), ==, 4);
+  tt_int_op(fetch_cells_from_buf(buf, cells+4, 60, 3), ==, 6);
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(cells[i].circ_id, ==, i+1);
+    tt_int_op(cells[i].command, ==, CELL_RELAY);
+    tt_int_op(cells[i].payload[0], ==, i+1);
+    tt_int_op(cells[i].payload[CELL_PAYLOAD_SIZE-1], ==, i+1);
+  }
+  /* The var cell stops us. */
+  tt_int_op(fetch_cells_from_buf(buf, cells, 64, 3), ==, 0);
+  tt_int_op(fetch_var_cell_from_buf(buf, &var_cell, 3), ==, 1);
+  tt_assert(var_cell);
+  tt_int_op(var_cell->command, ==, CELL_VERSIONS);
+  /* The incomplete cell stays behind. */
+  tt_int_op(fetch_cells_from_buf(buf, cells, 64, 3), ==, 1);
+  tt_int_op(cells[0].circ_id, ==, 11);
+  tt_int_op(fetch_cells_from_buf(buf, cells, 64, 3), ==, 0);
+  tt_int_op(buf_datalen(buf), ==, 100);
+
+ done:
+  tor_free(var_cell);
+  if (buf)
+    buf_free(buf);
+}
+
+/** Run unit tests for flushing a many-chunk buffer onto a socket. */
+static void
+test_buffer_flush(void *arg)
+{
+  buf_t *buf = NULL;
+  tor_socket_t fd[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *b = NULL, *out = NULL;
+  size_t flushlen, total = 1<<20, got = 0;
+  int i, r;
+  (void)arg;
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+  set_socket_nonblocking(fd[0]);
+  set_socket_nonblocking(fd[1]);
+
+  buf = buf_new();
+  b = tor_malloc(total);
+  out = tor_malloc_zero(total);
+  for (i = 0; i < (int)total; ++i)
+    b[i] = (char)(i*7);
+  for (i = 0; i < (int)total; i += 4096)
+    write_to_buf(b+i, 4096, buf);
+  flushlen = total;
+
+  /* The socket can't take a megabyte at once, so every flush but the last
+   * one is a partial write that stops somewhere inside a chunk. */
+  while (got < total) {
+    r = flush_buf(fd[0], buf, flushlen, &flushlen);
+    tt_int_op(r, >=, 0);
+    tt_int_op(flushlen, ==, buf_datalen(buf));
+    while ((r = tor_socket_recv(fd[1], out+got, total-got, 0)) > 0)
+      got += r;
+  }
+  tt_int_op(buf_datalen(buf), ==, 0);
+  tt_int_op(got, ==, total);
+  test_memeq(out, b, total);
+
+ done:
+  if (SOCKET_OK(fd[0]))
+    tor_close_socket(fd[0]);
+  if (SOCKET_OK(fd[1]))
+    tor_close_socket(fd[1]);
+  tor_free(b);
+  tor_free(out);
+  if (buf)
+    buf_free(buf);
+}
+
+/** Run unit tests for choosing how much of a buffer goes into each TLS
+ * write. */
+static void
+test_buffer_tls_write_len(void *arg)
+{
+  const size_t slab_len = CELL_SLAB_N_CELLS * CELL_NETWORK_SIZE;
+  buf_t *buf = NULL;
+  char b[4096];
+  int i;
+  (void)arg;
+
+  buf = buf_new();
+  tt_int_op(buf_get_tls_write_len(buf, 0, 0), ==, 0);
+
+  /* Whole cell slabs go out in place, one per write. */
+  for (i = 0; i < 3; ++i)
+    write_chunk_to_buf(buf_chunk_new(slab_len), 0, slab_len, buf);
+  tt_int_op(buf_get_tls_write_len(buf, 3*slab_len, 0), ==, slab_len);
+  tt_int_op(buf_get_tls_write_len(buf, 100, 0), ==, 100);
+
+  /* What is left of a partly written slab isn't merged with the next
+   * whole one either. */
+  fetch_from_buf(b, slab_len - 100, buf);
+  tt_int_op(buf_get_tls_write_len(buf, 2*slab_len + 100, 0), ==, 100);
+  buf_clear(buf);
+
+  /* Runs of small chunks are gathered, up to a full TLS record... */
+  for (i = 0; i < 40; ++i)
+    write_chunk_to_buf(buf_chunk_new(CELL_NETWORK_SIZE), 0,
+                       CELL_NETWORK_SIZE, buf);
+  tt_int_op(buf_get_tls_write_len(buf, 40*CELL_NETWORK_SIZE, 0), ==, 16384);
+  /* ...or up to what we were asked to write... */
+  tt_int_op(buf_get_tls_write_len(buf, 1000, 0), ==, 1000);
+  /* ...but stop in front of a large chunk. */
+  buf_clear(buf);
+  for (i = 0; i < 3; ++i)
+    write_chunk_to_buf(buf_chunk_new(CELL_NETWORK_SIZE), 0,
+                       CELL_NETWORK_SIZE, buf);
+  write_chunk_to_buf(buf_chunk_new(slab_len), 0, slab_len, buf);
+  tt_int_op(buf_get_tls_write_len(buf, 3*CELL_NETWORK_SIZE + slab_len, 0),
+            ==, 3*CELL_NETWORK_SIZE);
+
+  /* A write that blocked is retried with exactly as many bytes, whether
+   * that is more or less than we would choose now. */
+  tt_int_op(buf_get_tls_write_len(buf, 10, 2*CELL_NETWORK_SIZE),
+            ==, 2*CELL_NETWORK_SIZE);
+  tt_int_op(buf_get_tls_write_len(buf, 3*CELL_NETWORK_SIZE + slab_len,
+                                  2*CELL_NETWORK_SIZE),
+            ==, 2*CELL_NETWORK_SIZE);
+  fetch_from_buf(b, 3*CELL_NETWORK_SIZE, buf);
+  tt_int_op(buf_get_tls_write_len(buf, slab_len, slab_len), ==, slab_len);
+
+ done:
+  if (buf)
+    buf_free(buf);
+}
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers(void)
@@ -856,6 +1075,135 @@ test_onion_handshake(void)
     crypto_pk_free(pk);
 }
 
+/** The batch most recently handed to test_sig_check_batch_done(), and
+ * whether it was completed. */
+static sig_check_batch_t *sig_check_batch_done = NULL;
+static int sig_check_batch_completed = -1;
+
+/** Callback for sig_check_batch_run_async() in test_sig_check_batch(). */
+static void
+test_sig_check_batch_done(sig_check_batch_t *batch, int completed, void *arg)
+{
+  ++*(int *)arg;
+  sig_check_batch_done = batch;
+  sig_check_batch_completed = completed;
+}
+
+/** Run unit tests for checking batches of signatures on the directory
+ * workers. */
+static void
+test_sig_check_batch(void)
+{
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  sig_check_batch_t *batch = NULL;
+  char digest[DIGEST_LEN], sig[PK_BYTES];
+  int i, sig_len, n_done = 0;
+  tor_libevent_cfg cfg;
+
+  pk1 = pk_generate(0);
+  pk2 = pk_generate(1);
+
+  /* Enough signatures to go to the workers; every third is bad, in one of
+   * three ways. */
+  get_options_mutable()->NumCPUs = 4;
+  batch = sig_check_batch_new();
+  for (i = 0; i < 60; ++i) {
+    memset(digest, i, DIGEST_LEN);
+    sig_len = crypto_pk_private_sign(i % 9 == 3 ? pk2 : pk1, sig,
+                                     sizeof(sig), digest, DIGEST_LEN);
+    test_eq(sig_len, PK_BYTES);
+    if (i % 9 == 6)
+      sig[10] ^= 1;
+    if (i % 9 == 0)
+      digest[0] ^= 1;
+    test_eq(i, sig_check_batch_add(batch, digest, DIGEST_LEN, sig, sig_len,
+                                   pk1));
+  }
+  /* The batch must keep its own copies. */
+  memset(sig, 0, sizeof(sig));
+  crypto_pk_free(pk2);
+  pk2 = NULL;
+
+  sig_check_batch_run(batch);
+  test_eq(60, sig_check_batch_len(batch));
+  for (i = 0; i < 60; ++i)
+    test_eq(i % 3 != 0, sig_check_batch_is_ok(batch, i));
+  sig_check_batch_free(batch);
+
+  /* A small batch is checked right here. */
+  batch = sig_check_batch_new();
+  sig_check_batch_run(batch);
+  memset(digest, 7, DIGEST_LEN);
+  sig_len = crypto_pk_private_sign(pk1, sig, sizeof(sig), digest,
+                                   DIGEST_LEN);
+  sig_check_batch_add(batch, digest, DIGEST_LEN, sig, sig_len, pk1);
+  sig_check_batch_run(batch);
+  test_assert(sig_check_batch_is_ok(batch, 0));
+  sig_check_batch_free(batch);
+
+  /* Checking a batch asynchronously doesn't wait for the verdicts, even
+   * with only one CPU: they come back through the event loop. */
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->NumCPUs = 1;
+  batch = sig_check_batch_new();
+  for (i = 0; i < 20; ++i) {
+    memset(digest, i, DIGEST_LEN);
+    sig_len = crypto_pk_private_sign(pk1, sig, sizeof(sig), digest,
+                                     DIGEST_LEN);
+    if (i % 4 == 1)
+      digest[0] ^= 1;
+    sig_check_batch_add(batch, digest, DIGEST_LEN, sig, sig_len, pk1);
+  }
+  sig_check_batch_run_async(batch, test_sig_check_batch_done, &n_done);
+  batch = NULL;
+  test_eq(n_done, 0);
+  while (!n_done)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+  test_eq(n_done, 1);
+  test_eq(sig_check_batch_completed, 1);
+  batch = sig_check_batch_done;
+  test_eq(20, sig_check_batch_len(batch));
+  for (i = 0; i < 20; ++i)
+    test_eq(i % 4 != 1, sig_check_batch_is_ok(batch, i));
+  sig_check_batch_free(batch);
+  batch = NULL;
+
+  /* A batch that is still out when we shut the workers down comes back
+   * then, aborted so that its owner only cleans up: even when its
+   * signatures have been checked and only the reply is waiting. */
+  sig_check_batch_done = NULL;
+  batch = sig_check_batch_new();
+  sig_check_batch_add(batch, digest, DIGEST_LEN, sig, sig_len, pk1);
+  sig_check_batch_run_async(batch, test_sig_check_batch_done, &n_done);
+  batch = NULL;
+  {
+    int n_threads;
+    tor_socket_t s = workqueue_get_alert_socket(
+                                         sig_check_get_queue(&n_threads));
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    test_eq(1, select((int)s + 1, &fds, NULL, NULL, &tv));
+  }
+  test_eq(n_done, 1);
+  cpuworkers_free_all();
+  test_eq(n_done, 2);
+  test_eq(sig_check_batch_completed, 0);
+  batch = sig_check_batch_done;
+
+ done:
+  sig_check_batch_free(batch);
+  cpuworkers_free_all();
+  if (pk1)
+    crypto_pk_free(pk1);
+  if (pk2)
+    crypto_pk_free(pk2);
+}
+
 static void
 test_circuit_timeout(void)
 {
@@ -1790,6 +2138,885 @@ test_stats(void)
   tor_free(s);
 }
 
+/** Run unit tests for cell queues. */
+static void
+test_cell_queue(void)
+{
+  cell_queue_t queue;
+  cell_slab_t *slab;
+  cell_t cell;
+  int i, n_slabs;
+  const int n_cells = 3*CELL_SLAB_N_CELLS + 1;
+
+  memset(&queue, 0, sizeof(queue));
+  memset(&cell, 0, sizeof(cell));
+  init_cell_pool();
+
+  /* Fill a few slabs, and make sure the cells come out in order. */
+  cell.command = CELL_RELAY;
+  for (i = 0; i < n_cells; ++i) {
+    cell.circ_id = i+1;
+    cell_queue_append_packed_copy(&queue, &cell);
+  }
+  test_eq(queue.n, n_cells);
+  n_slabs = 0;
+  for (slab = queue.head; slab; slab = slab->next) {
+    ++n_slabs;
+    test_assert(slab->next || slab == queue.tail);
+  }
+  test_eq(n_slabs, 4);
+  for (i = 0; i < CELL_SLAB_N_CELLS + 2; ++i) {
+    slab = queue.head;
+    test_eq(ntohs(get_uint16(slab->cells[slab->first].body)), i+1);
+    cell_queue_drop_first(&queue);
+  }
+  test_eq(queue.n, n_cells - CELL_SLAB_N_CELLS - 2);
+  test_eq(queue.head->first, 2);
+
+  /* Drain the queue completely, then reuse it. */
+  while (queue.n)
+    cell_queue_drop_first(&queue);
+  test_assert(!queue.head);
+  test_assert(!queue.tail);
+  cell.circ_id = 77;
+  cell_queue_append_packed_copy(&queue, &cell);
+  test_eq(queue.n, 1);
+  test_eq(ntohs(get_uint16(queue.head->cells[0].body)), 77);
+
+  cell_queue_clear(&queue);
+  test_eq(queue.n, 0);
+  test_assert(!queue.head);
+  test_assert(!queue.tail);
+
+ done:
+  cell_queue_clear(&queue);
+  free_cell_pool();
+}
+
+/** Return a new OR connection for the circuit tests: it has an outbuf and
+ * an active circuit heap, but no socket, and nothing else knows about it.
+ * Free it with test_or_connection_free(). */
+static or_connection_t *
+test_or_connection_new(void)
+{
+  or_connection_t *conn = tor_malloc_zero(sizeof(or_connection_t));
+  conn->_base.magic = OR_CONNECTION_MAGIC;
+  conn->_base.type = CONN_TYPE_OR;
+  conn->_base.s = TOR_INVALID_SOCKET;
+  conn->_base.outbuf = buf_new();
+  conn->active_circuit_pqueue = smartlist_new();
+  return conn;
+}
+
+/** Release storage held by <b>conn</b>, from test_or_connection_new().
+ * Circuits that still point at it must not be used again. */
+static void
+test_or_connection_free(or_connection_t *conn)
+{
+  if (!conn)
+    return;
+  circuit_free_circid_map(conn);
+  buf_free(conn->_base.outbuf);
+  smartlist_free(conn->active_circuit_pqueue);
+  tor_free(conn);
+}
+
+/** Return true iff the active circuit heap of <b>conn</b> is in order and
+ * every entry knows its own position. */
+static int
+cell_ewma_heap_is_ok(or_connection_t *conn)
+{
+  smartlist_t *heap = conn->active_circuit_pqueue;
+  int i;
+  for (i = 0; i < smartlist_len(heap); ++i) {
+    cell_ewma_t *e = smartlist_get(heap, i);
+    if (e->heap_index != i)
+      return 0;
+    if (i > 0 && ((cell_ewma_t*)smartlist_get(heap, (i-1)/4))->cell_count >
+        e->cell_count)
+      return 0;
+  }
+  return 1;
+}
+
+/** Run unit tests for the priority queue of active circuits. */
+static void
+test_cell_ewma_heap(void)
+{
+  or_connection_t *conn = test_or_connection_new();
+  cell_ewma_t ewma[200];
+  double lowest;
+  int i, j, n_active = 0;
+
+  memset(ewma, 0, sizeof(ewma));
+  for (i = 0; i < 200; ++i) {
+    ewma[i].cell_count = crypto_rand_int(1000);
+    ewma[i].heap_index = -1;
+  }
+  for (i = 0; i < 100; ++i)
+    add_cell_ewma_to_conn(conn, &ewma[i]);
+  test_assert(cell_ewma_heap_is_ok(conn));
+
+  /* Add, remove, and charge circuits at random; the heap should stay in
+   * order, with the lowest count on top. */
+  for (j = 0; j < 2000; ++j) {
+    cell_ewma_t *e = &ewma[crypto_rand_int(200)];
+    if (e->heap_index == -1)
+      add_cell_ewma_to_conn(conn, e);
+    else if (crypto_rand_int(2))
+      remove_cell_ewma_from_conn(conn, e);
+    else
+      cell_ewma_note_flushed(conn, e, crypto_rand_int(100));
+    test_assert(cell_ewma_heap_is_ok(conn));
+  }
+  n_active = 0;
+  lowest = 1e100;
+  for (i = 0; i < 200; ++i) {
+    if (ewma[i].heap_index != -1) {
+      ++n_active;
+      if (ewma[i].cell_count < lowest)
+        lowest = ewma[i].cell_count;
+    }
+  }
+  test_eq(n_active, smartlist_len(conn->active_circuit_pqueue));
+  if (n_active) {
+    cell_ewma_t *top = smartlist_get(conn->active_circuit_pqueue, 0);
+    test_assert(fabs(top->cell_count - lowest) < 1e-9);
+  }
+
+  /* Charging a circuit that isn't active just changes its count. */
+  for (i = 0; i < 200 && ewma[i].heap_index != -1; ++i)
+    ;
+  if (i < 200) {
+    double old = ewma[i].cell_count;
+    cell_ewma_note_flushed(conn, &ewma[i], 5.0);
+    test_assert(fabs(ewma[i].cell_count - (old + 5.0)) < 1e-9);
+    test_eq(ewma[i].heap_index, -1);
+  }
+
+ done:
+  test_or_connection_free(conn);
+}
+
+/** Run unit tests for the per-connection map from circuit ID to
+ * circuit. */
+static void
+test_circid_map(void)
+{
+  or_connection_t *conns[2];
+  or_circuit_t *circs[300];
+  int i, j, k;
+
+  for (i = 0; i < 2; ++i)
+    conns[i] = test_or_connection_new();
+  for (i = 0; i < 300; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->_base.magic = OR_CIRCUIT_MAGIC;
+  }
+
+  /* Move circuits between IDs and connections at random.  Use few enough
+   * IDs that probe runs grow long and wrap around, so that removals have
+   * to patch them up. */
+  for (j = 0; j < 20000; ++j) {
+    or_circuit_t *circ = circs[crypto_rand_int(300)];
+    circid_t id = (circid_t)(1 + crypto_rand_int(400));
+    or_connection_t *conn = crypto_rand_int(8) ? conns[crypto_rand_int(2)]
+                                               : NULL;
+    /* Don't steal an ID that another circuit is using. */
+    if (conn && circuit_id_in_use_on_orconn(id, conn) &&
+        circuit_get_by_circid_orconn(id, conn) != TO_CIRCUIT(circ))
+      continue;
+    circuit_set_p_circid_orconn(circ, conn ? id : 0, conn);
+
+    if (j % 1000 == 0 || j == 19999) {
+      /* Every circuit is found under its own ID, and nothing else is. */
+      int n_found[2] = { 0, 0 };
+      for (k = 0; k < 2; ++k) {
+        for (i = 1; i <= 400; ++i) {
+          circuit_t *c = circuit_get_by_circid_orconn(i, conns[k]);
+          if (c) {
+            test_eq_ptr(TO_OR_CIRCUIT(c)->p_conn, conns[k]);
+            test_eq(TO_OR_CIRCUIT(c)->p_circ_id, i);
+            ++n_found[k];
+          }
+        }
+      }
+      for (i = 0; i < 300; ++i) {
+        if (circs[i]->p_conn)
+          test_eq_ptr(circuit_get_by_circid_orconn(circs[i]->p_circ_id,
+                                                   circs[i]->p_conn),
+                      TO_CIRCUIT(circs[i]));
+      }
+      for (k = 0; k < 2; ++k) {
+        test_eq(n_found[k], conns[k]->n_circuits);
+        test_eq(n_found[k], conns[k]->circid_map_n_used);
+        test_assert(conns[k]->circid_map_n_used * 2 <=
+                    conns[k]->circid_map_size);
+      }
+    }
+  }
+
+ done:
+  for (i = 0; i < 300; ++i) {
+    circuit_set_p_circid_orconn(circs[i], 0, NULL);
+    tor_free(circs[i]);
+  }
+  for (i = 0; i < 2; ++i)
+    test_or_connection_free(conns[i]);
+}
+
+/** Run unit tests for adapting a circuit's N3 to the queue length that the
+ * neighbor it sends to reports with each credit. */
+static void
+test_n23_adapt_n3(void)
+{
+  or_options_t *options = get_options_mutable();
+  int old_n3_min = options->N3Min, old_n3_max = options->N3Max;
+  or_connection_t *conn = NULL;
+  or_circuit_t *circ;
+  cell_t cell;
+  int n3, i;
+
+  options->N3Min = 5 * N2;
+  options->N3Max = 10 * N2;
+
+  /* An empty queue downstream grows N3, a backlog of more than N2 cells
+   * shrinks it, and anything in between leaves it alone. */
+  n3 = 7 * N2;
+  circuit_adapt_n3(&n3, 0);
+  test_eq(n3, 8 * N2);
+  circuit_adapt_n3(&n3, 1);
+  test_eq(n3, 8 * N2);
+  circuit_adapt_n3(&n3, N2);
+  test_eq(n3, 8 * N2);
+  circuit_adapt_n3(&n3, N2 + 1);
+  test_eq(n3, 7 * N2);
+
+  /* N3 stays within [N3Min, N3Max]... */
+  for (i = 0; i < 10; ++i)
+    circuit_adapt_n3(&n3, 0);
+  test_eq(n3, 10 * N2);
+  for (i = 0; i < 10; ++i)
+    circuit_adapt_n3(&n3, 1000);
+  test_eq(n3, 5 * N2);
+  /* ...even when those change under an existing circuit. */
+  options->N3Max = 6 * N2;
+  n3 = 9 * N2;
+  circuit_adapt_n3(&n3, N2);
+  test_eq(n3, 6 * N2);
+  options->N3Min = 7 * N2;
+  options->N3Max = 10 * N2;
+  circuit_adapt_n3(&n3, N2);
+  test_eq(n3, 7 * N2);
+
+  /* The queue length reported in a credit adapts the N3 for the cells we
+   * send to that neighbor, before the new balance is computed. */
+  conn = test_or_connection_new();
+  conn->credit_has_queue_len = 1;
+  circ = or_circuit_new(0, NULL);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 5, conn);
+  circ->n3_n = 8 * N2;
+  TO_CIRCUIT(circ)->cells_fwded_n = 4;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_FLOWCONTROL;
+  cell.circ_id = 5;
+  set_uint32(cell.payload, htonl(N2));
+  set_uint16(cell.payload + 4, htons(0));
+  command_process_flowcontrol_cell(&cell, conn);
+  test_eq(circ->n3_n, 9 * N2);
+  test_eq(TO_CIRCUIT(circ)->credit_balance_n, N2 + 9 * N2 - (4 - N2));
+
+  TO_CIRCUIT(circ)->flowctl_changed = 0;
+  set_uint16(cell.payload + 4, htons(3 * N2));
+  command_process_flowcontrol_cell(&cell, conn);
+  test_eq(circ->n3_n, 8 * N2);
+  test_eq(TO_CIRCUIT(circ)->credit_balance_n, N2 + 8 * N2 - (4 - N2));
+  test_assert(TO_CIRCUIT(circ)->flowctl_changed);
+
+  /* A neighbor that didn't list N23_QUEUE_LEN_VERSION sends only
+   * cells_fwded, and we don't read what follows as a queue length. */
+  conn->credit_has_queue_len = 0;
+  TO_CIRCUIT(circ)->flowctl_changed = 0;
+  set_uint16(cell.payload + 4, htons(0));
+  command_process_flowcontrol_cell(&cell, conn);
+  test_eq(circ->n3_n, 8 * N2);
+  test_eq(TO_CIRCUIT(circ)->credit_balance_n, N2 + 8 * N2 - (4 - N2));
+  /* Nothing changed, so there's nothing new to tell controllers. */
+  test_assert(!TO_CIRCUIT(circ)->flowctl_changed);
+
+ done:
+  test_or_connection_free(conn);
+  options->N3Min = old_n3_min;
+  options->N3Max = old_n3_max;
+}
+
+/** Run unit tests for sending N23 credit in CELL_FLOWCONTROL_BATCH cells:
+ * the balance the receiver ends up with must match what the same credit
+ * sent as individual CELL_FLOWCONTROL cells would give. */
+static void
+test_n23_batched_credit(void)
+{
+  or_options_t *options = get_options_mutable();
+  int old_batched = options->UseN23BatchedCredit;
+  int old_n3 = options->N3Initial;
+  int old_n3_min = options->N3Min, old_n3_max = options->N3Max;
+  tor_libevent_cfg cfg;
+  or_connection_t *conns[2];
+  or_circuit_t *sending[2], *batched[2], *single[2], *looped;
+  smartlist_t *cells = smartlist_new();
+  var_cell_t *vcell;
+  cell_t cell;
+  int i, j;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  init_cell_pool();
+  options->UseN23BatchedCredit = 1;
+  options->N3Min = N2;
+  options->N3Initial = 50 * N2;
+  options->N3Max = 100 * N2;
+
+  for (i = 0; i < 2; ++i) {
+    conns[i] = test_or_connection_new();
+    conns[i]->link_proto = 3;
+    conns[i]->credit_has_queue_len = 1;
+  }
+  /* conns[0] is the sender's link to the receiver, and conns[1] the
+   * receiver's link back.  Circuit 10+i gets its credit batched; circuit
+   * 20+i gets the same credit one cell at a time. */
+  for (i = 0; i < 2; ++i) {
+    sending[i] = or_circuit_new(0, NULL);
+    circuit_set_p_circid_orconn(sending[i], 10 + i, conns[0]);
+    batched[i] = or_circuit_new(0, NULL);
+    circuit_set_n_circid_orconn(TO_CIRCUIT(batched[i]), 10 + i, conns[1]);
+    single[i] = or_circuit_new(0, NULL);
+    circuit_set_n_circid_orconn(TO_CIRCUIT(single[i]), 20 + i, conns[1]);
+    TO_CIRCUIT(batched[i])->cells_fwded_n = 3 + i;
+    TO_CIRCUIT(single[i])->cells_fwded_n = 3 + i;
+  }
+  /* Circuit 11 still has cells queued when it earns its credit. */
+  memset(&cell, 0, sizeof(cell));
+  for (j = 0; j < 2 * N2; ++j)
+    cell_queue_append_packed_copy(&TO_CIRCUIT(sending[1])->n_conn_cells,
+                                  &cell);
+
+  /* Circuit 10 earns two credits before the flush, circuit 11 one. */
+  for (i = 0; i < 2; ++i) {
+    for (j = 0; j < 2 - i; ++j)
+      connection_or_queue_flowcontrol(TO_CIRCUIT(sending[i]),
+                                      CELL_DIRECTION_IN, N2);
+  }
+  test_eq(smartlist_len(conns[0]->pending_credit), 3);
+  connection_or_pack_pending_flowcontrol(conns[0], cells);
+  test_eq(smartlist_len(cells), 1);
+  test_eq(smartlist_len(conns[0]->pending_credit), 0);
+  vcell = smartlist_get(cells, 0);
+  test_eq(vcell->command, CELL_FLOWCONTROL_BATCH);
+  test_eq(vcell->payload_len, 3 * FLOWCONTROL_BATCH_ENTRY_LEN);
+  for (i = 0; i < 3; ++i) {
+    const uint8_t *entry = vcell->payload + i * FLOWCONTROL_BATCH_ENTRY_LEN;
+    test_eq(ntohs(get_uint16(entry)), i < 2 ? 10 : 11);
+    test_eq(ntohl(get_uint32(entry + 2)), N2);
+    test_eq(ntohs(get_uint16(entry + 6)), i < 2 ? 0 : 2 * N2);
+  }
+  command_process_flowcontrol_batch_cell(vcell, conns[1]);
+
+  for (i = 0; i < 2; ++i) {
+    for (j = 0; j < 2 - i; ++j) {
+      memset(&cell, 0, sizeof(cell));
+      cell.command = CELL_FLOWCONTROL;
+      cell.circ_id = 20 + i;
+      set_uint32(cell.payload, htonl(N2));
+      set_uint16(cell.payload + 4, htons(i ? 2 * N2 : 0));
+      command_process_flowcontrol_cell(&cell, conns[1]);
+    }
+  }
+
+  /* Each credit adapted N3 once: up for the empty queue, down for the
+   * backlog. */
+  test_eq(batched[0]->n3_n, 52 * N2);
+  test_eq(batched[1]->n3_n, 49 * N2);
+  for (i = 0; i < 2; ++i) {
+    test_eq(batched[i]->n3_n, single[i]->n3_n);
+    test_eq(TO_CIRCUIT(batched[i])->credit_balance_n,
+            TO_CIRCUIT(single[i])->credit_balance_n);
+    test_eq(TO_CIRCUIT(batched[i])->credit_balance_n,
+            N2 + batched[i]->n3_n - (3 + i - N2));
+  }
+
+  /* Nothing is left to send. */
+  SMARTLIST_FOREACH(cells, var_cell_t *, c, var_cell_free(c));
+  smartlist_clear(cells);
+  connection_or_pack_pending_flowcontrol(conns[0], cells);
+  test_eq(smartlist_len(cells), 0);
+
+  /* With a peer that doesn't report queue lengths, entries keep the old
+   * layout, and the credit leaves N3 alone. */
+  for (i = 0; i < 2; ++i)
+    conns[i]->credit_has_queue_len = 0;
+  connection_or_queue_flowcontrol(TO_CIRCUIT(sending[1]), CELL_DIRECTION_IN,
+                                  N2);
+  connection_or_pack_pending_flowcontrol(conns[0], cells);
+  test_eq(smartlist_len(cells), 1);
+  vcell = smartlist_get(cells, 0);
+  test_eq(vcell->payload_len, FLOWCONTROL_BATCH_ENTRY_LEN_NO_QUEUE_LEN);
+  test_eq(ntohs(get_uint16(vcell->payload)), 11);
+  test_eq(ntohl(get_uint32(vcell->payload + 2)), N2);
+  TO_CIRCUIT(batched[1])->cells_fwded_n = 2 * N2;
+  command_process_flowcontrol_batch_cell(vcell, conns[1]);
+  test_eq(batched[1]->n3_n, 49 * N2);
+  test_eq(TO_CIRCUIT(batched[1])->credit_balance_n, N2 + 49 * N2 - N2);
+  SMARTLIST_FOREACH(cells, var_cell_t *, c, var_cell_free(c));
+  smartlist_clear(cells);
+
+  /* Credit queued for circuit 10 towards conns[0] isn't sent once a
+   * circuit that came in over conns[0] under another ID has taken circuit
+   * 10 as its ID going back out. */
+  connection_or_queue_flowcontrol(TO_CIRCUIT(sending[0]), CELL_DIRECTION_IN,
+                                  N2);
+  circuit_set_p_circid_orconn(sending[0], 12, conns[0]);
+  looped = or_circuit_new(0, NULL);
+  circuit_set_p_circid_orconn(looped, 13, conns[0]);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(looped), 10, conns[0]);
+  connection_or_pack_pending_flowcontrol(conns[0], cells);
+  test_eq(smartlist_len(cells), 0);
+
+ done:
+  options->UseN23BatchedCredit = old_batched;
+  options->N3Initial = old_n3;
+  options->N3Min = old_n3_min;
+  options->N3Max = old_n3_max;
+  SMARTLIST_FOREACH(cells, var_cell_t *, c, var_cell_free(c));
+  smartlist_free(cells);
+}
+
+/** Run unit tests for the N23 statistics that we show controllers. */
+static void
+test_n23_controller_output(void)
+{
+  or_connection_t *conns[2];
+  or_circuit_t *circ;
+  struct timeval now;
+  char *s = NULL;
+  int i;
+
+  /* Bucket 0 holds zeros, and bucket i holds [2^(i-1), 2^i), except that
+   * the last one holds everything from 2^14 up. */
+  rep_hist_note_n23_stall(0);
+  rep_hist_note_n23_stall(1);
+  rep_hist_note_n23_stall(2);
+  rep_hist_note_n23_stall(3);
+  rep_hist_note_n23_stall(4);
+  rep_hist_note_n23_stall(1000);
+  rep_hist_note_n23_stall(U64_LITERAL(1) << 40);
+  rep_hist_note_n23_queue_len(-1);
+  rep_hist_note_n23_queue_len(16384);
+  rep_hist_note_n23_queue_len(16383);
+  rep_hist_note_n23_credit_sent();
+  rep_hist_note_n23_credit_sent();
+  rep_hist_note_n23_credit_received();
+  s = rep_hist_format_n23_stats();
+  test_streq(s,
+    "credit-sent 2\n"
+    "credit-received 1\n"
+    "stall-msec 0=1 1=1 2=2 4=1 8=0 16=0 32=0 64=0 128=0 256=0 512=1 "
+      "1024=0 2048=0 4096=0 8192=0 16384=1\n"
+    "queue-len 0=1 1=0 2=0 4=0 8=0 16=0 32=0 64=0 128=0 256=0 512=0 "
+      "1024=0 2048=0 4096=0 8192=1 16384=1\n");
+  tor_free(s);
+
+  for (i = 0; i < 2; ++i) {
+    conns[i] = test_or_connection_new();
+    conns[i]->_base.global_identifier = 40 + i;
+  }
+  circ = or_circuit_new(0, NULL);
+  circuit_set_p_circid_orconn(circ, 7, conns[0]);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 9, conns[1]);
+  circ->n3_n = 120;
+  circ->n3_p = 80;
+  TO_CIRCUIT(circ)->credit_balance_n = -2;
+  circ->credit_balance_p = 85;
+  TO_CIRCUIT(circ)->cells_fwded_n = 3;
+  circ->cells_fwded_p = 4;
+  TO_CIRCUIT(circ)->n_flowctl_stats.n_stalls = 5;
+  TO_CIRCUIT(circ)->n_flowctl_stats.stalled_msec = 600;
+  TO_CIRCUIT(circ)->n_flowctl_stats.n_credit_sent = 11;
+  TO_CIRCUIT(circ)->n_flowctl_stats.n_credit_received = 12;
+  circ->p_flowctl_stats.n_stalls = 1;
+  circ->p_flowctl_stats.stalled_msec = 70;
+  circ->p_flowctl_stats.n_credit_sent = 13;
+  circ->p_flowctl_stats.n_credit_received = 14;
+
+  /* A stall toward n_conn that is still going on counts up to now. */
+  tor_gettimeofday_cache_clear();
+  tor_gettimeofday_cached(&now);
+  TO_CIRCUIT(circ)->n_flowctl_stats.stalled_since = now;
+  TO_CIRCUIT(circ)->n_flowctl_stats.stalled_since.tv_sec -= 2;
+
+  s = circuit_describe_flowctl_for_controller(circ);
+  test_streq(s,
+             "PConn=40 PCircID=7 NConn=41 NCircID=9 N3N=120 N3P=80 "
+             "CreditN=-2 CreditP=85 FwdN=3 FwdP=4 StallsN=5 StallsP=1 "
+             "StalledMsecN=2600 StalledMsecP=70 "
+             "CreditSentN=11 CreditSentP=13 "
+             "CreditRecvN=12 CreditRecvP=14");
+
+ done:
+  tor_free(s);
+}
+
+/** Run unit tests for shaping circuits and streams with PerCircuitBWRate
+ * and PerStreamBWRate. */
+static void
+test_circuit_bucket(void)
+{
+  or_options_t *options = get_options_mutable();
+  uint64_t old_circ_rate = options->PerCircuitBWRate;
+  uint64_t old_circ_burst = options->PerCircuitBWBurst;
+  uint64_t old_stream_rate = options->PerStreamBWRate;
+  uint64_t old_stream_burst = options->PerStreamBWBurst;
+  int old_n23 = options->UseN23;
+  tor_libevent_cfg cfg;
+  or_connection_t *conns[2];
+  or_circuit_t *circ;
+  edge_connection_t *edge = NULL;
+  cell_t cell;
+  int i;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  init_cell_pool();
+  options->UseN23 = 0;
+  options->PerCircuitBWRate = 5 * CELL_NETWORK_SIZE;
+  options->PerCircuitBWBurst = 4 * CELL_NETWORK_SIZE;
+
+  for (i = 0; i < 2; ++i)
+    conns[i] = test_or_connection_new();
+  circ = or_circuit_new(0, NULL);
+  circuit_set_p_circid_orconn(circ, 7, conns[0]);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 9, conns[1]);
+  TO_CIRCUIT(circ)->write_bucket = 3 * CELL_NETWORK_SIZE;
+  memset(&cell, 0, sizeof(cell));
+  for (i = 0; i < 10; ++i)
+    cell_queue_append_packed_copy(&TO_CIRCUIT(circ)->n_conn_cells, &cell);
+  make_circuit_active_on_conn(TO_CIRCUIT(circ), conns[1]);
+
+  /* The circuit sends what its bucket allows, and then comes off its
+   * connections even though it still has cells queued. */
+  test_eq(connection_or_flush_from_first_active_circuit(conns[1], 10, 0), 3);
+  test_eq(TO_CIRCUIT(circ)->write_bucket, 0);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 1);
+  test_eq(TO_CIRCUIT(circ)->n_bucket_depletions, 1);
+  test_eq_ptr(conns[1]->active_circuits, NULL);
+  test_eq(TO_CIRCUIT(circ)->n_conn_cells.n, 7);
+  /* It stays off until the bucket is refilled. */
+  make_circuit_active_on_conn(TO_CIRCUIT(circ), conns[1]);
+  test_eq_ptr(conns[1]->active_circuits, NULL);
+
+  /* A refill never goes past the burst, and puts the circuit back. */
+  connection_bucket_refill(1000, 0);
+  test_eq(TO_CIRCUIT(circ)->write_bucket, 4 * CELL_NETWORK_SIZE);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 0);
+  test_eq_ptr(conns[1]->active_circuits, TO_CIRCUIT(circ));
+
+  /* When the N23 credit and the bucket run out on the same cell, the
+   * circuit is still blocked on its bucket. */
+  options->UseN23 = 1;
+  TO_CIRCUIT(circ)->credit_balance_n = 2;
+  TO_CIRCUIT(circ)->write_bucket = 2 * CELL_NETWORK_SIZE;
+  test_eq(connection_or_flush_from_first_active_circuit(conns[1], 10, 0), 2);
+  test_eq(TO_CIRCUIT(circ)->credit_balance_n, 0);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 1);
+  test_eq(TO_CIRCUIT(circ)->n_bucket_depletions, 2);
+  test_eq_ptr(conns[1]->active_circuits, NULL);
+  /* Refilling the bucket doesn't get around the missing credit. */
+  connection_bucket_refill(1000, 0);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 0);
+  test_eq_ptr(conns[1]->active_circuits, NULL);
+  options->UseN23 = 0;
+
+  /* Turning shaping off lets a blocked circuit go on the next refill. */
+  TO_CIRCUIT(circ)->n_flowctl_stats.stalled_since.tv_sec = 0;
+  TO_CIRCUIT(circ)->write_bucket = CELL_NETWORK_SIZE;
+  make_circuit_active_on_conn(TO_CIRCUIT(circ), conns[1]);
+  test_eq(connection_or_flush_from_first_active_circuit(conns[1], 10, 0), 1);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 1);
+  options->PerCircuitBWRate = options->PerCircuitBWBurst = 0;
+  connection_bucket_refill(10, 0);
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 0);
+  test_eq_ptr(conns[1]->active_circuits, TO_CIRCUIT(circ));
+
+  /* Exit streams get their read buckets refilled at PerStreamBWRate. */
+  options->PerStreamBWRate = 1000;
+  options->PerStreamBWBurst = 3000;
+  edge = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  test_eq(edge->read_bucket, 3000);
+  edge->read_bucket = -500;
+  smartlist_add(get_connection_array(), edge);
+  connection_bucket_refill(1000, 0);
+  test_eq(edge->read_bucket, 500);
+  connection_bucket_refill(5000, 0);
+  test_eq(edge->read_bucket, 3000);
+
+ done:
+  if (edge) {
+    smartlist_remove(get_connection_array(), edge);
+    connection_free(TO_CONN(edge));
+  }
+  options->PerCircuitBWRate = old_circ_rate;
+  options->PerCircuitBWBurst = old_circ_burst;
+  options->PerStreamBWRate = old_stream_rate;
+  options->PerStreamBWBurst = old_stream_burst;
+  options->UseN23 = old_n23;
+}
+
+/** Return the circuit ID of the next cell on the outbuf of <b>conn</b>,
+ * which uses link protocol 3, and take the cell off. */
+static int
+test_scheduler_next_circ_id(or_connection_t *conn)
+{
+  char cell[CELL_NETWORK_SIZE];
+  if (fetch_from_buf(cell, sizeof(cell), conn->_base.outbuf) < 0)
+    return -1;
+  return ntohs(get_uint16(cell));
+}
+
+/** Run unit tests for the KernelAwareScheduling scheduler. */
+static void
+test_scheduler(void)
+{
+  or_options_t *options = get_options_mutable();
+  int old_kernel_aware = options->KernelAwareScheduling;
+  int old_n23 = options->UseN23;
+  uint64_t old_circ_rate = options->PerCircuitBWRate;
+  uint64_t old_circ_burst = options->PerCircuitBWBurst;
+  double old_halflife = options->CircuitPriorityHalflife;
+  tor_libevent_cfg cfg;
+  or_connection_t *conns[2] = { NULL, NULL };
+  or_circuit_t *circs[2], *circ;
+  char buf[CELL_NETWORK_SIZE];
+  cell_t cell;
+  int i, j, budget;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  init_cell_pool();
+  options->KernelAwareScheduling = 1;
+  options->UseN23 = 0;
+  options->CircuitPriorityHalflife = 30;
+  cell_ewma_set_scale_factor(options, NULL);
+  /* The circuits' EWMA ticks must match the ones the flushes use. */
+  update_approx_time(time(NULL));
+  memset(buf, 0, sizeof(buf));
+
+  /* Where we can't ask the kernel, a connection may fill its outbuf up to
+   * OR_CONN_HIGHWATER. */
+  conns[0] = test_or_connection_new();
+  budget = CEIL_DIV(OR_CONN_HIGHWATER, CELL_NETWORK_SIZE);
+  test_eq(scheduler_get_cell_budget(conns[0]), budget);
+  for (i = 0; i < 10; ++i)
+    write_to_buf(buf, sizeof(buf), conns[0]->_base.outbuf);
+  test_eq(scheduler_get_cell_budget(conns[0]), budget - 10);
+  while (connection_get_outbuf_len(TO_CONN(conns[0])) < OR_CONN_HIGHWATER)
+    write_to_buf(buf, sizeof(buf), conns[0]->_base.outbuf);
+  test_eq(scheduler_get_cell_budget(conns[0]), 0);
+  test_or_connection_free(conns[0]);
+
+  for (i = 0; i < 2; ++i) {
+    conns[i] = test_or_connection_new();
+    conns[i]->_base.state = OR_CONN_STATE_OPEN;
+    conns[i]->link_proto = 3;
+    conns[i]->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  }
+
+  /* Two circuits on one connection: each pick writes a slab's worth of
+   * cells from the circuit with the lowest EWMA count, until the
+   * connection's budget runs out. */
+  scheduler_set_cell_budget_for_testing_(20);
+  for (i = 0; i < 2; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circuit_set_n_circid_orconn(TO_CIRCUIT(circs[i]), 10 + i, conns[0]);
+    TO_CIRCUIT(circs[i])->n_cell_ewma.cell_count = i ? 3.5 : 0.0;
+    memset(&cell, 0, sizeof(cell));
+    cell.circ_id = 10 + i;
+    for (j = 0; j < 30; ++j)
+      cell_queue_append_packed_copy(&TO_CIRCUIT(circs[i])->n_conn_cells,
+                                    &cell);
+    make_circuit_active_on_conn(TO_CIRCUIT(circs[i]), conns[0]);
+  }
+  test_eq(conns[0]->scheduler_pending, 1);
+  scheduler_run();
+  test_eq(conns[0]->scheduler_pending, 0);
+  test_eq(connection_get_outbuf_len(TO_CONN(conns[0])),
+          20 * CELL_NETWORK_SIZE);
+  for (i = 0; i < 20; ++i)
+    test_eq(test_scheduler_next_circ_id(conns[0]), i < 7 || i >= 14 ? 10
+                                                                   : 11);
+  for (i = 0; i < 2; ++i) {
+    make_circuit_inactive_on_conn(TO_CIRCUIT(circs[i]), conns[0]);
+    circuit_set_n_circid_orconn(TO_CIRCUIT(circs[i]), 0, NULL);
+  }
+
+  /* A circuit on two connections whose token bucket holds four cells: the
+   * connection where it has sent less lately gets them all, even though
+   * the other one asked first. */
+  options->PerCircuitBWRate = 5 * CELL_NETWORK_SIZE;
+  options->PerCircuitBWBurst = 4 * CELL_NETWORK_SIZE;
+  circ = or_circuit_new(0, NULL);
+  circuit_set_p_circid_orconn(circ, 7, conns[0]);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 9, conns[1]);
+  TO_CIRCUIT(circ)->write_bucket = 4 * CELL_NETWORK_SIZE;
+  circ->p_cell_ewma.cell_count = 3.5;
+  memset(&cell, 0, sizeof(cell));
+  for (j = 0; j < 10; ++j) {
+    cell_queue_append_packed_copy(&circ->p_conn_cells, &cell);
+    cell_queue_append_packed_copy(&TO_CIRCUIT(circ)->n_conn_cells, &cell);
+  }
+  make_circuit_active_on_conn(TO_CIRCUIT(circ), conns[0]);
+  make_circuit_active_on_conn(TO_CIRCUIT(circ), conns[1]);
+  scheduler_run();
+  test_eq(TO_CIRCUIT(circ)->write_blocked_on_bucket, 1);
+  test_eq(circ->p_conn_cells.n, 10);
+  test_eq(TO_CIRCUIT(circ)->n_conn_cells.n, 6);
+  options->PerCircuitBWRate = 0;
+  circuit_bucket_unblock(TO_CIRCUIT(circ));
+  make_circuit_inactive_on_conn(TO_CIRCUIT(circ), conns[1]);
+  buf_clear(conns[0]->_base.outbuf);
+  buf_clear(conns[1]->_base.outbuf);
+
+  /* A connection with no room and nothing on its outbuf gets another look
+   * soon; one with cells on its outbuf waits to hear that they've been
+   * written. */
+  scheduler_set_cell_budget_for_testing_(0);
+  scheduler_run();
+  test_eq(conns[0]->scheduler_pending, 1);
+  test_eq(circ->p_conn_cells.n, 10);
+  scheduler_set_cell_budget_for_testing_(3);
+  scheduler_run();
+  test_eq(conns[0]->scheduler_pending, 0);
+  test_eq(circ->p_conn_cells.n, 7);
+  scheduler_set_cell_budget_for_testing_(0);
+  scheduler_conn_has_cells(conns[0]);
+  scheduler_run();
+  test_eq(conns[0]->scheduler_pending, 0);
+  test_eq(circ->p_conn_cells.n, 7);
+
+  /* A connection that goes away is forgotten. */
+  scheduler_set_cell_budget_for_testing_(20);
+  scheduler_conn_has_cells(conns[0]);
+  test_eq(conns[0]->scheduler_pending, 1);
+  scheduler_conn_freed(conns[0]);
+  test_eq(conns[0]->scheduler_pending, 0);
+  test_or_connection_free(conns[0]);
+  conns[0] = NULL;
+  scheduler_run();
+  test_eq(circ->p_conn_cells.n, 7);
+
+ done:
+  scheduler_set_cell_budget_for_testing_(-1);
+  scheduler_free_all();
+  for (i = 0; i < 2; ++i)
+    test_or_connection_free(conns[i]);
+  options->KernelAwareScheduling = old_kernel_aware;
+  options->UseN23 = old_n23;
+  options->PerCircuitBWRate = old_circ_rate;
+  options->PerCircuitBWBurst = old_circ_burst;
+  options->CircuitPriorityHalflife = old_halflife;
+  cell_ewma_set_scale_factor(options, NULL);
+}
+
+/** Run unit tests for closing circuits when cell queues use too much
+ * memory. */
+static void
+test_circuit_oom(void)
+{
+  /* How many seconds ago each circuit's first cell was queued. */
+  const int ages[5] = { 5, 4, 3, 2, 1 };
+  or_options_t *options = get_options_mutable();
+  uint64_t old_limit = options->MaxMemInCellQueues;
+  size_t slab_cost;
+  or_circuit_t *circs[5];
+  cell_t cell;
+  uint32_t now;
+  int i, j;
+
+  init_cell_pool();
+  memset(&cell, 0, sizeof(cell));
+  now = cell_queue_msec_now();
+  for (i = 0; i < 5; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    for (j = 0; j < CELL_SLAB_N_CELLS * 2; ++j)
+      cell_queue_append_packed_copy(&circs[i]->p_conn_cells, &cell);
+    circs[i]->p_conn_cells.head->queued_msec = now - 1000 * ages[i];
+    circs[i]->p_conn_cells.tail->queued_msec = now - 1000 * ages[i] + 100;
+    circuit_note_cells_queued(TO_CIRCUIT(circs[i]));
+    test_assert(TO_CIRCUIT(circs[i])->oom_heap_idx >= 0);
+  }
+  slab_cost = cell_queues_get_total_allocation() / 10;
+
+  /* The oldest circuit sends its oldest slab, and what's left of its queue
+   * is newer than anybody's.  Its place in the heap is now out of date. */
+  circs[0]->p_conn_cells.tail->queued_msec = now;
+  for (j = 0; j < CELL_SLAB_N_CELLS; ++j)
+    cell_queue_drop_first(&circs[0]->p_conn_cells);
+  test_eq(cell_queues_get_total_allocation(), 9 * slab_cost);
+
+  /* Getting back under 90% of 7 slabs means closing two 2-slab circuits:
+   * the two oldest, once we notice that circs[0] isn't. */
+  options->MaxMemInCellQueues = 7 * slab_cost;
+  test_eq(circuits_handle_oom(cell_queues_get_total_allocation()), 2);
+  test_eq(cell_queues_get_total_allocation(), 5 * slab_cost);
+  for (i = 0; i < 5; ++i) {
+    int killed = (i == 1 || i == 2);
+    test_eq(!!TO_CIRCUIT(circs[i])->marked_for_close, killed);
+    test_eq(circs[i]->p_conn_cells.n,
+            killed ? 0 : (i ? 2 : 1) * CELL_SLAB_N_CELLS);
+    test_eq(TO_CIRCUIT(circs[i])->oom_heap_idx >= 0, !killed);
+  }
+
+  /* A circuit whose queue is emptied leaves the heap. */
+  while (circs[4]->p_conn_cells.n)
+    cell_queue_drop_first(&circs[4]->p_conn_cells);
+  circuit_note_queue_drained(TO_CIRCUIT(circs[4]));
+  test_eq(TO_CIRCUIT(circs[4])->oom_heap_idx, -1);
+
+ done:
+  options->MaxMemInCellQueues = old_limit;
+}
+
+/** Run unit tests for the cell latency histograms. */
+static void
+test_cell_latency(void)
+{
+  char *s = NULL;
+  const char *empty = " count=0 sum=0 max=0 p50=0 p90=0 p99=0 p999=0 "
+    "buckets=\n";
+
+  rep_hist_reset_cell_latency();
+  rep_hist_note_cell_latency(CELL_TRACE_INBUF, 5, 3);
+  rep_hist_note_cell_latency(CELL_TRACE_INBUF, 100, 1);
+  rep_hist_note_cell_latency(CELL_TRACE_TOTAL, 0xffffffffu, 1);
+  s = rep_hist_format_cell_latency();
+  test_assert(!strcmpstart(s, "inbuf count=4 sum=115 max=100 p50=5 p90=96 "
+                           "p99=96 p999=96 buckets=5:3,96:1\ncrypt"));
+  test_assert(strstr(s, empty));
+  test_assert(strstr(s, "total count=1 sum=4294967295 max=4294967295 "
+                     "p50=4026531840 p90=4026531840 p99=4026531840 "
+                     "p999=4026531840 buckets=4026531840:1\n"));
+  tor_free(s);
+
+  /* Resetting forgets everything. */
+  rep_hist_reset_cell_latency();
+  s = rep_hist_format_cell_latency();
+  test_assert(!strcmpstart(s, "inbuf count=0 "));
+  test_assert(!strstr(s, "total count=1"));
+
+ done:
+  tor_free(s);
+}
+
 static void *
 legacy_test_setup(const struct testcase_t *testcase)
 {
@@ -1828,12 +3055,27 @@ const struct testcase_setup_t legacy_setup = {
 static struct testcase_t test_array[] = {
   ENT(buffers),
   { "buffer_copy", test_buffer_copy, 0, NULL, NULL },
+  { "buffer_chunk", test_buffer_chunk, 0, NULL, NULL },
+  { "buffer_fetch_cells", test_buffer_fetch_cells, 0, NULL, NULL },
+  { "buffer_flush", test_buffer_flush, 0, NULL, NULL },
+  { "buffer_tls_write_len", test_buffer_tls_write_len, 0, NULL, NULL },
   ENT(onion_handshake),
+  FORK(sig_check_batch),
   ENT(circuit_timeout),
   ENT(policies),
   ENT(rend_fns),
   ENT(geoip),
   FORK(stats),
+  ENT(cell_latency),
+  FORK(cell_queue),
+  ENT(cell_ewma_heap),
+  ENT(circid_map),
+  FORK(n23_adapt_n3),
+  FORK(n23_batched_credit),
+  FORK(n23_controller_output),
+  FORK(circuit_bucket),
+  FORK(scheduler),
+  FORK(circuit_oom),
 
   END_OF_TESTCASES
 };
@@ -241,6 +241,65 @@ test_crypto_aes(void *arg)
   tor_free(data3);
 }
 
+/** Make sure that crypting a batch of cell payloads with one call gives the
+ * same result as crypting them one at a time, wherever in the keystream the
+ * batch starts. */
+static void
+test_crypto_aes_batch(void *arg)
+{
+  crypto_cipher_t *env1 = NULL, *env2 = NULL;
+  char *data1 = NULL, *data2 = NULL;
+  char *bufs[70];
+  char key[CIPHER_KEY_LEN];
+  const size_t len = 509;
+  int i, n, skip;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+  evaluate_ctr_for_aes();
+
+  data1 = tor_malloc(70*len + 16);
+  data2 = tor_malloc(70*len + 16);
+  crypto_rand(key, sizeof(key));
+
+  for (n = 1; n <= 70; n += 23) {
+    for (skip = 0; skip < 16; skip += 5) {
+      env1 = crypto_cipher_new(key);
+      env2 = crypto_cipher_new(key);
+      crypto_rand(data1, n*len + 16);
+      memcpy(data2, data1, n*len + 16);
+
+      /* Start both ciphers partway into a block. */
+      crypto_cipher_crypt_inplace(env1, data1 + n*len, skip);
+      crypto_cipher_crypt_inplace(env2, data2 + n*len, skip);
+
+      for (i = 0; i < n; ++i) {
+        crypto_cipher_crypt_inplace(env1, data1 + i*len, len);
+        bufs[i] = data2 + i*len;
+      }
+      test_eq(0, crypto_cipher_crypt_inplace_batch(env2, bufs, n, len));
+      test_memeq(data1, data2, n*len + 16);
+
+      /* Both streams carry on from the same place afterwards. */
+      crypto_cipher_crypt_inplace(env1, data1, 16);
+      crypto_cipher_crypt_inplace(env2, data2, 16);
+      test_memeq(data1, data2, 16);
+
+      crypto_cipher_free(env1);
+      crypto_cipher_free(env2);
+      env1 = env2 = NULL;
+    }
+  }
+
+ done:
+  if (env1)
+    crypto_cipher_free(env1);
+  if (env2)
+    crypto_cipher_free(env2);
+  tor_free(data1);
+  tor_free(data2);
+}
+
 /** Run unit tests for our SHA-1 functionality */
 static void
 test_crypto_sha(void)
@@ -856,6 +915,10 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(rng),
   { "aes_AES", test_crypto_aes, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_EVP", test_crypto_aes, TT_FORK, &pass_data, (void*)"evp" },
+  { "aes_batch_AES", test_crypto_aes_batch, TT_FORK, &pass_data,
+    (void*)"aes" },
+  { "aes_batch_EVP", test_crypto_aes_batch, TT_FORK, &pass_data,
+    (void*)"evp" },
   CRYPTO_LEGACY(sha),
   CRYPTO_LEGACY(pk),
   CRYPTO_LEGACY(dh),
@@ -10,12 +10,18 @@
 #define DIRVOTE_PRIVATE
 #define ROUTER_PRIVATE
 #define ROUTERLIST_PRIVATE
+#define CONSDIFF_PRIVATE
 #define HIBERNATE_PRIVATE
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
+#include "config.h"
+#include "consdiff.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "hibernate.h"
+#include "memarea.h"
 #include "networkstatus.h"
 #include "router.h"
 #include "routerlist.h"
@@ -83,6 +89,10 @@ test_dir_formats(void)
   routerinfo_t *rp1 = NULL;
   addr_policy_t *ex1, *ex2;
   routerlist_t *dir1 = NULL, *dir2 = NULL;
+  smartlist_t *chunks = smartlist_new(), *routers = smartlist_new();
+  sig_check_batch_t *batch = NULL;
+  char *list = NULL;
+  int i;
 
   pk1 = pk_generate(0);
   pk2 = pk_generate(1);
@@ -185,6 +195,44 @@ test_dir_formats(void)
   test_assert(crypto_pk_cmp_keys(rp1->identity_pkey, pk2) == 0);
   //test_assert(rp1->exit_policy == NULL);
 
+  /* A list of descriptors gets its signatures checked all at once, and
+   * loses only the descriptor whose signature is bad. */
+  get_options_mutable()->NumCPUs = 4;
+  {
+    char *bad = tor_strdup(buf), *sig;
+    sig = strstr(bad, "-----BEGIN SIGNATURE-----\n");
+    tor_assert(sig);
+    sig += strlen("-----BEGIN SIGNATURE-----\n") + 10;
+    *sig = (*sig == 'A') ? 'B' : 'A';
+    for (i = 0; i < 12; ++i)
+      smartlist_add(chunks, tor_strdup(i == 5 ? bad : buf));
+    tor_free(bad);
+  }
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+  cp = list;
+  test_eq(0, router_parse_list_from_string((const char **)&cp, NULL, routers,
+                                           SAVED_NOWHERE, 0, 0, NULL));
+  test_eq(11, smartlist_len(routers));
+  test_eq_ptr(cp, list + strlen(list));
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri,
+                    test_assert(crypto_pk_cmp_keys(ri->identity_pkey,
+                                                   pk2) == 0));
+
+  /* The same list, parsed now and checked later, loses the same
+   * descriptor. */
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_clear(routers);
+  batch = sig_check_batch_new();
+  cp = list;
+  test_eq(0, router_parse_list_from_string_unchecked((const char **)&cp,
+                                                     NULL, routers, NULL,
+                                                     batch));
+  test_eq(12, smartlist_len(routers));
+  test_eq(12, sig_check_batch_len(batch));
+  sig_check_batch_run(batch);
+  routerinfo_list_drop_bad_signatures(routers, 0, batch, NULL);
+  test_eq(11, smartlist_len(routers));
+
 #if 0
   /* XXX Once we have exit policies, test this again. XXX */
   strlcpy(buf2, "router tor.tor.tor 9005 0 0 3000\n", sizeof(buf2));
@@ -257,6 +305,13 @@ test_dir_formats(void)
   if (pk2) crypto_pk_free(pk2);
   if (pk3) crypto_pk_free(pk3);
   if (rp1) routerinfo_free(rp1);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(routers);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(list);
+  sig_check_batch_free(batch);
+  cpuworkers_free_all();
   tor_free(dir1); /* XXXX And more !*/
   tor_free(dir2); /* And more !*/
 }
@@ -1510,6 +1565,314 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+/** Make sure that the consensus we serve as a cache comes from its
+ * compressed file on disk, and that replacing it doesn't disturb anybody
+ * still spooling the old one. */
+static void
+test_dir_cached_consensus_file(void *arg)
+{
+  const char *text1 = "network-status-version 3\nvote-status consensus\n"
+    "valid-after 2012-10-01 00:00:00\n";
+  const char *text2 = "network-status-version 3\nvote-status consensus\n"
+    "valid-after 2012-10-01 01:00:00\n";
+  digests_t digests;
+  cached_dir_t *d1 = NULL, *d2;
+  char *body = NULL, *fname = NULL, *file = NULL;
+  size_t body_len;
+  struct stat st;
+  (void)arg;
+
+  memset(&digests, 0, sizeof(digests));
+  dirserv_set_cached_consensus_networkstatus(text1, "ns", &digests,
+                                             time(NULL)-3600);
+  d1 = dirserv_get_consensus("ns");
+  tt_assert(d1);
+  ++d1->refcnt; /* As if some connection were spooling it. */
+
+  fname = get_datadir_fname("cached-consensus.z");
+#ifdef HAVE_SYS_MMAN_H
+  tt_assert(d1->dir_z_map);
+  file = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(file);
+  tt_int_op(st.st_size, ==, d1->dir_z_len);
+  test_memeq(file, d1->dir_z, d1->dir_z_len);
+  tor_free(file);
+#endif
+
+  dirserv_set_cached_consensus_networkstatus(text2, "ns", &digests,
+                                             time(NULL));
+  d2 = dirserv_get_consensus("ns");
+  tt_assert(d2);
+  tt_assert(d2 != d1);
+
+  /* The old object still holds what it did... */
+  tt_int_op(0, ==, tor_gzip_uncompress(&body, &body_len, d1->dir_z,
+                                       d1->dir_z_len, ZLIB_METHOD, 1,
+                                       LOG_WARN));
+  tt_int_op(body_len, ==, strlen(text1));
+  test_memeq(body, text1, body_len);
+  tor_free(body);
+
+  /* ...while the new one, and the file, hold the new consensus. */
+  tt_int_op(0, ==, tor_gzip_uncompress(&body, &body_len, d2->dir_z,
+                                       d2->dir_z_len, ZLIB_METHOD, 1,
+                                       LOG_WARN));
+  tt_int_op(body_len, ==, strlen(text2));
+  test_memeq(body, text2, body_len);
+  tor_free(body);
+#ifdef HAVE_SYS_MMAN_H
+  file = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(file);
+  tt_int_op(st.st_size, ==, d2->dir_z_len);
+  test_memeq(file, d2->dir_z, d2->dir_z_len);
+#endif
+
+ done:
+  cached_dir_decref(d1);
+  tor_free(body);
+  tor_free(file);
+  tor_free(fname);
+}
+
+/** Run some tests on generating and applying consensus diffs. */
+static void
+test_dir_consdiff(void *arg)
+{
+  const char *base1 = "a\nb\nc\n", *target1 = "a\nc\nd\n";
+  const char *base2 =
+    "network-status-version 3\n"
+    "valid-after 2012-10-01 00:00:00\n"
+    "r n3 " B64_3 " x 2012-10-01 00:00:00 1.2.3.4 9001 0\n"
+    "s Fast Running Valid\n"
+    "w Bandwidth=30\n"
+    "r n2 " B64_2 " x 2012-10-01 00:00:00 1.2.3.5 9001 0\n"
+    "s Fast Running\n"
+    "w Bandwidth=20\n"
+    "directory-footer\n"
+    "directory-signature A B\n";
+  const char *target2 =
+    "network-status-version 3\n"
+    "valid-after 2012-10-01 01:00:00\n"
+    "r n3 " B64_3 " x 2012-10-01 00:00:00 1.2.3.4 9001 0\n"
+    "s Fast Running Stable Valid\n"
+    "w Bandwidth=30\n"
+    "r n1 " B64_1 " x 2012-10-01 00:30:00 1.2.3.6 443 0\n"
+    "s Running\n"
+    "w Bandwidth=10\n"
+    "directory-footer\n"
+    "directory-signature A C\n";
+  char d_base[DIGEST256_LEN], d_target[DIGEST256_LEN];
+  char hex_base[HEX_DIGEST256_LEN+1], hex_target[HEX_DIGEST256_LEN+1];
+  char got_base[DIGEST256_LEN], got_target[DIGEST256_LEN];
+  char *diff = NULL, *result = NULL, *expected = NULL, *cp;
+  consdiff_line_t *lines = NULL;
+  (void)arg;
+
+  /* Lines are split at newlines, and the last one needs a newline too. */
+  tt_int_op(3, ==, consdiff_split_lines(base1, &lines));
+  tt_int_op(1, ==, lines[1].len);
+  tt_int_op('b', ==, lines[1].s[0]);
+  tor_free(lines);
+  tt_int_op(-1, ==, consdiff_split_lines("a\nb", &lines));
+  tt_ptr_op(NULL, ==, consdiff_generate("a\n", "a\nb"));
+
+  /* A small diff comes out exactly as diff -e would write it. */
+  crypto_digest256(d_base, base1, strlen(base1), DIGEST_SHA256);
+  crypto_digest256(d_target, target1, strlen(target1), DIGEST_SHA256);
+  base16_encode(hex_base, sizeof(hex_base), d_base, DIGEST256_LEN);
+  base16_encode(hex_target, sizeof(hex_target), d_target, DIGEST256_LEN);
+  tor_asprintf(&expected, "network-status-diff-version 1\n"
+               "hash %s %s\n3a\nd\n.\n2d\n", hex_base, hex_target);
+  diff = consdiff_generate(base1, target1);
+  test_streq(diff, expected);
+  tt_int_op(0, ==, consdiff_get_digests(diff, got_base, got_target));
+  test_memeq(got_base, d_base, DIGEST256_LEN);
+  test_memeq(got_target, d_target, DIGEST256_LEN);
+  result = consdiff_apply(base1, diff);
+  test_streq(result, target1);
+  tor_free(result);
+
+  /* It won't apply to anything else. */
+  tt_ptr_op(NULL, ==, consdiff_apply(target1, diff));
+  tt_ptr_op(NULL, ==, consdiff_apply("a\nb\nx\n", diff));
+  /* Or if somebody changed the lines it adds. */
+  cp = strstr(diff, "\nd\n");
+  tt_assert(cp);
+  cp[1] = 'e';
+  tt_ptr_op(NULL, ==, consdiff_apply(base1, diff));
+  tor_free(diff);
+  /* Or if its commands are out of order. */
+  tor_asprintf(&diff, "network-status-diff-version 1\n"
+               "hash %s %s\n2d\n3a\nd\n.\n", hex_base, hex_target);
+  tt_ptr_op(NULL, ==, consdiff_apply(base1, diff));
+  tor_free(diff);
+  tt_ptr_op(NULL, ==, consdiff_apply(base1, "garbage\n"));
+
+  /* Consensuses go back and forth, router entries and all. */
+  diff = consdiff_generate(base2, target2);
+  tt_assert(diff);
+  result = consdiff_apply(base2, diff);
+  test_streq(result, target2);
+  tor_free(result);
+  tor_free(diff);
+  diff = consdiff_generate(target2, base2);
+  tt_assert(diff);
+  result = consdiff_apply(target2, diff);
+  test_streq(result, base2);
+  tor_free(result);
+  tor_free(diff);
+  /* So do identical ones. */
+  diff = consdiff_generate(base2, base2);
+  tt_assert(diff);
+  result = consdiff_apply(base2, diff);
+  test_streq(result, base2);
+
+ done:
+  tor_free(lines);
+  tor_free(diff);
+  tor_free(result);
+  tor_free(expected);
+}
+
+/** Make sure that as a cache we keep diffs from the consensuses we used to
+ * serve to the one we serve now, and forget the old ones. */
+static void
+test_dir_consensus_diff_cache(void *arg)
+{
+  const char *texts[] = {
+    "network-status-version 3\nvalid-after 2012-10-01 00:00:00\n",
+    "network-status-version 3\nvalid-after 2012-10-01 01:00:00\n",
+    "network-status-version 3\nvalid-after 2012-10-01 02:00:00\n",
+  };
+  char digests256[3][DIGEST256_LEN];
+  digests_t digests;
+  cached_dir_t *diff;
+  char *result = NULL;
+  int i;
+  (void)arg;
+
+  memset(&digests, 0, sizeof(digests));
+  for (i = 0; i < 3; ++i)
+    crypto_digest256(digests256[i], texts[i], strlen(texts[i]),
+                     DIGEST_SHA256);
+
+  get_options_mutable()->CachedConsensusDiffs = 1;
+  dirserv_set_cached_consensus_networkstatus(texts[0], "ns", &digests,
+                                             time(NULL)-7200);
+  tt_ptr_op(NULL, ==, dirserv_get_consensus_diff("ns", digests256[0]));
+  dirserv_set_cached_consensus_networkstatus(texts[1], "ns", &digests,
+                                             time(NULL)-3600);
+  diff = dirserv_get_consensus_diff("ns", digests256[0]);
+  tt_assert(diff);
+  result = consdiff_apply(texts[0], diff->dir);
+  test_streq(result, texts[1]);
+  tor_free(result);
+  tt_ptr_op(NULL, ==, dirserv_get_consensus_diff("microdesc",
+                                                 digests256[0]));
+
+  /* With room for one, the oldest consensus falls off the end. */
+  dirserv_set_cached_consensus_networkstatus(texts[2], "ns", &digests,
+                                             time(NULL));
+  tt_ptr_op(NULL, ==, dirserv_get_consensus_diff("ns", digests256[0]));
+  diff = dirserv_get_consensus_diff("ns", digests256[1]);
+  tt_assert(diff);
+  result = consdiff_apply(texts[1], diff->dir);
+  test_streq(result, texts[2]);
+
+ done:
+  tor_free(result);
+}
+
+/** Make sure that parsing a big run of routerstatus entries on worker
+ * threads gives just what parsing them in order on this one does,
+ * including for the entries the workers leave to us and the ones nobody
+ * can parse. */
+static void
+test_dir_parallel_routerstatus_parse(void *arg)
+{
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  networkstatus_t ns1, ns2;
+  char *body = NULL;
+  const char *s1, *s2;
+  int i;
+  (void)arg;
+
+  memset(&ns1, 0, sizeof(ns1));
+  memset(&ns2, 0, sizeof(ns2));
+  ns1.type = ns2.type = NS_TYPE_CONSENSUS;
+  ns1.consensus_method = ns2.consensus_method = 13;
+  ns1.routerstatus_list = smartlist_new();
+  ns2.routerstatus_list = smartlist_new();
+
+  for (i = 0; i < 3000; ++i) {
+    char d[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1], d64[BASE64_DIGEST_LEN+1];
+    memset(d, i & 0xff, DIGEST_LEN);
+    set_uint32(d, htonl(i));
+    digest_to_base64(id64, d);
+    d[DIGEST_LEN-1] ^= 0xff;
+    digest_to_base64(d64, d);
+    /* Every 13th entry has an address nobody could parse. */
+    smartlist_add_asprintf(chunks,
+                           "r router%d %s %s 2012-10-01 00:00:00 %s 9001 0\n",
+                           i, id64, d64, (i % 13) ? "10.0.0.1" : "10.0.0");
+    /* Every 7th has an IPv6 address, which workers leave to us. */
+    if (i % 7 == 0)
+      smartlist_add_asprintf(chunks, "a [2001:db8::%x]:9001\n", i);
+    smartlist_add_asprintf(chunks,
+                           "s Fast Running%s\n"
+                           "v Tor 0.2.3.%d\n"
+                           "w Bandwidth=%d\n"
+                           "p accept 1-%d\n",
+                           (i % 3) ? " Valid" : "", i % 25, i * 10,
+                           1 + i % 65535);
+  }
+  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+  get_options_mutable()->NumCPUs = 4;
+  s1 = s2 = body;
+  parse_routerstatus_entries(area, tokens, &s1, NULL, &ns1, FLAV_NS,
+                             ns1.routerstatus_list, NULL, NULL);
+  parse_routerstatus_entries_in_parallel(&s2, &ns2, FLAV_NS);
+  tt_ptr_op(s2, !=, body);
+  parse_routerstatus_entries(area, tokens, &s2, NULL, &ns2, FLAV_NS,
+                             ns2.routerstatus_list, NULL, NULL);
+
+  tt_assert(!strcmpstart(s1, "directory-footer"));
+  tt_ptr_op(s1, ==, s2);
+  tt_int_op(smartlist_len(ns1.routerstatus_list), ==, 3000 - 3000/13 - 1);
+  tt_int_op(smartlist_len(ns1.routerstatus_list), ==,
+            smartlist_len(ns2.routerstatus_list));
+  for (i = 0; i < smartlist_len(ns1.routerstatus_list); ++i) {
+    routerstatus_t *rs1 = smartlist_get(ns1.routerstatus_list, i);
+    routerstatus_t *rs2 = smartlist_get(ns2.routerstatus_list, i);
+    routerstatus_t a = *rs1, b = *rs2;
+    test_streq(rs1->exitsummary, rs2->exitsummary);
+    a.exitsummary = b.exitsummary = NULL;
+    test_memeq(&a, &b, sizeof(a));
+  }
+
+ done:
+  cpuworkers_free_all();
+  if (ns1.routerstatus_list) {
+    SMARTLIST_FOREACH(ns1.routerstatus_list, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+    smartlist_free(ns1.routerstatus_list);
+  }
+  if (ns2.routerstatus_list) {
+    SMARTLIST_FOREACH(ns2.routerstatus_list, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+    smartlist_free(ns2.routerstatus_list);
+  }
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(body);
+}
+
 #define DIR_LEGACY(name)                                                   \
   { #name, legacy_test_helper, TT_FORK, &legacy_setup, test_dir_ ## name }
 
@@ -1527,6 +1890,13 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted),
   DIR(scale_bw),
+  { "cached_consensus_file", test_dir_cached_consensus_file, TT_FORK,
+    NULL, NULL },
+  DIR(consdiff),
+  { "consensus_diff_cache", test_dir_consensus_diff_cache, TT_FORK,
+    NULL, NULL },
+  { "parallel_routerstatus_parse", test_dir_parallel_routerstatus_parse,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
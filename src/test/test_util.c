@@ -13,6 +13,7 @@
 #include "test.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "workqueue.h"
 
 #ifdef _WIN32
 #include <tchar.h>
@@ -1348,6 +1349,155 @@ test_util_threads(void)
     tor_mutex_free(_thread_test_start2);
 }
 
+/** Job type for the workqueue test. */
+typedef struct wq_test_job_t {
+  workqueue_job_t base;
+  int input;
+  int output;
+  int generation;
+  int n_replies;
+  int completed;
+} wq_test_job_t;
+
+/** Workqueue test state constructor: remember which generation we are. */
+static void *
+wq_test_state_new(void *arg)
+{
+  int *generation = tor_malloc(sizeof(int));
+  *generation = *(volatile int *)arg;
+  return generation;
+}
+
+/** Workqueue test state destructor. */
+static void
+wq_test_state_free(void *state)
+{
+  tor_free(state);
+}
+
+/** Workqueue test work function: square the input in place. */
+static void
+wq_test_work(workqueue_job_t *work, void *state)
+{
+  wq_test_job_t *job = (wq_test_job_t *)work;
+  job->output = job->input * job->input;
+  job->generation = *(int *)state;
+}
+
+/** Workqueue test reply function: record that we got a reply. */
+static void
+wq_test_reply(workqueue_job_t *work, int completed)
+{
+  wq_test_job_t *job = (wq_test_job_t *)work;
+  ++job->n_replies;
+  job->completed = completed;
+}
+
+/** Run unit tests for the worker thread pool. */
+static void
+test_util_workqueue(void *arg)
+{
+#define WQ_TEST_N_JOBS 1000
+  workqueue_t *wq = NULL;
+  wq_test_job_t *jobs = NULL;
+  int generation = 0;
+  int i, next = 0, n_replied = 0, n_cancelled = 0;
+  time_t started = time(NULL);
+  (void)arg;
+
+  jobs = tor_malloc_zero(sizeof(wq_test_job_t) * WQ_TEST_N_JOBS);
+  wq = workqueue_new(NULL, 4, 16, wq_test_state_new, wq_test_state_free,
+                     &generation);
+  tt_assert(wq);
+  tt_int_op(workqueue_get_max_pending(wq), ==, 16);
+
+  while (n_replied < WQ_TEST_N_JOBS) {
+    fd_set fds;
+    struct timeval tv;
+    tor_socket_t s = workqueue_get_alert_socket(wq);
+
+    while (next < WQ_TEST_N_JOBS) {
+      jobs[next].base.work_fn = wq_test_work;
+      jobs[next].base.reply_fn = wq_test_reply;
+      jobs[next].input = next;
+      if (workqueue_add(wq, &jobs[next].base) < 0)
+        break;
+      ++next;
+    }
+    tt_int_op(workqueue_get_n_pending(wq), <=, 16);
+    if (next >= WQ_TEST_N_JOBS / 2 && !generation) {
+      /* Replacing the thread state must reach jobs added from here on. */
+      generation = 1;
+      workqueue_reset_thread_state(wq);
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    select((int)s + 1, &fds, NULL, NULL, &tv);
+    n_replied += workqueue_process_replies(wq);
+    tt_int_op(time(NULL), <, started + 60);
+  }
+  tt_int_op(workqueue_get_n_pending(wq), ==, 0);
+
+  for (i = 0; i < WQ_TEST_N_JOBS; ++i) {
+    tt_int_op(jobs[i].n_replies, ==, 1);
+    tt_assert(jobs[i].completed);
+    tt_int_op(jobs[i].output, ==, i * i);
+  }
+  tt_int_op(jobs[WQ_TEST_N_JOBS - 1].generation, ==, 1);
+
+  /* A caller that can't go on without its results can block for them. */
+  tt_int_op(workqueue_wait_for_replies(wq), ==, 0);
+  for (i = 0; i < 16; ++i) {
+    memset(&jobs[i], 0, sizeof(wq_test_job_t));
+    jobs[i].base.work_fn = wq_test_work;
+    jobs[i].base.reply_fn = wq_test_reply;
+    jobs[i].input = i;
+    tt_int_op(workqueue_add(wq, &jobs[i].base), ==, 0);
+  }
+  for (n_replied = 0; n_replied < 16; ) {
+    int n = workqueue_wait_for_replies(wq);
+    tt_int_op(n, >, 0);
+    n_replied += n;
+  }
+  tt_int_op(workqueue_get_n_pending(wq), ==, 0);
+  for (i = 0; i < 16; ++i)
+    tt_int_op(jobs[i].output, ==, i * i);
+
+  /* Every job gets exactly one reply, even if it is cancelled or the queue
+   * is freed before a worker reaches it; a job whose cancellation took
+   * effect must not have run. */
+  for (i = 0; i < 16; ++i) {
+    memset(&jobs[i], 0, sizeof(wq_test_job_t));
+    jobs[i].base.work_fn = wq_test_work;
+    jobs[i].base.reply_fn = wq_test_reply;
+    jobs[i].input = 7;
+    tt_int_op(workqueue_add(wq, &jobs[i].base), ==, 0);
+    workqueue_job_cancel(&jobs[i].base);
+  }
+  tt_int_op(workqueue_add(wq, &jobs[16].base), ==, -1);
+  workqueue_free(wq);
+  wq = NULL;
+  for (i = 0; i < 16; ++i) {
+    tt_int_op(jobs[i].n_replies, ==, 1);
+    if (!jobs[i].completed) {
+      tt_int_op(jobs[i].output, ==, 0);
+      ++n_cancelled;
+    }
+  }
+#ifndef TOR_IS_MULTITHREADED
+  /* Without threads, jobs run as soon as they are added. */
+  tt_int_op(n_cancelled, ==, 0);
+#endif
+
+ done:
+  workqueue_free(wq);
+  tor_free(jobs);
+#undef WQ_TEST_N_JOBS
+}
+
 /** Run unit tests for compression functions */
 static void
 test_util_gzip(void)
@@ -1457,6 +1607,81 @@ test_util_gzip(void)
   tor_free(buf1);
 }
 
+/** Run unit tests for splicing together separately compressed segments. */
+static void
+test_util_gzip_segments(void *arg)
+{
+  const char *docs[3] = {
+    "router alpha 10.0.0.1 9001 0 0\nplatform Tor\nrouter-signature\n",
+    "router beta 10.0.0.2 443 0 80\nplatform Tor\nrouter-signature\n",
+    "extra-info gamma 0123456789ABCDEF\npublished 2012-01-01 00:00:00\n",
+  };
+  /* Which documents to splice, in what order, ending with -1. */
+  const int orders[][4] = {
+    { 0, 1, 2, -1 }, { 2, 0, -1, -1 }, { 1, -1, -1, -1 }, { 1, 1, 0, -1 },
+    { -1, -1, -1, -1 },
+  };
+  char *segs[3] = { NULL, NULL, NULL };
+  size_t seg_lens[3];
+  uint32_t adlers[3];
+  char *stream = NULL, *expected = NULL, *out = NULL;
+  size_t out_len;
+  unsigned i;
+  int j;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(0, ==, tor_zlib_compress_segment(&segs[i], &seg_lens[i],
+                                               &adlers[i], docs[i],
+                                               strlen(docs[i])));
+    tt_assert(seg_lens[i] > 0);
+  }
+
+  for (i = 0; i < sizeof(orders)/sizeof(orders[0]); ++i) {
+    size_t stream_len = 0, expected_len = 0;
+    uint32_t adler;
+    stream = tor_malloc(TOR_ZLIB_SEGMENT_HEADER_LEN +
+                        seg_lens[0] + seg_lens[1] + seg_lens[2] + 1024 +
+                        TOR_ZLIB_SEGMENT_TRAILER_LEN);
+    expected = tor_malloc_zero(1024);
+    adler = tor_zlib_segment_header(stream);
+    stream_len = TOR_ZLIB_SEGMENT_HEADER_LEN;
+    for (j = 0; j < 4 && orders[i][j] >= 0; ++j) {
+      int d = orders[i][j];
+      memcpy(stream+stream_len, segs[d], seg_lens[d]);
+      stream_len += seg_lens[d];
+      adler = tor_zlib_segment_adler_combine(adler, adlers[d],
+                                             strlen(docs[d]));
+      strlcat(expected, docs[d], 1024);
+    }
+    expected_len = strlen(expected);
+    tor_zlib_segment_trailer(stream+stream_len, adler);
+    stream_len += TOR_ZLIB_SEGMENT_TRAILER_LEN;
+
+    test_assert(detect_compression_method(stream, stream_len) == ZLIB_METHOD);
+    tt_int_op(0, ==, tor_gzip_uncompress(&out, &out_len, stream, stream_len,
+                                         ZLIB_METHOD, 1, LOG_WARN));
+    tt_int_op(expected_len, ==, out_len);
+    test_memeq(expected, out, out_len);
+    tor_free(out);
+
+    /* A wrong checksum must not get past zlib. */
+    stream[stream_len-1] ^= 1;
+    tt_int_op(0, >, tor_gzip_uncompress(&out, &out_len, stream, stream_len,
+                                        ZLIB_METHOD, 1, LOG_INFO));
+    tor_free(out);
+    tor_free(stream);
+    tor_free(expected);
+  }
+
+ done:
+  for (i = 0; i < 3; ++i)
+    tor_free(segs[i]);
+  tor_free(stream);
+  tor_free(expected);
+  tor_free(out);
+}
+
 /** Run unit tests for mmap() wrapper functionality. */
 static void
 test_util_mmap(void)
@@ -3248,12 +3473,14 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(strmisc),
   UTIL_LEGACY(pow2),
   UTIL_LEGACY(gzip),
+  UTIL_TEST(gzip_segments, 0),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(mempool),
   UTIL_LEGACY(memarea),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_LEGACY(threads),
+  UTIL_TEST(workqueue, 0),
   UTIL_LEGACY(sscanf),
   UTIL_LEGACY(path_is_relative),
   UTIL_LEGACY(strtok),